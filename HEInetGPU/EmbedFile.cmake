@@ -0,0 +1,11 @@
+# Writes the bytes of INPUT into the C++ source OUTPUT as the null terminated byte array NAMESPACE::NAME and its size NAMESPACE::NAMESize
+# Usage: cmake -DINPUT=... -DOUTPUT=... -DNAMESPACE=... -DNAME=... -P EmbedFile.cmake
+
+file(READ "${INPUT}" contents HEX)
+
+string(LENGTH "${contents}" hexLength)
+math(EXPR size "${hexLength} / 2")
+
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," contents "${contents}")
+
+file(WRITE "${OUTPUT}" "// Generated from ${INPUT} by EmbedFile.cmake, do not edit\n\n#include <cstddef>\n\nnamespace ${NAMESPACE} {\n\textern const unsigned char ${NAME}[];\n\textern const std::size_t ${NAME}Size;\n\n\tconst unsigned char ${NAME}[] = { ${contents} 0x00 };\n\tconst std::size_t ${NAME}Size = ${size};\n}\n")
@@ -24,6 +24,29 @@ constant sampler_t defaultUnnormalizedSampler = CLK_NORMALIZED_COORDS_FALSE |
 	CLK_ADDRESS_NONE |
 	CLK_FILTER_NEAREST;
 
+// Build-time specialization (ComputeProgram::getVariant). A layer or network may build its own program with the constants of
+// its configuration defined, kernels then overwrite the matching arguments with them on entry, so receptive field loops get
+// constant trip counts and bounds the compiler can unroll and fold. The arguments stay, generic and specialized kernels bind alike.
+// Layer variants (EI_LAYER_VARIANT) define EI_E_FEED_FORWARD_DIMS, EI_E_DIMS, EI_I_DIMS, EI_I_FEED_BACK_DIMS, the five
+// EI_*_RADIUS, EI_WEIGHT_PRECISION and EI_FEED_BACK_INPUT, network variants (EI_NETWORK_VARIANT) EI_E_DIMS, EI_I_DIMS and
+// EI_PREDICTION_RADIUS_FROM_E/I
+#ifdef EI_LAYER_VARIANT
+#define SPECIALIZE_LAYER(argument, constant) argument = (constant)
+#else
+#define SPECIALIZE_LAYER(argument, constant)
+#endif
+
+#ifdef EI_NETWORK_VARIANT
+#define SPECIALIZE_NETWORK(argument, constant) argument = (constant)
+#else
+#define SPECIALIZE_NETWORK(argument, constant)
+#endif
+
+// 0 if the layer has no feed back input (EIlayer::Configuration::_feedBackInput), its feed back fields are then skipped
+#ifndef EI_FEED_BACK_INPUT
+#define EI_FEED_BACK_INPUT 1
+#endif
+
 // RNG
 float randFloat(uint2* state) {
 	const float invMaxInt = 1.0f / 4294967296.0f;
@@ -36,6 +59,28 @@ float randFloat(uint2* state) {
 	return convert_float(tmp) * invMaxInt;
 }
 
+// Counter based RNG (Philox4x32-10). The numbers only depend on counter and key, not on the order they are drawn in,
+// the work-group shape or the device
+uint4 philox4x32(uint4 counter, uint2 key) {
+	for (int round = 0; round < 10; round++) {
+		uint hi0 = mul_hi(0xD2511F53u, counter.x);
+		uint lo0 = 0xD2511F53u * counter.x;
+		uint hi1 = mul_hi(0xCD9E8D57u, counter.z);
+		uint lo1 = 0xCD9E8D57u * counter.z;
+
+		counter = (uint4)(hi1 ^ counter.y ^ key.x, lo1, hi0 ^ counter.w ^ key.y, lo0);
+
+		key += (uint2)(0x9E3779B9u, 0xBB67AE85u);
+	}
+
+	return counter;
+}
+
+// Uniform in [0, 1) from the top 24 bits, exact in single precision. Same as native::philoxFloat
+float philoxFloat(uint4 counter, uint2 key) {
+	return convert_float(philox4x32(counter, key).x >> 8) * (1.0f / 16777216.0f);
+}
+
 float sigmoid(float x) {
 	return 1.0f / (1.0f + exp(-x));
 }
@@ -56,244 +101,264 @@ float rstdp(float preHist, float postHist, float weight, float a, float b) {
 	return -b * preHist * postHist * weight;
 }
 
-// ---------------------------------------------------------------------------------------------------------------------------------
-// ------------------------------------------------------------ Layer --------------------------------------------------------------
-// ---------------------------------------------------------------------------------------------------------------------------------
+// Binary connectivity. A receptive field column (2r+1 rows) is packed into maskWordsPerColumn words of its neuron's mask,
+// bit dy + r set when weight > 0.5. Mask word mi of a neuron is at position.x + position.y * width + mi * width * height
+int getMaskWordsPerColumn(int radius) {
+	return (radius * 2 + 32) >> 5;
+}
 
-// Random weight initialization - excitatory
-void kernel EIlayer_eInitialize(write_only image3d_t eFeedForwardWeights,
-	write_only image3d_t eFeedBackWeights,
-	int eFeedForwardSize, int eFeedBackSize,
-	float minInitEWeight, float maxInitEWeight,
-	float minInitIWeight, float maxInitIWeight,
-	uint2 seed)
-{
-	uint2 seedValue = seed + (uint2)(get_global_id(0), get_global_id(1));
+// Spike maps are packed per column, word (y >> 5) of column x at x * wordsPerColumn + (y >> 5)
+// Returns the 32 rows starting at row (may be negative), rows outside the map read as 0
+uint readSpikeWord(global const uint* spikeBits, int x, int row, int wordsPerColumn) {
+	int word = row >= 0 ? row / 32 : -((31 - row) / 32);
+	int shift = row - word * 32;
 
-	int2 position = (int2)(get_global_id(0), get_global_id(1));
+	ulong lower = word >= 0 && word < wordsPerColumn ? spikeBits[x * wordsPerColumn + word] : 0;
+	ulong upper = word + 1 >= 0 && word + 1 < wordsPerColumn ? spikeBits[x * wordsPerColumn + word + 1] : 0;
+
+	return convert_uint((upper << 32 | lower) >> shift);
+}
 
-	for (int wi = 0; wi < eFeedForwardSize; wi++) {
-		int4 weightPosition = (int4)(position.x, position.y, wi, 0);
+// Number of connected inputs that spiked, same result as summing input * (weight > 0.5f ? 1.0f : 0.0f) over the field
+float sumConnected(global const uint* inputBits, global const uint* masks,
+	int2 position, int2 dims, int2 centerPosition, int2 inputDims, int radius)
+{
+	int maskWordsPerColumn = getMaskWordsPerColumn(radius);
+	int inputWordsPerColumn = (inputDims.y + 31) >> 5;
 
-		float weight = randFloat(&seedValue) * (maxInitEWeight - minInitEWeight) + minInitEWeight;
+	int neuronIndex = position.x + position.y * dims.x;
+	int layerSize = dims.x * dims.y;
 
-		write_imagef(eFeedForwardWeights, weightPosition, (float4)(weight));
-	}
+	uint count = 0;
 
-	for (int wi = 0; wi < eFeedBackSize; wi++) {
-		int4 weightPosition = (int4)(position.x, position.y, wi, 0);
+	for (int dx = -radius; dx <= radius; dx++) {
+		int inputX = centerPosition.x + dx;
 
-		float weight = randFloat(&seedValue) * (maxInitIWeight - minInitIWeight) + minInitIWeight;
+		if (inputX >= 0 && inputX < inputDims.x) {
+			for (int wi = 0; wi < maskWordsPerColumn; wi++) {
+				uint mask = masks[neuronIndex + ((dx + radius) * maskWordsPerColumn + wi) * layerSize];
 
-		write_imagef(eFeedBackWeights, weightPosition, (float4)(weight));
+				count += popcount(mask & readSpikeWord(inputBits, inputX, centerPosition.y - radius + wi * 32, inputWordsPerColumn));
+			}
+		}
 	}
-}
 
-// Random weight initialization - inhibitory
-void kernel EIlayer_iInitialize(write_only image3d_t iFeedForwardWeights,
-	write_only image3d_t iFeedBackWeights,
-	write_only image3d_t iLateralWeights,
-	int iFeedForwardSize, int iLateralSize, int iFeedBackSize,
-	float minInitEWeight, float maxInitEWeight,
-	float minInitIWeight, float maxInitIWeight,
-	uint2 seed)
-{
-	uint2 seedValue = seed + (uint2)(get_global_id(0), get_global_id(1));
+	return convert_float(count);
+}
 
-	int2 position = (int2)(get_global_id(0), get_global_id(1));
+// Event driven propagation. Returns 1 if the postsynaptic neuron at position is connected (mask bit set) to input
+int isConnected(global const uint* masks, int2 position, int2 dims, int2 centerPosition, int2 input, int radius) {
+	int dx = input.x - centerPosition.x;
+	int dy = input.y - centerPosition.y;
 
-	for (int wi = 0; wi < iFeedForwardSize; wi++) {
-		int4 weightPosition = (int4)(position.x, position.y, wi, 0);
+	if (dx < -radius || dx > radius || dy < -radius || dy > radius)
+		return 0;
 
-		float weight = randFloat(&seedValue) * (maxInitIWeight - minInitIWeight) + minInitIWeight;
+	int maskWordsPerColumn = getMaskWordsPerColumn(radius);
 
-		write_imagef(iFeedForwardWeights, weightPosition, (float4)(weight));
-	}
+	int row = dy + radius;
 
-	for (int wi = 0; wi < iLateralSize; wi++) {
-		int4 weightPosition = (int4)(position.x, position.y, wi, 0);
+	uint mask = masks[position.x + position.y * dims.x + ((dx + radius) * maskWordsPerColumn + (row >> 5)) * dims.x * dims.y];
 
-		float weight = randFloat(&seedValue) * (maxInitIWeight - minInitIWeight) + minInitIWeight;
+	return (mask >> (row & 31)) & 1;
+}
 
-		write_imagef(iLateralWeights, weightPosition, (float4)(weight));
-	}
+// Accumulates the mask bits of one receptive field column while a learn kernel walks dy, writes each finished word
+void updateMaskWord(global uint* masks, uint* maskWord, float weight, int valid,
+	int neuronIndex, int layerSize, int dx, int dy, int radius, int maskWordsPerColumn)
+{
+	int row = dy + radius;
 
-	for (int wi = 0; wi < iFeedBackSize; wi++) {
-		int4 weightPosition = (int4)(position.x, position.y, wi, 0);
+	if (valid && weight > 0.5f)
+		*maskWord |= 1u << (row & 31);
 
-		float weight = randFloat(&seedValue) * (maxInitIWeight - minInitIWeight) + minInitIWeight;
+	if ((row & 31) == 31 || dy == radius) {
+		masks[neuronIndex + ((dx + radius) * maskWordsPerColumn + (row >> 5)) * layerSize] = *maskWord;
 
-		write_imagef(iFeedBackWeights, weightPosition, (float4)(weight));
+		*maskWord = 0;
 	}
 }
 
-void kernel EIlayer_eActivate(read_only image2d_t feedForwardInput, read_only image2d_t iStatesPrev,
-	read_only image3d_t eFeedForwardWeightsPrev, read_only image3d_t eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
-	read_only image2d_t eActivationsPrev, read_only image2d_t eStatesPrev,
-	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStateAveragesPrev,
-	write_only image2d_t eActivations, write_only image2d_t eStates,
-	write_only image2d_t eStatesHistory, write_only image2d_t eStateAverages,
-	int2 eFeedForwardDims, int2 eDims, int2 iDims,
-	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
-	int eFeedForwardRadius, int eFeedBackRadius,
-	float eta, float shDecay, float saDecay)
-{
-	int2 position = (int2)(get_global_id(0), get_global_id(1));
+// Weight storage. A neuron's weights cover the window of input positions its field can reach, min(2r + 1, input size)
+// per axis shifted to lie inside the input, so clipped border positions take no space when the input is smaller than the field.
+// Every neuron of a buffer has the same window size to keep the address free of an offset table, so when the input is larger
+// the windows of neurons near the border still hold slots for positions outside their field (never read or learned)
+// Window slot s = x * windowDims.y + y. Slots form chunks of 4 interleaved across neurons, chunk c of a neuron is the float4
+// at c * layerSize + neuronIndex, so neighbouring work items load neighbouring float4s
+int2 getWeightWindowDims(int radius, int2 inputDims) {
+	return min((int2)(radius * 2 + 1), inputDims);
+}
 
-	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
-	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+int2 getWeightWindowOrigin(int2 centerPosition, int radius, int2 inputDims, int2 windowDims) {
+	return clamp(centerPosition - (int2)(radius), (int2)(0), inputDims - windowDims);
+}
 
-	int wi = 0;
+int getWeightIndex(int2 inputPosition, int2 windowOrigin, int2 windowDims, int neuronIndex, int layerSize) {
+	int slot = (inputPosition.x - windowOrigin.x) * windowDims.y + inputPosition.y - windowOrigin.y;
 
-	float excitation = 0.0f;
-	float inhibition = 0.0f;
+	return ((slot >> 2) * layerSize + neuronIndex) * 4 + (slot & 3);
+}
 
-	// Feed forward (excitatory)
-	for (int dx = -eFeedForwardRadius; dx <= eFeedForwardRadius; dx++)
-		for (int dy = -eFeedForwardRadius; dy <= eFeedForwardRadius; dy++) {
-			int2 feedForwardPosition = (int2)(feedForwardCenterPosition.x + dx, feedForwardCenterPosition.y + dy);
+// Floats of a weight buffer, same as EIlayer::getWeightsSize
+int getWeightsSize(int radius, int2 inputDims, int layerSize) {
+	int2 windowDims = getWeightWindowDims(radius, inputDims);
 
-			if (feedForwardPosition.x >= 0 && feedForwardPosition.x < eFeedForwardDims.x && feedForwardPosition.y >= 0 && feedForwardPosition.y < eFeedForwardDims.y) {
-				float input = read_imagef(feedForwardInput, defaultUnnormalizedSampler, feedForwardPosition).x;
+	return (windowDims.x * windowDims.y + 3) / 4 * layerSize * 4;
+}
 
-				float weight = read_imagef(eFeedForwardWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+// Batched layers (EIlayer::Configuration::_batchSize) stack the neuron images of the batch items vertically, item b takes rows
+// b * dims.y to (b + 1) * dims.y. Activation runs one work item per neuron and item (global id 2), weights and thresholds are shared
+int2 getBatchPosition(int2 position, int2 dims, int batch) {
+	return (int2)(position.x, position.y + batch * dims.y);
+}
 
-				excitation += input * (weight > 0.5f ? 1.0f : 0.0f);
-			}
+// Layer weight storage (EIlayer::WeightPrecision): 0 float, 1 half, 2 unorm8. Buffers are declared as float and
+// reinterpreted for the smaller formats, which hold weights in [0, 1]
+float loadWeight(global const float* weights, int index, int weightPrecision) {
+	if (weightPrecision == 1)
+		return vload_half(index, (global const half*)weights);
 
-			wi++;
-		}
+	if (weightPrecision == 2)
+		return convert_float(((global const uchar*)weights)[index]) * (1.0f / 255.0f);
 
-	wi = 0;
+	return weights[index];
+}
 
-	// Feed back (inhibitory)
-	for (int dx = -eFeedBackRadius; dx <= eFeedBackRadius; dx++)
-		for (int dy = -eFeedBackRadius; dy <= eFeedBackRadius; dy++) {
-			int2 feedBackPosition = (int2)(feedBackCenterPosition.x + dx, feedBackCenterPosition.y + dy);
+float4 loadWeights4(int offset, global const float* weights, int weightPrecision) {
+	if (weightPrecision == 1)
+		return vload_half4(offset, (global const half*)weights);
 
-			if (feedBackPosition.x >= 0 && feedBackPosition.x < iDims.x && feedBackPosition.y >= 0 && feedBackPosition.y < iDims.y) {
-				float input = read_imagef(iStatesPrev, defaultUnnormalizedSampler, feedBackPosition).x;
+	if (weightPrecision == 2)
+		return convert_float4(vload4(offset, (global const uchar*)weights)) * (1.0f / 255.0f);
 
-				float weight = read_imagef(eFeedBackWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+	return vload4(offset, weights);
+}
 
-				inhibition += input * (weight > 0.5f ? 1.0f : 0.0f);
-			}
+// Returns the stored weight. The smaller formats round stochastically with rngState, so updates smaller than a
+// step still move the weight on average, or to nearest without it (0)
+float storeWeight(global float* weights, int index, float weight, int weightPrecision, uint2* rngState) {
+	if (weightPrecision == 1) {
+		if (rngState == 0) {
+			vstore_half_rte(weight, index, (global half*)weights);
 
-			wi++;
+			return vload_half(index, (global const half*)weights);
 		}
 
-	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
-
-	float activationPrev = read_imagef(eActivationsPrev, defaultUnnormalizedSampler, position).x;
+		ushort bits;
 
-	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
+		vstore_half_rtn(weight, 0, (private half*)&bits);
+		float down = vload_half(0, (private const half*)&bits);
 
-	float statePrev = read_imagef(eStatesPrev, defaultUnnormalizedSampler, position).x;
+		vstore_half_rtp(weight, 0, (private half*)&bits);
+		float up = vload_half(0, (private const half*)&bits);
 
-	float state = 0.0f;
+		float stored = up > down && randFloat(rngState) < (weight - down) / (up - down) ? up : down;
 
-	if (activation > thresholdPrev) { // Includes refractory period
-		state = 1.0f;
+		vstore_half(stored, index, (global half*)weights);
 
-		activation = 0.0f;
+		return stored;
 	}
 
-	float stateHistoryPrev = read_imagef(eStatesHistoryPrev, position).x;
+	if (weightPrecision == 2) {
+		float level = clamp(floor(weight * 255.0f + (rngState == 0 ? 0.5f : randFloat(rngState))), 0.0f, 255.0f);
 
-	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
+		((global uchar*)weights)[index] = convert_uchar(level);
 
-	float stateAveragePrev = read_imagef(eStateAveragesPrev, position).x;
+		return level * (1.0f / 255.0f);
+	}
 
-	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
+	weights[index] = weight;
 
-	write_imagef(eActivations, position, (float4)(activation));
-	write_imagef(eStates, position, (float4)(state));
-	write_imagef(eStatesHistory, position, (float4)(stateHistory));
-	write_imagef(eStateAverages, position, (float4)(stateAverage));
+	return weight;
 }
 
-void kernel EIlayer_iActivate(read_only image2d_t feedBackInput, read_only image2d_t eStatesPrev,
-	read_only image3d_t iFeedForwardWeightsPrev, read_only image3d_t iLateralWeightsPrev, read_only image3d_t iFeedBackWeightsPrev, read_only image2d_t iThresholdsPrev,
-	read_only image2d_t iActivationsPrev, read_only image2d_t iStatesPrev,
-	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStateAveragesPrev,
-	write_only image2d_t iActivations, write_only image2d_t iStates,
-	write_only image2d_t iStatesHistory, write_only image2d_t iStateAverages,
-	int2 eDims, int2 iDims, int2 iFeedBackDims,
-	float2 iDimsToEDims, float2 iDimsToFeedBackDims,
-	int iFeedForwardRadius, int iLateralRadius, int iFeedBackRadius,
-	float eta, float shDecay, float saDecay)
+// Initial weight of one window slot, one work item per slot. Global id 0 is 4 * x + slot lane and global id 2 the slot chunk,
+// so neighbouring work items write neighbouring weights. The weight is drawn with counter (neuron, field slot, stream) where the
+// field slot is (dx + r) * (2r + 1) + dy + r, so it does not depend on the borders. Slots outside the field (clipped borders
+// and chunk padding) get 0. Writes weightsPrev and, if doubleBuffered, weights
+void initializeWeight(global float* weightsPrev, global float* weights, int doubleBuffered,
+	int2 centerPosition, int2 inputDims, int radius,
+	int neuronIndex, int layerSize, int slot,
+	float minInitWeight, float maxInitWeight, uint2 seed, uint stream, int weightPrecision)
 {
-	int2 position = (int2)(get_global_id(0), get_global_id(1));
+	// Same float result on every device and on the native backend
+	#pragma OPENCL FP_CONTRACT OFF
 
-	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * iDimsToEDims.x + 0.5f, (position.y + 0.5f) * iDimsToEDims.y + 0.5f);
-	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * iDimsToFeedBackDims.x + 0.5f, (position.y + 0.5f) * iDimsToFeedBackDims.y + 0.5f);
+	int2 windowDims = getWeightWindowDims(radius, inputDims);
+	int2 windowOrigin = getWeightWindowOrigin(centerPosition, radius, inputDims, windowDims);
 
-	int wi = 0;
+	int2 inputPosition = (int2)(windowOrigin.x + slot / windowDims.y, windowOrigin.y + slot % windowDims.y);
 
-	float excitation = 0.0f;
-	float inhibition = 0.0f;
+	int2 delta = inputPosition - centerPosition;
 
-	// Feed forward (excitatory)
-	for (int dx = -iFeedForwardRadius; dx <= iFeedForwardRadius; dx++)
-		for (int dy = -iFeedForwardRadius; dy <= iFeedForwardRadius; dy++) {
-			int2 feedForwardPosition = (int2)(feedForwardCenterPosition.x + dx, feedForwardCenterPosition.y + dy);
+	float weight = 0.0f;
 
-			if (feedForwardPosition.x >= 0 && feedForwardPosition.x < eDims.x && feedForwardPosition.y >= 0 && feedForwardPosition.y < eDims.y) {
-				float input = read_imagef(eStatesPrev, defaultUnnormalizedSampler, feedForwardPosition).x;
+	if (slot < windowDims.x * windowDims.y && delta.x >= -radius && delta.x <= radius && delta.y >= -radius && delta.y <= radius) {
+		uint fieldSlot = (delta.x + radius) * (radius * 2 + 1) + delta.y + radius;
 
-				float weight = read_imagef(iFeedForwardWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+		weight = philoxFloat((uint4)(neuronIndex, fieldSlot, stream, 0), seed) * (maxInitWeight - minInitWeight) + minInitWeight;
+	}
 
-				excitation += input * (weight > 0.5f ? 1.0f : 0.0f);
-			}
+	int weightIndex = ((slot >> 2) * layerSize + neuronIndex) * 4 + (slot & 3);
 
-			wi++;
-		}
+	storeWeight(weightsPrev, weightIndex, weight, weightPrecision, 0);
 
-	wi = 0;
+	if (doubleBuffered)
+		storeWeight(weights, weightIndex, weight, weightPrecision, 0);
+}
 
-	// Feed back (inhibitory)
-	for (int dx = -iFeedBackRadius; dx <= iFeedBackRadius; dx++)
-		for (int dy = -iFeedBackRadius; dy <= iFeedBackRadius; dy++) {
-			int2 feedBackPosition = (int2)(feedBackCenterPosition.x + dx, feedBackCenterPosition.y + dy);
+// Number of connected inputs that spiked over the field, walks the window one float4 chunk at a time.
+// Window slots run x outer, y inner like the field, positions outside the field (or the neuron itself if lateral) are skipped
+float sumWindow(read_only image2d_t inputs, int2 inputDims, int batch, global const float* weights,
+	int neuronIndex, int layerSize, int2 centerPosition, int radius, int lateral, int weightPrecision)
+{
+	int2 windowDims = getWeightWindowDims(radius, inputDims);
+	int2 windowOrigin = getWeightWindowOrigin(centerPosition, radius, inputDims, windowDims);
 
-			if (feedBackPosition.x >= 0 && feedBackPosition.x < iFeedBackDims.x && feedBackPosition.y >= 0 && feedBackPosition.y < iFeedBackDims.y) {
-				float input = read_imagef(feedBackInput, defaultUnnormalizedSampler, feedBackPosition).x;
+	int windowSize = windowDims.x * windowDims.y;
 
-				float weight = read_imagef(iFeedBackWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+	float sum = 0.0f;
 
-				inhibition += input * (weight > 0.5f ? 1.0f : 0.0f);
-			}
+	for (int chunk = 0; chunk * 4 < windowSize; chunk++) {
+		float chunkWeights[4];
 
-			wi++;
-		}
+		vstore4(loadWeights4(chunk * layerSize + neuronIndex, weights, weightPrecision), 0, chunkWeights);
 
-	wi = 0;
+		for (int lane = 0; lane < 4; lane++) {
+			int slot = chunk * 4 + lane;
 
-	// Lateral (inhibitory)
-	for (int dx = -iLateralRadius; dx <= iLateralRadius; dx++)
-		for (int dy = -iLateralRadius; dy <= iLateralRadius; dy++) {
-			if (dx != 0 || dy != 0) {
-				int2 lateralPosition = (int2)(position.x + dx, position.y + dy);
+			int2 inputPosition = (int2)(windowOrigin.x + slot / windowDims.y, windowOrigin.y + slot % windowDims.y);
 
-				if (lateralPosition.x >= 0 && lateralPosition.x < iDims.x && lateralPosition.y >= 0 && lateralPosition.y < iDims.y) {
-					float input = read_imagef(iStatesPrev, defaultUnnormalizedSampler, lateralPosition).x;
+			int2 delta = inputPosition - centerPosition;
 
-					float weight = read_imagef(iLateralWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+			if (slot < windowSize && delta.x >= -radius && delta.x <= radius && delta.y >= -radius && delta.y <= radius && (!lateral || delta.x != 0 || delta.y != 0)) {
+				float input = read_imagef(inputs, defaultUnnormalizedSampler, getBatchPosition(inputPosition, inputDims, batch)).x;
 
-					inhibition += input * (weight > 0.5f ? 1.0f : 0.0f);
-				}
+				sum += input * (chunkWeights[lane] > 0.5f ? 1.0f : 0.0f);
 			}
-
-			wi++;
 		}
+	}
 
-	float thresholdPrev = read_imagef(iThresholdsPrev, defaultUnnormalizedSampler, position).x;
-	
-	float activationPrev = read_imagef(iActivationsPrev, defaultUnnormalizedSampler, position).x;
+	return sum;
+}
 
-	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
+// Packed states (EIlayer::Configuration::_packedStates) keep (state, history, average, activation) in one CL_RGBA texel.
+// States stay in x so spike inputs read the same from either layout, histories and averages go through these
+float readHistory(read_only image2d_t states, int2 position) {
+	float4 texel = read_imagef(states, defaultUnnormalizedSampler, position);
 
-	float statePrev = read_imagef(iStatesPrev, defaultUnnormalizedSampler, position).x;
+	return get_image_channel_order(states) == CLK_RGBA ? texel.y : texel.x;
+}
+
+float readAverage(read_only image2d_t states, int2 position) {
+	float4 texel = read_imagef(states, defaultUnnormalizedSampler, position);
+
+	return get_image_channel_order(states) == CLK_RGBA ? texel.z : texel.x;
+}
+
+// Same update as the activation kernels, on a packed texel
+float4 updatePackedState(float4 statePrev, float thresholdPrev, float input, float eta, float shDecay, float saDecay) {
+	float activation = (1.0f - eta) * statePrev.w + input;
 
 	float state = 0.0f;
 
@@ -303,236 +368,1945 @@ void kernel EIlayer_iActivate(read_only image2d_t feedBackInput, read_only image
 		activation = 0.0f;
 	}
 
-	float stateHistoryPrev = read_imagef(iStatesHistoryPrev, position).x;
+	float stateHistory = fmax((1.0f - shDecay) * statePrev.y, state);
 
-	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
+	float stateAverage = (1.0f - saDecay) * statePrev.z + saDecay * state;
 
-	float stateAveragePrev = read_imagef(iStateAveragesPrev, position).x;
+	return (float4)(state, stateHistory, stateAverage, activation);
+}
 
-	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
+// ---------------------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------------ Layer --------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------------------------------
 
-	write_imagef(iActivations, position, (float4)(activation));
-	write_imagef(iStates, position, (float4)(state));
-	write_imagef(iStatesHistory, position, (float4)(stateHistory));
-	write_imagef(iStateAverages, position, (float4)(stateAverage));
+// Random weight initialization of one weight set over (4 * width, height, slot chunks), see initializeWeight.
+// lateral centers the fields on the neurons themselves
+void kernel EIlayer_initializeWeights(global float* weightsPrev, global float* weights, int doubleBuffered,
+	int2 inputDims, float2 dimsToInputDims, int radius, int lateral, int weightPrecision,
+	float minInitWeight, float maxInitWeight, uint2 seed, uint stream)
+{
+	int2 position = (int2)(get_global_id(0) >> 2, get_global_id(1));
+
+	int2 dims = (int2)(get_global_size(0) >> 2, get_global_size(1));
+
+	int2 centerPosition = lateral ? position : (int2)((position.x + 0.5f) * dimsToInputDims.x + 0.5f, (position.y + 0.5f) * dimsToInputDims.y + 0.5f);
+
+	initializeWeight(weightsPrev, weights, doubleBuffered, centerPosition, inputDims, radius,
+		position.x + position.y * dims.x, dims.x * dims.y, get_global_id(2) * 4 + (get_global_id(0) & 3),
+		minInitWeight, maxInitWeight, seed, stream, weightPrecision);
 }
 
-// Learn - excitatory
-void kernel EIlayer_eLearn(read_only image2d_t feedForwardStatesHistoryPrev, read_only image2d_t feedForwardStatesHistory,
-	read_only image2d_t eStates,
-	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStatesHistory,
-	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStatesHistory,
-	read_only image2d_t eStateAverages,
-	read_only image3d_t eFeedForwardWeightsPrev, read_only image3d_t eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
-	write_only image3d_t eFeedForwardWeights, write_only image3d_t eFeedBackWeights, write_only image2d_t eThresholds,
+void kernel EIlayer_eActivate(read_only image2d_t feedForwardInput, float eta, float shDecay, float saDecay,
+	read_only image2d_t iStatesPrev,
+	global const float* eFeedForwardWeightsPrev, global const float* eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
+	read_only image2d_t eActivationsPrev, read_only image2d_t eStatesPrev,
+	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStateAveragesPrev,
+	write_only image2d_t eActivations, write_only image2d_t eStates,
+	write_only image2d_t eStatesHistory, write_only image2d_t eStateAverages,
 	int2 eFeedForwardDims, int2 eDims, int2 iDims,
 	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
-	int eFeedForwardRadius, int eFeedBackRadius,
-	float alpha, float beta, float delta, float sparsity)
+	int eFeedForwardRadius, int eFeedBackRadius, int weightPrecision)
 {
-	int2 position = (int2)(get_global_id(0), get_global_id(1));
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(eFeedForwardRadius, EI_E_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(eFeedBackRadius, EI_E_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
 
-	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
-	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
-
-	float eState = read_imagef(eStates, defaultUnnormalizedSampler, position).x;
-	float eStateHistory = read_imagef(eStatesHistory, defaultUnnormalizedSampler, position).x;
-	float eStateHistoryPrev = read_imagef(eStatesHistoryPrev, defaultUnnormalizedSampler, position).x;
-
-	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
 
-	float stateAverage = read_imagef(eStateAverages, position).x;
+	int batch = get_global_id(2);
 
-	float kurt = stateAverage - sparsity;
+	int2 statePosition = getBatchPosition(position, eDims, batch);
 
-	float eLearn = fmax(0.0f, -kurt);
-	float iLearn = fmax(0.0f, kurt);
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
 
-	int wi = 0;
+	int neuronIndex = position.x + position.y * eDims.x;
+	int layerSize = eDims.x * eDims.y;
 
 	// Feed forward (excitatory)
-	for (int dx = -eFeedForwardRadius; dx <= eFeedForwardRadius; dx++)
-		for (int dy = -eFeedForwardRadius; dy <= eFeedForwardRadius; dy++) {
-			int2 feedForwardPosition = (int2)(feedForwardCenterPosition.x + dx, feedForwardCenterPosition.y + dy);
+	float excitation = sumWindow(feedForwardInput, eFeedForwardDims, batch, eFeedForwardWeightsPrev, neuronIndex, layerSize, feedForwardCenterPosition, eFeedForwardRadius, 0, weightPrecision);
 
-			if (feedForwardPosition.x >= 0 && feedForwardPosition.x < eFeedForwardDims.x && feedForwardPosition.y >= 0 && feedForwardPosition.y < eFeedForwardDims.y) {
-				float inputPrev = read_imagef(feedForwardStatesHistoryPrev, defaultUnnormalizedSampler, feedForwardPosition).x;
+	// Feed back (inhibitory)
+	float inhibition = sumWindow(iStatesPrev, iDims, batch, eFeedBackWeightsPrev, neuronIndex, layerSize, feedBackCenterPosition, eFeedBackRadius, 0, weightPrecision);
 
-				float weightPrev = read_imagef(eFeedForwardWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
 
-				float weight = fmin(1.0f, fmax(0.0f, weightPrev + alpha * stdp(inputPrev, eStateHistory, weightPrev, eLearn, iLearn)));
+	float activationPrev = read_imagef(eActivationsPrev, defaultUnnormalizedSampler, statePosition).x;
 
-				write_imagef(eFeedForwardWeights, (int4)(position.x, position.y, wi, 0), (float4)(weight));
-			}
+	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
 
-			wi++;
-		}
+	float statePrev = read_imagef(eStatesPrev, defaultUnnormalizedSampler, statePosition).x;
 
-	wi = 0;
+	float state = 0.0f;
 
-	// Feed back (inhibitory)
-	for (int dx = -eFeedBackRadius; dx <= eFeedBackRadius; dx++)
-		for (int dy = -eFeedBackRadius; dy <= eFeedBackRadius; dy++) {
-			int2 feedBackPosition = (int2)(feedBackCenterPosition.x + dx, feedBackCenterPosition.y + dy);
+	if (activation > thresholdPrev) { // Includes refractory period
+		state = 1.0f;
 
-			if (feedBackPosition.x >= 0 && feedBackPosition.x < iDims.x && feedBackPosition.y >= 0 && feedBackPosition.y < iDims.y) {
-				float inputPrev = read_imagef(iStatesHistoryPrev, defaultUnnormalizedSampler, feedBackPosition).x;
-	
-				float weightPrev = read_imagef(eFeedBackWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+		activation = 0.0f;
+	}
 
-				float weight = fmin(1.0f, fmax(0.0f, weightPrev + beta * stdp(inputPrev, eStateHistory, weightPrev, iLearn, eLearn)));
+	float stateHistoryPrev = read_imagef(eStatesHistoryPrev, statePosition).x;
 
-				write_imagef(eFeedBackWeights, (int4)(position.x, position.y, wi, 0), (float4)(weight));
-			}
+	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
 
-			wi++;
-		}
+	float stateAveragePrev = read_imagef(eStateAveragesPrev, statePosition).x;
 
-	float threshold = thresholdPrev + delta * kurt;
+	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
 
-	write_imagef(eThresholds, position, (float4)(threshold));
+	write_imagef(eActivations, statePosition, (float4)(activation));
+	write_imagef(eStates, statePosition, (float4)(state));
+	write_imagef(eStatesHistory, statePosition, (float4)(stateHistory));
+	write_imagef(eStateAverages, statePosition, (float4)(stateAverage));
 }
 
-// Learn - inhibitory
-void kernel EIlayer_iLearn(read_only image2d_t feedBackStatesHistoryPrev, read_only image2d_t feedBackStatesHistory,
-	read_only image2d_t iStates,
-	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStatesHistory,
-	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStatesHistory,
-	read_only image2d_t iStateAverages,
-	read_only image3d_t iFeedForwardWeightsPrev, read_only image3d_t iLateralWeightsPrev, read_only image3d_t iFeedBackWeightsPrev, read_only image2d_t iThresholdsPrev,
-	write_only image3d_t iFeedForwardWeights, write_only image3d_t iLateralWeights, write_only image3d_t iFeedBackWeights, write_only image2d_t iThresholds,
+void kernel EIlayer_iActivate(read_only image2d_t feedBackInput, float eta, float shDecay, float saDecay,
+	read_only image2d_t eStatesPrev,
+	global const float* iFeedForwardWeightsPrev, global const float* iLateralWeightsPrev, global const float* iFeedBackWeightsPrev, read_only image2d_t iThresholdsPrev,
+	read_only image2d_t iActivationsPrev, read_only image2d_t iStatesPrev,
+	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStateAveragesPrev,
+	write_only image2d_t iActivations, write_only image2d_t iStates,
+	write_only image2d_t iStatesHistory, write_only image2d_t iStateAverages,
 	int2 eDims, int2 iDims, int2 iFeedBackDims,
 	float2 iDimsToEDims, float2 iDimsToFeedBackDims,
-	int iFeedForwardRadius, int iLateralRadius, int iFeedBackRadius,
-	float alpha, float beta, float gamma, float delta, float sparsity)
+	int iFeedForwardRadius, int iLateralRadius, int iFeedBackRadius, int weightPrecision)
 {
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(iFeedBackDims, EI_I_FEED_BACK_DIMS);
+	SPECIALIZE_LAYER(iFeedForwardRadius, EI_I_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(iLateralRadius, EI_I_LATERAL_RADIUS);
+	SPECIALIZE_LAYER(iFeedBackRadius, EI_I_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
 	int2 position = (int2)(get_global_id(0), get_global_id(1));
 
+	int batch = get_global_id(2);
+
+	int2 statePosition = getBatchPosition(position, iDims, batch);
+
 	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * iDimsToEDims.x + 0.5f, (position.y + 0.5f) * iDimsToEDims.y + 0.5f);
 	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * iDimsToFeedBackDims.x + 0.5f, (position.y + 0.5f) * iDimsToFeedBackDims.y + 0.5f);
 
-	float iState = read_imagef(iStates, defaultUnnormalizedSampler, position).x;
-	float iStateHistory = read_imagef(iStatesHistory, defaultUnnormalizedSampler, position).x;
-	float iStateHistoryPrev = read_imagef(iStatesHistoryPrev, defaultUnnormalizedSampler, position).x;
-
-	float thresholdPrev = read_imagef(iThresholdsPrev, defaultUnnormalizedSampler, position).x;
+	int neuronIndex = position.x + position.y * iDims.x;
+	int layerSize = iDims.x * iDims.y;
 
-	float stateAverage = read_imagef(iStateAverages, position).x;
+	// Feed forward (excitatory)
+	float excitation = sumWindow(eStatesPrev, eDims, batch, iFeedForwardWeightsPrev, neuronIndex, layerSize, feedForwardCenterPosition, iFeedForwardRadius, 0, weightPrecision);
 
-	float kurt = stateAverage - sparsity;
+	// Feed back (inhibitory)
+	float inhibition = EI_FEED_BACK_INPUT ? sumWindow(feedBackInput, iFeedBackDims, batch, iFeedBackWeightsPrev, neuronIndex, layerSize, feedBackCenterPosition, iFeedBackRadius, 0, weightPrecision) : 0.0f;
 
-	float eLearn = fmax(0.0f, -kurt);
-	float iLearn = fmax(0.0f, kurt);
+	// Lateral (inhibitory)
+	inhibition += sumWindow(iStatesPrev, iDims, batch, iLateralWeightsPrev, neuronIndex, layerSize, position, iLateralRadius, 1, weightPrecision);
 
-	int wi = 0;
+	float thresholdPrev = read_imagef(iThresholdsPrev, defaultUnnormalizedSampler, position).x;
+	
+	float activationPrev = read_imagef(iActivationsPrev, defaultUnnormalizedSampler, statePosition).x;
 
-	// Feed forward (excitatory)
-	for (int dx = -iFeedForwardRadius; dx <= iFeedForwardRadius; dx++)
-		for (int dy = -iFeedForwardRadius; dy <= iFeedForwardRadius; dy++) {
-			int2 feedForwardPosition = (int2)(feedForwardCenterPosition.x + dx, feedForwardCenterPosition.y + dy);
+	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
 
-			if (feedForwardPosition.x >= 0 && feedForwardPosition.x < eDims.x && feedForwardPosition.y >= 0 && feedForwardPosition.y < eDims.y) {
-				float input = read_imagef(eStatesHistory, defaultUnnormalizedSampler, feedForwardPosition).x;
+	float statePrev = read_imagef(iStatesPrev, defaultUnnormalizedSampler, statePosition).x;
 
-				float weightPrev = read_imagef(iFeedForwardWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+	float state = 0.0f;
 
-				float weight = fmin(1.0f, fmax(0.0f, weightPrev + alpha * rstdp(input, iStateHistoryPrev, weightPrev, eLearn, iLearn)));
+	if (activation > thresholdPrev) { // Includes refractory period
+		state = 1.0f;
 
-				write_imagef(iFeedForwardWeights, (int4)(position.x, position.y, wi, 0), (float4)(weight));
-			}
+		activation = 0.0f;
+	}
 
-			wi++;
-		}
+	float stateHistoryPrev = read_imagef(iStatesHistoryPrev, statePosition).x;
 
-	wi = 0;
+	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
 
-	// Feed back (inhibitory)
-	for (int dx = -iFeedBackRadius; dx <= iFeedBackRadius; dx++)
-		for (int dy = -iFeedBackRadius; dy <= iFeedBackRadius; dy++) {
-			int2 feedBackPosition = (int2)(feedBackCenterPosition.x + dx, feedBackCenterPosition.y + dy);
+	float stateAveragePrev = read_imagef(iStateAveragesPrev, statePosition).x;
 
-			if (feedBackPosition.x >= 0 && feedBackPosition.x < iFeedBackDims.x && feedBackPosition.y >= 0 && feedBackPosition.y < iFeedBackDims.y) {
-				float inputPrev = read_imagef(feedBackStatesHistoryPrev, defaultUnnormalizedSampler, feedBackPosition).x;
+	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
 
-				float weightPrev = read_imagef(iFeedBackWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+	write_imagef(iActivations, statePosition, (float4)(activation));
+	write_imagef(iStates, statePosition, (float4)(state));
+	write_imagef(iStatesHistory, statePosition, (float4)(stateHistory));
+	write_imagef(iStateAverages, statePosition, (float4)(stateAverage));
+}
 
-				float weight = fmin(1.0f, fmax(0.0f, weightPrev + beta * stdp(inputPrev, iStateHistory, weightPrev, iLearn, eLearn)));
 
-				write_imagef(iFeedBackWeights, (int4)(position.x, position.y, wi, 0), (float4)(weight));
-			}
+// Same as EIlayer_eActivate on packed states
+void kernel EIlayer_eActivatePacked(read_only image2d_t feedForwardInput, float eta, float shDecay, float saDecay,
+	read_only image2d_t iStatesPrev,
+	global const float* eFeedForwardWeightsPrev, global const float* eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
+	read_only image2d_t eStatesPrev, write_only image2d_t eStates,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
+	int eFeedForwardRadius, int eFeedBackRadius, int weightPrecision)
+{
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(eFeedForwardRadius, EI_E_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(eFeedBackRadius, EI_E_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
 
-			wi++;
-		}
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
 
-	wi = 0;
+	int batch = get_global_id(2);
 
-	// Lateral (inhibitory)
-	for (int dx = -iLateralRadius; dx <= iLateralRadius; dx++)
-		for (int dy = -iLateralRadius; dy <= iLateralRadius; dy++) {
-			int2 lateralPosition = (int2)(position.x + dx, position.y + dy);
+	int2 statePosition = getBatchPosition(position, eDims, batch);
 
-			if (lateralPosition.x >= 0 && lateralPosition.x < iDims.x && lateralPosition.y >= 0 && lateralPosition.y < iDims.y) {
-				float inputPrev = read_imagef(iStatesHistoryPrev, defaultUnnormalizedSampler, lateralPosition).x;
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
 
-				float weightPrev = read_imagef(iLateralWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+	int neuronIndex = position.x + position.y * eDims.x;
+	int layerSize = eDims.x * eDims.y;
 
-				float weight = fmin(1.0f, fmax(0.0f, weightPrev + gamma * stdp(inputPrev, iStateHistory, weightPrev, iLearn, eLearn)));
+	// Feed forward (excitatory)
+	float excitation = sumWindow(feedForwardInput, eFeedForwardDims, batch, eFeedForwardWeightsPrev, neuronIndex, layerSize, feedForwardCenterPosition, eFeedForwardRadius, 0, weightPrecision);
 
-				write_imagef(iLateralWeights, (int4)(position.x, position.y, wi, 0), (float4)(weight));
-			}
+	// Feed back (inhibitory)
+	float inhibition = sumWindow(iStatesPrev, iDims, batch, eFeedBackWeightsPrev, neuronIndex, layerSize, feedBackCenterPosition, eFeedBackRadius, 0, weightPrecision);
 
-			wi++;
-		}
+	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
 
-	float threshold = thresholdPrev + delta * kurt;
+	float4 statePrev = read_imagef(eStatesPrev, defaultUnnormalizedSampler, statePosition);
 
-	write_imagef(iThresholds, position, (float4)(threshold));
+	write_imagef(eStates, statePosition, updatePackedState(statePrev, thresholdPrev, excitation - inhibition, eta, shDecay, saDecay));
 }
 
-// ---------------------------------------------------------------------------------------------------------------------------------
-// ------------------------------------------------------------- HEInet --------------------------------------------------------------
-// ---------------------------------------------------------------------------------------------------------------------------------
-
-// Initialize prediction weights
-void kernel HEInet_predictionInitialize(write_only image3d_t predictionWeightsFromE, write_only image3d_t predictionWeightsFromI,
-	int predictionFromESize, int predictionFromISize,
-	float minInitWeight, float maxInitWeight, uint2 seed)
+// Same as EIlayer_iActivate on packed states
+void kernel EIlayer_iActivatePacked(read_only image2d_t feedBackInput, float eta, float shDecay, float saDecay,
+	read_only image2d_t eStatesPrev,
+	global const float* iFeedForwardWeightsPrev, global const float* iLateralWeightsPrev, global const float* iFeedBackWeightsPrev, read_only image2d_t iThresholdsPrev,
+	read_only image2d_t iStatesPrev, write_only image2d_t iStates,
+	int2 eDims, int2 iDims, int2 iFeedBackDims,
+	float2 iDimsToEDims, float2 iDimsToFeedBackDims,
+	int iFeedForwardRadius, int iLateralRadius, int iFeedBackRadius, int weightPrecision)
 {
-	uint2 seedValue = seed + (uint2)(get_global_id(0), get_global_id(1));
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(iFeedBackDims, EI_I_FEED_BACK_DIMS);
+	SPECIALIZE_LAYER(iFeedForwardRadius, EI_I_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(iLateralRadius, EI_I_LATERAL_RADIUS);
+	SPECIALIZE_LAYER(iFeedBackRadius, EI_I_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
 
 	int2 position = (int2)(get_global_id(0), get_global_id(1));
 
-	for (int wi = 0; wi < predictionFromESize; wi++) {
-		int4 weightPosition = (int4)(position.x, position.y, wi, 0);
+	int batch = get_global_id(2);
 
-		float weight = randFloat(&seedValue) * (maxInitWeight - minInitWeight) + minInitWeight;
+	int2 statePosition = getBatchPosition(position, iDims, batch);
 
-		write_imagef(predictionWeightsFromE, weightPosition, (float4)(weight));
-	}
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * iDimsToEDims.x + 0.5f, (position.y + 0.5f) * iDimsToEDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * iDimsToFeedBackDims.x + 0.5f, (position.y + 0.5f) * iDimsToFeedBackDims.y + 0.5f);
 
-	for (int wi = 0; wi < predictionFromISize; wi++) {
-		int4 weightPosition = (int4)(position.x, position.y, wi, 0);
+	int neuronIndex = position.x + position.y * iDims.x;
+	int layerSize = iDims.x * iDims.y;
 
-		float weight = randFloat(&seedValue) * (maxInitWeight - minInitWeight) + minInitWeight;
+	// Feed forward (excitatory)
+	float excitation = sumWindow(eStatesPrev, eDims, batch, iFeedForwardWeightsPrev, neuronIndex, layerSize, feedForwardCenterPosition, iFeedForwardRadius, 0, weightPrecision);
 
-		write_imagef(predictionWeightsFromI, weightPosition, (float4)(weight));
-	}
-}
+	// Feed back (inhibitory)
+	float inhibition = EI_FEED_BACK_INPUT ? sumWindow(feedBackInput, iFeedBackDims, batch, iFeedBackWeightsPrev, neuronIndex, layerSize, feedBackCenterPosition, iFeedBackRadius, 0, weightPrecision) : 0.0f;
 
-// Perceptron from eStates and iStates that forms predictions
+	// Lateral (inhibitory)
+	inhibition += sumWindow(iStatesPrev, iDims, batch, iLateralWeightsPrev, neuronIndex, layerSize, position, iLateralRadius, 1, weightPrecision);
+
+	float thresholdPrev = read_imagef(iThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float4 statePrev = read_imagef(iStatesPrev, defaultUnnormalizedSampler, statePosition);
+
+	write_imagef(iStates, statePosition, updatePackedState(statePrev, thresholdPrev, excitation - inhibition, eta, shDecay, saDecay));
+}
+
+// Tiled variants. A work-group of neurons first copies the input positions their receptive fields reach (the tile, positions
+// outside the input read as 0) to local memory, so overlapping fields are fetched from global memory once per group.
+// Global sizes are rounded up to whole work-groups, the extra work items only help loading
+
+// Input position at the corner of this work-group's tile
+int2 getTileOrigin(float2 dimsToInputDims, int radius) {
+	int2 groupPosition = (int2)(get_group_id(0) * get_local_size(0), get_group_id(1) * get_local_size(1));
+
+	int2 centerPosition = (int2)((groupPosition.x + 0.5f) * dimsToInputDims.x + 0.5f, (groupPosition.y + 0.5f) * dimsToInputDims.y + 0.5f);
+
+	return centerPosition - (int2)(radius);
+}
+
+// Histories are read with readHistory, anything else from x
+void loadTile(read_only image2d_t inputs, int2 inputDims, local float* tile, int2 tileOrigin, int2 tileDims, int history) {
+	int localIndex = get_local_id(0) + get_local_id(1) * get_local_size(0);
+	int localSize = get_local_size(0) * get_local_size(1);
+
+	for (int ti = localIndex; ti < tileDims.x * tileDims.y; ti += localSize) {
+		int2 inputPosition = (int2)(tileOrigin.x + ti % tileDims.x, tileOrigin.y + ti / tileDims.x);
+
+		if (inputPosition.x < 0 || inputPosition.x >= inputDims.x || inputPosition.y < 0 || inputPosition.y >= inputDims.y)
+			tile[ti] = 0.0f;
+		else
+			tile[ti] = history ? readHistory(inputs, inputPosition) : read_imagef(inputs, defaultUnnormalizedSampler, inputPosition).x;
+	}
+}
+
+float readTile(local const float* tile, int2 tileOrigin, int2 tileDims, int2 inputPosition) {
+	return tile[(inputPosition.x - tileOrigin.x) + (inputPosition.y - tileOrigin.y) * tileDims.x];
+}
+
+// Same as sumWindow, inputs come from a tile
+float sumWindowTile(local const float* tile, int2 tileOrigin, int2 tileDims, int2 inputDims, global const float* weights,
+	int neuronIndex, int layerSize, int2 centerPosition, int radius, int weightPrecision)
+{
+	int2 windowDims = getWeightWindowDims(radius, inputDims);
+	int2 windowOrigin = getWeightWindowOrigin(centerPosition, radius, inputDims, windowDims);
+
+	int windowSize = windowDims.x * windowDims.y;
+
+	float sum = 0.0f;
+
+	for (int chunk = 0; chunk * 4 < windowSize; chunk++) {
+		float chunkWeights[4];
+
+		vstore4(loadWeights4(chunk * layerSize + neuronIndex, weights, weightPrecision), 0, chunkWeights);
+
+		for (int lane = 0; lane < 4; lane++) {
+			int slot = chunk * 4 + lane;
+
+			int2 inputPosition = (int2)(windowOrigin.x + slot / windowDims.y, windowOrigin.y + slot % windowDims.y);
+
+			int2 delta = inputPosition - centerPosition;
+
+			if (slot < windowSize && delta.x >= -radius && delta.x <= radius && delta.y >= -radius && delta.y <= radius)
+				sum += readTile(tile, tileOrigin, tileDims, inputPosition) * (chunkWeights[lane] > 0.5f ? 1.0f : 0.0f);
+		}
+	}
+
+	return sum;
+}
+
+// Same as EIlayer_eActivate, with work-groups of tiles
+void kernel EIlayer_eActivateTiled(read_only image2d_t feedForwardInput, float eta, float shDecay, float saDecay,
+	read_only image2d_t iStatesPrev,
+	global const float* eFeedForwardWeightsPrev, global const float* eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
+	read_only image2d_t eActivationsPrev, read_only image2d_t eStatesPrev,
+	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStateAveragesPrev,
+	write_only image2d_t eActivations, write_only image2d_t eStates,
+	write_only image2d_t eStatesHistory, write_only image2d_t eStateAverages,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
+	int eFeedForwardRadius, int eFeedBackRadius, int weightPrecision,
+	local float* feedForwardTile, local float* feedBackTile, int2 feedForwardTileDims, int2 feedBackTileDims)
+{
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(eFeedForwardRadius, EI_E_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(eFeedBackRadius, EI_E_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int2 feedForwardTileOrigin = getTileOrigin(eDimsToEFeedForwardDims, eFeedForwardRadius);
+	int2 feedBackTileOrigin = getTileOrigin(eDimsToIDims, eFeedBackRadius);
+
+	loadTile(feedForwardInput, eFeedForwardDims, feedForwardTile, feedForwardTileOrigin, feedForwardTileDims, 0);
+	loadTile(iStatesPrev, iDims, feedBackTile, feedBackTileOrigin, feedBackTileDims, 0);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (position.x >= eDims.x || position.y >= eDims.y)
+		return;
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+
+	int neuronIndex = position.x + position.y * eDims.x;
+	int layerSize = eDims.x * eDims.y;
+
+	// Feed forward (excitatory)
+	float excitation = sumWindowTile(feedForwardTile, feedForwardTileOrigin, feedForwardTileDims, eFeedForwardDims, eFeedForwardWeightsPrev, neuronIndex, layerSize, feedForwardCenterPosition, eFeedForwardRadius, weightPrecision);
+
+	// Feed back (inhibitory)
+	float inhibition = sumWindowTile(feedBackTile, feedBackTileOrigin, feedBackTileDims, iDims, eFeedBackWeightsPrev, neuronIndex, layerSize, feedBackCenterPosition, eFeedBackRadius, weightPrecision);
+
+	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float activationPrev = read_imagef(eActivationsPrev, defaultUnnormalizedSampler, position).x;
+
+	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
+
+	float state = 0.0f;
+
+	if (activation > thresholdPrev) { // Includes refractory period
+		state = 1.0f;
+
+		activation = 0.0f;
+	}
+
+	float stateHistoryPrev = read_imagef(eStatesHistoryPrev, position).x;
+
+	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
+
+	float stateAveragePrev = read_imagef(eStateAveragesPrev, position).x;
+
+	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
+
+	write_imagef(eActivations, position, (float4)(activation));
+	write_imagef(eStates, position, (float4)(state));
+	write_imagef(eStatesHistory, position, (float4)(stateHistory));
+	write_imagef(eStateAverages, position, (float4)(stateAverage));
+}
+
+// Same as EIlayer_eActivateTiled on packed states
+void kernel EIlayer_eActivateTiledPacked(read_only image2d_t feedForwardInput, float eta, float shDecay, float saDecay,
+	read_only image2d_t iStatesPrev,
+	global const float* eFeedForwardWeightsPrev, global const float* eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
+	read_only image2d_t eStatesPrev, write_only image2d_t eStates,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
+	int eFeedForwardRadius, int eFeedBackRadius, int weightPrecision,
+	local float* feedForwardTile, local float* feedBackTile, int2 feedForwardTileDims, int2 feedBackTileDims)
+{
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(eFeedForwardRadius, EI_E_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(eFeedBackRadius, EI_E_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int2 feedForwardTileOrigin = getTileOrigin(eDimsToEFeedForwardDims, eFeedForwardRadius);
+	int2 feedBackTileOrigin = getTileOrigin(eDimsToIDims, eFeedBackRadius);
+
+	loadTile(feedForwardInput, eFeedForwardDims, feedForwardTile, feedForwardTileOrigin, feedForwardTileDims, 0);
+	loadTile(iStatesPrev, iDims, feedBackTile, feedBackTileOrigin, feedBackTileDims, 0);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (position.x >= eDims.x || position.y >= eDims.y)
+		return;
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+
+	int neuronIndex = position.x + position.y * eDims.x;
+	int layerSize = eDims.x * eDims.y;
+
+	// Feed forward (excitatory)
+	float excitation = sumWindowTile(feedForwardTile, feedForwardTileOrigin, feedForwardTileDims, eFeedForwardDims, eFeedForwardWeightsPrev, neuronIndex, layerSize, feedForwardCenterPosition, eFeedForwardRadius, weightPrecision);
+
+	// Feed back (inhibitory)
+	float inhibition = sumWindowTile(feedBackTile, feedBackTileOrigin, feedBackTileDims, iDims, eFeedBackWeightsPrev, neuronIndex, layerSize, feedBackCenterPosition, eFeedBackRadius, weightPrecision);
+
+	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float4 statePrev = read_imagef(eStatesPrev, defaultUnnormalizedSampler, position);
+
+	write_imagef(eStates, position, updatePackedState(statePrev, thresholdPrev, excitation - inhibition, eta, shDecay, saDecay));
+}
+
+// Build connectivity masks from weights, positions outside the input are not connected
+void kernel EIlayer_initializeMasks(global const float* weights, global uint* masks,
+	int2 inputDims, float2 dimsToInputDims, int radius, int lateral, int weightPrecision)
+{
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int2 centerPosition = lateral ? position : (int2)((position.x + 0.5f) * dimsToInputDims.x + 0.5f, (position.y + 0.5f) * dimsToInputDims.y + 0.5f);
+
+	int neuronIndex = position.x + position.y * get_global_size(0);
+	int layerSize = get_global_size(0) * get_global_size(1);
+
+	int2 windowDims = getWeightWindowDims(radius, inputDims);
+	int2 windowOrigin = getWeightWindowOrigin(centerPosition, radius, inputDims, windowDims);
+
+	int maskWordsPerColumn = getMaskWordsPerColumn(radius);
+
+	uint maskWord = 0;
+
+	for (int dx = -radius; dx <= radius; dx++)
+		for (int dy = -radius; dy <= radius; dy++) {
+			int2 inputPosition = (int2)(centerPosition.x + dx, centerPosition.y + dy);
+
+			int valid = inputPosition.x >= 0 && inputPosition.x < inputDims.x && inputPosition.y >= 0 && inputPosition.y < inputDims.y;
+
+			float weight = valid ? loadWeight(weights, getWeightIndex(inputPosition, windowOrigin, windowDims, neuronIndex, layerSize), weightPrecision) : 0.0f;
+
+			updateMaskWord(masks, &maskWord, weight, valid && (!lateral || dx != 0 || dy != 0), neuronIndex, layerSize, dx, dy, radius, maskWordsPerColumn);
+		}
+}
+
+// Pack binary states into a spike map, one work item per word
+void kernel EIlayer_packStates(read_only image2d_t states, global uint* stateBits,
+	int2 dims)
+{
+	int x = get_global_id(0);
+	int word = get_global_id(1);
+
+	int wordsPerColumn = get_global_size(1);
+
+	uint bits = 0;
+
+	for (int b = 0; b < 32; b++) {
+		int y = word * 32 + b;
+
+		if (y < dims.y && read_imagef(states, defaultUnnormalizedSampler, (int2)(x, y)).x > 0.0f)
+			bits |= 1u << b;
+	}
+
+	stateBits[x * wordsPerColumn + word] = bits;
+}
+
+// Same as EIlayer_eActivate, receptive fields are summed with masks and spike maps
+void kernel EIlayer_eActivateBinary(global const uint* feedForwardInputBits, float eta, float shDecay, float saDecay,
+	global const uint* iStateBitsPrev,
+	global const uint* eFeedForwardMasksPrev, global const uint* eFeedBackMasksPrev, read_only image2d_t eThresholdsPrev,
+	read_only image2d_t eActivationsPrev,
+	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStateAveragesPrev,
+	write_only image2d_t eActivations, write_only image2d_t eStates,
+	write_only image2d_t eStatesHistory, write_only image2d_t eStateAverages,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
+	int eFeedForwardRadius, int eFeedBackRadius)
+{
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(eFeedForwardRadius, EI_E_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(eFeedBackRadius, EI_E_FEED_BACK_RADIUS);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+
+	// Feed forward (excitatory)
+	float excitation = sumConnected(feedForwardInputBits, eFeedForwardMasksPrev, position, eDims, feedForwardCenterPosition, eFeedForwardDims, eFeedForwardRadius);
+
+	// Feed back (inhibitory)
+	float inhibition = sumConnected(iStateBitsPrev, eFeedBackMasksPrev, position, eDims, feedBackCenterPosition, iDims, eFeedBackRadius);
+
+	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float activationPrev = read_imagef(eActivationsPrev, defaultUnnormalizedSampler, position).x;
+
+	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
+
+	float state = 0.0f;
+
+	if (activation > thresholdPrev) { // Includes refractory period
+		state = 1.0f;
+
+		activation = 0.0f;
+	}
+
+	float stateHistoryPrev = read_imagef(eStatesHistoryPrev, position).x;
+
+	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
+
+	float stateAveragePrev = read_imagef(eStateAveragesPrev, position).x;
+
+	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
+
+	write_imagef(eActivations, position, (float4)(activation));
+	write_imagef(eStates, position, (float4)(state));
+	write_imagef(eStatesHistory, position, (float4)(stateHistory));
+	write_imagef(eStateAverages, position, (float4)(stateAverage));
+}
+
+// Same as EIlayer_iActivate, receptive fields are summed with masks and spike maps
+void kernel EIlayer_iActivateBinary(global const uint* feedBackInputBits, float eta, float shDecay, float saDecay,
+	global const uint* eStateBitsPrev,
+	global const uint* iFeedForwardMasksPrev, global const uint* iLateralMasksPrev, global const uint* iFeedBackMasksPrev, read_only image2d_t iThresholdsPrev,
+	read_only image2d_t iActivationsPrev, global const uint* iStateBitsPrev,
+	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStateAveragesPrev,
+	write_only image2d_t iActivations, write_only image2d_t iStates,
+	write_only image2d_t iStatesHistory, write_only image2d_t iStateAverages,
+	int2 eDims, int2 iDims, int2 iFeedBackDims,
+	float2 iDimsToEDims, float2 iDimsToFeedBackDims,
+	int iFeedForwardRadius, int iLateralRadius, int iFeedBackRadius)
+{
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(iFeedBackDims, EI_I_FEED_BACK_DIMS);
+	SPECIALIZE_LAYER(iFeedForwardRadius, EI_I_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(iLateralRadius, EI_I_LATERAL_RADIUS);
+	SPECIALIZE_LAYER(iFeedBackRadius, EI_I_FEED_BACK_RADIUS);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * iDimsToEDims.x + 0.5f, (position.y + 0.5f) * iDimsToEDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * iDimsToFeedBackDims.x + 0.5f, (position.y + 0.5f) * iDimsToFeedBackDims.y + 0.5f);
+
+	// Feed forward (excitatory)
+	float excitation = sumConnected(eStateBitsPrev, iFeedForwardMasksPrev, position, iDims, feedForwardCenterPosition, eDims, iFeedForwardRadius);
+
+	// Feed back (inhibitory)
+	float inhibition = EI_FEED_BACK_INPUT ? sumConnected(feedBackInputBits, iFeedBackMasksPrev, position, iDims, feedBackCenterPosition, iFeedBackDims, iFeedBackRadius) : 0.0f;
+
+	// Lateral (inhibitory), the masks never contain the neuron itself
+	inhibition += sumConnected(iStateBitsPrev, iLateralMasksPrev, position, iDims, position, iDims, iLateralRadius);
+
+	float thresholdPrev = read_imagef(iThresholdsPrev, defaultUnnormalizedSampler, position).x;
+	
+	float activationPrev = read_imagef(iActivationsPrev, defaultUnnormalizedSampler, position).x;
+
+	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
+
+	float state = 0.0f;
+
+	if (activation > thresholdPrev) { // Includes refractory period
+		state = 1.0f;
+
+		activation = 0.0f;
+	}
+
+	float stateHistoryPrev = read_imagef(iStatesHistoryPrev, position).x;
+
+	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
+
+	float stateAveragePrev = read_imagef(iStateAveragesPrev, position).x;
+
+	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
+
+	write_imagef(iActivations, position, (float4)(activation));
+	write_imagef(iStates, position, (float4)(state));
+	write_imagef(iStatesHistory, position, (float4)(stateHistory));
+	write_imagef(iStateAverages, position, (float4)(stateAverage));
+}
+
+// Sparse connectivity. A connection list holds the offsets (input position - field center) of a neuron's connected inputs in
+// receptive field order, entry k of a neuron at k * layerSize + neuronIndex, and its length in connectionCounts. Lists have room
+// for the whole window (ELL layout), so they are rebuilt in place without allocating
+void kernel EIlayer_buildConnections(global const uint* masks, global char2* connections, global int* connectionCounts,
+	int radius)
+{
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int neuronIndex = position.x + position.y * get_global_size(0);
+	int layerSize = get_global_size(0) * get_global_size(1);
+
+	int maskWordsPerColumn = getMaskWordsPerColumn(radius);
+
+	int count = 0;
+
+	for (int dx = -radius; dx <= radius; dx++)
+		for (int wi = 0; wi < maskWordsPerColumn; wi++) {
+			uint mask = masks[neuronIndex + ((dx + radius) * maskWordsPerColumn + wi) * layerSize];
+
+			// Lowest row first, like the field loops
+			while (mask != 0) {
+				uint bit = mask & (0u - mask);
+
+				int row = wi * 32 + 31 - convert_int(clz(bit));
+
+				connections[count * layerSize + neuronIndex] = convert_char2((int2)(dx, row - radius));
+
+				count++;
+
+				mask ^= bit;
+			}
+		}
+
+	connectionCounts[neuronIndex] = count;
+}
+
+// Same result as sumWindow with the connectivity the list was built from, only reads the connected inputs
+float sumConnections(read_only image2d_t inputs, int2 inputDims, int batch, global const char2* connections, global const int* connectionCounts,
+	int neuronIndex, int layerSize, int2 centerPosition)
+{
+	int count = connectionCounts[neuronIndex];
+
+	float sum = 0.0f;
+
+	for (int k = 0; k < count; k++) {
+		int2 inputPosition = centerPosition + convert_int2(connections[k * layerSize + neuronIndex]);
+
+		sum += read_imagef(inputs, defaultUnnormalizedSampler, getBatchPosition(inputPosition, inputDims, batch)).x;
+	}
+
+	return sum;
+}
+
+// Same as EIlayer_eActivate, receptive fields are summed over the connection lists
+void kernel EIlayer_eActivateSparse(read_only image2d_t feedForwardInput, float eta, float shDecay, float saDecay,
+	read_only image2d_t iStatesPrev,
+	global const char2* eFeedForwardConnections, global const int* eFeedForwardConnectionCounts,
+	global const char2* eFeedBackConnections, global const int* eFeedBackConnectionCounts, read_only image2d_t eThresholdsPrev,
+	read_only image2d_t eActivationsPrev,
+	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStateAveragesPrev,
+	write_only image2d_t eActivations, write_only image2d_t eStates,
+	write_only image2d_t eStatesHistory, write_only image2d_t eStateAverages,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims)
+{
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int batch = get_global_id(2);
+
+	int2 statePosition = getBatchPosition(position, eDims, batch);
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+
+	int neuronIndex = position.x + position.y * eDims.x;
+	int layerSize = eDims.x * eDims.y;
+
+	// Feed forward (excitatory)
+	float excitation = sumConnections(feedForwardInput, eFeedForwardDims, batch, eFeedForwardConnections, eFeedForwardConnectionCounts, neuronIndex, layerSize, feedForwardCenterPosition);
+
+	// Feed back (inhibitory)
+	float inhibition = sumConnections(iStatesPrev, iDims, batch, eFeedBackConnections, eFeedBackConnectionCounts, neuronIndex, layerSize, feedBackCenterPosition);
+
+	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float activationPrev = read_imagef(eActivationsPrev, defaultUnnormalizedSampler, statePosition).x;
+
+	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
+
+	float state = 0.0f;
+
+	if (activation > thresholdPrev) { // Includes refractory period
+		state = 1.0f;
+
+		activation = 0.0f;
+	}
+
+	float stateHistoryPrev = read_imagef(eStatesHistoryPrev, statePosition).x;
+
+	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
+
+	float stateAveragePrev = read_imagef(eStateAveragesPrev, statePosition).x;
+
+	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
+
+	write_imagef(eActivations, statePosition, (float4)(activation));
+	write_imagef(eStates, statePosition, (float4)(state));
+	write_imagef(eStatesHistory, statePosition, (float4)(stateHistory));
+	write_imagef(eStateAverages, statePosition, (float4)(stateAverage));
+}
+
+// Same as EIlayer_iActivate, receptive fields are summed over the connection lists
+void kernel EIlayer_iActivateSparse(read_only image2d_t feedBackInput, float eta, float shDecay, float saDecay,
+	read_only image2d_t eStatesPrev,
+	global const char2* iFeedForwardConnections, global const int* iFeedForwardConnectionCounts,
+	global const char2* iLateralConnections, global const int* iLateralConnectionCounts,
+	global const char2* iFeedBackConnections, global const int* iFeedBackConnectionCounts, read_only image2d_t iThresholdsPrev,
+	read_only image2d_t iActivationsPrev, read_only image2d_t iStatesPrev,
+	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStateAveragesPrev,
+	write_only image2d_t iActivations, write_only image2d_t iStates,
+	write_only image2d_t iStatesHistory, write_only image2d_t iStateAverages,
+	int2 eDims, int2 iDims, int2 iFeedBackDims,
+	float2 iDimsToEDims, float2 iDimsToFeedBackDims)
+{
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(iFeedBackDims, EI_I_FEED_BACK_DIMS);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int batch = get_global_id(2);
+
+	int2 statePosition = getBatchPosition(position, iDims, batch);
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * iDimsToEDims.x + 0.5f, (position.y + 0.5f) * iDimsToEDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * iDimsToFeedBackDims.x + 0.5f, (position.y + 0.5f) * iDimsToFeedBackDims.y + 0.5f);
+
+	int neuronIndex = position.x + position.y * iDims.x;
+	int layerSize = iDims.x * iDims.y;
+
+	// Feed forward (excitatory)
+	float excitation = sumConnections(eStatesPrev, eDims, batch, iFeedForwardConnections, iFeedForwardConnectionCounts, neuronIndex, layerSize, feedForwardCenterPosition);
+
+	// Feed back (inhibitory)
+	float inhibition = EI_FEED_BACK_INPUT ? sumConnections(feedBackInput, iFeedBackDims, batch, iFeedBackConnections, iFeedBackConnectionCounts, neuronIndex, layerSize, feedBackCenterPosition) : 0.0f;
+
+	// Lateral (inhibitory), the lists never contain the neuron itself
+	inhibition += sumConnections(iStatesPrev, iDims, batch, iLateralConnections, iLateralConnectionCounts, neuronIndex, layerSize, position);
+
+	float thresholdPrev = read_imagef(iThresholdsPrev, defaultUnnormalizedSampler, position).x;
+	
+	float activationPrev = read_imagef(iActivationsPrev, defaultUnnormalizedSampler, statePosition).x;
+
+	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
+
+	float state = 0.0f;
+
+	if (activation > thresholdPrev) { // Includes refractory period
+		state = 1.0f;
+
+		activation = 0.0f;
+	}
+
+	float stateHistoryPrev = read_imagef(iStatesHistoryPrev, statePosition).x;
+
+	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
+
+	float stateAveragePrev = read_imagef(iStateAveragesPrev, statePosition).x;
+
+	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
+
+	write_imagef(iActivations, statePosition, (float4)(activation));
+	write_imagef(iStates, statePosition, (float4)(state));
+	write_imagef(iStatesHistory, statePosition, (float4)(stateHistory));
+	write_imagef(iStateAverages, statePosition, (float4)(stateAverage));
+}
+
+// Append the positions of spiking neurons to a spike list, spikeCount must be cleared before
+void kernel EIlayer_compactSpikes(read_only image2d_t states, global int2* spikes, global int* spikeCount) {
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	if (read_imagef(states, defaultUnnormalizedSampler, position).x > 0.0f)
+		spikes[atomic_inc(spikeCount)] = position;
+}
+
+// Add each listed spike to the accumulators of the connected postsynaptic neurons.
+// Work items stride over the list, so any global size covers any spike count
+void kernel EIlayer_scatterSpikes(global const int2* spikes, global const int* spikeCount,
+	global const uint* masksPrev, global int* accumulators,
+	int2 dims, float2 dimsToInputDims, int radius, int lateral)
+{
+	int count = *spikeCount;
+
+	for (int si = get_global_id(0); si < count; si += get_global_size(0)) {
+		int2 input = spikes[si];
+
+		// Postsynaptic neurons whose receptive field may contain the input, checked exactly below
+		int2 lower, upper;
+
+		if (lateral) {
+			lower = input - (int2)(radius);
+			upper = input + (int2)(radius);
+		}
+		else {
+			lower = (int2)(floor((input.x - radius - 0.5f) / dimsToInputDims.x - 0.5f) - 1, floor((input.y - radius - 0.5f) / dimsToInputDims.y - 0.5f) - 1);
+			upper = (int2)(ceil((input.x + radius + 0.5f) / dimsToInputDims.x - 0.5f) + 1, ceil((input.y + radius + 0.5f) / dimsToInputDims.y - 0.5f) + 1);
+		}
+
+		lower = max(lower, (int2)(0));
+		upper = min(upper, dims - (int2)(1));
+
+		for (int x = lower.x; x <= upper.x; x++)
+			for (int y = lower.y; y <= upper.y; y++) {
+				int2 position = (int2)(x, y);
+
+				int2 centerPosition = lateral ? position : (int2)((position.x + 0.5f) * dimsToInputDims.x + 0.5f, (position.y + 0.5f) * dimsToInputDims.y + 0.5f);
+
+				if (isConnected(masksPrev, position, dims, centerPosition, input, radius))
+					atomic_inc(&accumulators[x + y * dims.x]);
+			}
+	}
+}
+
+// Neuron update from scattered excitation and inhibition counts, same as the end of EIlayer_eActivate/iActivate
+void kernel EIlayer_integrate(global const int* excitations, global const int* inhibitions,
+	read_only image2d_t thresholdsPrev, read_only image2d_t activationsPrev,
+	read_only image2d_t statesHistoryPrev, read_only image2d_t stateAveragesPrev,
+	write_only image2d_t activations, write_only image2d_t states,
+	write_only image2d_t statesHistory, write_only image2d_t stateAverages,
+	float eta, float shDecay, float saDecay)
+{
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int index = position.x + position.y * get_global_size(0);
+
+	float excitation = convert_float(excitations[index]);
+	float inhibition = convert_float(inhibitions[index]);
+
+	float thresholdPrev = read_imagef(thresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float activationPrev = read_imagef(activationsPrev, defaultUnnormalizedSampler, position).x;
+
+	float activation = (1.0f - eta) * activationPrev + (excitation - inhibition);
+
+	float state = 0.0f;
+
+	if (activation > thresholdPrev) { // Includes refractory period
+		state = 1.0f;
+
+		activation = 0.0f;
+	}
+
+	float stateHistoryPrev = read_imagef(statesHistoryPrev, position).x;
+
+	float stateHistory = fmax((1.0f - shDecay) * stateHistoryPrev, state);
+
+	float stateAveragePrev = read_imagef(stateAveragesPrev, position).x;
+
+	float stateAverage = (1.0f - saDecay) * stateAveragePrev + saDecay * state;
+
+	write_imagef(activations, position, (float4)(activation));
+	write_imagef(states, position, (float4)(state));
+	write_imagef(statesHistory, position, (float4)(stateHistory));
+	write_imagef(stateAverages, position, (float4)(stateAverage));
+}
+
+// Learn - excitatory
+void kernel EIlayer_eLearn(read_only image2d_t feedForwardStatesHistoryPrev, read_only image2d_t feedForwardStatesHistory,
+	float alpha, float beta, float delta, float sparsity, uint2 seed,
+	read_only image2d_t eStates,
+	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStatesHistory,
+	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStatesHistory,
+	read_only image2d_t eStateAverages,
+	global const float* eFeedForwardWeightsPrev, global const float* eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
+	global float* eFeedForwardWeights, global float* eFeedBackWeights, write_only image2d_t eThresholds,
+	global uint* eFeedForwardMasks, global uint* eFeedBackMasks,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
+	int eFeedForwardRadius, int eFeedBackRadius, int weightPrecision)
+{
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(eFeedForwardRadius, EI_E_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(eFeedBackRadius, EI_E_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	// Stochastic rounding of the stored weights
+	uint2 rngState = seed + (uint2)(position.x * 29 + position.y * 16807, position.x * 16807 + position.y * 29);
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+
+	float eState = read_imagef(eStates, defaultUnnormalizedSampler, position).x;
+	float eStateHistory = readHistory(eStatesHistory, position);
+	float eStateHistoryPrev = readHistory(eStatesHistoryPrev, position);
+
+	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float stateAverage = readAverage(eStateAverages, position);
+
+	float kurt = stateAverage - sparsity;
+
+	float eLearn = fmax(0.0f, -kurt);
+	float iLearn = fmax(0.0f, kurt);
+
+	int neuronIndex = position.x + position.y * eDims.x;
+	int layerSize = eDims.x * eDims.y;
+
+	int2 feedForwardWindowDims = getWeightWindowDims(eFeedForwardRadius, eFeedForwardDims);
+	int2 feedForwardWindowOrigin = getWeightWindowOrigin(feedForwardCenterPosition, eFeedForwardRadius, eFeedForwardDims, feedForwardWindowDims);
+	int2 feedBackWindowDims = getWeightWindowDims(eFeedBackRadius, iDims);
+	int2 feedBackWindowOrigin = getWeightWindowOrigin(feedBackCenterPosition, eFeedBackRadius, iDims, feedBackWindowDims);
+
+	int eFeedForwardMaskWordsPerColumn = getMaskWordsPerColumn(eFeedForwardRadius);
+	int eFeedBackMaskWordsPerColumn = getMaskWordsPerColumn(eFeedBackRadius);
+
+	uint maskWord = 0;
+
+	// Feed forward (excitatory)
+	for (int dx = -eFeedForwardRadius; dx <= eFeedForwardRadius; dx++)
+		for (int dy = -eFeedForwardRadius; dy <= eFeedForwardRadius; dy++) {
+			int2 feedForwardPosition = (int2)(feedForwardCenterPosition.x + dx, feedForwardCenterPosition.y + dy);
+
+			int valid = feedForwardPosition.x >= 0 && feedForwardPosition.x < eFeedForwardDims.x && feedForwardPosition.y >= 0 && feedForwardPosition.y < eFeedForwardDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedForwardPosition, feedForwardWindowOrigin, feedForwardWindowDims, neuronIndex, layerSize);
+
+				float inputPrev = readHistory(feedForwardStatesHistoryPrev, feedForwardPosition);
+
+				float weightPrev = loadWeight(eFeedForwardWeightsPrev, weightIndex, weightPrecision);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + alpha * stdp(inputPrev, eStateHistory, weightPrev, eLearn, iLearn)));
+
+				weight = storeWeight(eFeedForwardWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(eFeedForwardMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, eFeedForwardRadius, eFeedForwardMaskWordsPerColumn);
+		}
+
+	// Feed back (inhibitory)
+	for (int dx = -eFeedBackRadius; dx <= eFeedBackRadius; dx++)
+		for (int dy = -eFeedBackRadius; dy <= eFeedBackRadius; dy++) {
+			int2 feedBackPosition = (int2)(feedBackCenterPosition.x + dx, feedBackCenterPosition.y + dy);
+
+			int valid = feedBackPosition.x >= 0 && feedBackPosition.x < iDims.x && feedBackPosition.y >= 0 && feedBackPosition.y < iDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedBackPosition, feedBackWindowOrigin, feedBackWindowDims, neuronIndex, layerSize);
+
+				float inputPrev = readHistory(iStatesHistoryPrev, feedBackPosition);
+	
+				float weightPrev = loadWeight(eFeedBackWeightsPrev, weightIndex, weightPrecision);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + beta * stdp(inputPrev, eStateHistory, weightPrev, iLearn, eLearn)));
+
+				weight = storeWeight(eFeedBackWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(eFeedBackMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, eFeedBackRadius, eFeedBackMaskWordsPerColumn);
+		}
+
+	float threshold = thresholdPrev + delta * kurt;
+
+	write_imagef(eThresholds, position, (float4)(threshold));
+}
+
+// Same as EIlayer_eLearn, with work-groups of tiles
+void kernel EIlayer_eLearnTiled(read_only image2d_t feedForwardStatesHistoryPrev, read_only image2d_t feedForwardStatesHistory,
+	float alpha, float beta, float delta, float sparsity, uint2 seed,
+	read_only image2d_t eStates,
+	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStatesHistory,
+	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStatesHistory,
+	read_only image2d_t eStateAverages,
+	global const float* eFeedForwardWeightsPrev, global const float* eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
+	global float* eFeedForwardWeights, global float* eFeedBackWeights, write_only image2d_t eThresholds,
+	global uint* eFeedForwardMasks, global uint* eFeedBackMasks,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
+	int eFeedForwardRadius, int eFeedBackRadius, int weightPrecision,
+	local float* feedForwardTile, local float* feedBackTile, int2 feedForwardTileDims, int2 feedBackTileDims)
+{
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(eFeedForwardRadius, EI_E_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(eFeedBackRadius, EI_E_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	// Stochastic rounding of the stored weights
+	uint2 rngState = seed + (uint2)(position.x * 29 + position.y * 16807, position.x * 16807 + position.y * 29);
+
+	int2 feedForwardTileOrigin = getTileOrigin(eDimsToEFeedForwardDims, eFeedForwardRadius);
+	int2 feedBackTileOrigin = getTileOrigin(eDimsToIDims, eFeedBackRadius);
+
+	loadTile(feedForwardStatesHistoryPrev, eFeedForwardDims, feedForwardTile, feedForwardTileOrigin, feedForwardTileDims, 1);
+	loadTile(iStatesHistoryPrev, iDims, feedBackTile, feedBackTileOrigin, feedBackTileDims, 1);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (position.x >= eDims.x || position.y >= eDims.y)
+		return;
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+
+	float eState = read_imagef(eStates, defaultUnnormalizedSampler, position).x;
+	float eStateHistory = readHistory(eStatesHistory, position);
+	float eStateHistoryPrev = readHistory(eStatesHistoryPrev, position);
+
+	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float stateAverage = readAverage(eStateAverages, position);
+
+	float kurt = stateAverage - sparsity;
+
+	float eLearn = fmax(0.0f, -kurt);
+	float iLearn = fmax(0.0f, kurt);
+
+	int neuronIndex = position.x + position.y * eDims.x;
+	int layerSize = eDims.x * eDims.y;
+
+	int2 feedForwardWindowDims = getWeightWindowDims(eFeedForwardRadius, eFeedForwardDims);
+	int2 feedForwardWindowOrigin = getWeightWindowOrigin(feedForwardCenterPosition, eFeedForwardRadius, eFeedForwardDims, feedForwardWindowDims);
+	int2 feedBackWindowDims = getWeightWindowDims(eFeedBackRadius, iDims);
+	int2 feedBackWindowOrigin = getWeightWindowOrigin(feedBackCenterPosition, eFeedBackRadius, iDims, feedBackWindowDims);
+
+	int eFeedForwardMaskWordsPerColumn = getMaskWordsPerColumn(eFeedForwardRadius);
+	int eFeedBackMaskWordsPerColumn = getMaskWordsPerColumn(eFeedBackRadius);
+
+	uint maskWord = 0;
+
+	// Feed forward (excitatory)
+	for (int dx = -eFeedForwardRadius; dx <= eFeedForwardRadius; dx++)
+		for (int dy = -eFeedForwardRadius; dy <= eFeedForwardRadius; dy++) {
+			int2 feedForwardPosition = (int2)(feedForwardCenterPosition.x + dx, feedForwardCenterPosition.y + dy);
+
+			int valid = feedForwardPosition.x >= 0 && feedForwardPosition.x < eFeedForwardDims.x && feedForwardPosition.y >= 0 && feedForwardPosition.y < eFeedForwardDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedForwardPosition, feedForwardWindowOrigin, feedForwardWindowDims, neuronIndex, layerSize);
+
+				float inputPrev = readTile(feedForwardTile, feedForwardTileOrigin, feedForwardTileDims, feedForwardPosition);
+
+				float weightPrev = loadWeight(eFeedForwardWeightsPrev, weightIndex, weightPrecision);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + alpha * stdp(inputPrev, eStateHistory, weightPrev, eLearn, iLearn)));
+
+				weight = storeWeight(eFeedForwardWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(eFeedForwardMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, eFeedForwardRadius, eFeedForwardMaskWordsPerColumn);
+		}
+
+	// Feed back (inhibitory)
+	for (int dx = -eFeedBackRadius; dx <= eFeedBackRadius; dx++)
+		for (int dy = -eFeedBackRadius; dy <= eFeedBackRadius; dy++) {
+			int2 feedBackPosition = (int2)(feedBackCenterPosition.x + dx, feedBackCenterPosition.y + dy);
+
+			int valid = feedBackPosition.x >= 0 && feedBackPosition.x < iDims.x && feedBackPosition.y >= 0 && feedBackPosition.y < iDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedBackPosition, feedBackWindowOrigin, feedBackWindowDims, neuronIndex, layerSize);
+
+				float inputPrev = readTile(feedBackTile, feedBackTileOrigin, feedBackTileDims, feedBackPosition);
+	
+				float weightPrev = loadWeight(eFeedBackWeightsPrev, weightIndex, weightPrecision);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + beta * stdp(inputPrev, eStateHistory, weightPrev, iLearn, eLearn)));
+
+				weight = storeWeight(eFeedBackWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(eFeedBackMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, eFeedBackRadius, eFeedBackMaskWordsPerColumn);
+		}
+
+	float threshold = thresholdPrev + delta * kurt;
+
+	write_imagef(eThresholds, position, (float4)(threshold));
+}
+
+// Learn - inhibitory
+void kernel EIlayer_iLearn(read_only image2d_t feedBackStatesHistoryPrev, read_only image2d_t feedBackStatesHistory,
+	float alpha, float beta, float gamma, float delta, float sparsity, uint2 seed,
+	read_only image2d_t iStates,
+	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStatesHistory,
+	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStatesHistory,
+	read_only image2d_t iStateAverages,
+	global const float* iFeedForwardWeightsPrev, global const float* iLateralWeightsPrev, global const float* iFeedBackWeightsPrev, read_only image2d_t iThresholdsPrev,
+	global float* iFeedForwardWeights, global float* iLateralWeights, global float* iFeedBackWeights, write_only image2d_t iThresholds,
+	global uint* iFeedForwardMasks, global uint* iLateralMasks, global uint* iFeedBackMasks,
+	int2 eDims, int2 iDims, int2 iFeedBackDims,
+	float2 iDimsToEDims, float2 iDimsToFeedBackDims,
+	int iFeedForwardRadius, int iLateralRadius, int iFeedBackRadius, int weightPrecision)
+{
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(iFeedBackDims, EI_I_FEED_BACK_DIMS);
+	SPECIALIZE_LAYER(iFeedForwardRadius, EI_I_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(iLateralRadius, EI_I_LATERAL_RADIUS);
+	SPECIALIZE_LAYER(iFeedBackRadius, EI_I_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	// Stochastic rounding of the stored weights
+	uint2 rngState = seed + (uint2)(position.x * 29 + position.y * 16807, position.x * 16807 + position.y * 29);
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * iDimsToEDims.x + 0.5f, (position.y + 0.5f) * iDimsToEDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * iDimsToFeedBackDims.x + 0.5f, (position.y + 0.5f) * iDimsToFeedBackDims.y + 0.5f);
+
+	float iState = read_imagef(iStates, defaultUnnormalizedSampler, position).x;
+	float iStateHistory = readHistory(iStatesHistory, position);
+	float iStateHistoryPrev = readHistory(iStatesHistoryPrev, position);
+
+	float thresholdPrev = read_imagef(iThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float stateAverage = readAverage(iStateAverages, position);
+
+	float kurt = stateAverage - sparsity;
+
+	float eLearn = fmax(0.0f, -kurt);
+	float iLearn = fmax(0.0f, kurt);
+
+	int neuronIndex = position.x + position.y * iDims.x;
+	int layerSize = iDims.x * iDims.y;
+
+	int2 feedForwardWindowDims = getWeightWindowDims(iFeedForwardRadius, eDims);
+	int2 feedForwardWindowOrigin = getWeightWindowOrigin(feedForwardCenterPosition, iFeedForwardRadius, eDims, feedForwardWindowDims);
+	int2 feedBackWindowDims = getWeightWindowDims(iFeedBackRadius, iFeedBackDims);
+	int2 feedBackWindowOrigin = getWeightWindowOrigin(feedBackCenterPosition, iFeedBackRadius, iFeedBackDims, feedBackWindowDims);
+	int2 lateralWindowDims = getWeightWindowDims(iLateralRadius, iDims);
+	int2 lateralWindowOrigin = getWeightWindowOrigin(position, iLateralRadius, iDims, lateralWindowDims);
+
+	int iFeedForwardMaskWordsPerColumn = getMaskWordsPerColumn(iFeedForwardRadius);
+	int iLateralMaskWordsPerColumn = getMaskWordsPerColumn(iLateralRadius);
+	int iFeedBackMaskWordsPerColumn = getMaskWordsPerColumn(iFeedBackRadius);
+
+	uint maskWord = 0;
+
+	// Feed forward (excitatory)
+	for (int dx = -iFeedForwardRadius; dx <= iFeedForwardRadius; dx++)
+		for (int dy = -iFeedForwardRadius; dy <= iFeedForwardRadius; dy++) {
+			int2 feedForwardPosition = (int2)(feedForwardCenterPosition.x + dx, feedForwardCenterPosition.y + dy);
+
+			int valid = feedForwardPosition.x >= 0 && feedForwardPosition.x < eDims.x && feedForwardPosition.y >= 0 && feedForwardPosition.y < eDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedForwardPosition, feedForwardWindowOrigin, feedForwardWindowDims, neuronIndex, layerSize);
+
+				float input = readHistory(eStatesHistory, feedForwardPosition);
+
+				float weightPrev = loadWeight(iFeedForwardWeightsPrev, weightIndex, weightPrecision);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + alpha * rstdp(input, iStateHistoryPrev, weightPrev, eLearn, iLearn)));
+
+				weight = storeWeight(iFeedForwardWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(iFeedForwardMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, iFeedForwardRadius, iFeedForwardMaskWordsPerColumn);
+		}
+
+	// Feed back (inhibitory)
+	for (int dx = -iFeedBackRadius; dx <= iFeedBackRadius; dx++)
+		for (int dy = -iFeedBackRadius; dy <= iFeedBackRadius; dy++) {
+			int2 feedBackPosition = (int2)(feedBackCenterPosition.x + dx, feedBackCenterPosition.y + dy);
+
+			int valid = feedBackPosition.x >= 0 && feedBackPosition.x < iFeedBackDims.x && feedBackPosition.y >= 0 && feedBackPosition.y < iFeedBackDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedBackPosition, feedBackWindowOrigin, feedBackWindowDims, neuronIndex, layerSize);
+
+				float inputPrev = EI_FEED_BACK_INPUT ? readHistory(feedBackStatesHistoryPrev, feedBackPosition) : 0.0f;
+
+				float weightPrev = loadWeight(iFeedBackWeightsPrev, weightIndex, weightPrecision);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + beta * stdp(inputPrev, iStateHistory, weightPrev, iLearn, eLearn)));
+
+				weight = storeWeight(iFeedBackWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(iFeedBackMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, iFeedBackRadius, iFeedBackMaskWordsPerColumn);
+		}
+
+	// Lateral (inhibitory)
+	for (int dx = -iLateralRadius; dx <= iLateralRadius; dx++)
+		for (int dy = -iLateralRadius; dy <= iLateralRadius; dy++) {
+			int2 lateralPosition = (int2)(position.x + dx, position.y + dy);
+
+			int valid = lateralPosition.x >= 0 && lateralPosition.x < iDims.x && lateralPosition.y >= 0 && lateralPosition.y < iDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(lateralPosition, lateralWindowOrigin, lateralWindowDims, neuronIndex, layerSize);
+
+				float inputPrev = readHistory(iStatesHistoryPrev, lateralPosition);
+
+				float weightPrev = loadWeight(iLateralWeightsPrev, weightIndex, weightPrecision);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + gamma * stdp(inputPrev, iStateHistory, weightPrev, iLearn, eLearn)));
+
+				weight = storeWeight(iLateralWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			// Activation skips the neuron itself
+			updateMaskWord(iLateralMasks, &maskWord, weight, valid && (dx != 0 || dy != 0), neuronIndex, layerSize, dx, dy, iLateralRadius, iLateralMaskWordsPerColumn);
+		}
+
+	float threshold = thresholdPrev + delta * kurt;
+
+	write_imagef(iThresholds, position, (float4)(threshold));
+}
+
+// Activity gated learning (EIlayer::setActivityGatedLearning). Every STDP term is pre * post, so a neuron whose postsynaptic
+// histories (this step, and the previous one for the inhibitory feed forward rule) are zero changes no weight. Only the
+// neurons of a learner list are learned, thresholds of all neurons are updated separately
+
+// Append the neurons whose postsynaptic histories are above minHistory (readPrev: this or the previous step) to a learner list,
+// learnerCount must be cleared before. With two weight buffers a neuron that learned last step is listed once more, it then
+// copies its weights into the buffer it skipped (rates 0 in the learn kernels), so later steps do not read stale weights.
+// learnedPrev keeps that flag per neuron
+void kernel EIlayer_compactLearners(read_only image2d_t statesHistory, read_only image2d_t statesHistoryPrev, int readPrev,
+	global uchar* learnedPrev, int doubleBuffered, global int2* learners, global int* learnerCount, float minHistory)
+{
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int neuronIndex = position.x + position.y * get_global_size(0);
+
+	float postHistory = readHistory(statesHistory, position);
+
+	if (readPrev)
+		postHistory = fmax(postHistory, readHistory(statesHistoryPrev, position));
+
+	uchar learns = postHistory > minHistory ? 1 : 0;
+
+	if (learns || (doubleBuffered && learnedPrev[neuronIndex]))
+		learners[atomic_inc(learnerCount)] = position;
+
+	learnedPrev[neuronIndex] = learns;
+}
+
+// Threshold update of the learn kernels
+void kernel EIlayer_learnThresholds(read_only image2d_t stateAverages, read_only image2d_t thresholdsPrev, write_only image2d_t thresholds,
+	float delta, float sparsity)
+{
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	float thresholdPrev = read_imagef(thresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	float kurt = readAverage(stateAverages, position) - sparsity;
+
+	write_imagef(thresholds, position, (float4)(thresholdPrev + delta * kurt));
+}
+
+// Weight update of one receptive field, same as the loops of the learn kernels (reverse selects rstdp). With skipSilent (weights
+// stored in place) connections whose presynaptic history is at most minHistory are not touched, their mask bit is kept
+void learnField(read_only image2d_t preHistories, int hasInputs, int2 preDims, int2 centerPosition, int radius, int lateral,
+	global const float* weightsPrev, global float* weights, global uint* masks,
+	int neuronIndex, int layerSize, float postHistory, float rate, float a, float b, int reverse,
+	int skipSilent, float minHistory, int weightPrecision, uint2* rngState)
+{
+	int2 windowDims = getWeightWindowDims(radius, preDims);
+	int2 windowOrigin = getWeightWindowOrigin(centerPosition, radius, preDims, windowDims);
+
+	int maskWordsPerColumn = getMaskWordsPerColumn(radius);
+
+	uint maskWord = 0;
+
+	for (int dx = -radius; dx <= radius; dx++)
+		for (int dy = -radius; dy <= radius; dy++) {
+			int2 prePosition = (int2)(centerPosition.x + dx, centerPosition.y + dy);
+
+			int valid = prePosition.x >= 0 && prePosition.x < preDims.x && prePosition.y >= 0 && prePosition.y < preDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				float preHistory = hasInputs ? readHistory(preHistories, prePosition) : 0.0f;
+
+				if (skipSilent && preHistory <= minHistory) {
+					int row = dy + radius;
+
+					// Word is only written once its column part is done (updateMaskWord)
+					weight = (masks[neuronIndex + ((dx + radius) * maskWordsPerColumn + (row >> 5)) * layerSize] >> (row & 31)) & 1 ? 1.0f : 0.0f;
+				}
+				else {
+					int weightIndex = getWeightIndex(prePosition, windowOrigin, windowDims, neuronIndex, layerSize);
+
+					float weightPrev = loadWeight(weightsPrev, weightIndex, weightPrecision);
+
+					float update = reverse ? rstdp(preHistory, postHistory, weightPrev, a, b) : stdp(preHistory, postHistory, weightPrev, a, b);
+
+					weight = fmin(1.0f, fmax(0.0f, weightPrev + rate * update));
+
+					// Round to nearest without a rate so copies stay exact
+					weight = storeWeight(weights, weightIndex, weight, weightPrecision, rate == 0.0f ? 0 : rngState);
+				}
+			}
+
+			// Activation skips the neuron itself
+			updateMaskWord(masks, &maskWord, weight, valid && (!lateral || dx != 0 || dy != 0), neuronIndex, layerSize, dx, dy, radius, maskWordsPerColumn);
+		}
+}
+
+// Same weight updates as EIlayer_eLearn for the listed neurons. Work items stride over the list
+void kernel EIlayer_eLearnActive(read_only image2d_t feedForwardStatesHistoryPrev,
+	float alpha, float beta, float sparsity, float minHistory, uint2 seed,
+	global const int2* learners, global const int* learnerCount,
+	read_only image2d_t eStatesHistory, read_only image2d_t iStatesHistoryPrev, read_only image2d_t eStateAverages,
+	global const float* eFeedForwardWeightsPrev, global const float* eFeedBackWeightsPrev,
+	global float* eFeedForwardWeights, global float* eFeedBackWeights,
+	global uint* eFeedForwardMasks, global uint* eFeedBackMasks,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
+	int eFeedForwardRadius, int eFeedBackRadius, int weightPrecision, int skipSilent)
+{
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(eFeedForwardRadius, EI_E_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(eFeedBackRadius, EI_E_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
+	int count = *learnerCount;
+
+	for (int li = get_global_id(0); li < count; li += get_global_size(0)) {
+		int2 position = learners[li];
+
+		// Same rounding noise as EIlayer_eLearn
+		uint2 rngState = seed + (uint2)(position.x * 29 + position.y * 16807, position.x * 16807 + position.y * 29);
+
+		int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+		int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+
+		float eStateHistory = readHistory(eStatesHistory, position);
+
+		// Neurons only listed to bring the other buffer up to date copy their weights
+		float rateScale = eStateHistory > minHistory ? 1.0f : 0.0f;
+
+		float kurt = readAverage(eStateAverages, position) - sparsity;
+
+		float eLearn = fmax(0.0f, -kurt);
+		float iLearn = fmax(0.0f, kurt);
+
+		int neuronIndex = position.x + position.y * eDims.x;
+		int layerSize = eDims.x * eDims.y;
+
+		// Feed forward (excitatory)
+		learnField(feedForwardStatesHistoryPrev, 1, eFeedForwardDims, feedForwardCenterPosition, eFeedForwardRadius, 0,
+			eFeedForwardWeightsPrev, eFeedForwardWeights, eFeedForwardMasks, neuronIndex, layerSize, eStateHistory, alpha * rateScale, eLearn, iLearn, 0,
+			skipSilent, minHistory, weightPrecision, &rngState);
+
+		// Feed back (inhibitory)
+		learnField(iStatesHistoryPrev, 1, iDims, feedBackCenterPosition, eFeedBackRadius, 0,
+			eFeedBackWeightsPrev, eFeedBackWeights, eFeedBackMasks, neuronIndex, layerSize, eStateHistory, beta * rateScale, iLearn, eLearn, 0,
+			skipSilent, minHistory, weightPrecision, &rngState);
+	}
+}
+
+// Same weight updates as EIlayer_iLearn for the listed neurons. Work items stride over the list
+void kernel EIlayer_iLearnActive(read_only image2d_t feedBackStatesHistoryPrev,
+	float alpha, float beta, float gamma, float sparsity, float minHistory, uint2 seed,
+	global const int2* learners, global const int* learnerCount,
+	read_only image2d_t eStatesHistory, read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStatesHistory, read_only image2d_t iStateAverages,
+	global const float* iFeedForwardWeightsPrev, global const float* iLateralWeightsPrev, global const float* iFeedBackWeightsPrev,
+	global float* iFeedForwardWeights, global float* iLateralWeights, global float* iFeedBackWeights,
+	global uint* iFeedForwardMasks, global uint* iLateralMasks, global uint* iFeedBackMasks,
+	int2 eDims, int2 iDims, int2 iFeedBackDims,
+	float2 iDimsToEDims, float2 iDimsToFeedBackDims,
+	int iFeedForwardRadius, int iLateralRadius, int iFeedBackRadius, int weightPrecision, int skipSilent)
+{
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(iFeedBackDims, EI_I_FEED_BACK_DIMS);
+	SPECIALIZE_LAYER(iFeedForwardRadius, EI_I_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(iLateralRadius, EI_I_LATERAL_RADIUS);
+	SPECIALIZE_LAYER(iFeedBackRadius, EI_I_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
+	int count = *learnerCount;
+
+	for (int li = get_global_id(0); li < count; li += get_global_size(0)) {
+		int2 position = learners[li];
+
+		// Same rounding noise as EIlayer_iLearn
+		uint2 rngState = seed + (uint2)(position.x * 29 + position.y * 16807, position.x * 16807 + position.y * 29);
+
+		int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * iDimsToEDims.x + 0.5f, (position.y + 0.5f) * iDimsToEDims.y + 0.5f);
+		int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * iDimsToFeedBackDims.x + 0.5f, (position.y + 0.5f) * iDimsToFeedBackDims.y + 0.5f);
+
+		float iStateHistory = readHistory(iStatesHistory, position);
+		float iStateHistoryPrev = readHistory(iStatesHistoryPrev, position);
+
+		// Neurons only listed to bring the other buffer up to date copy their weights
+		float rateScale = fmax(iStateHistory, iStateHistoryPrev) > minHistory ? 1.0f : 0.0f;
+
+		float kurt = readAverage(iStateAverages, position) - sparsity;
+
+		float eLearn = fmax(0.0f, -kurt);
+		float iLearn = fmax(0.0f, kurt);
+
+		int neuronIndex = position.x + position.y * iDims.x;
+		int layerSize = iDims.x * iDims.y;
+
+		// Feed forward (excitatory)
+		learnField(eStatesHistory, 1, eDims, feedForwardCenterPosition, iFeedForwardRadius, 0,
+			iFeedForwardWeightsPrev, iFeedForwardWeights, iFeedForwardMasks, neuronIndex, layerSize, iStateHistoryPrev, alpha * rateScale, eLearn, iLearn, 1,
+			skipSilent, minHistory, weightPrecision, &rngState);
+
+		// Feed back (inhibitory)
+		learnField(feedBackStatesHistoryPrev, EI_FEED_BACK_INPUT, iFeedBackDims, feedBackCenterPosition, iFeedBackRadius, 0,
+			iFeedBackWeightsPrev, iFeedBackWeights, iFeedBackMasks, neuronIndex, layerSize, iStateHistory, beta * rateScale, iLearn, eLearn, 0,
+			skipSilent, minHistory, weightPrecision, &rngState);
+
+		// Lateral (inhibitory)
+		learnField(iStatesHistoryPrev, 1, iDims, position, iLateralRadius, 1,
+			iLateralWeightsPrev, iLateralWeights, iLateralMasks, neuronIndex, layerSize, iStateHistory, gamma * rateScale, iLearn, eLearn, 0,
+			skipSilent, minHistory, weightPrecision, &rngState);
+	}
+}
+
+// Batched learning. Weights and thresholds move by the mean of the updates the learn kernels would make for each batch item
+
+// Mean update of one connection, the rates come from each item's postsynaptic state average like in the learn kernels
+// (swapped for inhibitory inputs), reverse selects rstdp
+float batchUpdate(read_only image2d_t preHistories, int2 prePosition, int2 preDims,
+	read_only image2d_t postHistories, read_only image2d_t postAverages, int2 postPosition, int2 postDims,
+	float weight, float sparsity, int inhibitory, int reverse, int batchSize)
+{
+	float sum = 0.0f;
+
+	for (int b = 0; b < batchSize; b++) {
+		float pre = readHistory(preHistories, getBatchPosition(prePosition, preDims, b));
+		float post = readHistory(postHistories, getBatchPosition(postPosition, postDims, b));
+
+		float kurt = readAverage(postAverages, getBatchPosition(postPosition, postDims, b)) - sparsity;
+
+		float eLearn = fmax(0.0f, -kurt);
+		float iLearn = fmax(0.0f, kurt);
+
+		float a = inhibitory ? iLearn : eLearn;
+		float c = inhibitory ? eLearn : iLearn;
+
+		sum += reverse ? rstdp(pre, post, weight, a, c) : stdp(pre, post, weight, a, c);
+	}
+
+	return sum / batchSize;
+}
+
+float batchKurtosis(read_only image2d_t stateAverages, int2 position, int2 dims, float sparsity, int batchSize) {
+	float sum = 0.0f;
+
+	for (int b = 0; b < batchSize; b++)
+		sum += readAverage(stateAverages, getBatchPosition(position, dims, b)) - sparsity;
+
+	return sum / batchSize;
+}
+
+// Same as EIlayer_eLearn over a batch
+void kernel EIlayer_eLearnBatch(read_only image2d_t feedForwardStatesHistoryPrev, read_only image2d_t feedForwardStatesHistory,
+	float alpha, float beta, float delta, float sparsity, uint2 seed,
+	read_only image2d_t eStates,
+	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStatesHistory,
+	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStatesHistory,
+	read_only image2d_t eStateAverages,
+	global const float* eFeedForwardWeightsPrev, global const float* eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
+	global float* eFeedForwardWeights, global float* eFeedBackWeights, write_only image2d_t eThresholds,
+	global uint* eFeedForwardMasks, global uint* eFeedBackMasks,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
+	int eFeedForwardRadius, int eFeedBackRadius, int weightPrecision,
+	int batchSize)
+{
+	SPECIALIZE_LAYER(eFeedForwardDims, EI_E_FEED_FORWARD_DIMS);
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(eFeedForwardRadius, EI_E_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(eFeedBackRadius, EI_E_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	// Stochastic rounding of the stored weights
+	uint2 rngState = seed + (uint2)(position.x * 29 + position.y * 16807, position.x * 16807 + position.y * 29);
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+
+	float thresholdPrev = read_imagef(eThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	int neuronIndex = position.x + position.y * eDims.x;
+	int layerSize = eDims.x * eDims.y;
+
+	int2 feedForwardWindowDims = getWeightWindowDims(eFeedForwardRadius, eFeedForwardDims);
+	int2 feedForwardWindowOrigin = getWeightWindowOrigin(feedForwardCenterPosition, eFeedForwardRadius, eFeedForwardDims, feedForwardWindowDims);
+	int2 feedBackWindowDims = getWeightWindowDims(eFeedBackRadius, iDims);
+	int2 feedBackWindowOrigin = getWeightWindowOrigin(feedBackCenterPosition, eFeedBackRadius, iDims, feedBackWindowDims);
+
+	int eFeedForwardMaskWordsPerColumn = getMaskWordsPerColumn(eFeedForwardRadius);
+	int eFeedBackMaskWordsPerColumn = getMaskWordsPerColumn(eFeedBackRadius);
+
+	uint maskWord = 0;
+
+	// Feed forward (excitatory)
+	for (int dx = -eFeedForwardRadius; dx <= eFeedForwardRadius; dx++)
+		for (int dy = -eFeedForwardRadius; dy <= eFeedForwardRadius; dy++) {
+			int2 feedForwardPosition = (int2)(feedForwardCenterPosition.x + dx, feedForwardCenterPosition.y + dy);
+
+			int valid = feedForwardPosition.x >= 0 && feedForwardPosition.x < eFeedForwardDims.x && feedForwardPosition.y >= 0 && feedForwardPosition.y < eFeedForwardDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedForwardPosition, feedForwardWindowOrigin, feedForwardWindowDims, neuronIndex, layerSize);
+
+				float weightPrev = loadWeight(eFeedForwardWeightsPrev, weightIndex, weightPrecision);
+
+				float update = batchUpdate(feedForwardStatesHistoryPrev, feedForwardPosition, eFeedForwardDims, eStatesHistory, eStateAverages, position, eDims, weightPrev, sparsity, 0, 0, batchSize);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + alpha * update));
+
+				weight = storeWeight(eFeedForwardWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(eFeedForwardMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, eFeedForwardRadius, eFeedForwardMaskWordsPerColumn);
+		}
+
+	// Feed back (inhibitory)
+	for (int dx = -eFeedBackRadius; dx <= eFeedBackRadius; dx++)
+		for (int dy = -eFeedBackRadius; dy <= eFeedBackRadius; dy++) {
+			int2 feedBackPosition = (int2)(feedBackCenterPosition.x + dx, feedBackCenterPosition.y + dy);
+
+			int valid = feedBackPosition.x >= 0 && feedBackPosition.x < iDims.x && feedBackPosition.y >= 0 && feedBackPosition.y < iDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedBackPosition, feedBackWindowOrigin, feedBackWindowDims, neuronIndex, layerSize);
+
+				float weightPrev = loadWeight(eFeedBackWeightsPrev, weightIndex, weightPrecision);
+
+				float update = batchUpdate(iStatesHistoryPrev, feedBackPosition, iDims, eStatesHistory, eStateAverages, position, eDims, weightPrev, sparsity, 1, 0, batchSize);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + beta * update));
+
+				weight = storeWeight(eFeedBackWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(eFeedBackMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, eFeedBackRadius, eFeedBackMaskWordsPerColumn);
+		}
+
+	float threshold = thresholdPrev + delta * batchKurtosis(eStateAverages, position, eDims, sparsity, batchSize);
+
+	write_imagef(eThresholds, position, (float4)(threshold));
+}
+
+// Same as EIlayer_iLearn over a batch
+void kernel EIlayer_iLearnBatch(read_only image2d_t feedBackStatesHistoryPrev, read_only image2d_t feedBackStatesHistory,
+	float alpha, float beta, float gamma, float delta, float sparsity, uint2 seed,
+	read_only image2d_t iStates,
+	read_only image2d_t eStatesHistoryPrev, read_only image2d_t eStatesHistory,
+	read_only image2d_t iStatesHistoryPrev, read_only image2d_t iStatesHistory,
+	read_only image2d_t iStateAverages,
+	global const float* iFeedForwardWeightsPrev, global const float* iLateralWeightsPrev, global const float* iFeedBackWeightsPrev, read_only image2d_t iThresholdsPrev,
+	global float* iFeedForwardWeights, global float* iLateralWeights, global float* iFeedBackWeights, write_only image2d_t iThresholds,
+	global uint* iFeedForwardMasks, global uint* iLateralMasks, global uint* iFeedBackMasks,
+	int2 eDims, int2 iDims, int2 iFeedBackDims,
+	float2 iDimsToEDims, float2 iDimsToFeedBackDims,
+	int iFeedForwardRadius, int iLateralRadius, int iFeedBackRadius, int weightPrecision,
+	int batchSize)
+{
+	SPECIALIZE_LAYER(eDims, EI_E_DIMS);
+	SPECIALIZE_LAYER(iDims, EI_I_DIMS);
+	SPECIALIZE_LAYER(iFeedBackDims, EI_I_FEED_BACK_DIMS);
+	SPECIALIZE_LAYER(iFeedForwardRadius, EI_I_FEED_FORWARD_RADIUS);
+	SPECIALIZE_LAYER(iLateralRadius, EI_I_LATERAL_RADIUS);
+	SPECIALIZE_LAYER(iFeedBackRadius, EI_I_FEED_BACK_RADIUS);
+	SPECIALIZE_LAYER(weightPrecision, EI_WEIGHT_PRECISION);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	// Stochastic rounding of the stored weights
+	uint2 rngState = seed + (uint2)(position.x * 29 + position.y * 16807, position.x * 16807 + position.y * 29);
+
+	int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * iDimsToEDims.x + 0.5f, (position.y + 0.5f) * iDimsToEDims.y + 0.5f);
+	int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * iDimsToFeedBackDims.x + 0.5f, (position.y + 0.5f) * iDimsToFeedBackDims.y + 0.5f);
+
+	float thresholdPrev = read_imagef(iThresholdsPrev, defaultUnnormalizedSampler, position).x;
+
+	int neuronIndex = position.x + position.y * iDims.x;
+	int layerSize = iDims.x * iDims.y;
+
+	int2 feedForwardWindowDims = getWeightWindowDims(iFeedForwardRadius, eDims);
+	int2 feedForwardWindowOrigin = getWeightWindowOrigin(feedForwardCenterPosition, iFeedForwardRadius, eDims, feedForwardWindowDims);
+	int2 feedBackWindowDims = getWeightWindowDims(iFeedBackRadius, iFeedBackDims);
+	int2 feedBackWindowOrigin = getWeightWindowOrigin(feedBackCenterPosition, iFeedBackRadius, iFeedBackDims, feedBackWindowDims);
+	int2 lateralWindowDims = getWeightWindowDims(iLateralRadius, iDims);
+	int2 lateralWindowOrigin = getWeightWindowOrigin(position, iLateralRadius, iDims, lateralWindowDims);
+
+	int iFeedForwardMaskWordsPerColumn = getMaskWordsPerColumn(iFeedForwardRadius);
+	int iLateralMaskWordsPerColumn = getMaskWordsPerColumn(iLateralRadius);
+	int iFeedBackMaskWordsPerColumn = getMaskWordsPerColumn(iFeedBackRadius);
+
+	uint maskWord = 0;
+
+	// Feed forward (excitatory)
+	for (int dx = -iFeedForwardRadius; dx <= iFeedForwardRadius; dx++)
+		for (int dy = -iFeedForwardRadius; dy <= iFeedForwardRadius; dy++) {
+			int2 feedForwardPosition = (int2)(feedForwardCenterPosition.x + dx, feedForwardCenterPosition.y + dy);
+
+			int valid = feedForwardPosition.x >= 0 && feedForwardPosition.x < eDims.x && feedForwardPosition.y >= 0 && feedForwardPosition.y < eDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedForwardPosition, feedForwardWindowOrigin, feedForwardWindowDims, neuronIndex, layerSize);
+
+				float weightPrev = loadWeight(iFeedForwardWeightsPrev, weightIndex, weightPrecision);
+
+				float update = batchUpdate(eStatesHistory, feedForwardPosition, eDims, iStatesHistoryPrev, iStateAverages, position, iDims, weightPrev, sparsity, 0, 1, batchSize);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + alpha * update));
+
+				weight = storeWeight(iFeedForwardWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(iFeedForwardMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, iFeedForwardRadius, iFeedForwardMaskWordsPerColumn);
+		}
+
+	// Feed back (inhibitory)
+	for (int dx = -iFeedBackRadius; dx <= iFeedBackRadius; dx++)
+		for (int dy = -iFeedBackRadius; dy <= iFeedBackRadius; dy++) {
+			int2 feedBackPosition = (int2)(feedBackCenterPosition.x + dx, feedBackCenterPosition.y + dy);
+
+			int valid = feedBackPosition.x >= 0 && feedBackPosition.x < iFeedBackDims.x && feedBackPosition.y >= 0 && feedBackPosition.y < iFeedBackDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(feedBackPosition, feedBackWindowOrigin, feedBackWindowDims, neuronIndex, layerSize);
+
+				float weightPrev = loadWeight(iFeedBackWeightsPrev, weightIndex, weightPrecision);
+
+				float update = EI_FEED_BACK_INPUT ? batchUpdate(feedBackStatesHistoryPrev, feedBackPosition, iFeedBackDims, iStatesHistory, iStateAverages, position, iDims, weightPrev, sparsity, 1, 0, batchSize) : 0.0f;
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + beta * update));
+
+				weight = storeWeight(iFeedBackWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			updateMaskWord(iFeedBackMasks, &maskWord, weight, valid, neuronIndex, layerSize, dx, dy, iFeedBackRadius, iFeedBackMaskWordsPerColumn);
+		}
+
+	// Lateral (inhibitory)
+	for (int dx = -iLateralRadius; dx <= iLateralRadius; dx++)
+		for (int dy = -iLateralRadius; dy <= iLateralRadius; dy++) {
+			int2 lateralPosition = (int2)(position.x + dx, position.y + dy);
+
+			int valid = lateralPosition.x >= 0 && lateralPosition.x < iDims.x && lateralPosition.y >= 0 && lateralPosition.y < iDims.y;
+
+			float weight = 0.0f;
+
+			if (valid) {
+				int weightIndex = getWeightIndex(lateralPosition, lateralWindowOrigin, lateralWindowDims, neuronIndex, layerSize);
+
+				float weightPrev = loadWeight(iLateralWeightsPrev, weightIndex, weightPrecision);
+
+				float update = batchUpdate(iStatesHistoryPrev, lateralPosition, iDims, iStatesHistory, iStateAverages, position, iDims, weightPrev, sparsity, 1, 0, batchSize);
+
+				weight = fmin(1.0f, fmax(0.0f, weightPrev + gamma * update));
+
+				weight = storeWeight(iLateralWeights, weightIndex, weight, weightPrecision, &rngState);
+			}
+
+			// Activation skips the neuron itself
+			updateMaskWord(iLateralMasks, &maskWord, weight, valid && (dx != 0 || dy != 0), neuronIndex, layerSize, dx, dy, iLateralRadius, iLateralMaskWordsPerColumn);
+		}
+
+	float threshold = thresholdPrev + delta * batchKurtosis(iStateAverages, position, iDims, sparsity, batchSize);
+
+	write_imagef(iThresholds, position, (float4)(threshold));
+}
+
+// Activity statistics (HEInet::createStatistics), one record per population and recording, same layout as EIlayer::PopulationStatistics
+typedef struct {
+	float stateAverageMean;
+	float stateAverageVariance;
+	float thresholdMin;
+	float thresholdMax;
+	uint spikes;
+	uint synapticEvents;
+} PopulationStatistics;
+
+// Work-group reduction (power of two size) of value, op 0 sums, 1 takes the minimum and 2 the maximum. All work items get the result
+float reduceGroup(local float* scratch, float value, int op) {
+	int localIndex = get_local_id(0);
+
+	scratch[localIndex] = value;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = get_local_size(0) / 2; stride > 0; stride >>= 1) {
+		if (localIndex < stride) {
+			float other = scratch[localIndex + stride];
+
+			scratch[localIndex] = op == 0 ? scratch[localIndex] + other : (op == 1 ? fmin(scratch[localIndex], other) : fmax(scratch[localIndex], other));
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	float result = scratch[0];
+
+	// Scratch is reused by the next reduction
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return result;
+}
+
+uint reduceGroupCount(local uint* scratch, uint value) {
+	int localIndex = get_local_id(0);
+
+	scratch[localIndex] = value;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = get_local_size(0) / 2; stride > 0; stride >>= 1) {
+		if (localIndex < stride)
+			scratch[localIndex] += scratch[localIndex + stride];
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	uint result = scratch[0];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	return result;
+}
+
+// Reduces the spikes, state averages and thresholds of a population (batch items included, stacked vertically) and writes its record
+// together with the synaptic events each work item counted. The variance is summed around the mean in a second pass
+void writeStatistics(global PopulationStatistics* statistics, read_only image2d_t states, read_only image2d_t stateAverages, read_only image2d_t thresholds,
+	int2 dims, int batchSize, uint synapticEvents, local float* floatScratch, local uint* countScratch)
+{
+	int layerSize = dims.x * dims.y;
+	int numNeurons = layerSize * batchSize;
+
+	uint spikes = 0;
+	float averageSum = 0.0f;
+	float thresholdMin = INFINITY;
+	float thresholdMax = -INFINITY;
+
+	for (int i = get_local_id(0); i < numNeurons; i += get_local_size(0)) {
+		int2 statePosition = (int2)(i % dims.x, i / dims.x);
+
+		spikes += read_imagef(states, defaultUnnormalizedSampler, statePosition).x > 0.5f ? 1 : 0;
+
+		averageSum += readAverage(stateAverages, statePosition);
+
+		// Thresholds are shared by the batch items
+		if (i < layerSize) {
+			float threshold = read_imagef(thresholds, defaultUnnormalizedSampler, statePosition).x;
+
+			thresholdMin = fmin(thresholdMin, threshold);
+			thresholdMax = fmax(thresholdMax, threshold);
+		}
+	}
+
+	float mean = reduceGroup(floatScratch, averageSum, 0) / numNeurons;
+
+	float deviationSum = 0.0f;
+
+	for (int i = get_local_id(0); i < numNeurons; i += get_local_size(0)) {
+		float deviation = readAverage(stateAverages, (int2)(i % dims.x, i / dims.x)) - mean;
+
+		deviationSum += deviation * deviation;
+	}
+
+	float variance = reduceGroup(floatScratch, deviationSum, 0) / numNeurons;
+
+	thresholdMin = reduceGroup(floatScratch, thresholdMin, 1);
+	thresholdMax = reduceGroup(floatScratch, thresholdMax, 2);
+
+	spikes = reduceGroupCount(countScratch, spikes);
+	synapticEvents = reduceGroupCount(countScratch, synapticEvents);
+
+	if (get_local_id(0) == 0) {
+		statistics->stateAverageMean = mean;
+		statistics->stateAverageVariance = variance;
+		statistics->thresholdMin = thresholdMin;
+		statistics->thresholdMax = thresholdMax;
+		statistics->spikes = spikes;
+		statistics->synapticEvents = synapticEvents;
+	}
+}
+
+// Statistics of the excitatory population after activation, run by a single work-group. Synaptic events are the connected inputs
+// (weight > 0.5) that spiked into its neurons, read from the same images and weights as EIlayer_eActivate
+void kernel EIlayer_eStatistics(global PopulationStatistics* statistics, int record,
+	read_only image2d_t feedForwardInput, read_only image2d_t iStatesPrev,
+	global const float* eFeedForwardWeightsPrev, global const float* eFeedBackWeightsPrev, read_only image2d_t eThresholdsPrev,
+	read_only image2d_t eStates, read_only image2d_t eStateAverages,
+	int2 eFeedForwardDims, int2 eDims, int2 iDims,
+	float2 eDimsToEFeedForwardDims, float2 eDimsToIDims,
+	int eFeedForwardRadius, int eFeedBackRadius, int weightPrecision, int batchSize,
+	local float* floatScratch, local uint* countScratch)
+{
+	int layerSize = eDims.x * eDims.y;
+
+	uint synapticEvents = 0;
+
+	for (int i = get_local_id(0); i < layerSize * batchSize; i += get_local_size(0)) {
+		int neuronIndex = i % layerSize;
+		int batch = i / layerSize;
+
+		int2 position = (int2)(neuronIndex % eDims.x, neuronIndex / eDims.x);
+
+		int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * eDimsToEFeedForwardDims.x + 0.5f, (position.y + 0.5f) * eDimsToEFeedForwardDims.y + 0.5f);
+		int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * eDimsToIDims.x + 0.5f, (position.y + 0.5f) * eDimsToIDims.y + 0.5f);
+
+		float excitation = sumWindow(feedForwardInput, eFeedForwardDims, batch, eFeedForwardWeightsPrev, neuronIndex, layerSize, feedForwardCenterPosition, eFeedForwardRadius, 0, weightPrecision);
+		float inhibition = sumWindow(iStatesPrev, iDims, batch, eFeedBackWeightsPrev, neuronIndex, layerSize, feedBackCenterPosition, eFeedBackRadius, 0, weightPrecision);
+
+		synapticEvents += convert_uint(excitation + inhibition);
+	}
+
+	writeStatistics(statistics + record, eStates, eStateAverages, eThresholdsPrev, eDims, batchSize, synapticEvents, floatScratch, countScratch);
+}
+
+// Same as EIlayer_eStatistics for the inhibitory population, hasFeedBack is 0 for the top layer (zero feed back input)
+void kernel EIlayer_iStatistics(global PopulationStatistics* statistics, int record,
+	read_only image2d_t feedBackInput, int hasFeedBack, read_only image2d_t eStatesPrev,
+	global const float* iFeedForwardWeightsPrev, global const float* iLateralWeightsPrev, global const float* iFeedBackWeightsPrev, read_only image2d_t iThresholdsPrev,
+	read_only image2d_t iStatesPrev, read_only image2d_t iStates, read_only image2d_t iStateAverages,
+	int2 eDims, int2 iDims, int2 iFeedBackDims,
+	float2 iDimsToEDims, float2 iDimsToFeedBackDims,
+	int iFeedForwardRadius, int iLateralRadius, int iFeedBackRadius, int weightPrecision, int batchSize,
+	local float* floatScratch, local uint* countScratch)
+{
+	int layerSize = iDims.x * iDims.y;
+
+	uint synapticEvents = 0;
+
+	for (int i = get_local_id(0); i < layerSize * batchSize; i += get_local_size(0)) {
+		int neuronIndex = i % layerSize;
+		int batch = i / layerSize;
+
+		int2 position = (int2)(neuronIndex % iDims.x, neuronIndex / iDims.x);
+
+		int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * iDimsToEDims.x + 0.5f, (position.y + 0.5f) * iDimsToEDims.y + 0.5f);
+		int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * iDimsToFeedBackDims.x + 0.5f, (position.y + 0.5f) * iDimsToFeedBackDims.y + 0.5f);
+
+		float excitation = sumWindow(eStatesPrev, eDims, batch, iFeedForwardWeightsPrev, neuronIndex, layerSize, feedForwardCenterPosition, iFeedForwardRadius, 0, weightPrecision);
+
+		float inhibition = hasFeedBack ? sumWindow(feedBackInput, iFeedBackDims, batch, iFeedBackWeightsPrev, neuronIndex, layerSize, feedBackCenterPosition, iFeedBackRadius, 0, weightPrecision) : 0.0f;
+
+		inhibition += sumWindow(iStatesPrev, iDims, batch, iLateralWeightsPrev, neuronIndex, layerSize, position, iLateralRadius, 1, weightPrecision);
+
+		synapticEvents += convert_uint(excitation + inhibition);
+	}
+
+	writeStatistics(statistics + record, iStates, iStateAverages, iThresholdsPrev, iDims, batchSize, synapticEvents, floatScratch, countScratch);
+}
+
+// ---------------------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------------- HEInet --------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------------------------------
+
+// Initialize one set of prediction weights (float) over (4 * input width, input height, slot chunks), see initializeWeight
+void kernel HEInet_predictionInitialize(global float* predictionWeightsPrev, global float* predictionWeights,
+	float2 eFeedForwardDimsToDims, int2 dims, int predictionRadius,
+	float minInitWeight, float maxInitWeight, uint2 seed, uint stream)
+{
+	int2 position = (int2)(get_global_id(0) >> 2, get_global_id(1));
+
+	int2 inputDims = (int2)(get_global_size(0) >> 2, get_global_size(1));
+
+	int2 centerPosition = (int2)((position.x + 0.5f) * eFeedForwardDimsToDims.x + 0.5f, (position.y + 0.5f) * eFeedForwardDimsToDims.y + 0.5f);
+
+	initializeWeight(predictionWeightsPrev, predictionWeights, 1, centerPosition, dims, predictionRadius,
+		position.x + position.y * inputDims.x, inputDims.x * inputDims.y, get_global_id(2) * 4 + (get_global_id(0) & 3),
+		minInitWeight, maxInitWeight, seed, stream, 0);
+}
+
+// Perceptron from eStates and iStates that forms predictions
 void kernel HEInet_predict(read_only image2d_t eStates, read_only image2d_t iStates,
-	read_only image3d_t predictionFromEWeightsPrev, read_only image3d_t predictionFromIWeightsPrev,
+	global const float* predictionFromEWeightsPrev, global const float* predictionFromIWeightsPrev,
 	write_only image2d_t predictions,
 	float2 eFeedForwardDimsToEDims, float2 eFeedForwardDimsToIDims,
 	int2 eDims, int2 iDims,
 	int predictionRadiusFromE, int predictionRadiusFromI)
 {
+	SPECIALIZE_NETWORK(eDims, EI_E_DIMS);
+	SPECIALIZE_NETWORK(iDims, EI_I_DIMS);
+	SPECIALIZE_NETWORK(predictionRadiusFromE, EI_PREDICTION_RADIUS_FROM_E);
+	SPECIALIZE_NETWORK(predictionRadiusFromI, EI_PREDICTION_RADIUS_FROM_I);
+
 	int2 position = (int2)(get_global_id(0), get_global_id(1));
 
+	int batch = get_global_id(2);
+
 	int2 eCenterPosition = (int2)((position.x + 0.5f) * eFeedForwardDimsToEDims.x + 0.5f, (position.y + 0.5f) * eFeedForwardDimsToEDims.y + 0.5f);
 	int2 iCenterPosition = (int2)((position.x + 0.5f) * eFeedForwardDimsToIDims.x + 0.5f, (position.y + 0.5f) * eFeedForwardDimsToIDims.y + 0.5f);
 
-	int wi = 0;
+	int neuronIndex = position.x + position.y * get_global_size(0);
+	int layerSize = get_global_size(0) * get_global_size(1);
+
+	int2 eWindowDims = getWeightWindowDims(predictionRadiusFromE, eDims);
+	int2 eWindowOrigin = getWeightWindowOrigin(eCenterPosition, predictionRadiusFromE, eDims, eWindowDims);
+	int2 iWindowDims = getWeightWindowDims(predictionRadiusFromI, iDims);
+	int2 iWindowOrigin = getWeightWindowOrigin(iCenterPosition, predictionRadiusFromI, iDims, iWindowDims);
 
 	float sum = 0.0f;
 
@@ -541,31 +2315,104 @@ void kernel HEInet_predict(read_only image2d_t eStates, read_only image2d_t iSta
 			int2 ePosition = (int2)(eCenterPosition.x + dx, eCenterPosition.y + dy);
 
 			if (ePosition.x >= 0 && ePosition.x < eDims.x && ePosition.y >= 0 && ePosition.y < eDims.y) {
-				float input = read_imagef(eStates, defaultUnnormalizedSampler, ePosition).x;
+				int weightIndex = getWeightIndex(ePosition, eWindowOrigin, eWindowDims, neuronIndex, layerSize);
+
+				float input = read_imagef(eStates, defaultUnnormalizedSampler, getBatchPosition(ePosition, eDims, batch)).x;
 
-				float weight = read_imagef(predictionFromEWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+				float weight = predictionFromEWeightsPrev[weightIndex];
 
 				sum += weight * input;
 			}
+		}
+
+	for (int dx = -predictionRadiusFromI; dx <= predictionRadiusFromI; dx++)
+		for (int dy = -predictionRadiusFromI; dy <= predictionRadiusFromI; dy++) {
+			int2 iPosition = (int2)(iCenterPosition.x + dx, iCenterPosition.y + dy);
+
+			if (iPosition.x >= 0 && iPosition.x < iDims.x && iPosition.y >= 0 && iPosition.y < iDims.y) {
+				int weightIndex = getWeightIndex(iPosition, iWindowOrigin, iWindowDims, neuronIndex, layerSize);
+
+				float input = read_imagef(iStates, defaultUnnormalizedSampler, getBatchPosition(iPosition, iDims, batch)).x;
 
-			wi++;
+				float weight = predictionFromIWeightsPrev[weightIndex];
+
+				sum += weight * input;
+			}
 		}
 
-	wi = 0;
+	write_imagef(predictions, getBatchPosition(position, (int2)(get_global_size(0), get_global_size(1)), batch), (float4)(sum));
+}
+
+// Same as HEInet_predict, with work-groups of tiles
+void kernel HEInet_predictTiled(read_only image2d_t eStates, read_only image2d_t iStates,
+	global const float* predictionFromEWeightsPrev, global const float* predictionFromIWeightsPrev,
+	write_only image2d_t predictions,
+	float2 eFeedForwardDimsToEDims, float2 eFeedForwardDimsToIDims,
+	int2 eDims, int2 iDims,
+	int predictionRadiusFromE, int predictionRadiusFromI,
+	local float* eTile, local float* iTile, int2 eTileDims, int2 iTileDims)
+{
+	SPECIALIZE_NETWORK(eDims, EI_E_DIMS);
+	SPECIALIZE_NETWORK(iDims, EI_I_DIMS);
+	SPECIALIZE_NETWORK(predictionRadiusFromE, EI_PREDICTION_RADIUS_FROM_E);
+	SPECIALIZE_NETWORK(predictionRadiusFromI, EI_PREDICTION_RADIUS_FROM_I);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int2 eTileOrigin = getTileOrigin(eFeedForwardDimsToEDims, predictionRadiusFromE);
+	int2 iTileOrigin = getTileOrigin(eFeedForwardDimsToIDims, predictionRadiusFromI);
+
+	loadTile(eStates, eDims, eTile, eTileOrigin, eTileDims, 0);
+	loadTile(iStates, iDims, iTile, iTileOrigin, iTileDims, 0);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int2 dims = get_image_dim(predictions);
+
+	if (position.x >= dims.x || position.y >= dims.y)
+		return;
+
+	int2 eCenterPosition = (int2)((position.x + 0.5f) * eFeedForwardDimsToEDims.x + 0.5f, (position.y + 0.5f) * eFeedForwardDimsToEDims.y + 0.5f);
+	int2 iCenterPosition = (int2)((position.x + 0.5f) * eFeedForwardDimsToIDims.x + 0.5f, (position.y + 0.5f) * eFeedForwardDimsToIDims.y + 0.5f);
+
+	int neuronIndex = position.x + position.y * dims.x;
+	int layerSize = dims.x * dims.y;
+
+	int2 eWindowDims = getWeightWindowDims(predictionRadiusFromE, eDims);
+	int2 eWindowOrigin = getWeightWindowOrigin(eCenterPosition, predictionRadiusFromE, eDims, eWindowDims);
+	int2 iWindowDims = getWeightWindowDims(predictionRadiusFromI, iDims);
+	int2 iWindowOrigin = getWeightWindowOrigin(iCenterPosition, predictionRadiusFromI, iDims, iWindowDims);
+
+	float sum = 0.0f;
+
+	for (int dx = -predictionRadiusFromE; dx <= predictionRadiusFromE; dx++)
+		for (int dy = -predictionRadiusFromE; dy <= predictionRadiusFromE; dy++) {
+			int2 ePosition = (int2)(eCenterPosition.x + dx, eCenterPosition.y + dy);
+
+			if (ePosition.x >= 0 && ePosition.x < eDims.x && ePosition.y >= 0 && ePosition.y < eDims.y) {
+				int weightIndex = getWeightIndex(ePosition, eWindowOrigin, eWindowDims, neuronIndex, layerSize);
+
+				float input = readTile(eTile, eTileOrigin, eTileDims, ePosition);
+
+				float weight = predictionFromEWeightsPrev[weightIndex];
+
+				sum += weight * input;
+			}
+		}
 
 	for (int dx = -predictionRadiusFromI; dx <= predictionRadiusFromI; dx++)
 		for (int dy = -predictionRadiusFromI; dy <= predictionRadiusFromI; dy++) {
 			int2 iPosition = (int2)(iCenterPosition.x + dx, iCenterPosition.y + dy);
 
 			if (iPosition.x >= 0 && iPosition.x < iDims.x && iPosition.y >= 0 && iPosition.y < iDims.y) {
-				float input = read_imagef(iStates, defaultUnnormalizedSampler, iPosition).x;
+				int weightIndex = getWeightIndex(iPosition, iWindowOrigin, iWindowDims, neuronIndex, layerSize);
+
+				float input = readTile(iTile, iTileOrigin, iTileDims, iPosition);
 
-				float weight = read_imagef(predictionFromIWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+				float weight = predictionFromIWeightsPrev[weightIndex];
 
 				sum += weight * input;
 			}
-
-			wi++;
 		}
 
 	write_imagef(predictions, position, (float4)(sum));
@@ -574,13 +2421,18 @@ void kernel HEInet_predict(read_only image2d_t eStates, read_only image2d_t iSta
 // Learn perceptron
 void kernel HEInet_predictionLearn(read_only image2d_t eStates, read_only image2d_t iStates,
 	read_only image2d_t feedForwardInput, read_only image2d_t predictions,
-	read_only image3d_t predictionFromEWeightsPrev, read_only image3d_t predictionFromIWeightsPrev,
-	write_only image3d_t predictionFromEWeights, write_only image3d_t predictionFromIWeights,
+	global const float* predictionFromEWeightsPrev, global const float* predictionFromIWeightsPrev,
+	global float* predictionFromEWeights, global float* predictionFromIWeights,
 	float2 eFeedForwardDimsToEDims, float2 eFeedForwardDimsToIDims,
 	int2 eDims, int2 iDims,
 	int predictionRadiusFromE, int predictionRadiusFromI,
 	float alpha)
 {
+	SPECIALIZE_NETWORK(eDims, EI_E_DIMS);
+	SPECIALIZE_NETWORK(iDims, EI_I_DIMS);
+	SPECIALIZE_NETWORK(predictionRadiusFromE, EI_PREDICTION_RADIUS_FROM_E);
+	SPECIALIZE_NETWORK(predictionRadiusFromI, EI_PREDICTION_RADIUS_FROM_I);
+
 	int2 position = (int2)(get_global_id(0), get_global_id(1));
 
 	int2 eCenterPosition = (int2)((position.x + 0.5f) * eFeedForwardDimsToEDims.x + 0.5f, (position.y + 0.5f) * eFeedForwardDimsToEDims.y + 0.5f);
@@ -591,49 +2443,126 @@ void kernel HEInet_predictionLearn(read_only image2d_t eStates, read_only image2
 
 	float alphaError = alpha * (target - prediction);
 
-	int wi = 0;
+	int neuronIndex = position.x + position.y * get_global_size(0);
+	int layerSize = get_global_size(0) * get_global_size(1);
+
+	int2 eWindowDims = getWeightWindowDims(predictionRadiusFromE, eDims);
+	int2 eWindowOrigin = getWeightWindowOrigin(eCenterPosition, predictionRadiusFromE, eDims, eWindowDims);
+	int2 iWindowDims = getWeightWindowDims(predictionRadiusFromI, iDims);
+	int2 iWindowOrigin = getWeightWindowOrigin(iCenterPosition, predictionRadiusFromI, iDims, iWindowDims);
 
 	for (int dx = -predictionRadiusFromE; dx <= predictionRadiusFromE; dx++)
 		for (int dy = -predictionRadiusFromE; dy <= predictionRadiusFromE; dy++) {
 			int2 ePosition = (int2)(eCenterPosition.x + dx, eCenterPosition.y + dy);
 
 			if (ePosition.x >= 0 && ePosition.x < eDims.x && ePosition.y >= 0 && ePosition.y < eDims.y) {
+				int weightIndex = getWeightIndex(ePosition, eWindowOrigin, eWindowDims, neuronIndex, layerSize);
+
 				float input = read_imagef(eStates, defaultUnnormalizedSampler, ePosition).x;
 
-				float weightPrev = read_imagef(predictionFromEWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+				float weightPrev = predictionFromEWeightsPrev[weightIndex];
 
 				float weight = weightPrev + alphaError * input;
 
-				write_imagef(predictionFromEWeights, (int4)(position.x, position.y, wi, 0), (float4)(weight));
+				predictionFromEWeights[weightIndex] = weight;
 			}
-
-			wi++;
 		}
 
-	wi = 0;
-
 	for (int dx = -predictionRadiusFromI; dx <= predictionRadiusFromI; dx++)
 		for (int dy = -predictionRadiusFromI; dy <= predictionRadiusFromI; dy++) {
 			int2 iPosition = (int2)(iCenterPosition.x + dx, iCenterPosition.y + dy);
 
 			if (iPosition.x >= 0 && iPosition.x < iDims.x && iPosition.y >= 0 && iPosition.y < iDims.y) {
+				int weightIndex = getWeightIndex(iPosition, iWindowOrigin, iWindowDims, neuronIndex, layerSize);
+
 				float input = read_imagef(iStates, defaultUnnormalizedSampler, iPosition).x;
 
-				float weightPrev = read_imagef(predictionFromIWeightsPrev, defaultUnnormalizedSampler, (int4)(position.x, position.y, wi, 0)).x;
+				float weightPrev = predictionFromIWeightsPrev[weightIndex];
 
 				float weight = weightPrev + alphaError * input;
 
-				write_imagef(predictionFromIWeights, (int4)(position.x, position.y, wi, 0), (float4)(weight));
+				predictionFromIWeights[weightIndex] = weight;
+			}
+		}
+}
+
+// Same as HEInet_predictionLearn over a batch, weights move by the mean update
+void kernel HEInet_predictionLearnBatch(read_only image2d_t eStates, read_only image2d_t iStates,
+	read_only image2d_t feedForwardInput, read_only image2d_t predictions,
+	global const float* predictionFromEWeightsPrev, global const float* predictionFromIWeightsPrev,
+	global float* predictionFromEWeights, global float* predictionFromIWeights,
+	float2 eFeedForwardDimsToEDims, float2 eFeedForwardDimsToIDims,
+	int2 eDims, int2 iDims,
+	int predictionRadiusFromE, int predictionRadiusFromI,
+	float alpha, int batchSize)
+{
+	SPECIALIZE_NETWORK(eDims, EI_E_DIMS);
+	SPECIALIZE_NETWORK(iDims, EI_I_DIMS);
+	SPECIALIZE_NETWORK(predictionRadiusFromE, EI_PREDICTION_RADIUS_FROM_E);
+	SPECIALIZE_NETWORK(predictionRadiusFromI, EI_PREDICTION_RADIUS_FROM_I);
+
+	int2 position = (int2)(get_global_id(0), get_global_id(1));
+
+	int2 dims = (int2)(get_global_size(0), get_global_size(1));
+
+	int2 eCenterPosition = (int2)((position.x + 0.5f) * eFeedForwardDimsToEDims.x + 0.5f, (position.y + 0.5f) * eFeedForwardDimsToEDims.y + 0.5f);
+	int2 iCenterPosition = (int2)((position.x + 0.5f) * eFeedForwardDimsToIDims.x + 0.5f, (position.y + 0.5f) * eFeedForwardDimsToIDims.y + 0.5f);
+
+	int neuronIndex = position.x + position.y * dims.x;
+	int layerSize = dims.x * dims.y;
+
+	int2 eWindowDims = getWeightWindowDims(predictionRadiusFromE, eDims);
+	int2 eWindowOrigin = getWeightWindowOrigin(eCenterPosition, predictionRadiusFromE, eDims, eWindowDims);
+	int2 iWindowDims = getWeightWindowDims(predictionRadiusFromI, iDims);
+	int2 iWindowOrigin = getWeightWindowOrigin(iCenterPosition, predictionRadiusFromI, iDims, iWindowDims);
+
+	float batchAlpha = alpha / batchSize;
+
+	for (int dx = -predictionRadiusFromE; dx <= predictionRadiusFromE; dx++)
+		for (int dy = -predictionRadiusFromE; dy <= predictionRadiusFromE; dy++) {
+			int2 ePosition = (int2)(eCenterPosition.x + dx, eCenterPosition.y + dy);
+
+			if (ePosition.x >= 0 && ePosition.x < eDims.x && ePosition.y >= 0 && ePosition.y < eDims.y) {
+				int weightIndex = getWeightIndex(ePosition, eWindowOrigin, eWindowDims, neuronIndex, layerSize);
+
+				float update = 0.0f;
+
+				for (int b = 0; b < batchSize; b++) {
+					float target = read_imagef(feedForwardInput, defaultUnnormalizedSampler, getBatchPosition(position, dims, b)).x;
+					float prediction = read_imagef(predictions, defaultUnnormalizedSampler, getBatchPosition(position, dims, b)).x;
+
+					update += (target - prediction) * read_imagef(eStates, defaultUnnormalizedSampler, getBatchPosition(ePosition, eDims, b)).x;
+				}
+
+				predictionFromEWeights[weightIndex] = predictionFromEWeightsPrev[weightIndex] + batchAlpha * update;
 			}
+		}
+
+	for (int dx = -predictionRadiusFromI; dx <= predictionRadiusFromI; dx++)
+		for (int dy = -predictionRadiusFromI; dy <= predictionRadiusFromI; dy++) {
+			int2 iPosition = (int2)(iCenterPosition.x + dx, iCenterPosition.y + dy);
+
+			if (iPosition.x >= 0 && iPosition.x < iDims.x && iPosition.y >= 0 && iPosition.y < iDims.y) {
+				int weightIndex = getWeightIndex(iPosition, iWindowOrigin, iWindowDims, neuronIndex, layerSize);
+
+				float update = 0.0f;
 
-			wi++;
+				for (int b = 0; b < batchSize; b++) {
+					float target = read_imagef(feedForwardInput, defaultUnnormalizedSampler, getBatchPosition(position, dims, b)).x;
+					float prediction = read_imagef(predictions, defaultUnnormalizedSampler, getBatchPosition(position, dims, b)).x;
+
+					update += (target - prediction) * read_imagef(iStates, defaultUnnormalizedSampler, getBatchPosition(iPosition, iDims, b)).x;
+				}
+
+				predictionFromIWeights[weightIndex] = predictionFromIWeightsPrev[weightIndex] + batchAlpha * update;
+			}
 		}
 }
 
-void kernel HEInet_updateInputSpikes(read_only image2d_t spikeRates, read_only image2d_t spikeTimersPrev,
+void kernel HEInet_updateInputSpikes(read_only image2d_t spikeRates, float shDecay,
+	read_only image2d_t spikeTimersPrev,
 	read_only image2d_t spikesHistoryPrev,
-	write_only image2d_t spikeTimers, write_only image2d_t spikes, write_only image2d_t spikesHistory,
-	float shDecay)
+	write_only image2d_t spikeTimers, write_only image2d_t spikes, write_only image2d_t spikesHistory)
 {
 	int2 position = (int2)(get_global_id(0), get_global_id(1));
 
@@ -673,4 +2602,329 @@ void kernel HEInet_sumSpikes(read_only image2d_t spikes, read_only image2d_t sum
 	float sum = sumPrev + spike * scalar;
 
 	write_imagef(sums, position, (float4)(sum));
+}
+// ---------------------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- Persistent settle -------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------------------------------
+
+// Per layer parameters of HEInet_settlePersistent
+#define PERSISTENT_LAYER_INTS 16
+#define PERSISTENT_LAYER_FLOATS 8
+
+// Neuron population block in local memory, 7 arrays of the population size.
+// States and state histories are double buffered, slot 0 holds the previous step when loaded and stored
+#define PERSISTENT_ACTIVATIONS 0
+#define PERSISTENT_THRESHOLDS 1
+#define PERSISTENT_STATE_AVERAGES 2
+#define PERSISTENT_STATES 3
+#define PERSISTENT_STATES_HISTORY 5
+#define PERSISTENT_POPULATION_ARRAYS 7
+
+// Input block, 4 arrays of the input size (spikes double buffered)
+#define PERSISTENT_INPUT_TIMERS 0
+#define PERSISTENT_INPUT_HISTORY 1
+#define PERSISTENT_INPUT_SPIKES 2
+#define PERSISTENT_INPUT_ARRAYS 4
+
+// Same as the receptive field loops of EIlayer_eActivate/iActivate, on a population in local memory
+float persistentSumConnected(local const float* inputs, int2 inputDims, global const float* weights,
+	int neuronIndex, int layerSize, int2 centerPosition, int radius, int lateral)
+{
+	int2 windowDims = getWeightWindowDims(radius, inputDims);
+	int2 windowOrigin = getWeightWindowOrigin(centerPosition, radius, inputDims, windowDims);
+
+	float sum = 0.0f;
+
+	for (int dx = -radius; dx <= radius; dx++)
+		for (int dy = -radius; dy <= radius; dy++) {
+			int2 inputPosition = (int2)(centerPosition.x + dx, centerPosition.y + dy);
+
+			if ((!lateral || dx != 0 || dy != 0) && inputPosition.x >= 0 && inputPosition.x < inputDims.x && inputPosition.y >= 0 && inputPosition.y < inputDims.y) {
+				float input = inputs[inputPosition.x + inputPosition.y * inputDims.x];
+
+				float weight = weights[getWeightIndex(inputPosition, windowOrigin, windowDims, neuronIndex, layerSize)];
+
+				sum += input * (weight > 0.5f ? 1.0f : 0.0f);
+			}
+		}
+
+	return sum;
+}
+
+// Same as the receptive field loops of EIlayer_eLearn/iLearn. Weights belong to the neuron, so they are updated in place.
+// Without inputs (feed back of the top layer) the rule runs on zero input like it does on the zero image
+void persistentLearn(local const float* inputs, int hasInputs, int2 inputDims, global float* weights,
+	int neuronIndex, int layerSize, int2 centerPosition, int radius,
+	float rate, float postHist, float a, float b, int reverse)
+{
+	int2 windowDims = getWeightWindowDims(radius, inputDims);
+	int2 windowOrigin = getWeightWindowOrigin(centerPosition, radius, inputDims, windowDims);
+
+	for (int dx = -radius; dx <= radius; dx++)
+		for (int dy = -radius; dy <= radius; dy++) {
+			int2 inputPosition = (int2)(centerPosition.x + dx, centerPosition.y + dy);
+
+			if (inputPosition.x >= 0 && inputPosition.x < inputDims.x && inputPosition.y >= 0 && inputPosition.y < inputDims.y) {
+				int weightIndex = getWeightIndex(inputPosition, windowOrigin, windowDims, neuronIndex, layerSize);
+
+				float input = hasInputs ? inputs[inputPosition.x + inputPosition.y * inputDims.x] : 0.0f;
+
+				float weightPrev = weights[weightIndex];
+
+				float dWeight = reverse ? rstdp(input, postHist, weightPrev, a, b) : stdp(input, postHist, weightPrev, a, b);
+
+				weights[weightIndex] = fmin(1.0f, fmax(0.0f, weightPrev + rate * dWeight));
+			}
+		}
+}
+
+// Move the latest slot of a double buffered array to slot 0
+void persistentSettleSlots(local float* slots, int size, int parity) {
+	if (parity != 0)
+		for (int n = get_local_id(0); n < size; n += get_local_size(0))
+			slots[n] = slots[size + n];
+}
+
+// Neuron update, same as the end of EIlayer_eActivate/iActivate. The state average is updated after learning,
+// which reads the previous one
+float persistentIntegrate(local float* population, int size, int n, int parity, float excitation, float inhibition,
+	float eta, float shDecay)
+{
+	float activation = (1.0f - eta) * population[PERSISTENT_ACTIVATIONS * size + n] + (excitation - inhibition);
+
+	float state = 0.0f;
+
+	if (activation > population[PERSISTENT_THRESHOLDS * size + n]) { // Includes refractory period
+		state = 1.0f;
+
+		activation = 0.0f;
+	}
+
+	float stateHistoryPrev = population[(PERSISTENT_STATES_HISTORY + parity) * size + n];
+
+	population[PERSISTENT_ACTIVATIONS * size + n] = activation;
+	population[(PERSISTENT_STATES + 1 - parity) * size + n] = state;
+	population[(PERSISTENT_STATES_HISTORY + 1 - parity) * size + n] = fmax((1.0f - shDecay) * stateHistoryPrev, state);
+
+	return state;
+}
+
+// Whole settle loop of HEInet (update, sumSpikes, learn, stepEnd per iteration) in one launch of a single work-group.
+// All neuron state lives in local memory, weights are updated in place in a global buffer (the weight sets of EIlayer::copyToPersistent).
+// Each work item owns the same neurons in every phase, so only the phase boundaries need barriers
+void kernel HEInet_settlePersistent(read_only image2d_t inputFrequencies, global float* state, global float* weights,
+	local float* shared, global const int* layerInts, global const float* layerFloats,
+	int numLayers, int stateSize, int iterations, float sumScalar,
+	float eta, float shDecay, float saDecay,
+	float eAlpha, float eBeta, float eDelta, float iAlpha, float iBeta, float iGamma, float iDelta,
+	float sparsityE, float sparsityI)
+{
+	int localId = get_local_id(0);
+	int localSize = get_local_size(0);
+
+	for (int i = localId; i < stateSize; i += localSize)
+		shared[i] = state[i];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int2 inputDims = (int2)(layerInts[0], layerInts[1]);
+	int inputSize = inputDims.x * inputDims.y;
+
+	int frontESize = layerInts[2] * layerInts[3];
+	int frontISize = layerInts[4] * layerInts[5];
+
+	local float* input = shared;
+	local float* eSums = shared + PERSISTENT_INPUT_ARRAYS * inputSize;
+	local float* iSums = eSums + frontESize;
+
+	int parity = 0;
+
+	for (int iter = 0; iter < iterations; iter++) {
+		// Input spikes
+		for (int n = localId; n < inputSize; n += localSize) {
+			int2 position = (int2)(n % inputDims.x, n / inputDims.x);
+
+			float spikeRate = read_imagef(inputFrequencies, position).x;
+
+			float spikeTimer = input[PERSISTENT_INPUT_TIMERS * inputSize + n] + spikeRate;
+
+			float spike = 0.0f;
+
+			if (spikeTimer >= 1.0f) {
+				spikeTimer -= 1.0f;
+
+				spike = 1.0f;
+			}
+
+			input[PERSISTENT_INPUT_TIMERS * inputSize + n] = spikeTimer;
+			input[(PERSISTENT_INPUT_SPIKES + 1 - parity) * inputSize + n] = spike;
+			input[PERSISTENT_INPUT_HISTORY * inputSize + n] = fmax((1.0f - shDecay) * input[PERSISTENT_INPUT_HISTORY * inputSize + n], spike);
+		}
+
+		// Activation, reads previous states only so all layers run in the same phase
+		for (int li = 0; li < numLayers; li++) {
+			global const int* ints = layerInts + li * PERSISTENT_LAYER_INTS;
+			global const float* floats = layerFloats + li * PERSISTENT_LAYER_FLOATS;
+
+			int2 eFeedForwardDims = (int2)(ints[0], ints[1]);
+			int2 eDims = (int2)(ints[2], ints[3]);
+			int2 iDims = (int2)(ints[4], ints[5]);
+			int2 iFeedBackDims = (int2)(ints[6], ints[7]);
+
+			int eSize = eDims.x * eDims.y;
+			int iSize = iDims.x * iDims.y;
+
+			local float* ePopulation = shared + ints[13];
+			local float* iPopulation = shared + ints[14];
+
+			local const float* feedForwardStatesPrev = li == 0 ? input + (PERSISTENT_INPUT_SPIKES + parity) * inputSize :
+				shared + layerInts[(li - 1) * PERSISTENT_LAYER_INTS + 13] + (PERSISTENT_STATES + parity) * eFeedForwardDims.x * eFeedForwardDims.y;
+			local const float* feedBackStatesPrev = li == numLayers - 1 ? iPopulation :
+				shared + layerInts[(li + 1) * PERSISTENT_LAYER_INTS + 14] + (PERSISTENT_STATES + parity) * iFeedBackDims.x * iFeedBackDims.y;
+
+			global const float* eFeedForwardWeights = weights + ints[15];
+			global const float* eFeedBackWeights = eFeedForwardWeights + getWeightsSize(ints[8], eFeedForwardDims, eSize);
+			global const float* iFeedForwardWeights = eFeedBackWeights + getWeightsSize(ints[9], iDims, eSize);
+			global const float* iLateralWeights = iFeedForwardWeights + getWeightsSize(ints[10], eDims, iSize);
+			global const float* iFeedBackWeights = iLateralWeights + getWeightsSize(ints[11], iDims, iSize);
+
+			for (int n = localId; n < eSize; n += localSize) {
+				int2 position = (int2)(n % eDims.x, n / eDims.x);
+
+				int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * floats[0] + 0.5f, (position.y + 0.5f) * floats[1] + 0.5f);
+				int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * floats[2] + 0.5f, (position.y + 0.5f) * floats[3] + 0.5f);
+
+				float excitation = persistentSumConnected(feedForwardStatesPrev, eFeedForwardDims, eFeedForwardWeights, n, eSize, feedForwardCenterPosition, ints[8], 0);
+				float inhibition = persistentSumConnected(iPopulation + (PERSISTENT_STATES + parity) * iSize, iDims, eFeedBackWeights, n, eSize, feedBackCenterPosition, ints[9], 0);
+
+				float spike = persistentIntegrate(ePopulation, eSize, n, parity, excitation, inhibition, eta, shDecay);
+
+				if (li == 0)
+					eSums[n] += spike * sumScalar;
+			}
+
+			for (int n = localId; n < iSize; n += localSize) {
+				int2 position = (int2)(n % iDims.x, n / iDims.x);
+
+				int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * floats[4] + 0.5f, (position.y + 0.5f) * floats[5] + 0.5f);
+				int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * floats[6] + 0.5f, (position.y + 0.5f) * floats[7] + 0.5f);
+
+				float excitation = persistentSumConnected(ePopulation + (PERSISTENT_STATES + parity) * eSize, eDims, iFeedForwardWeights, n, iSize, feedForwardCenterPosition, ints[10], 0);
+
+				float inhibition = 0.0f;
+
+				if (li != numLayers - 1)
+					inhibition += persistentSumConnected(feedBackStatesPrev, iFeedBackDims, iFeedBackWeights, n, iSize, feedBackCenterPosition, ints[12], 0);
+
+				inhibition += persistentSumConnected(iPopulation + (PERSISTENT_STATES + parity) * iSize, iDims, iLateralWeights, n, iSize, position, ints[11], 1);
+
+				float spike = persistentIntegrate(iPopulation, iSize, n, parity, excitation, inhibition, eta, shDecay);
+
+				if (li == 0)
+					iSums[n] += spike * sumScalar;
+			}
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+		// Learn
+		for (int li = 0; li < numLayers; li++) {
+			global const int* ints = layerInts + li * PERSISTENT_LAYER_INTS;
+			global const float* floats = layerFloats + li * PERSISTENT_LAYER_FLOATS;
+
+			int2 eFeedForwardDims = (int2)(ints[0], ints[1]);
+			int2 eDims = (int2)(ints[2], ints[3]);
+			int2 iDims = (int2)(ints[4], ints[5]);
+			int2 iFeedBackDims = (int2)(ints[6], ints[7]);
+
+			int eSize = eDims.x * eDims.y;
+			int iSize = iDims.x * iDims.y;
+
+			local float* ePopulation = shared + ints[13];
+			local float* iPopulation = shared + ints[14];
+
+			// Layer 0 learns from the input spikes (not their history), like HEInet::learn
+			local const float* feedForwardStatesHistoryPrev = li == 0 ? input + (PERSISTENT_INPUT_SPIKES + parity) * inputSize :
+				shared + layerInts[(li - 1) * PERSISTENT_LAYER_INTS + 13] + (PERSISTENT_STATES_HISTORY + parity) * eFeedForwardDims.x * eFeedForwardDims.y;
+			local const float* feedBackStatesHistoryPrev = li == numLayers - 1 ? iPopulation :
+				shared + layerInts[(li + 1) * PERSISTENT_LAYER_INTS + 14] + (PERSISTENT_STATES_HISTORY + parity) * iFeedBackDims.x * iFeedBackDims.y;
+
+			global float* eFeedForwardWeights = weights + ints[15];
+			global float* eFeedBackWeights = eFeedForwardWeights + getWeightsSize(ints[8], eFeedForwardDims, eSize);
+			global float* iFeedForwardWeights = eFeedBackWeights + getWeightsSize(ints[9], iDims, eSize);
+			global float* iLateralWeights = iFeedForwardWeights + getWeightsSize(ints[10], eDims, iSize);
+			global float* iFeedBackWeights = iLateralWeights + getWeightsSize(ints[11], iDims, iSize);
+
+			for (int n = localId; n < eSize; n += localSize) {
+				int2 position = (int2)(n % eDims.x, n / eDims.x);
+
+				int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * floats[0] + 0.5f, (position.y + 0.5f) * floats[1] + 0.5f);
+				int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * floats[2] + 0.5f, (position.y + 0.5f) * floats[3] + 0.5f);
+
+				float eStateHistory = ePopulation[(PERSISTENT_STATES_HISTORY + 1 - parity) * eSize + n];
+
+				float stateAveragePrev = ePopulation[PERSISTENT_STATE_AVERAGES * eSize + n];
+
+				float kurt = stateAveragePrev - sparsityE;
+
+				float eLearn = fmax(0.0f, -kurt);
+				float iLearn = fmax(0.0f, kurt);
+
+				persistentLearn(feedForwardStatesHistoryPrev, 1, eFeedForwardDims, eFeedForwardWeights, n, eSize, feedForwardCenterPosition, ints[8], eAlpha, eStateHistory, eLearn, iLearn, 0);
+				persistentLearn(iPopulation + (PERSISTENT_STATES_HISTORY + parity) * iSize, 1, iDims, eFeedBackWeights, n, eSize, feedBackCenterPosition, ints[9], eBeta, eStateHistory, iLearn, eLearn, 0);
+
+				ePopulation[PERSISTENT_THRESHOLDS * eSize + n] += eDelta * kurt;
+				ePopulation[PERSISTENT_STATE_AVERAGES * eSize + n] = (1.0f - saDecay) * stateAveragePrev + saDecay * ePopulation[(PERSISTENT_STATES + 1 - parity) * eSize + n];
+			}
+
+			for (int n = localId; n < iSize; n += localSize) {
+				int2 position = (int2)(n % iDims.x, n / iDims.x);
+
+				int2 feedForwardCenterPosition = (int2)((position.x + 0.5f) * floats[4] + 0.5f, (position.y + 0.5f) * floats[5] + 0.5f);
+				int2 feedBackCenterPosition = (int2)((position.x + 0.5f) * floats[6] + 0.5f, (position.y + 0.5f) * floats[7] + 0.5f);
+
+				float iStateHistory = iPopulation[(PERSISTENT_STATES_HISTORY + 1 - parity) * iSize + n];
+				float iStateHistoryPrev = iPopulation[(PERSISTENT_STATES_HISTORY + parity) * iSize + n];
+
+				float stateAveragePrev = iPopulation[PERSISTENT_STATE_AVERAGES * iSize + n];
+
+				float kurt = stateAveragePrev - sparsityI;
+
+				float eLearn = fmax(0.0f, -kurt);
+				float iLearn = fmax(0.0f, kurt);
+
+				persistentLearn(ePopulation + (PERSISTENT_STATES_HISTORY + 1 - parity) * eSize, 1, eDims, iFeedForwardWeights, n, iSize, feedForwardCenterPosition, ints[10], iAlpha, iStateHistoryPrev, eLearn, iLearn, 1);
+				persistentLearn(feedBackStatesHistoryPrev, li != numLayers - 1, iFeedBackDims, iFeedBackWeights, n, iSize, feedBackCenterPosition, ints[12], iBeta, iStateHistory, iLearn, eLearn, 0);
+				persistentLearn(iPopulation + (PERSISTENT_STATES_HISTORY + parity) * iSize, 1, iDims, iLateralWeights, n, iSize, position, ints[11], iGamma, iStateHistory, iLearn, eLearn, 0);
+
+				iPopulation[PERSISTENT_THRESHOLDS * iSize + n] += iDelta * kurt;
+				iPopulation[PERSISTENT_STATE_AVERAGES * iSize + n] = (1.0f - saDecay) * stateAveragePrev + saDecay * iPopulation[(PERSISTENT_STATES + 1 - parity) * iSize + n];
+			}
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+		// Step end
+		parity = 1 - parity;
+	}
+
+	// Latest states to slot 0, then write everything back
+	persistentSettleSlots(input + PERSISTENT_INPUT_SPIKES * inputSize, inputSize, parity);
+
+	for (int li = 0; li < numLayers; li++) {
+		global const int* ints = layerInts + li * PERSISTENT_LAYER_INTS;
+
+		int eSize = ints[2] * ints[3];
+		int iSize = ints[4] * ints[5];
+
+		persistentSettleSlots(shared + ints[13] + PERSISTENT_STATES * eSize, eSize, parity);
+		persistentSettleSlots(shared + ints[13] + PERSISTENT_STATES_HISTORY * eSize, eSize, parity);
+		persistentSettleSlots(shared + ints[14] + PERSISTENT_STATES * iSize, iSize, parity);
+		persistentSettleSlots(shared + ints[14] + PERSISTENT_STATES_HISTORY * iSize, iSize, parity);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = localId; i < stateSize; i += localSize)
+		state[i] = shared[i];
 }
\ No newline at end of file
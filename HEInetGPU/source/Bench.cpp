@@ -0,0 +1,1003 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+// Headless benchmark (heinet_bench). Builds networks over a grid of layer sizes, layer counts and radii (generateConfigsFromSizes),
+// runs warmup and timed examples (spikeSumBegin, iterations of update, sumSpikes, learn and stepEnd, then predict and learnPrediction)
+// and writes one JSON object per network to the output file. With --roofline the timed examples are profiled instead and every
+// kernel gets a line with its achieved GB/s and GFLOP/s (bytes and FLOPs from the configuration, see getKernelCost) against the
+// device peaks measured by a stream and an FMA probe. --device native runs HEInetNative on --threads workers (0 = hardware concurrency).
+// --compare N steps an OpenCL network and a native one from the same generator state N times instead of timing, writes spike
+// mismatches and the largest activation, threshold and weight differences in ulps per network, and fails if any spike differs. Usage:
+// heinet_bench [--device gpu|cpu|all|native] [--threads 0] [--sizes 16,32,64] [--layers 1,2,3] [--radii 4,6,8] [--warmup 5] [--examples 50]
+//              [--iterations 50] [--persistent] [--in-place] [--sparse] [--gated-learning] [--statistics 0] [--roofline] [--compare 0]
+//              [--output heinet_bench.jsonl]
+
+#include <system/ComputeSystem.h>
+#include <system/ComputeProgram.h>
+
+#include <ei/HEInet.h>
+#include <ei/HEInetNative.h>
+#include <ei/KernelSource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+	struct Options {
+		sys::ComputeSystem::DeviceType _deviceType;
+		int _threads;
+		std::vector<int> _sizes;
+		std::vector<int> _layers;
+		std::vector<int> _radii;
+		int _warmup;
+		int _examples;
+		int _iterations;
+		bool _persistent;
+		bool _inPlace;
+		bool _sparse;
+		bool _gatedLearning;
+		int _statistics;
+		bool _roofline;
+		int _compare;
+		std::string _output;
+
+		Options()
+			: _deviceType(sys::ComputeSystem::_gpu), _threads(0), _warmup(5), _examples(50), _iterations(50), _persistent(false), _inPlace(false), _sparse(false), _gatedLearning(false), _statistics(0), _roofline(false), _compare(0), _output("heinet_bench.jsonl")
+		{
+			_sizes = { 16, 32, 64 };
+			_layers = { 1, 2, 3 };
+			_radii = { 4, 6, 8 };
+		}
+	};
+
+	struct Result {
+		int _size;
+		int _layers;
+		int _radius;
+		bool _persistent;
+		bool _sparse;
+
+		long long _neurons;
+		long long _synapses;
+
+		double _seconds;
+		double _stepsPerSecond;
+		double _synapticUpdatesPerSecond;
+		double _p50;
+		double _p99;
+
+		// From the statistics records (--statistics), spikes per layer neuron and synaptic events per step
+		double _spikeRate;
+		double _synapticEventsPerStep;
+	};
+
+	bool parseList(const std::string &text, std::vector<int> &values) {
+		values.clear();
+
+		std::istringstream stream(text);
+		std::string item;
+
+		while (std::getline(stream, item, ',')) {
+			int value = std::atoi(item.c_str());
+
+			if (value <= 0)
+				return false;
+
+			values.push_back(value);
+		}
+
+		return !values.empty();
+	}
+
+	bool parseOptions(int argc, char** argv, Options &options) {
+		for (int ai = 1; ai < argc; ai++) {
+			std::string arg = argv[ai];
+
+			if (arg == "--persistent") {
+				options._persistent = true;
+
+				continue;
+			}
+
+			if (arg == "--in-place") {
+				options._inPlace = true;
+
+				continue;
+			}
+
+			if (arg == "--sparse") {
+				options._sparse = true;
+
+				continue;
+			}
+
+			if (arg == "--gated-learning") {
+				options._gatedLearning = true;
+
+				continue;
+			}
+
+			if (arg == "--roofline") {
+				options._roofline = true;
+
+				continue;
+			}
+
+			if (ai + 1 >= argc) {
+				std::cerr << "Missing value for " << arg << "!" << std::endl;
+
+				return false;
+			}
+
+			std::string value = argv[++ai];
+
+			bool valid = true;
+
+			if (arg == "--device") {
+				if (value == "gpu")
+					options._deviceType = sys::ComputeSystem::_gpu;
+				else if (value == "cpu")
+					options._deviceType = sys::ComputeSystem::_cpu;
+				else if (value == "all")
+					options._deviceType = sys::ComputeSystem::_all;
+				else if (value == "native")
+					options._deviceType = sys::ComputeSystem::_native;
+				else
+					valid = false;
+			}
+			else if (arg == "--threads")
+				valid = (options._threads = std::atoi(value.c_str())) >= 0;
+			else if (arg == "--sizes")
+				valid = parseList(value, options._sizes);
+			else if (arg == "--layers")
+				valid = parseList(value, options._layers);
+			else if (arg == "--radii")
+				valid = parseList(value, options._radii);
+			else if (arg == "--warmup")
+				valid = (options._warmup = std::atoi(value.c_str())) >= 0;
+			else if (arg == "--examples")
+				valid = (options._examples = std::atoi(value.c_str())) > 0;
+			else if (arg == "--iterations")
+				valid = (options._iterations = std::atoi(value.c_str())) > 0;
+			else if (arg == "--statistics")
+				valid = (options._statistics = std::atoi(value.c_str())) >= 0;
+			else if (arg == "--compare")
+				valid = (options._compare = std::atoi(value.c_str())) >= 0;
+			else if (arg == "--output")
+				options._output = value;
+			else
+				valid = false;
+
+			if (!valid) {
+				std::cerr << "Invalid argument " << arg << " " << value << "!" << std::endl;
+
+				return false;
+			}
+		}
+
+		bool native = options._deviceType == sys::ComputeSystem::_native;
+
+		// HEInetNative only has the per-step dense path
+		if ((native || options._compare > 0) && (options._persistent || options._sparse || options._gatedLearning || options._statistics > 0 || options._roofline)) {
+			std::cerr << "--persistent, --sparse, --gated-learning, --statistics and --roofline are not supported by the native backend!" << std::endl;
+
+			return false;
+		}
+
+		if (native && options._compare > 0) {
+			std::cerr << "--compare runs an OpenCL device against the native backend, choose gpu, cpu or all!" << std::endl;
+
+			return false;
+		}
+
+		return true;
+	}
+
+	// Device peaks in GB/s and GFLOP/s
+	struct Peaks {
+		double _bandwidth;
+		double _flops;
+	};
+
+	// Stream copy (16 bytes read and written per work item) and 4 independent float4 FMA chains (256 x 32 FLOPs per work item)
+	const char* probeSource =
+		"void kernel streamCopy(global const float4* source, global float4* destination) {\n"
+		"	int i = get_global_id(0);\n"
+		"	destination[i] = source[i];\n"
+		"}\n"
+		"void kernel fmaProbe(global float* result, float a, float b) {\n"
+		"	float4 x0 = (float4)(get_global_id(0) * 1e-6f), x1 = x0 + 1.0f, x2 = x0 + 2.0f, x3 = x0 + 3.0f;\n"
+		"	for (int i = 0; i < 256; i++) {\n"
+		"		x0 = mad(x0, a, b); x1 = mad(x1, a, b); x2 = mad(x2, a, b); x3 = mad(x3, a, b);\n"
+		"	}\n"
+		"	float4 x = x0 + x1 + x2 + x3;\n"
+		"	result[get_global_id(0)] = x.x + x.y + x.z + x.w;\n"
+		"}\n";
+
+	// Shortest of a few runs in seconds, the queue must have profiling enabled
+	double timeKernel(sys::ComputeSystem &cs, const cl::Kernel &kernel, const cl::NDRange &global) {
+		double best = 0.0;
+
+		for (int ri = 0; ri < 5; ri++) {
+			cl::Event event;
+
+			cs.getQueue().enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange, nullptr, &event);
+
+			event.wait();
+
+			double seconds = (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+
+			if (ri == 0 || seconds < best)
+				best = seconds;
+		}
+
+		return best;
+	}
+
+	bool measurePeaks(sys::ComputeSystem &cs, Peaks &peaks) {
+		sys::ComputeProgram program;
+
+		if (!program.loadFromSource(probeSource, cs))
+			return false;
+
+		// Large enough to stream from memory rather than cache
+		int numVectors = static_cast<int>(std::min<cl_ulong>(cs.getDevice().getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / 2, 256 << 20) / sizeof(cl_float4));
+
+		cl::Buffer source(cs.getContext(), CL_MEM_READ_ONLY, numVectors * sizeof(cl_float4));
+		cl::Buffer destination(cs.getContext(), CL_MEM_WRITE_ONLY, numVectors * sizeof(cl_float4));
+
+		cl_float zero = 0.0f;
+
+		cs.getQueue().enqueueFillBuffer(source, zero, 0, numVectors * sizeof(cl_float4));
+
+		cl::Kernel streamKernel(program.getProgram(), "streamCopy");
+
+		streamKernel.setArg(0, source);
+		streamKernel.setArg(1, destination);
+
+		peaks._bandwidth = 2.0 * numVectors * sizeof(cl_float4) / timeKernel(cs, streamKernel, cl::NDRange(numVectors)) * 1e-9;
+
+		int numItems = cs.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 16384;
+
+		cl::Buffer result(cs.getContext(), CL_MEM_WRITE_ONLY, numItems * sizeof(cl_float));
+
+		cl::Kernel fmaKernel(program.getProgram(), "fmaProbe");
+
+		fmaKernel.setArg(0, result);
+		fmaKernel.setArg(1, 0.999f);
+		fmaKernel.setArg(2, 0.001f);
+
+		peaks._flops = 256.0 * 32.0 * numItems / timeKernel(cs, fmaKernel, cl::NDRange(numItems)) * 1e-9;
+
+		return true;
+	}
+
+	// Connections of a neuron to an input of the given size, clipped the way the weight windows are
+	double getSlots(int radius, int inputWidth, int inputHeight) {
+		return static_cast<double>(std::min(radius * 2 + 1, inputWidth)) * std::min(radius * 2 + 1, inputHeight);
+	}
+
+	// Compulsory memory traffic and arithmetic of one launch. Weights are counted once per launch (shared by a batch), input and state
+	// images once per pixel (neighbouring receptive fields share them through the cache). Activation costs 2 FLOPs per connection,
+	// learning about 8 (STDP, update and clamp). Returns false for commands without a model (fills, copies, helpers)
+	bool getKernelCost(const ei::HEInet &ht, const std::string &phase, int layer, double &bytes, double &flops) {
+		const ei::EIlayer::Configuration &front = ht.getEIlayers().front().getConfig();
+
+		double batch = ht.getBatchSize();
+
+		double numInputs = static_cast<double>(front._eFeedForwardWidth) * front._eFeedForwardHeight;
+
+		if (layer < 0) {
+			double numE = static_cast<double>(front._eWidth) * front._eHeight;
+			double numI = static_cast<double>(front._iWidth) * front._iHeight;
+
+			double predictionSlots = getSlots(ht.getPredictionRadiusFromE(), front._eWidth, front._eHeight) + getSlots(ht.getPredictionRadiusFromI(), front._iWidth, front._iHeight);
+
+			if (phase == "updateInputSpikes") {
+				bytes = 24.0 * numInputs * batch;
+				flops = 6.0 * numInputs * batch;
+			}
+			else if (phase == "eSumSpikes" || phase == "iSumSpikes") {
+				double numNeurons = phase == "eSumSpikes" ? numE : numI;
+
+				bytes = 12.0 * numNeurons * batch;
+				flops = 2.0 * numNeurons * batch;
+			}
+			else if (phase == "predict") {
+				bytes = predictionSlots * numInputs * sizeof(cl_float) + ((numE + numI) + numInputs) * sizeof(cl_float) * batch;
+				flops = 2.0 * predictionSlots * numInputs * batch;
+			}
+			else if (phase == "learnPrediction") {
+				bytes = 2.0 * predictionSlots * numInputs * sizeof(cl_float) + ((numE + numI) + 2.0 * numInputs) * sizeof(cl_float) * batch;
+				flops = 4.0 * predictionSlots * numInputs * batch;
+			}
+			else
+				return false;
+
+			return true;
+		}
+
+		const ei::EIlayer &eiLayer = ht.getEIlayers()[layer];
+		const ei::EIlayer::Configuration &config = eiLayer.getConfig();
+
+		double weightBytes = ei::EIlayer::getWeightBytes(eiLayer.getWeightPrecision());
+
+		double numE = static_cast<double>(config._eWidth) * config._eHeight;
+		double numI = static_cast<double>(config._iWidth) * config._iHeight;
+		double numFeedForward = static_cast<double>(config._eFeedForwardWidth) * config._eFeedForwardHeight;
+		double numFeedBack = static_cast<double>(config._iFeedBackWidth) * config._iFeedBackHeight;
+
+		double eSlots = getSlots(config._eFeedForwardRadius, config._eFeedForwardWidth, config._eFeedForwardHeight) + getSlots(config._eFeedBackRadius, config._iWidth, config._iHeight);
+		double iSlots = getSlots(config._iFeedForwardRadius, config._eWidth, config._eHeight) + getSlots(config._iLateralRadius, config._iWidth, config._iHeight)
+			+ getSlots(config._iFeedBackRadius, config._iFeedBackWidth, config._iFeedBackHeight);
+
+		// Activation reads and writes four floats of state per neuron, one RGBA texel each way when packed
+		const double stateBytes = 32.0;
+
+		if (phase == "eActivate") {
+			bytes = eSlots * numE * weightBytes + (numFeedForward + numI) * sizeof(cl_float) * batch + numE * sizeof(cl_float) + numE * stateBytes * batch;
+			flops = (2.0 * eSlots + 10.0) * numE * batch;
+		}
+		else if (phase == "iActivate") {
+			bytes = iSlots * numI * weightBytes + (numE + numFeedBack) * sizeof(cl_float) * batch + numI * sizeof(cl_float) + numI * stateBytes * batch;
+			flops = (2.0 * iSlots + 10.0) * numI * batch;
+		}
+		else if (phase == "eLearn") {
+			double maskBytes = (ei::EIlayer::getMaskSize(config._eFeedForwardRadius) + ei::EIlayer::getMaskSize(config._eFeedBackRadius)) * sizeof(cl_uint) * numE;
+
+			bytes = 2.0 * eSlots * numE * weightBytes + maskBytes + 2.0 * (numFeedForward + numI) * sizeof(cl_float) * batch + 4.0 * numE * sizeof(cl_float) * batch + 2.0 * numE * sizeof(cl_float);
+			flops = (8.0 * eSlots + 10.0) * numE * batch;
+		}
+		else if (phase == "iLearn") {
+			double maskBytes = (ei::EIlayer::getMaskSize(config._iFeedForwardRadius) + ei::EIlayer::getMaskSize(config._iLateralRadius) + ei::EIlayer::getMaskSize(config._iFeedBackRadius))
+				* sizeof(cl_uint) * numI;
+
+			bytes = 2.0 * iSlots * numI * weightBytes + maskBytes + 2.0 * (numE + numFeedBack) * sizeof(cl_float) * batch + 4.0 * numI * sizeof(cl_float) * batch + 2.0 * numI * sizeof(cl_float);
+			flops = (8.0 * iSlots + 10.0) * numI * batch;
+		}
+		else
+			return false;
+
+		return true;
+	}
+
+	void writeRoofline(const ei::HEInet &ht, const sys::Profiler &profiler, const Peaks &peaks, const std::string &deviceName,
+		int size, int layers, int radius, std::ostream &output)
+	{
+		std::vector<sys::Profiler::Statistics> statistics;
+
+		profiler.getStatistics(statistics);
+
+		// Arithmetic intensity above which the device is compute bound
+		double ridge = peaks._flops / peaks._bandwidth;
+
+		std::cout << "size " << size << " layers " << layers << " radius " << radius << ":" << std::endl;
+
+		for (int si = 0; si < static_cast<int>(statistics.size()); si++) {
+			const sys::Profiler::Statistics &s = statistics[si];
+
+			double bytes, flops;
+
+			if (!getKernelCost(ht, s._phase, s._layer, bytes, flops))
+				continue;
+
+			double seconds = s._total / s._count * 1e-3;
+
+			double bandwidth = bytes / seconds * 1e-9;
+			double throughput = flops / seconds * 1e-9;
+			double intensity = flops / bytes;
+
+			// Attainable GFLOP/s at this intensity
+			double roof = std::min(peaks._flops, intensity * peaks._bandwidth);
+
+			output << "{\"device\":\"" << deviceName << "\",\"size\":" << size << ",\"layers\":" << layers << ",\"radius\":" << radius
+				<< ",\"kernel\":\"" << s._phase << "\",\"layer\":" << s._layer << ",\"launches\":" << s._count << ",\"averageMs\":" << s._total / s._count
+				<< ",\"bytes\":" << bytes << ",\"flops\":" << flops << ",\"gbPerSecond\":" << bandwidth << ",\"gflopPerSecond\":" << throughput
+				<< ",\"intensity\":" << intensity << ",\"bound\":\"" << (intensity < ridge ? "memory" : "compute") << "\",\"fractionOfRoof\":" << throughput / roof << "}" << std::endl;
+
+			std::cout << "  " << s._phase << " (layer " << s._layer << "): " << bandwidth << " GB/s, " << throughput << " GFLOP/s, "
+				<< (intensity < ridge ? "memory" : "compute") << " bound at " << 100.0 * throughput / roof << "% of roof" << std::endl;
+		}
+	}
+
+	// Nearest rank
+	double percentile(std::vector<double> sorted, double p) {
+		std::sort(sorted.begin(), sorted.end());
+
+		int rank = static_cast<int>(p * sorted.size() + 0.999999);
+
+		return sorted[std::min<int>(sorted.size(), std::max(1, rank)) - 1];
+	}
+
+	// Parameters of every example
+	const float eta = 0.02f, shDecay = 0.1f, saDecay = 0.01f;
+	const float eAlpha = 0.008f, eBeta = 0.008f, eDelta = 0.005f, iAlpha = 0.008f, iBeta = 0.008f, iGamma = 0.01f, iDelta = 0.005f;
+	const float sparsityE = 0.025f, sparsityI = 0.025f;
+
+	void runExample(sys::ComputeSystem &cs, ei::HEInet &ht, const cl::Image2D &inputImage, const cl::Image2D &zeroImage, const Options &options) {
+		float sumScalar = 2.0f / options._iterations;
+
+		ht.spikeSumBegin(cs);
+
+		if (!options._persistent || !ht.settlePersistent(cs, inputImage, options._iterations, sumScalar, eta, shDecay, saDecay,
+			eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI))
+		{
+			for (int iter = 0; iter < options._iterations; iter++) {
+				ht.update(cs, inputImage, zeroImage, eta, shDecay, saDecay);
+				ht.sumSpikes(cs, sumScalar);
+				ht.learn(cs, zeroImage, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
+				ht.stepEnd(cs);
+			}
+		}
+
+		ht.predict(cs);
+		ht.learnPrediction(cs, inputImage, 0.005f);
+		ht.predictionEnd();
+	}
+
+	// Same steps as runExample on the native backend
+	void runExampleNative(sys::ComputeSystem &cs, ei::HEInetNative &ht, const std::vector<float> &input, const Options &options) {
+		float sumScalar = 2.0f / options._iterations;
+
+		ht.spikeSumBegin(cs);
+
+		for (int iter = 0; iter < options._iterations; iter++) {
+			ht.update(cs, input, eta, shDecay, saDecay);
+			ht.sumSpikes(cs, sumScalar);
+			ht.learn(cs, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
+			ht.stepEnd(cs);
+		}
+
+		ht.predict(cs);
+		ht.learnPrediction(cs, input, 0.005f);
+		ht.predictionEnd();
+	}
+
+	void generateConfigs(int size, int layers, int radius, const Options &options, std::vector<ei::EIlayer::Configuration> &configs) {
+		std::vector<cl_int2> eSizes(layers);
+		std::vector<cl_int2> iSizes(layers);
+
+		for (int li = 0; li < layers; li++) {
+			eSizes[li].x = eSizes[li].y = size;
+			iSizes[li].x = iSizes[li].y = std::max(1, size / 2);
+		}
+
+		cl_int2 inputSize = { size, size };
+
+		ei::generateConfigsFromSizes(inputSize, eSizes, iSizes, configs);
+
+		for (int li = 0; li < layers; li++) {
+			configs[li]._eFeedForwardRadius = radius;
+			configs[li]._eFeedBackRadius = radius;
+			configs[li]._iFeedForwardRadius = radius;
+			configs[li]._iLateralRadius = radius;
+			configs[li]._iFeedBackRadius = radius;
+			configs[li]._inPlaceWeights = options._inPlace;
+		}
+	}
+
+	// A few random input frames, cycled through so uploads are part of every example
+	void generateFrames(int size, std::mt19937 &generator, std::vector<std::vector<float>> &frames) {
+		const int numFrames = 8;
+
+		frames.assign(numFrames, std::vector<float>(size * size));
+
+		std::uniform_real_distribution<float> inputDist(0.0f, 1.0f);
+
+		for (int fi = 0; fi < numFrames; fi++)
+			for (int i = 0; i < static_cast<int>(frames[fi].size()); i++)
+				frames[fi][i] = inputDist(generator);
+	}
+
+	// Input image of size x size and the 1 x 1 zero image the top layer reads as feed back
+	void createInputImages(sys::ComputeSystem &cs, int size, cl::Image2D &inputImage, cl::Image2D &zeroImage) {
+		inputImage = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), size, size);
+		zeroImage = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), 1, 1);
+
+		cl::size_t<3> zeroCoord;
+		zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+		cl::size_t<3> zeroDims;
+		zeroDims[0] = zeroDims[1] = zeroDims[2] = 1;
+
+		cl_float4 zeroColor = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+		cs.getQueue().enqueueFillImage(zeroImage, zeroColor, zeroCoord, zeroDims);
+	}
+
+	// Non-blocking, input must stay valid until the queue finished
+	void writeInput(sys::ComputeSystem &cs, const cl::Image2D &inputImage, int size, const std::vector<float> &input) {
+		cl::size_t<3> zeroCoord;
+		zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+		cl::size_t<3> inputDims;
+		inputDims[0] = inputDims[1] = size;
+		inputDims[2] = 1;
+
+		cs.getQueue().enqueueWriteImage(inputImage, CL_FALSE, zeroCoord, inputDims, 0, 0, input.data());
+	}
+
+	// Throughput and latency figures from the timed examples
+	void finishResult(const std::vector<double> &latencies, const Options &options, Result &result) {
+		result._seconds = 0.0;
+
+		for (int i = 0; i < static_cast<int>(latencies.size()); i++)
+			result._seconds += latencies[i];
+
+		double steps = static_cast<double>(options._examples) * options._iterations;
+
+		result._stepsPerSecond = steps / result._seconds;
+
+		// Every step reads and updates each connection once
+		result._synapticUpdatesPerSecond = result._synapses * result._stepsPerSecond;
+
+		result._p50 = percentile(latencies, 0.5) * 1000.0;
+		result._p99 = percentile(latencies, 0.99) * 1000.0;
+
+		result._spikeRate = 0.0;
+		result._synapticEventsPerStep = 0.0;
+	}
+
+	Result runNetwork(sys::ComputeSystem &cs, const std::shared_ptr<ei::EIlayer::Kernels> &layerKernels, const std::shared_ptr<ei::HEInet::Kernels> &hKernels,
+		int size, int layers, int radius, const Options &options, const Peaks &peaks, const std::string &deviceName, std::ostream &output, std::mt19937 &generator)
+	{
+		std::vector<ei::EIlayer::Configuration> configs;
+
+		generateConfigs(size, layers, radius, options, configs);
+
+		ei::HEInet ht;
+
+		ht.createRandom(configs, radius, radius, 0.0f, 1.0f, 0.0f, 1.0f, 0.01f, 0.01f, 0.1f, 0.1f, cs, layerKernels, hKernels, generator);
+
+		if (options._sparse)
+			ht.setSparseActivation(cs, true);
+
+		ht.setActivityGatedLearning(options._gatedLearning);
+
+		if (options._statistics > 0)
+			ht.createStatistics(cs, options._statistics);
+
+		cl::Image2D inputImage;
+		cl::Image2D zeroImage;
+
+		createInputImages(cs, size, inputImage, zeroImage);
+
+		std::vector<std::vector<float>> frames;
+
+		generateFrames(size, generator, frames);
+
+		cs.getQueue().finish();
+
+		std::vector<double> latencies;
+
+		sys::Profiler profiler;
+
+		for (int xi = 0; xi < options._warmup + options._examples; xi++) {
+			if (options._roofline && xi == options._warmup)
+				cs.setProfiler(&profiler);
+
+			std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+			writeInput(cs, inputImage, size, frames[xi % frames.size()]);
+
+			runExample(cs, ht, inputImage, zeroImage, options);
+
+			cs.getQueue().finish();
+
+			if (xi >= options._warmup)
+				latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+		}
+
+		if (options._roofline) {
+			cs.setProfiler(nullptr);
+
+			profiler.resolve();
+
+			writeRoofline(ht, profiler, peaks, deviceName, size, layers, radius, output);
+		}
+
+		Result result;
+
+		result._size = size;
+		result._layers = layers;
+		result._radius = radius;
+		result._persistent = options._persistent && ht.canSettlePersistent();
+		result._sparse = ht.getSparseActivation();
+
+		result._neurons = ht.getNumNeurons();
+		result._synapses = 0;
+
+		for (int li = 0; li < static_cast<int>(ht.getEIlayers().size()); li++)
+			result._synapses += ht.getEIlayers()[li].getNumConnections();
+
+		finishResult(latencies, options, result);
+
+		std::vector<ei::HEInet::StatisticsRecord> records;
+
+		ht.readStatistics(cs, records);
+
+		if (!records.empty()) {
+			long long layerNeurons = 0;
+
+			for (int li = 0; li < static_cast<int>(configs.size()); li++)
+				layerNeurons += (configs[li]._eWidth * configs[li]._eHeight + configs[li]._iWidth * configs[li]._iHeight) * configs[li]._batchSize;
+
+			for (int ri = 0; ri < static_cast<int>(records.size()); ri++)
+				for (int pi = 0; pi < static_cast<int>(records[ri]._populations.size()); pi++) {
+					result._spikeRate += records[ri]._populations[pi]._spikes;
+					result._synapticEventsPerStep += records[ri]._populations[pi]._synapticEvents;
+				}
+
+			result._spikeRate /= static_cast<double>(records.size()) * layerNeurons;
+			result._synapticEventsPerStep /= records.size();
+		}
+
+		return result;
+	}
+
+	Result runNetworkNative(sys::ComputeSystem &cs, int size, int layers, int radius, const Options &options, std::mt19937 &generator) {
+		std::vector<ei::EIlayer::Configuration> configs;
+
+		generateConfigs(size, layers, radius, options, configs);
+
+		ei::HEInetNative ht;
+
+		ht.createRandom(configs, radius, radius, 0.0f, 1.0f, 0.0f, 1.0f, 0.01f, 0.01f, 0.1f, 0.1f, cs, generator);
+
+		std::vector<std::vector<float>> frames;
+
+		generateFrames(size, generator, frames);
+
+		std::vector<double> latencies;
+
+		for (int xi = 0; xi < options._warmup + options._examples; xi++) {
+			std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+			runExampleNative(cs, ht, frames[xi % frames.size()], options);
+
+			if (xi >= options._warmup)
+				latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+		}
+
+		Result result;
+
+		result._size = size;
+		result._layers = layers;
+		result._radius = radius;
+		result._persistent = false;
+		result._sparse = false;
+
+		// Same counts as HEInet::getNumNeurons and EIlayer::getNumConnections
+		result._neurons = static_cast<long long>(configs.front()._eFeedForwardWidth) * configs.front()._eFeedForwardHeight;
+		result._synapses = 0;
+
+		for (int li = 0; li < static_cast<int>(configs.size()); li++) {
+			result._neurons += configs[li]._eWidth * configs[li]._eHeight + configs[li]._iWidth * configs[li]._iHeight;
+			result._synapses += ei::EIlayer::getNumConnections(configs[li]);
+		}
+
+		finishResult(latencies, options, result);
+
+		return result;
+	}
+
+	// Distance of two floats in units in the last place
+	long long getUlps(float a, float b) {
+		cl_uint bitsA, bitsB;
+
+		std::memcpy(&bitsA, &a, sizeof(float));
+		std::memcpy(&bitsB, &b, sizeof(float));
+
+		// Sign and magnitude to a monotonic integer, +0 and -0 both map to 0
+		long long orderedA = (bitsA & 0x80000000u) ? -static_cast<long long>(bitsA & 0x7fffffffu) : static_cast<long long>(bitsA);
+		long long orderedB = (bitsB & 0x80000000u) ? -static_cast<long long>(bitsB & 0x7fffffffu) : static_cast<long long>(bitsB);
+
+		return orderedA > orderedB ? orderedA - orderedB : orderedB - orderedA;
+	}
+
+	struct Comparison {
+		long long _spikeMismatches;
+		int _firstMismatchStep;
+
+		long long _maxActivationUlps;
+		long long _maxThresholdUlps;
+		long long _maxWeightUlps;
+	};
+
+	void readImage(sys::ComputeSystem &cs, const cl::Image2D &image, int width, int height, std::vector<float> &data) {
+		cl::size_t<3> zeroCoord;
+		zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+		cl::size_t<3> dims;
+		dims[0] = width;
+		dims[1] = height;
+		dims[2] = 1;
+
+		data.resize(width * height);
+
+		cs.getQueue().enqueueReadImage(image, CL_TRUE, zeroCoord, dims, 0, 0, data.data());
+	}
+
+	// Step just simulated, stepEnd moved it to the previous images
+	void comparePopulation(sys::ComputeSystem &cs, const ei::EIlayer::NeuronLayer &layer, const ei::EIlayerNative::NeuronLayer &nativeLayer,
+		int width, int height, int step, Comparison &comparison)
+	{
+		std::vector<float> data;
+
+		readImage(cs, layer._statesPrev, width, height, data);
+
+		for (int i = 0; i < static_cast<int>(data.size()); i++)
+			if (data[i] != nativeLayer._statesPrev[i]) {
+				if (comparison._spikeMismatches == 0)
+					comparison._firstMismatchStep = step;
+
+				comparison._spikeMismatches++;
+			}
+
+		readImage(cs, layer._activationsPrev, width, height, data);
+
+		for (int i = 0; i < static_cast<int>(data.size()); i++)
+			comparison._maxActivationUlps = std::max(comparison._maxActivationUlps, getUlps(data[i], nativeLayer._activationsPrev[i]));
+
+		readImage(cs, layer._thresholdsPrev, width, height, data);
+
+		for (int i = 0; i < static_cast<int>(data.size()); i++)
+			comparison._maxThresholdUlps = std::max(comparison._maxThresholdUlps, getUlps(data[i], nativeLayer._thresholdsPrev[i]));
+	}
+
+	// Native weights keep the full field layout of EIlayer::readWeights, only positions inside the input are compared
+	void compareWeights(sys::ComputeSystem &cs, const ei::EIlayer::Weights2D &weights, const ei::EIlayerNative::Weights2D &nativeWeights, int radius,
+		int width, int height, int inputWidth, int inputHeight, bool lateral, ei::EIlayer::WeightPrecision weightPrecision, Comparison &comparison)
+	{
+		std::vector<float> fieldWeights;
+
+		ei::EIlayer::readWeights(cs, weights._weightsPrev, radius, width, height, inputWidth, inputHeight, lateral, fieldWeights, weightPrecision);
+
+		int diam = radius * 2 + 1;
+		int layerSize = width * height;
+
+		float widthRatio = static_cast<float>(inputWidth + 1) / static_cast<float>(width + 1);
+		float heightRatio = static_cast<float>(inputHeight + 1) / static_cast<float>(height + 1);
+
+		for (int x = 0; x < width; x++)
+			for (int y = 0; y < height; y++) {
+				int centerX = lateral ? x : static_cast<int>((x + 0.5f) * widthRatio + 0.5f);
+				int centerY = lateral ? y : static_cast<int>((y + 0.5f) * heightRatio + 0.5f);
+
+				for (int dx = -radius; dx <= radius; dx++)
+					for (int dy = -radius; dy <= radius; dy++) {
+						int inputX = centerX + dx;
+						int inputY = centerY + dy;
+
+						if (inputX < 0 || inputX >= inputWidth || inputY < 0 || inputY >= inputHeight)
+							continue;
+
+						int index = x + y * width + ((dx + radius) * diam + dy + radius) * layerSize;
+
+						comparison._maxWeightUlps = std::max(comparison._maxWeightUlps, getUlps(fieldWeights[index], nativeWeights._weightsPrev[index]));
+					}
+			}
+	}
+
+	// Step an OpenCL and a native network created from the same generator state on one input, see the usage above
+	Comparison compareNetwork(sys::ComputeSystem &cs, sys::ComputeSystem &nativeCs,
+		const std::shared_ptr<ei::EIlayer::Kernels> &layerKernels, const std::shared_ptr<ei::HEInet::Kernels> &hKernels,
+		int size, int layers, int radius, const Options &options, std::mt19937 &generator)
+	{
+		std::vector<ei::EIlayer::Configuration> configs;
+
+		generateConfigs(size, layers, radius, options, configs);
+
+		// Both networks draw the same seeds
+		std::mt19937 nativeGenerator = generator;
+
+		ei::HEInet ht;
+
+		ht.createRandom(configs, radius, radius, 0.0f, 1.0f, 0.0f, 1.0f, 0.01f, 0.01f, 0.1f, 0.1f, cs, layerKernels, hKernels, generator);
+
+		ei::HEInetNative native;
+
+		native.createRandom(configs, radius, radius, 0.0f, 1.0f, 0.0f, 1.0f, 0.01f, 0.01f, 0.1f, 0.1f, nativeCs, nativeGenerator);
+
+		std::vector<std::vector<float>> frames;
+
+		generateFrames(size, generator, frames);
+
+		cl::Image2D inputImage;
+		cl::Image2D zeroImage;
+
+		createInputImages(cs, size, inputImage, zeroImage);
+
+		writeInput(cs, inputImage, size, frames.front());
+
+		Comparison comparison = { 0, -1, 0, 0, 0 };
+
+		for (int step = 0; step < options._compare; step++) {
+			ht.update(cs, inputImage, zeroImage, eta, shDecay, saDecay);
+			ht.learn(cs, zeroImage, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
+			ht.stepEnd(cs);
+
+			native.update(nativeCs, frames.front(), eta, shDecay, saDecay);
+			native.learn(nativeCs, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
+			native.stepEnd(nativeCs);
+
+			for (int li = 0; li < layers; li++) {
+				const ei::EIlayer &layer = ht.getEIlayers()[li];
+				const ei::EIlayerNative &nativeLayer = native.getEIlayers()[li];
+
+				comparePopulation(cs, layer._eLayer, nativeLayer._eLayer, configs[li]._eWidth, configs[li]._eHeight, step, comparison);
+				comparePopulation(cs, layer._iLayer, nativeLayer._iLayer, configs[li]._iWidth, configs[li]._iHeight, step, comparison);
+			}
+		}
+
+		for (int li = 0; li < layers; li++) {
+			const ei::EIlayer &layer = ht.getEIlayers()[li];
+			const ei::EIlayerNative &nativeLayer = native.getEIlayers()[li];
+			const ei::EIlayer::Configuration &config = layer.getConfig();
+
+			ei::EIlayer::WeightPrecision weightPrecision = layer.getWeightPrecision();
+
+			compareWeights(cs, layer._eFeedForwardWeights, nativeLayer._eFeedForwardWeights, config._eFeedForwardRadius,
+				config._eWidth, config._eHeight, config._eFeedForwardWidth, config._eFeedForwardHeight, false, weightPrecision, comparison);
+			compareWeights(cs, layer._eFeedBackWeights, nativeLayer._eFeedBackWeights, config._eFeedBackRadius,
+				config._eWidth, config._eHeight, config._iWidth, config._iHeight, false, weightPrecision, comparison);
+			compareWeights(cs, layer._iFeedForwardWeights, nativeLayer._iFeedForwardWeights, config._iFeedForwardRadius,
+				config._iWidth, config._iHeight, config._eWidth, config._eHeight, false, weightPrecision, comparison);
+			compareWeights(cs, layer._iLateralWeights, nativeLayer._iLateralWeights, config._iLateralRadius,
+				config._iWidth, config._iHeight, config._iWidth, config._iHeight, true, weightPrecision, comparison);
+			compareWeights(cs, layer._iFeedBackWeights, nativeLayer._iFeedBackWeights, config._iFeedBackRadius,
+				config._iWidth, config._iHeight, config._iFeedBackWidth, config._iFeedBackHeight, false, weightPrecision, comparison);
+		}
+
+		return comparison;
+	}
+}
+
+int main(int argc, char** argv) {
+	Options options;
+
+	if (!parseOptions(argc, argv, options))
+		return 1;
+
+	sys::ComputeSystem cs;
+
+	// Kernels are timed one after another for the roofline
+	if (!cs.create(options._deviceType, false, options._threads, !options._roofline, options._roofline)) {
+		std::cerr << "Could not create a compute system!" << std::endl;
+
+		return 1;
+	}
+
+	bool native = options._deviceType == sys::ComputeSystem::_native;
+
+	// Native side of --compare
+	sys::ComputeSystem nativeCs;
+
+	if (options._compare > 0 && !nativeCs.create(sys::ComputeSystem::_native, false, options._threads)) {
+		std::cerr << "Could not create the native compute system!" << std::endl;
+
+		return 1;
+	}
+
+	sys::ComputeProgram program;
+	program.setCacheDirectory("programCache");
+
+	std::shared_ptr<ei::EIlayer::Kernels> layerKernels = std::make_shared<ei::EIlayer::Kernels>();
+	std::shared_ptr<ei::HEInet::Kernels> hKernels = std::make_shared<ei::HEInet::Kernels>();
+
+	if (!native) {
+		if (!program.loadFromSource(ei::getKernelSource(), cs)) {
+			std::cerr << "Could not build the kernels!" << std::endl;
+
+			return 1;
+		}
+
+		layerKernels->loadFromProgram(program);
+		hKernels->loadFromProgram(program);
+	}
+
+	std::ofstream output(options._output);
+
+	if (!output.is_open()) {
+		std::cerr << "Could not create " << options._output << "!" << std::endl;
+
+		return 1;
+	}
+
+	// Same networks every run
+	std::mt19937 generator(1234);
+
+	std::string deviceName = native ? "native" : cs.getDevice().getInfo<CL_DEVICE_NAME>();
+
+	bool matched = true;
+
+	Peaks peaks = { 0.0, 0.0 };
+
+	if (options._roofline) {
+		if (!measurePeaks(cs, peaks)) {
+			std::cerr << "Could not build the probe kernels!" << std::endl;
+
+			return 1;
+		}
+
+		output << "{\"device\":\"" << deviceName << "\",\"peakGbPerSecond\":" << peaks._bandwidth << ",\"peakGflopPerSecond\":" << peaks._flops << "}" << std::endl;
+
+		std::cout << "Peak " << peaks._bandwidth << " GB/s, " << peaks._flops << " GFLOP/s" << std::endl;
+	}
+
+	for (int si = 0; si < static_cast<int>(options._sizes.size()); si++)
+		for (int li = 0; li < static_cast<int>(options._layers.size()); li++)
+			for (int ri = 0; ri < static_cast<int>(options._radii.size()); ri++) {
+				if (options._compare > 0) {
+					Comparison comparison = compareNetwork(cs, nativeCs, layerKernels, hKernels, options._sizes[si], options._layers[li], options._radii[ri], options, generator);
+
+					output << "{\"device\":\"" << deviceName << "\",\"compare\":\"native\",\"size\":" << options._sizes[si] << ",\"layers\":" << options._layers[li]
+						<< ",\"radius\":" << options._radii[ri] << ",\"inPlace\":" << (options._inPlace ? "true" : "false") << ",\"steps\":" << options._compare
+						<< ",\"spikeMismatches\":" << comparison._spikeMismatches << ",\"firstMismatchStep\":" << comparison._firstMismatchStep
+						<< ",\"maxActivationUlps\":" << comparison._maxActivationUlps << ",\"maxThresholdUlps\":" << comparison._maxThresholdUlps
+						<< ",\"maxWeightUlps\":" << comparison._maxWeightUlps << "}" << std::endl;
+
+					std::cout << "size " << options._sizes[si] << " layers " << options._layers[li] << " radius " << options._radii[ri] << ": "
+						<< comparison._spikeMismatches << " spike mismatches";
+
+					if (comparison._spikeMismatches > 0)
+						std::cout << " from step " << comparison._firstMismatchStep;
+
+					std::cout << ", max ulps activations " << comparison._maxActivationUlps << ", thresholds " << comparison._maxThresholdUlps
+						<< ", weights " << comparison._maxWeightUlps << std::endl;
+
+					matched = matched && comparison._spikeMismatches == 0;
+
+					continue;
+				}
+
+				Result result = native ? runNetworkNative(cs, options._sizes[si], options._layers[li], options._radii[ri], options, generator)
+					: runNetwork(cs, layerKernels, hKernels, options._sizes[si], options._layers[li], options._radii[ri], options, peaks, deviceName, output, generator);
+
+				if (options._roofline)
+					continue;
+
+				output << "{\"device\":\"" << deviceName << "\",\"size\":" << result._size << ",\"layers\":" << result._layers << ",\"radius\":" << result._radius
+					<< ",\"persistent\":" << (result._persistent ? "true" : "false") << ",\"inPlace\":" << (options._inPlace ? "true" : "false") << ",\"sparse\":" << (result._sparse ? "true" : "false") << ",\"gatedLearning\":" << (options._gatedLearning ? "true" : "false") << ",\"statistics\":" << options._statistics << ",\"iterations\":" << options._iterations << ",\"examples\":" << options._examples
+					<< ",\"neurons\":" << result._neurons << ",\"synapses\":" << result._synapses
+					<< ",\"seconds\":" << result._seconds << ",\"stepsPerSecond\":" << result._stepsPerSecond << ",\"synapticUpdatesPerSecond\":" << result._synapticUpdatesPerSecond
+					<< ",\"p50Ms\":" << result._p50 << ",\"p99Ms\":" << result._p99;
+
+				if (options._statistics > 0)
+					output << ",\"spikeRate\":" << result._spikeRate << ",\"synapticEventsPerStep\":" << result._synapticEventsPerStep;
+
+				output << "}" << std::endl;
+
+				std::cout << "size " << result._size << " layers " << result._layers << " radius " << result._radius << ": "
+					<< result._stepsPerSecond << " steps/s, " << result._synapticUpdatesPerSecond << " synaptic updates/s, p50 "
+					<< result._p50 << " ms, p99 " << result._p99 << " ms" << std::endl;
+			}
+
+	return output.good() && matched ? 0 : 1;
+}
\ No newline at end of file
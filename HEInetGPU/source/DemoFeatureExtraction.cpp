@@ -26,6 +26,7 @@ misrepresented as being the original software.
 #include <system/ComputeSystem.h>
 
 #include <ei/HEInet.h>
+#include <ei/KernelSource.h>
 
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
@@ -46,10 +47,12 @@ int main() {
 
 	sys::ComputeSystem cs;
 
-	cs.create(sys::ComputeSystem::_gpu);
+	// Independent kernels of a step (e and i learning, spike sums) may overlap
+	cs.create(sys::ComputeSystem::_gpu, false, 0, true);
 
 	sys::ComputeProgram program;
-	program.loadFromFile("resources/ei.cl", cs);
+	program.setCacheDirectory("programCache");
+	program.loadFromSource(ei::getKernelSource(), cs);
 
 	std::shared_ptr<ei::EIlayer::Kernels> rsc2dKernels = std::make_shared<ei::EIlayer::Kernels>();
 
@@ -92,8 +95,6 @@ int main() {
 
 	ht.createRandom(configs, 6, 6, 0.0f, 1.0f, 0.0f, 1.0f, 0.5f, 0.5f, 0.02f, 0.02f, cs, rsc2dKernels, eiKernels, generator);
 
-	cl::Image2D inputImage = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), windowWidth, windowHeight);
-
 	cl::Image2D zeroImage = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), 1, 1);
 
 	sf::RenderWindow window;
@@ -108,6 +109,33 @@ int main() {
 	std::uniform_int_distribution<int> distX(0, testImage.getSize().x - windowWidth - 1);
 	std::uniform_int_distribution<int> distY(0, testImage.getSize().y - windowHeight - 1);
 
+	// Random patch of the test image, the next one is prepared and uploaded while the current one settles
+	auto stagePatch = [&]() {
+		sf::Image subImage;
+
+		subImage.create(windowWidth, windowHeight);
+
+		subImage.copy(testImage, 0, 0, sf::IntRect(distX(generator), distY(generator), windowWidth, windowHeight));
+
+		float* inputData = ht.getInputStaging(cs);
+
+		for (int x = 0; x < windowWidth; x++)
+			for (int y = 0; y < windowHeight; y++) {
+				sf::Color c = subImage.getPixel(x, y);
+				inputData[x + y * windowWidth] = (c.r + c.g + c.b) / (3.0f * 255.0f) * 0.5f; // Scale by 0.5f so maximum spike rate is 1/2 of the time
+			}
+
+		ht.submitInput(cs);
+	};
+
+	ht.createInputPipeline(cs);
+
+	stagePatch();
+
+	ht.createOutputReadback(cs);
+
+	const ei::HEInet::Outputs* pOutputs = nullptr;
+
 	bool quit = false;
 
 	int s = 0;
@@ -123,29 +151,7 @@ int main() {
 			}
 		}
 
-		cl::size_t<3> zeroCoord;
-		zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
-
-		cl::size_t<3> dims;
-		dims[0] = windowWidth;
-		dims[1] = windowHeight;
-		dims[2] = 1;
-
-		sf::Image subImage;
-
-		subImage.create(windowWidth, windowHeight);
-
-		subImage.copy(testImage, 0, 0, sf::IntRect(distX(generator), distY(generator), windowWidth, windowHeight));
-
-		std::vector<float> inputData(windowWidth * windowHeight);
-
-		for (int x = 0; x < windowWidth; x++)
-			for (int y = 0; y < windowHeight; y++) {
-				sf::Color c = subImage.getPixel(x, y);
-				inputData[x + y * windowWidth] = (c.r + c.g + c.b) / (3.0f * 255.0f) * 0.5f; // Scale by 0.5f so maximum spike rate is 1/2 of the time
-			}
-
-		cs.getQueue().enqueueWriteImage(inputImage, CL_TRUE, zeroCoord, dims, 0, 0, inputData.data());
+		const cl::Image2D &inputImage = ht.beginInput(cs);
 
 		ht.spikeSumBegin(cs);
 
@@ -163,16 +169,25 @@ int main() {
 		ht.predict(cs);
 		ht.learnPrediction(cs, inputImage, 0.005f);
 
+		ht.endInput(cs);
+
+		// Show the outputs of the previous example, read back while this one ran (the current ones on the first frame)
+		const ei::HEInet::Outputs* pShownOutputs = pOutputs;
+
+		pOutputs = &ht.requestOutputs(cs);
+
+		stagePatch();
+
 		window.clear();
 
-		std::vector<cl_float> iSpikeData(ht.getEIlayers()[0].getConfig()._iWidth * ht.getEIlayers()[0].getConfig()._iHeight);
-		std::vector<cl_float> eSpikeData(ht.getEIlayers()[0].getConfig()._eWidth * ht.getEIlayers()[0].getConfig()._eHeight);
-		std::vector<float> predictionData(windowWidth * windowHeight);
+		if (pShownOutputs == nullptr)
+			pShownOutputs = pOutputs;
 
-		cl::size_t<3> inputDims;
-		inputDims[0] = windowWidth;
-		inputDims[1] = windowHeight;
-		inputDims[2] = 1;
+		pShownOutputs->wait();
+
+		const float* iSpikeData = pShownOutputs->_iSpikeSums;
+		const float* eSpikeData = pShownOutputs->_eSpikeSums;
+		const float* predictionData = pShownOutputs->_prediction;
 
 		cl::size_t<3> eDims;
 		eDims[0] = ht.getEIlayers()[0].getConfig()._eWidth;
@@ -184,10 +199,6 @@ int main() {
 		iDims[1] = ht.getEIlayers()[0].getConfig()._iHeight;
 		iDims[2] = 1;
 
-		cs.getQueue().enqueueReadImage(ht._iSpikeSumsIterPrev, CL_TRUE, zeroCoord, iDims, 0, 0, iSpikeData.data());
-		cs.getQueue().enqueueReadImage(ht._eSpikeSumsIterPrev, CL_TRUE, zeroCoord, eDims, 0, 0, eSpikeData.data());
-		cs.getQueue().enqueueReadImage(ht._prediction, CL_TRUE, zeroCoord, inputDims, 0, 0, predictionData.data());
-
 		{
 			sf::Image img;
 			img.create(iDims[0], iDims[1]);
@@ -245,9 +256,10 @@ int main() {
 			effWeightsDims[1] = ht.getEIlayers()[0].getConfig()._eHeight;
 			effWeightsDims[2] = std::pow(configs[0]._eFeedForwardRadius * 2 + 1, 2);
 
-			std::vector<float> eWeights(eDims[0] * eDims[1] * effWeightsDims[2], 0.0f);
+			std::vector<float> eWeights;
 
-			cs.getQueue().enqueueReadImage(ht.getEIlayers()[0]._eFeedForwardWeights._weights, CL_TRUE, zeroCoord, effWeightsDims, 0, 0, eWeights.data());
+			ei::EIlayer::readWeights(cs, ht.getEIlayers()[0]._eFeedForwardWeights._weights, configs[0]._eFeedForwardRadius,
+				configs[0]._eWidth, configs[0]._eHeight, configs[0]._eFeedForwardWidth, configs[0]._eFeedForwardHeight, false, eWeights);
 
 			float mean = 0.5f;
 
@@ -26,10 +26,12 @@ misrepresented as being the original software.
 #include <system/ComputeSystem.h>
 
 #include <ei/HEInet.h>
+#include <ei/KernelSource.h>
 
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
 
+#include <algorithm>
 #include <array>
 
 #include <time.h>
@@ -46,10 +48,17 @@ int main() {
 
 	sys::ComputeSystem cs;
 
-	cs.create(sys::ComputeSystem::_gpu);
+	// Independent kernels of a step (e and i learning, spike sums) may overlap
+	cs.create(sys::ComputeSystem::_gpu, false, 0, true, DEMO_PROFILE_FRAMES > 0);
+
+	sys::Profiler profiler;
+
+	if (DEMO_PROFILE_FRAMES > 0)
+		cs.setProfiler(&profiler);
 
 	sys::ComputeProgram program;
-	program.loadFromFile("resources/ei.cl", cs);
+	program.setCacheDirectory("programCache");
+	program.loadFromSource(ei::getKernelSource(), cs);
 
 	std::shared_ptr<ei::EIlayer::Kernels> layerKernels = std::make_shared<ei::EIlayer::Kernels>();
 
@@ -97,7 +106,15 @@ int main() {
 
 	ht.createRandom(configs, 6, 6, 0.0f, 1.0f, 0.0f, 1.0f, 0.01f, 0.01f, 0.1f, 0.1f, cs, layerKernels, hKernels, generator);
 
-	cl::Image2D inputImage = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), inputSize.x, inputSize.y);
+	// The next sequence element is uploaded while the current one settles
+	ht.createInputPipeline(cs);
+
+	std::copy(sequence[1], sequence[1] + 4, ht.getInputStaging(cs));
+	ht.submitInput(cs);
+
+	ht.createOutputReadback(cs);
+
+	const ei::HEInet::Outputs* pOutputs = nullptr;
 
 	cl::Image2D zeroImage = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), 1, 1);
 
@@ -114,6 +131,8 @@ int main() {
 
 	int s = 0;
 
+	int frame = 0;
+
 	while (!quit) {
 		sf::Event e;
 
@@ -131,15 +150,7 @@ int main() {
 			std::cout << "Sequence:" << std::endl;
 		}
 
-		cl::size_t<3> zeroCoord;
-		zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
-
-		cl::size_t<3> dims;
-		dims[0] = inputSize.x;
-		dims[1] = inputSize.y;
-		dims[2] = 1;
-
-		cs.getQueue().enqueueWriteImage(inputImage, CL_TRUE, zeroCoord, dims, 0, 0, sequence[s]);
+		const cl::Image2D &inputImage = ht.beginInput(cs);
 
 		ht.spikeSumBegin(cs);
 
@@ -153,16 +164,26 @@ int main() {
 		ht.predict(cs);
 		ht.learnPrediction(cs, inputImage, 0.005f);
 
+		ht.endInput(cs);
+
+		// Show the outputs of the previous example, read back while this one ran (the current ones on the first frame)
+		const ei::HEInet::Outputs* pShownOutputs = pOutputs;
+
+		pOutputs = &ht.requestOutputs(cs);
+
+		std::copy(sequence[(s + 1) % 8], sequence[(s + 1) % 8] + 4, ht.getInputStaging(cs));
+		ht.submitInput(cs);
+
 		window.clear();
 
-		std::vector<cl_float> iSpikeData(ht.getEIlayers()[0].getConfig()._iWidth * ht.getEIlayers()[0].getConfig()._iHeight);
-		std::vector<cl_float> eSpikeData(ht.getEIlayers()[0].getConfig()._eWidth * ht.getEIlayers()[0].getConfig()._eHeight);
-		std::vector<float> predictionData(4);
+		if (pShownOutputs == nullptr)
+			pShownOutputs = pOutputs;
+
+		pShownOutputs->wait();
 
-		cl::size_t<3> inputDims;
-		inputDims[0] = inputSize.x;
-		inputDims[1] = inputSize.y;
-		inputDims[2] = 1;
+		const float* iSpikeData = pShownOutputs->_iSpikeSums;
+		const float* eSpikeData = pShownOutputs->_eSpikeSums;
+		const float* predictionData = pShownOutputs->_prediction;
 
 		cl::size_t<3> eDims;
 		eDims[0] = ht.getEIlayers()[0].getConfig()._eWidth;
@@ -174,10 +195,6 @@ int main() {
 		iDims[1] = ht.getEIlayers()[0].getConfig()._iHeight;
 		iDims[2] = 1;
 
-		cs.getQueue().enqueueReadImage(ht._iSpikeSumsIterPrev, CL_TRUE, zeroCoord, iDims, 0, 0, iSpikeData.data());
-		cs.getQueue().enqueueReadImage(ht._eSpikeSumsIterPrev, CL_TRUE, zeroCoord, eDims, 0, 0, eSpikeData.data());
-		cs.getQueue().enqueueReadImage(ht._prediction, CL_TRUE, zeroCoord, inputDims, 0, 0, predictionData.data());
-
 		{
 			sf::Image img;
 			img.create(iDims[0], iDims[1]);
@@ -235,9 +252,10 @@ int main() {
 			effWeightsDims[1] = ht.getEIlayers()[0].getConfig()._eHeight;
 			effWeightsDims[2] = std::pow(configs[0]._eFeedForwardRadius * 2 + 1, 2);
 
-			std::vector<float> eWeights(eDims[0] * eDims[1] * effWeightsDims[2], 0.0f);
+			std::vector<float> eWeights;
 
-			cs.getQueue().enqueueReadImage(ht.getEIlayers()[0]._eFeedForwardWeights._weights, CL_TRUE, zeroCoord, effWeightsDims, 0, 0, eWeights.data());
+			ei::EIlayer::readWeights(cs, ht.getEIlayers()[0]._eFeedForwardWeights._weights, configs[0]._eFeedForwardRadius,
+				configs[0]._eWidth, configs[0]._eHeight, configs[0]._eFeedForwardWidth, configs[0]._eFeedForwardHeight, false, eWeights);
 
 			sf::Image img;
 
@@ -272,7 +290,7 @@ int main() {
 			window.draw(s);
 		}
 
-		for (int i = 0; i < predictionData.size(); i++)
+		for (int i = 0; i < inputSize.x * inputSize.y; i++)
 			std::cout << (predictionData[i] > 0.0f ? 1 : 0) << " ";
 
 		std::cout << std::endl;
@@ -280,6 +298,22 @@ int main() {
 		ht.predictionEnd();
 
 		window.display();
+
+		if (cs.getProfiler() != nullptr && ++frame == DEMO_PROFILE_FRAMES) {
+			cs.setProfiler(nullptr);
+
+			profiler.resolve();
+
+			std::vector<sys::Profiler::Statistics> statistics;
+
+			profiler.getStatistics(statistics);
+
+			for (int i = 0; i < statistics.size(); i++)
+				std::cout << statistics[i]._phase << " (layer " << statistics[i]._layer << "): " << statistics[i]._count << " x " << statistics[i]._total / statistics[i]._count
+					<< " ms, latency " << statistics[i]._averageLatency << " ms" << std::endl;
+
+			profiler.writeChromeTrace("profile.json");
+		}
 	}
 
 	return 0;
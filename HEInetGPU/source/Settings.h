@@ -3,4 +3,7 @@
 #define DEMO_PREDICTION 0
 #define DEMO_FEATURE_EXTRACTION 1
 
-#define DEMO_SELECTION DEMO_FEATURE_EXTRACTION
\ No newline at end of file
+#define DEMO_SELECTION DEMO_FEATURE_EXTRACTION
+
+// Profile the first frames of the prediction demo, then print per-kernel statistics and write profile.json (0 = off)
+#define DEMO_PROFILE_FRAMES 0
\ No newline at end of file
@@ -0,0 +1,244 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "Checkpoint.h"
+
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace ei;
+
+namespace {
+	cl_ulong alignOffset(cl_ulong offset) {
+		return (offset + Checkpoint::_alignment - 1) / Checkpoint::_alignment * Checkpoint::_alignment;
+	}
+}
+
+bool Checkpoint::create(const std::string &fileName) {
+	close();
+
+	_sections.clear();
+
+	_output.open(fileName, std::ios::binary | std::ios::trunc);
+
+	if (!_output.is_open()) {
+#ifdef SYS_DEBUG
+		std::cerr << "Could not create checkpoint " << fileName << "!" << std::endl;
+#endif
+		return false;
+	}
+
+	// Header page, written again by finish
+	std::vector<char> headerPage(_alignment, 0);
+
+	_output.write(headerPage.data(), headerPage.size());
+
+	_end = _alignment;
+
+	return _output.good();
+}
+
+bool Checkpoint::addSection(const std::string &name, const void* data, cl_ulong size) {
+	if (!_output.is_open() || name.size() >= sizeof(Section::_name))
+		return false;
+
+	Section section;
+
+	std::memset(&section, 0, sizeof(Section));
+	std::memcpy(section._name, name.c_str(), name.size());
+
+	section._offset = _end;
+	section._size = size;
+
+	_output.write(static_cast<const char*>(data), size);
+
+	// Pad to the next page
+	cl_ulong end = alignOffset(_end + size);
+
+	std::vector<char> padding(end - _end - size, 0);
+
+	_output.write(padding.data(), padding.size());
+
+	_end = end;
+
+	_sections.push_back(section);
+
+	return _output.good();
+}
+
+bool Checkpoint::finish() {
+	if (!_output.is_open())
+		return false;
+
+	Header header;
+
+	std::memset(&header, 0, sizeof(Header));
+
+	header._magic = _magic;
+	header._version = _version;
+	header._alignment = _alignment;
+	header._numSections = _sections.size();
+	header._tableOffset = _end;
+
+	_output.write(reinterpret_cast<const char*>(_sections.data()), _sections.size() * sizeof(Section));
+
+	_output.seekp(0);
+	_output.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+	bool good = _output.good();
+
+	_output.close();
+
+	return good;
+}
+
+bool Checkpoint::open(const std::string &fileName) {
+	close();
+
+	_sections.clear();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+	if (file != INVALID_HANDLE_VALUE) {
+		LARGE_INTEGER fileSize;
+
+		if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+			_mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+
+			if (_mapping != nullptr) {
+				_data = static_cast<char*>(MapViewOfFile(_mapping, FILE_MAP_COPY, 0, 0, 0));
+				_size = fileSize.QuadPart;
+			}
+		}
+
+		CloseHandle(file);
+	}
+#else
+	int file = ::open(fileName.c_str(), O_RDONLY);
+
+	if (file != -1) {
+		struct stat fileStat;
+
+		if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0) {
+			void* data = mmap(nullptr, fileStat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+
+			if (data != MAP_FAILED) {
+				// Sections are uploaded front to back
+				madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+
+				_data = static_cast<char*>(data);
+				_size = fileStat.st_size;
+			}
+		}
+
+		::close(file);
+	}
+#endif
+
+	if (_data == nullptr) {
+#ifdef SYS_DEBUG
+		std::cerr << "Could not map checkpoint " << fileName << "!" << std::endl;
+#endif
+		close();
+
+		return false;
+	}
+
+	const Header* header = reinterpret_cast<const Header*>(_data);
+
+	if (_size < _alignment || header->_magic != _magic || header->_version != _version || header->_alignment != _alignment
+		|| header->_tableOffset > _size || (_size - header->_tableOffset) / sizeof(Section) < header->_numSections)
+	{
+#ifdef SYS_DEBUG
+		std::cerr << "Checkpoint " << fileName << " is not a version " << _version << " checkpoint!" << std::endl;
+#endif
+		close();
+
+		return false;
+	}
+
+	_sections.resize(header->_numSections);
+
+	std::memcpy(_sections.data(), _data + header->_tableOffset, _sections.size() * sizeof(Section));
+
+	for (int si = 0; si < static_cast<int>(_sections.size()); si++) {
+		Section &section = _sections[si];
+
+		section._name[sizeof(Section::_name) - 1] = '\0';
+
+		if (section._offset % _alignment != 0 || section._offset > header->_tableOffset || section._size > header->_tableOffset - section._offset) {
+#ifdef SYS_DEBUG
+			std::cerr << "Checkpoint " << fileName << " has a damaged section table!" << std::endl;
+#endif
+			close();
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void Checkpoint::close() {
+	if (_output.is_open())
+		_output.close();
+
+	if (_data != nullptr) {
+#ifdef _WIN32
+		UnmapViewOfFile(_data);
+#else
+		munmap(_data, _size);
+#endif
+	}
+
+#ifdef _WIN32
+	if (_mapping != nullptr)
+		CloseHandle(_mapping);
+
+	_mapping = nullptr;
+#endif
+
+	_data = nullptr;
+	_size = 0;
+}
+
+void* Checkpoint::getSection(const std::string &name, cl_ulong size) {
+	for (int si = 0; si < static_cast<int>(_sections.size()); si++)
+		if (_data != nullptr && name == _sections[si]._name && size == _sections[si]._size)
+			return _data + _sections[si]._offset;
+
+#ifdef SYS_DEBUG
+	std::cerr << "Checkpoint section " << name << " is missing or does not match the configuration!" << std::endl;
+#endif
+
+	return nullptr;
+}
\ No newline at end of file
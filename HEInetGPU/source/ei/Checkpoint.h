@@ -0,0 +1,106 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include "../system/ComputeSystem.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace ei {
+	// Versioned binary model file of named sections (HEInet::saveCheckpoint). A header page is followed by the sections,
+	// each starting on a page boundary, and the section table. Reading maps the whole file copy on write, so sections can be
+	// uploaded straight from the page cache or wrapped in place (CL_MEM_USE_HOST_PTR) without going through another buffer.
+	// Values are stored in host byte order, the magic number rejects files of the other endianness
+	class Checkpoint : private sys::Uncopyable {
+	public:
+		static const cl_uint _magic = 0x43494548; // "HEIC"
+		static const cl_uint _version = 1;
+
+		// Section alignment, a multiple of the page size and of CL_DEVICE_MEM_BASE_ADDR_ALIGN on common devices
+		static const cl_uint _alignment = 4096;
+
+		struct Header {
+			cl_uint _magic;
+			cl_uint _version;
+			cl_uint _alignment;
+			cl_uint _numSections;
+			cl_ulong _tableOffset;
+		};
+
+		struct Section {
+			char _name[48];
+			cl_ulong _offset;
+			cl_ulong _size;
+		};
+
+	private:
+		std::vector<Section> _sections;
+
+		// Writing
+		std::ofstream _output;
+		cl_ulong _end;
+
+		// Reading, the mapped file
+		char* _data;
+		cl_ulong _size;
+
+#ifdef _WIN32
+		void* _mapping;
+#endif
+
+	public:
+		Checkpoint()
+			: _end(0), _data(nullptr), _size(0)
+#ifdef _WIN32
+			, _mapping(nullptr)
+#endif
+		{}
+
+		~Checkpoint() {
+			close();
+		}
+
+		// Start writing a new file, then add sections and finish
+		bool create(const std::string &fileName);
+
+		// Append a section, names are at most 47 characters
+		bool addSection(const std::string &name, const void* data, cl_ulong size);
+
+		// Write the section table and header
+		bool finish();
+
+		// Map a file for reading, fails if it is not a checkpoint of this version
+		bool open(const std::string &fileName);
+
+		// Unmap the file, pointers from getSection become invalid
+		void close();
+
+		// Mapped section data (writable, changes stay private to this process), nullptr if there is no such section or it is not size bytes
+		void* getSection(const std::string &name, cl_ulong size);
+
+		const std::vector<Section> &getSections() const {
+			return _sections;
+		}
+	};
+}
\ No newline at end of file
@@ -21,18 +21,121 @@ misrepresented as being the original software.
 
 #include "EIlayer.h"
 
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
 using namespace ei;
 
+namespace {
+	// IEEE 754 half (little endian device) to float
+	float halfToFloat(unsigned int bits) {
+		int exponent = (bits >> 10) & 0x1f;
+		float mantissa = static_cast<float>(bits & 0x3ff);
+
+		float value;
+
+		if (exponent == 0)
+			value = std::ldexp(mantissa, -24);
+		else if (exponent == 31)
+			value = mantissa == 0.0f ? std::numeric_limits<float>::infinity() : std::numeric_limits<float>::quiet_NaN();
+		else
+			value = std::ldexp(mantissa + 1024.0f, exponent - 25);
+
+		return (bits & 0x8000) ? -value : value;
+	}
+
+	// Configuration (13 sizes and radii, packed states, batch size, feed back input), weight precision, rounding seed and in place weights
+	const int checkpointConfigInts = 20;
+
+	// Work-group of a statistics kernel, the largest power of two up to 256 the device runs it with
+	int getStatisticsGroupSize(sys::ComputeSystem &cs, const cl::Kernel &kernel) {
+		int maxSize = std::min<int>(256, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(cs.getDevice()));
+
+		int groupSize = 1;
+
+		while (groupSize * 2 <= maxSize)
+			groupSize *= 2;
+
+		return groupSize;
+	}
+
+	// Positions inside an input of inputSize within radius of the receptive field centers along one axis, summed over the layer
+	long long countAxisConnections(int size, int inputSize, int radius, bool lateral) {
+		float dimsToInputDims = static_cast<float>(inputSize + 1) / static_cast<float>(size + 1);
+
+		long long count = 0;
+
+		for (int i = 0; i < size; i++) {
+			// Same projection as the kernels
+			int center = lateral ? i : static_cast<int>((i + 0.5f) * dimsToInputDims + 0.5f);
+
+			count += std::min(center + radius, inputSize - 1) - std::max(center - radius, 0) + 1;
+		}
+
+		return count;
+	}
+
+	long long countConnections(int width, int height, int inputWidth, int inputHeight, int radius, bool lateral) {
+		long long count = countAxisConnections(width, inputWidth, radius, lateral) * countAxisConnections(height, inputHeight, radius, lateral);
+
+		// Lateral fields skip the neuron itself
+		return lateral ? count - static_cast<long long>(width) * height : count;
+	}
+}
+
 void EIlayer::Kernels::loadFromProgram(sys::ComputeProgram &program) {
+	loadFromProgram(program.getProgram());
+
+	_variants = &program;
+}
+
+void EIlayer::Kernels::loadFromProgram(const cl::Program &program) {
+	_program = program;
+	_variants = nullptr;
+
 	// Create kernels
-	_eInitializeKernel = cl::Kernel(program.getProgram(), "EIlayer_eInitialize");
-	_iInitializeKernel = cl::Kernel(program.getProgram(), "EIlayer_iInitialize");
+	_initializeWeightsKernel = cl::Kernel(program, "EIlayer_initializeWeights");
+
+	_eActivationKernel = cl::Kernel(program, "EIlayer_eActivate");
+	_iActivationKernel = cl::Kernel(program, "EIlayer_iActivate");
+
+	_eLearnKernel = cl::Kernel(program, "EIlayer_eLearn");
+	_iLearnKernel = cl::Kernel(program, "EIlayer_iLearn");
+
+	_initializeMasksKernel = cl::Kernel(program, "EIlayer_initializeMasks");
+	_packStatesKernel = cl::Kernel(program, "EIlayer_packStates");
 
-	_eActivationKernel = cl::Kernel(program.getProgram(), "EIlayer_eActivate");
-	_iActivationKernel = cl::Kernel(program.getProgram(), "EIlayer_iActivate");
+	_eActivationBinaryKernel = cl::Kernel(program, "EIlayer_eActivateBinary");
+	_iActivationBinaryKernel = cl::Kernel(program, "EIlayer_iActivateBinary");
 
-	_eLearnKernel = cl::Kernel(program.getProgram(), "EIlayer_eLearn");
-	_iLearnKernel = cl::Kernel(program.getProgram(), "EIlayer_iLearn");
+	_buildConnectionsKernel = cl::Kernel(program, "EIlayer_buildConnections");
+	_eActivationSparseKernel = cl::Kernel(program, "EIlayer_eActivateSparse");
+	_iActivationSparseKernel = cl::Kernel(program, "EIlayer_iActivateSparse");
+
+	_compactSpikesKernel = cl::Kernel(program, "EIlayer_compactSpikes");
+	_scatterSpikesKernel = cl::Kernel(program, "EIlayer_scatterSpikes");
+	_integrateKernel = cl::Kernel(program, "EIlayer_integrate");
+
+	_eActivationTiledKernel = cl::Kernel(program, "EIlayer_eActivateTiled");
+	_eLearnTiledKernel = cl::Kernel(program, "EIlayer_eLearnTiled");
+
+	_eActivationPackedKernel = cl::Kernel(program, "EIlayer_eActivatePacked");
+	_iActivationPackedKernel = cl::Kernel(program, "EIlayer_iActivatePacked");
+	_eActivationTiledPackedKernel = cl::Kernel(program, "EIlayer_eActivateTiledPacked");
+
+	_eLearnBatchKernel = cl::Kernel(program, "EIlayer_eLearnBatch");
+	_iLearnBatchKernel = cl::Kernel(program, "EIlayer_iLearnBatch");
+
+	_compactLearnersKernel = cl::Kernel(program, "EIlayer_compactLearners");
+	_learnThresholdsKernel = cl::Kernel(program, "EIlayer_learnThresholds");
+	_eLearnActiveKernel = cl::Kernel(program, "EIlayer_eLearnActive");
+	_iLearnActiveKernel = cl::Kernel(program, "EIlayer_iLearnActive");
+
+	_eStatisticsKernel = cl::Kernel(program, "EIlayer_eStatistics");
+	_iStatisticsKernel = cl::Kernel(program, "EIlayer_iStatistics");
 }
 
 void EIlayer::createRandom(const Configuration &config,
@@ -40,65 +143,170 @@ void EIlayer::createRandom(const Configuration &config,
 	float minInitIWeight, float maxInitIWeight,
 	float initEThreshold, float initIThreshold,
 	float sparsityE, float sparsityI,
-	sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &eilKernels, std::mt19937 &generator)
+	sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &eilKernels, std::mt19937 &generator,
+	WeightPrecision weightPrecision)
+{
+	create(config, initEThreshold, initIThreshold, sparsityE, sparsityI, cs, eilKernels, weightPrecision);
+
+	int eSize = _config._eWidth * _config._eHeight;
+	int iSize = _config._iWidth * _config._iHeight;
+
+	// Weight buffer sizes (weights)
+	int eFeedForwardSize = getWeightsSize(_config._eFeedForwardRadius, _config._eFeedForwardWidth, _config._eFeedForwardHeight, eSize);
+	int eFeedBackSize = getWeightsSize(_config._eFeedBackRadius, _config._iWidth, _config._iHeight, eSize);
+	int iFeedForwardSize = getWeightsSize(_config._iFeedForwardRadius, _config._eWidth, _config._eHeight, iSize);
+	int iLateralSize = getWeightsSize(_config._iLateralRadius, _config._iWidth, _config._iHeight, iSize);
+	int iFeedBackSize = getWeightsSize(_config._iFeedBackRadius, _config._iFeedBackWidth, _config._iFeedBackHeight, iSize);
+
+	// Create buffers - weights
+	createWeights(cs, _eFeedForwardWeights, eFeedForwardSize, nullptr);
+	createWeights(cs, _eFeedBackWeights, eFeedBackSize, nullptr);
+	createWeights(cs, _iFeedForwardWeights, iFeedForwardSize, nullptr);
+	createWeights(cs, _iLateralWeights, iLateralSize, nullptr);
+	createWeights(cs, _iFeedBackWeights, iFeedBackSize, nullptr);
+
+	// Weight RNG keys, full 32 bit
+	cl_uint2 seedE = { static_cast<cl_uint>(generator()), static_cast<cl_uint>(generator()) };
+	cl_uint2 seedI = { static_cast<cl_uint>(generator()), static_cast<cl_uint>(generator()) };
+
+	std::uniform_int_distribution<int> seedDist(0, 10000);
+
+	_roundingSeed.x = seedDist(generator);
+	_roundingSeed.y = seedDist(generator);
+
+	// Initialize weights, both buffers of a pair at once
+	initializeWeights(cs, _eFeedForwardWeights, _config._eFeedForwardRadius, false, _config._eWidth, _config._eHeight, _config._eFeedForwardWidth, _config._eFeedForwardHeight,
+		minInitEWeight, maxInitEWeight, seedE, _eFeedForwardStream);
+	initializeWeights(cs, _eFeedBackWeights, _config._eFeedBackRadius, false, _config._eWidth, _config._eHeight, _config._iWidth, _config._iHeight,
+		minInitIWeight, maxInitIWeight, seedE, _eFeedBackStream);
+	initializeWeights(cs, _iFeedForwardWeights, _config._iFeedForwardRadius, false, _config._iWidth, _config._iHeight, _config._eWidth, _config._eHeight,
+		minInitIWeight, maxInitIWeight, seedI, _iFeedForwardStream);
+	initializeWeights(cs, _iLateralWeights, _config._iLateralRadius, true, _config._iWidth, _config._iHeight, _config._iWidth, _config._iHeight,
+		minInitIWeight, maxInitIWeight, seedI, _iLateralStream);
+	initializeWeights(cs, _iFeedBackWeights, _config._iFeedBackRadius, false, _config._iWidth, _config._iHeight, _config._iFeedBackWidth, _config._iFeedBackHeight,
+		minInitIWeight, maxInitIWeight, seedI, _iFeedBackStream);
+
+	finishCreate(cs);
+}
+
+void EIlayer::create(const Configuration &config,
+	float initEThreshold, float initIThreshold,
+	float sparsityE, float sparsityI,
+	sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &eilKernels, WeightPrecision weightPrecision)
 {
 	_kernels = eilKernels;
 
 	_config = config;
 
-	// Total size (number of weights) in receptive fields
-	int eFeedForwardSize = std::pow(_config._eFeedForwardRadius * 2 + 1, 2);
-	int eFeedBackSize = std::pow(_config._eFeedBackRadius * 2 + 1, 2);
-	int iFeedForwardSize = std::pow(_config._iFeedForwardRadius * 2 + 1, 2);
-	int iLateralSize = std::pow(_config._iLateralRadius * 2 + 1, 2);
-	int iFeedBackSize = std::pow(_config._iFeedBackRadius * 2 + 1, 2);
+	_weightPrecision = weightPrecision;
 
-	// Create images - neurons
-	_eLayer._activations = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
-	_eLayer._activationsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
+	// Kernel instances of this layer, one per buffer parity. They come from the variant specialized to the configuration
+	// if there is one, getVariant leaves the generic program if the variant does not build
+	cl::Program program = _kernels->_program;
 
-	_eLayer._states = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
-	_eLayer._statesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
+	if (_kernels->_variants != nullptr)
+		_kernels->_variants->getVariant(getVariantOptions(), cs, program);
 
-	_eLayer._statesHistory = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
-	_eLayer._statesHistoryPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
+	_parityKernels[0].loadFromProgram(program);
+	_parityKernels[1].loadFromProgram(program);
 
-	_eLayer._stateAverages = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
-	_eLayer._stateAveragesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
+	_parity = 0;
 
-	_eLayer._thresholds = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
-	_eLayer._thresholdsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
+	_sparseActivation = false;
+
+	int eSize = _config._eWidth * _config._eHeight;
+	int iSize = _config._iWidth * _config._iHeight;
+
+	// Create images - neurons, stacked per batch item
+	int eBatchHeight = _config._eHeight * _config._batchSize;
+	int iBatchHeight = _config._iHeight * _config._batchSize;
+
+	if (_config._packedStates) {
+		_eLayer._states = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), _config._eWidth, eBatchHeight);
+		_eLayer._statesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), _config._eWidth, eBatchHeight);
+
+		_iLayer._states = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), _config._iWidth, iBatchHeight);
+		_iLayer._statesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), _config._iWidth, iBatchHeight);
+
+		_eLayer._activations = _eLayer._statesHistory = _eLayer._stateAverages = _eLayer._states;
+		_eLayer._activationsPrev = _eLayer._statesHistoryPrev = _eLayer._stateAveragesPrev = _eLayer._statesPrev;
+
+		_iLayer._activations = _iLayer._statesHistory = _iLayer._stateAverages = _iLayer._states;
+		_iLayer._activationsPrev = _iLayer._statesHistoryPrev = _iLayer._stateAveragesPrev = _iLayer._statesPrev;
+	}
+	else {
+		_eLayer._activations = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, eBatchHeight);
+		_eLayer._activationsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, eBatchHeight);
+
+		_eLayer._states = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, eBatchHeight);
+		_eLayer._statesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, eBatchHeight);
+
+		_eLayer._statesHistory = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, eBatchHeight);
+		_eLayer._statesHistoryPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, eBatchHeight);
 
-	_iLayer._activations = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
-	_iLayer._activationsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
+		_eLayer._stateAverages = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, eBatchHeight);
+		_eLayer._stateAveragesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, eBatchHeight);
 
-	_iLayer._states = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
-	_iLayer._statesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
+		_iLayer._activations = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, iBatchHeight);
+		_iLayer._activationsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, iBatchHeight);
 
-	_iLayer._statesHistory = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
-	_iLayer._statesHistoryPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
+		_iLayer._states = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, iBatchHeight);
+		_iLayer._statesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, iBatchHeight);
 
-	_iLayer._stateAverages = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
-	_iLayer._stateAveragesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
+		_iLayer._statesHistory = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, iBatchHeight);
+		_iLayer._statesHistoryPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, iBatchHeight);
+
+		_iLayer._stateAverages = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, iBatchHeight);
+		_iLayer._stateAveragesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, iBatchHeight);
+	}
+
+	_eLayer._thresholds = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
+	_eLayer._thresholdsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight);
 
 	_iLayer._thresholds = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
 	_iLayer._thresholdsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight);
 
-	// Create images - weights
-	_eFeedForwardWeights._weights = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight, eFeedForwardSize);
-	_eFeedForwardWeights._weightsPrev = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight, eFeedForwardSize);
+	// Create buffers - binary activation
+	int eStateBitsSize = getSpikeBitsSize(_config._eWidth, _config._eHeight);
+	int iStateBitsSize = getSpikeBitsSize(_config._iWidth, _config._iHeight);
+
+	_eLayer._stateBits = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, eStateBitsSize * sizeof(cl_uint));
+	_eLayer._stateBitsPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, eStateBitsSize * sizeof(cl_uint));
+
+	_iLayer._stateBits = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, iStateBitsSize * sizeof(cl_uint));
+	_iLayer._stateBitsPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, iStateBitsSize * sizeof(cl_uint));
+
+	createMasks(cs, _eFeedForwardWeights, eSize * getMaskSize(_config._eFeedForwardRadius));
+	createMasks(cs, _eFeedBackWeights, eSize * getMaskSize(_config._eFeedBackRadius));
+	createMasks(cs, _iFeedForwardWeights, iSize * getMaskSize(_config._iFeedForwardRadius));
+	createMasks(cs, _iFeedBackWeights, iSize * getMaskSize(_config._iFeedBackRadius));
+	createMasks(cs, _iLateralWeights, iSize * getMaskSize(_config._iLateralRadius));
 
-	_eFeedBackWeights._weights = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight, eFeedBackSize);
-	_eFeedBackWeights._weightsPrev = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._eWidth, _config._eHeight, eFeedBackSize);
+	// Create buffers - event driven activation
+	_eLayer._spikeList._spikes = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, eSize * sizeof(cl_int2));
+	_eLayer._spikeList._count = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
+	_eLayer._spikeListPrev._spikes = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, eSize * sizeof(cl_int2));
+	_eLayer._spikeListPrev._count = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
 
-	_iFeedForwardWeights._weights = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight, iFeedForwardSize);
-	_iFeedForwardWeights._weightsPrev = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight, iFeedForwardSize);
+	_iLayer._spikeList._spikes = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, iSize * sizeof(cl_int2));
+	_iLayer._spikeList._count = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
+	_iLayer._spikeListPrev._spikes = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, iSize * sizeof(cl_int2));
+	_iLayer._spikeListPrev._count = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
 
-	_iFeedBackWeights._weights = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight, iFeedBackSize);
-	_iFeedBackWeights._weightsPrev = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight, iFeedBackSize);
+	_eLayer._excitations = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, eSize * sizeof(cl_int));
+	_eLayer._inhibitions = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, eSize * sizeof(cl_int));
+	_iLayer._excitations = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, iSize * sizeof(cl_int));
+	_iLayer._inhibitions = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, iSize * sizeof(cl_int));
 
-	_iLateralWeights._weights = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight, iLateralSize);
-	_iLateralWeights._weightsPrev = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), _config._iWidth, _config._iHeight, iLateralSize);
+	// Create buffers - activity gated learning
+	_eLayer._learners._spikes = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, eSize * sizeof(cl_int2));
+	_eLayer._learners._count = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
+	_iLayer._learners._spikes = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, iSize * sizeof(cl_int2));
+	_iLayer._learners._count = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
+	_eLayer._learnedPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, eSize * sizeof(cl_uchar));
+	_iLayer._learnedPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, iSize * sizeof(cl_uchar));
+
+	_learnedPrevCurrent = false;
 
 	cl_float4 zeroColor = { 0.0f, 0.0f, 0.0f, 0.0f };
 	cl_float4 eSparsityColor = { sparsityE, sparsityE, sparsityE, sparsityE };
@@ -119,174 +327,1198 @@ void EIlayer::createRandom(const Configuration &config,
 	iDimsCoord[1] = _config._iHeight;
 	iDimsCoord[2] = 1;
 
+	cl::size_t<3> eBatchDimsCoord = eDimsCoord;
+	eBatchDimsCoord[1] = eBatchHeight;
+
+	cl::size_t<3> iBatchDimsCoord = iDimsCoord;
+	iBatchDimsCoord[1] = iBatchHeight;
+
 	// Clear to defaults
-	cs.getQueue().enqueueFillImage(_eLayer._activations, zeroColor, zeroCoord, eDimsCoord);
-	cs.getQueue().enqueueFillImage(_eLayer._activationsPrev, zeroColor, zeroCoord, eDimsCoord);
-	cs.getQueue().enqueueFillImage(_eLayer._states, zeroColor, zeroCoord, eDimsCoord);
-	cs.getQueue().enqueueFillImage(_eLayer._statesPrev, zeroColor, zeroCoord, eDimsCoord);
-	cs.getQueue().enqueueFillImage(_eLayer._statesHistory, zeroColor, zeroCoord, eDimsCoord);
-	cs.getQueue().enqueueFillImage(_eLayer._statesHistoryPrev, zeroColor, zeroCoord, eDimsCoord);
-	cs.getQueue().enqueueFillImage(_eLayer._stateAverages, eSparsityColor, zeroCoord, eDimsCoord);
-	cs.getQueue().enqueueFillImage(_eLayer._stateAveragesPrev, eSparsityColor, zeroCoord, eDimsCoord);
+	if (_config._packedStates) {
+		cl_float4 eStateColor = { 0.0f, 0.0f, sparsityE, 0.0f };
+		cl_float4 iStateColor = { 0.0f, 0.0f, sparsityI, 0.0f };
+
+		cs.getQueue().enqueueFillImage(_eLayer._states, eStateColor, zeroCoord, eBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_eLayer._statesPrev, eStateColor, zeroCoord, eBatchDimsCoord);
+
+		cs.getQueue().enqueueFillImage(_iLayer._states, iStateColor, zeroCoord, iBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_iLayer._statesPrev, iStateColor, zeroCoord, iBatchDimsCoord);
+	}
+	else {
+		cs.getQueue().enqueueFillImage(_eLayer._activations, zeroColor, zeroCoord, eBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_eLayer._activationsPrev, zeroColor, zeroCoord, eBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_eLayer._states, zeroColor, zeroCoord, eBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_eLayer._statesPrev, zeroColor, zeroCoord, eBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_eLayer._statesHistory, zeroColor, zeroCoord, eBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_eLayer._statesHistoryPrev, zeroColor, zeroCoord, eBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_eLayer._stateAverages, eSparsityColor, zeroCoord, eBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_eLayer._stateAveragesPrev, eSparsityColor, zeroCoord, eBatchDimsCoord);
+
+		cs.getQueue().enqueueFillImage(_iLayer._activations, zeroColor, zeroCoord, iBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_iLayer._activationsPrev, zeroColor, zeroCoord, iBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_iLayer._states, zeroColor, zeroCoord, iBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_iLayer._statesPrev, zeroColor, zeroCoord, iBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_iLayer._statesHistory, zeroColor, zeroCoord, iBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_iLayer._statesHistoryPrev, zeroColor, zeroCoord, iBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_iLayer._stateAverages, iSparsityColor, zeroCoord, iBatchDimsCoord);
+		cs.getQueue().enqueueFillImage(_iLayer._stateAveragesPrev, iSparsityColor, zeroCoord, iBatchDimsCoord);
+	}
+
 	cs.getQueue().enqueueFillImage(_eLayer._thresholds, eThresholdColor, zeroCoord, eDimsCoord);
 	cs.getQueue().enqueueFillImage(_eLayer._thresholdsPrev, eThresholdColor, zeroCoord, eDimsCoord);
-
-	cs.getQueue().enqueueFillImage(_iLayer._activations, zeroColor, zeroCoord, iDimsCoord);
-	cs.getQueue().enqueueFillImage(_iLayer._activationsPrev, zeroColor, zeroCoord, iDimsCoord);
-	cs.getQueue().enqueueFillImage(_iLayer._states, zeroColor, zeroCoord, iDimsCoord);
-	cs.getQueue().enqueueFillImage(_iLayer._statesPrev, zeroColor, zeroCoord, iDimsCoord);
-	cs.getQueue().enqueueFillImage(_iLayer._statesHistory, zeroColor, zeroCoord, iDimsCoord);
-	cs.getQueue().enqueueFillImage(_iLayer._statesHistoryPrev, zeroColor, zeroCoord, iDimsCoord);
-	cs.getQueue().enqueueFillImage(_iLayer._stateAverages, iSparsityColor, zeroCoord, iDimsCoord);
-	cs.getQueue().enqueueFillImage(_iLayer._stateAveragesPrev, iSparsityColor, zeroCoord, iDimsCoord);
 	cs.getQueue().enqueueFillImage(_iLayer._thresholds, iThresholdColor, zeroCoord, iDimsCoord);
 	cs.getQueue().enqueueFillImage(_iLayer._thresholdsPrev, iThresholdColor, zeroCoord, iDimsCoord);
 
+	cl_uint zeroBits = 0;
+
+	cs.getQueue().enqueueFillBuffer(_eLayer._stateBits, zeroBits, 0, eStateBitsSize * sizeof(cl_uint));
+	cs.getQueue().enqueueFillBuffer(_eLayer._stateBitsPrev, zeroBits, 0, eStateBitsSize * sizeof(cl_uint));
+	cs.getQueue().enqueueFillBuffer(_iLayer._stateBits, zeroBits, 0, iStateBitsSize * sizeof(cl_uint));
+	cs.getQueue().enqueueFillBuffer(_iLayer._stateBitsPrev, zeroBits, 0, iStateBitsSize * sizeof(cl_uint));
+
+	cl_int zeroCount = 0;
+
+	cs.getQueue().enqueueFillBuffer(_eLayer._spikeList._count, zeroCount, 0, sizeof(cl_int));
+	cs.getQueue().enqueueFillBuffer(_eLayer._spikeListPrev._count, zeroCount, 0, sizeof(cl_int));
+	cs.getQueue().enqueueFillBuffer(_iLayer._spikeList._count, zeroCount, 0, sizeof(cl_int));
+	cs.getQueue().enqueueFillBuffer(_iLayer._spikeListPrev._count, zeroCount, 0, sizeof(cl_int));
+}
+
+void EIlayer::createWeights(sys::ComputeSystem &cs, Weights2D &weights, int size, void* hostPtr) {
+	int bytes = size * getWeightBytes(_weightPrecision);
+
+	// Random initialization and checkpoints write every slot, padding and clipped border slots included
+	if (hostPtr != nullptr)
+		weights._weightsPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, bytes, hostPtr);
+	else
+		weights._weightsPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, bytes);
+
+	if (_config._inPlaceWeights)
+		weights._weights = weights._weightsPrev;
+	else
+		weights._weights = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, bytes);
+}
+
+void EIlayer::createMasks(sys::ComputeSystem &cs, Weights2D &weights, int size) {
+	weights._masksPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, size * sizeof(cl_uint));
+
+	if (_config._inPlaceWeights)
+		weights._masks = weights._masksPrev;
+	else
+		weights._masks = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, size * sizeof(cl_uint));
+
+	// Connection lists of an earlier configuration
+	weights._connections = cl::Buffer();
+	weights._connectionCounts = cl::Buffer();
+}
+
+void EIlayer::createConnections(sys::ComputeSystem &cs, Weights2D &weights, int radius, int width, int height, int inputWidth, int inputHeight) {
+	weights._connections = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, getConnectionsSize(radius, inputWidth, inputHeight, width * height) * sizeof(cl_char2));
+	weights._connectionCounts = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, width * height * sizeof(cl_int));
+}
+
+void EIlayer::finishCreate(sys::ComputeSystem &cs) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	cl_int2 eDims = { _config._eWidth, _config._eHeight };
+	cl_int2 iDims = { _config._iWidth, _config._iHeight };
+
+	cl_float2 eDimsToEFeedForwardDims = { static_cast<float>(_config._eFeedForwardWidth + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(_config._eFeedForwardHeight + 1) / static_cast<float>(eDims.y + 1) };
+	cl_float2 eDimsToIDims = { static_cast<float>(iDims.x + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(iDims.y + 1) / static_cast<float>(eDims.y + 1) };
+
+	// Connectivity masks of the initial or loaded weights
+	initializeMasks(cs, _eFeedForwardWeights, _config._eFeedForwardRadius, false, _config._eWidth, _config._eHeight, _config._eFeedForwardWidth, _config._eFeedForwardHeight);
+	initializeMasks(cs, _eFeedBackWeights, _config._eFeedBackRadius, false, _config._eWidth, _config._eHeight, _config._iWidth, _config._iHeight);
+	initializeMasks(cs, _iFeedForwardWeights, _config._iFeedForwardRadius, false, _config._iWidth, _config._iHeight, _config._eWidth, _config._eHeight);
+	initializeMasks(cs, _iLateralWeights, _config._iLateralRadius, true, _config._iWidth, _config._iHeight, _config._iWidth, _config._iHeight);
+	initializeMasks(cs, _iFeedBackWeights, _config._iFeedBackRadius, false, _config._iWidth, _config._iHeight, _config._iFeedBackWidth, _config._iFeedBackHeight);
+
+	// Work-groups of the tiled kernels, both read the same inputs through the same fields. Their tiles hold a single batch item
+	if (_config._batchSize > 1)
+		_tileSize = 0;
+	else
+		_tileSize = std::min(chooseTileSize(cs, getEActivationKernel(kernels, true), eDimsToEFeedForwardDims, _config._eFeedForwardRadius, eDimsToIDims, _config._eFeedBackRadius),
+			chooseTileSize(cs, kernels._eLearnTiledKernel, eDimsToEFeedForwardDims, _config._eFeedForwardRadius, eDimsToIDims, _config._eFeedBackRadius));
+
+	_feedForwardTileDims = getTileDims(_tileSize, eDimsToEFeedForwardDims, _config._eFeedForwardRadius);
+	_feedBackTileDims = getTileDims(_tileSize, eDimsToIDims, _config._eFeedBackRadius);
+
+	// Bind both buffer parities, stepEnd only selects the instance afterwards
+	bindKernels(_parityKernels[0]);
+	swapBuffers();
+	bindKernels(_parityKernels[1]);
+	swapBuffers();
+}
+
+void EIlayer::setSparseActivation(sys::ComputeSystem &cs, bool sparseActivation) {
+	if (sparseActivation && _config._packedStates) {
+#ifdef SYS_DEBUG
+		std::cout << "Sparse activation is not available with packed states!" << std::endl;
+#endif
+		return;
+	}
+
+	// Offsets are stored as chars
+	if (sparseActivation && std::max(std::max(std::max(_config._eFeedForwardRadius, _config._eFeedBackRadius), std::max(_config._iFeedForwardRadius, _config._iLateralRadius)), _config._iFeedBackRadius) > 127) {
+#ifdef SYS_DEBUG
+		std::cout << "Sparse activation is not available with radii above 127!" << std::endl;
+#endif
+		return;
+	}
+
+	_sparseActivation = sparseActivation;
+
+	if (!_sparseActivation)
+		return;
+
+	if (_eFeedForwardWeights._connections() == nullptr) {
+		createConnections(cs, _eFeedForwardWeights, _config._eFeedForwardRadius, _config._eWidth, _config._eHeight, _config._eFeedForwardWidth, _config._eFeedForwardHeight);
+		createConnections(cs, _eFeedBackWeights, _config._eFeedBackRadius, _config._eWidth, _config._eHeight, _config._iWidth, _config._iHeight);
+		createConnections(cs, _iFeedForwardWeights, _config._iFeedForwardRadius, _config._iWidth, _config._iHeight, _config._eWidth, _config._eHeight);
+		createConnections(cs, _iLateralWeights, _config._iLateralRadius, _config._iWidth, _config._iHeight, _config._iWidth, _config._iHeight);
+		createConnections(cs, _iFeedBackWeights, _config._iFeedBackRadius, _config._iWidth, _config._iHeight, _config._iFeedBackWidth, _config._iFeedBackHeight);
+
+		// Bind both buffer parities like finishCreate
+		bindSparseKernels(_parityKernels[_parity]);
+		swapBuffers();
+		bindSparseKernels(_parityKernels[1 - _parity]);
+		swapBuffers();
+	}
+
+	buildConnections(cs);
+}
+
+void EIlayer::buildConnections(sys::ComputeSystem &cs) {
+	if (_eFeedForwardWeights._connections() == nullptr)
+		return;
+
+	buildConnections(cs, _eFeedForwardWeights, _config._eFeedForwardRadius, _config._eWidth, _config._eHeight);
+	buildConnections(cs, _eFeedBackWeights, _config._eFeedBackRadius, _config._eWidth, _config._eHeight);
+	buildConnections(cs, _iFeedForwardWeights, _config._iFeedForwardRadius, _config._iWidth, _config._iHeight);
+	buildConnections(cs, _iLateralWeights, _config._iLateralRadius, _config._iWidth, _config._iHeight);
+	buildConnections(cs, _iFeedBackWeights, _config._iFeedBackRadius, _config._iWidth, _config._iHeight);
+}
+
+bool EIlayer::writeCheckpoint(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &prefix) const {
+	cl_int ints[checkpointConfigInts] = {
+		_config._eFeedForwardWidth, _config._eFeedForwardHeight,
+		_config._eWidth, _config._eHeight,
+		_config._iWidth, _config._iHeight,
+		_config._iFeedBackWidth, _config._iFeedBackHeight,
+		_config._eFeedForwardRadius,
+		_config._eFeedBackRadius,
+		_config._iFeedForwardRadius,
+		_config._iLateralRadius,
+		_config._iFeedBackRadius,
+		_config._packedStates ? 1 : 0,
+		_config._batchSize,
+		_config._feedBackInput ? 1 : 0,
+		static_cast<cl_int>(_weightPrecision),
+		static_cast<cl_int>(_roundingSeed.x), static_cast<cl_int>(_roundingSeed.y),
+		_config._inPlaceWeights ? 1 : 0
+	};
+
+	int eSize = _config._eWidth * _config._eHeight;
+	int iSize = _config._iWidth * _config._iHeight;
+
+	int eFeedForwardSize = getWeightsSize(_config._eFeedForwardRadius, _config._eFeedForwardWidth, _config._eFeedForwardHeight, eSize);
+	int eFeedBackSize = getWeightsSize(_config._eFeedBackRadius, _config._iWidth, _config._iHeight, eSize);
+	int iFeedForwardSize = getWeightsSize(_config._iFeedForwardRadius, _config._eWidth, _config._eHeight, iSize);
+	int iLateralSize = getWeightsSize(_config._iLateralRadius, _config._iWidth, _config._iHeight, iSize);
+	int iFeedBackSize = getWeightsSize(_config._iFeedBackRadius, _config._iFeedBackWidth, _config._iFeedBackHeight, iSize);
+
+	return checkpoint.addSection(prefix + ".config", ints, sizeof(ints))
+		&& writeWeights(cs, checkpoint, prefix + ".eFeedForwardWeights", _eFeedForwardWeights, eFeedForwardSize)
+		&& writeWeights(cs, checkpoint, prefix + ".eFeedBackWeights", _eFeedBackWeights, eFeedBackSize)
+		&& writeWeights(cs, checkpoint, prefix + ".iFeedForwardWeights", _iFeedForwardWeights, iFeedForwardSize)
+		&& writeWeights(cs, checkpoint, prefix + ".iLateralWeights", _iLateralWeights, iLateralSize)
+		&& writeWeights(cs, checkpoint, prefix + ".iFeedBackWeights", _iFeedBackWeights, iFeedBackSize)
+		&& writeNeurons(cs, checkpoint, prefix + ".e", _eLayer, _config._eWidth, _config._eHeight)
+		&& writeNeurons(cs, checkpoint, prefix + ".i", _iLayer, _config._iWidth, _config._iHeight);
+}
+
+bool EIlayer::writeWeights(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &name, const Weights2D &weights, int size) const {
+	std::vector<unsigned char> data(size * getWeightBytes(_weightPrecision));
+
+	cs.getQueue().enqueueReadBuffer(weights._weightsPrev, CL_TRUE, 0, data.size(), data.data());
+
+	return checkpoint.addSection(name, data.data(), data.size());
+}
+
+bool EIlayer::writeNeurons(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &prefix, const NeuronLayer &layer, int width, int height) const {
+	cl::size_t<3> zeroCoord;
+	zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+	cl::size_t<3> dims;
+	dims[0] = width;
+	dims[1] = height;
+	dims[2] = 1;
+
+	cl::size_t<3> batchDims = dims;
+	batchDims[1] = height * _config._batchSize;
+
+	std::vector<float> thresholds(width * height);
+
+	cs.getQueue().enqueueReadImage(layer._thresholdsPrev, CL_TRUE, zeroCoord, dims, 0, 0, thresholds.data());
+
+	// State averages of every batch item, the third channel of packed states
+	std::vector<float> stateAverages(width * height * _config._batchSize);
+
+	if (_config._packedStates) {
+		std::vector<float> states(stateAverages.size() * 4);
+
+		cs.getQueue().enqueueReadImage(layer._statesPrev, CL_TRUE, zeroCoord, batchDims, 0, 0, states.data());
+
+		for (int i = 0; i < static_cast<int>(stateAverages.size()); i++)
+			stateAverages[i] = states[i * 4 + 2];
+	}
+	else
+		cs.getQueue().enqueueReadImage(layer._stateAveragesPrev, CL_TRUE, zeroCoord, batchDims, 0, 0, stateAverages.data());
+
+	return checkpoint.addSection(prefix + "Thresholds", thresholds.data(), thresholds.size() * sizeof(float))
+		&& checkpoint.addSection(prefix + "StateAverages", stateAverages.data(), stateAverages.size() * sizeof(float));
+}
+
+bool EIlayer::createFromCheckpoint(Checkpoint &checkpoint, const std::string &prefix, bool wrapHostMemory,
+	sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &eilKernels)
+{
+	const cl_int* ints = static_cast<const cl_int*>(checkpoint.getSection(prefix + ".config", checkpointConfigInts * sizeof(cl_int)));
+
+	if (ints == nullptr || ints[14] < 1 || ints[16] < _float || ints[16] > _unorm8)
+		return false;
+
+	Configuration config;
+
+	config._eFeedForwardWidth = ints[0];
+	config._eFeedForwardHeight = ints[1];
+	config._eWidth = ints[2];
+	config._eHeight = ints[3];
+	config._iWidth = ints[4];
+	config._iHeight = ints[5];
+	config._iFeedBackWidth = ints[6];
+	config._iFeedBackHeight = ints[7];
+	config._eFeedForwardRadius = ints[8];
+	config._eFeedBackRadius = ints[9];
+	config._iFeedForwardRadius = ints[10];
+	config._iLateralRadius = ints[11];
+	config._iFeedBackRadius = ints[12];
+	config._packedStates = ints[13] != 0;
+	config._batchSize = ints[14];
+	config._feedBackInput = ints[15] != 0;
+	config._inPlaceWeights = ints[19] != 0;
+
+	// Thresholds and state averages are overwritten below
+	create(config, 0.0f, 0.0f, 0.0f, 0.0f, cs, eilKernels, static_cast<WeightPrecision>(ints[16]));
+
+	_roundingSeed.x = ints[17];
+	_roundingSeed.y = ints[18];
+
+	int eSize = _config._eWidth * _config._eHeight;
+	int iSize = _config._iWidth * _config._iHeight;
+
+	int eFeedForwardSize = getWeightsSize(_config._eFeedForwardRadius, _config._eFeedForwardWidth, _config._eFeedForwardHeight, eSize);
+	int eFeedBackSize = getWeightsSize(_config._eFeedBackRadius, _config._iWidth, _config._iHeight, eSize);
+	int iFeedForwardSize = getWeightsSize(_config._iFeedForwardRadius, _config._eWidth, _config._eHeight, iSize);
+	int iLateralSize = getWeightsSize(_config._iLateralRadius, _config._iWidth, _config._iHeight, iSize);
+	int iFeedBackSize = getWeightsSize(_config._iFeedBackRadius, _config._iFeedBackWidth, _config._iFeedBackHeight, iSize);
+
+	bool loaded = loadWeights(cs, checkpoint, prefix + ".eFeedForwardWeights", _eFeedForwardWeights, eFeedForwardSize, wrapHostMemory)
+		&& loadWeights(cs, checkpoint, prefix + ".eFeedBackWeights", _eFeedBackWeights, eFeedBackSize, wrapHostMemory)
+		&& loadWeights(cs, checkpoint, prefix + ".iFeedForwardWeights", _iFeedForwardWeights, iFeedForwardSize, wrapHostMemory)
+		&& loadWeights(cs, checkpoint, prefix + ".iLateralWeights", _iLateralWeights, iLateralSize, wrapHostMemory)
+		&& loadWeights(cs, checkpoint, prefix + ".iFeedBackWeights", _iFeedBackWeights, iFeedBackSize, wrapHostMemory)
+		&& loadNeurons(cs, checkpoint, prefix + ".e", _eLayer, _config._eWidth, _config._eHeight)
+		&& loadNeurons(cs, checkpoint, prefix + ".i", _iLayer, _config._iWidth, _config._iHeight);
+
+	if (!loaded)
+		return false;
+
+	finishCreate(cs);
+
+	return true;
+}
+
+bool EIlayer::loadWeights(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &name, Weights2D &weights, int size, bool wrapHostMemory) {
+	int bytes = size * getWeightBytes(_weightPrecision);
+
+	void* data = checkpoint.getSection(name, bytes);
+
+	if (data == nullptr)
+		return false;
+
+	createWeights(cs, weights, size, wrapHostMemory ? data : nullptr);
+
+	if (!wrapHostMemory)
+		cs.getQueue().enqueueWriteBuffer(weights._weightsPrev, CL_TRUE, 0, bytes, data);
+
+	if (!_config._inPlaceWeights)
+		cs.getQueue().enqueueCopyBuffer(weights._weightsPrev, weights._weights, 0, 0, bytes);
+
+	return true;
+}
+
+bool EIlayer::loadNeurons(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &prefix, NeuronLayer &layer, int width, int height) {
+	int size = width * height;
+	int batchedSize = size * _config._batchSize;
+
+	const float* thresholds = static_cast<const float*>(checkpoint.getSection(prefix + "Thresholds", size * sizeof(float)));
+	const float* stateAverages = static_cast<const float*>(checkpoint.getSection(prefix + "StateAverages", batchedSize * sizeof(float)));
+
+	if (thresholds == nullptr || stateAverages == nullptr)
+		return false;
+
+	cl::size_t<3> zeroCoord;
+	zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+	cl::size_t<3> dims;
+	dims[0] = width;
+	dims[1] = height;
+	dims[2] = 1;
+
+	cl::size_t<3> batchDims = dims;
+	batchDims[1] = height * _config._batchSize;
+
+	cs.getQueue().enqueueWriteImage(layer._thresholds, CL_TRUE, zeroCoord, dims, 0, 0, thresholds);
+	cs.getQueue().enqueueWriteImage(layer._thresholdsPrev, CL_TRUE, zeroCoord, dims, 0, 0, thresholds);
+
+	// Packed states start cleared apart from the averages
+	if (_config._packedStates) {
+		std::vector<float> states(batchedSize * 4, 0.0f);
+
+		for (int i = 0; i < batchedSize; i++)
+			states[i * 4 + 2] = stateAverages[i];
+
+		cs.getQueue().enqueueWriteImage(layer._states, CL_TRUE, zeroCoord, batchDims, 0, 0, states.data());
+		cs.getQueue().enqueueWriteImage(layer._statesPrev, CL_TRUE, zeroCoord, batchDims, 0, 0, states.data());
+	}
+	else {
+		cs.getQueue().enqueueWriteImage(layer._stateAverages, CL_TRUE, zeroCoord, batchDims, 0, 0, stateAverages);
+		cs.getQueue().enqueueWriteImage(layer._stateAveragesPrev, CL_TRUE, zeroCoord, batchDims, 0, 0, stateAverages);
+	}
+
+	return true;
+}
+
+void EIlayer::initializeWeights(sys::ComputeSystem &cs, Weights2D &weights, int radius, bool lateral, int width, int height, int inputWidth, int inputHeight,
+	float minInitWeight, float maxInitWeight, cl_uint2 seed, InitializationStream stream)
+{
+	Kernels &kernels = _parityKernels[_parity];
+
+	cl_int2 inputDims = { inputWidth, inputHeight };
+	cl_float2 dimsToInputDims = { static_cast<float>(inputWidth + 1) / static_cast<float>(width + 1), static_cast<float>(inputHeight + 1) / static_cast<float>(height + 1) };
+
+	int windowSize = std::min(radius * 2 + 1, inputWidth) * std::min(radius * 2 + 1, inputHeight);
+
 	int index = 0;
 
-	std::uniform_int_distribution<int> seedDist(0, 10000);
+	kernels._initializeWeightsKernel.setArg(index++, weights._weightsPrev);
+	kernels._initializeWeightsKernel.setArg(index++, weights._weights);
+	kernels._initializeWeightsKernel.setArg(index++, _config._inPlaceWeights ? 0 : 1);
+	kernels._initializeWeightsKernel.setArg(index++, inputDims);
+	kernels._initializeWeightsKernel.setArg(index++, dimsToInputDims);
+	kernels._initializeWeightsKernel.setArg(index++, radius);
+	kernels._initializeWeightsKernel.setArg(index++, lateral ? 1 : 0);
+	kernels._initializeWeightsKernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
+	kernels._initializeWeightsKernel.setArg(index++, minInitWeight);
+	kernels._initializeWeightsKernel.setArg(index++, maxInitWeight);
+	kernels._initializeWeightsKernel.setArg(index++, seed);
+	kernels._initializeWeightsKernel.setArg(index++, static_cast<cl_uint>(stream));
+
+	// One work item per weight slot, chunks of 4 included
+	cs.getQueue().enqueueNDRangeKernel(kernels._initializeWeightsKernel, cl::NullRange, cl::NDRange(width * 4, height, (windowSize + 3) / 4), cl::NullRange, nullptr, cs.profile("initializeWeights"));
+}
+
+void EIlayer::initializeMasks(sys::ComputeSystem &cs, Weights2D &weights, int radius, bool lateral, int width, int height, int inputWidth, int inputHeight) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	cl_int2 inputDims = { inputWidth, inputHeight };
+	cl_float2 dimsToInputDims = { static_cast<float>(inputWidth + 1) / static_cast<float>(width + 1), static_cast<float>(inputHeight + 1) / static_cast<float>(height + 1) };
 
-	// Weight RNG seed
-	cl_uint2 seedE = { seedDist(generator), seedDist(generator) };
-	cl_uint2 seedI = { seedDist(generator), seedDist(generator) };
+	int index = 0;
 
-	// Initialize weights
-	_kernels->_eInitializeKernel.setArg(index++, _eFeedForwardWeights._weightsPrev);
-	_kernels->_eInitializeKernel.setArg(index++, _eFeedBackWeights._weightsPrev);
-	_kernels->_eInitializeKernel.setArg(index++, eFeedForwardSize);
-	_kernels->_eInitializeKernel.setArg(index++, eFeedBackSize);
-	_kernels->_eInitializeKernel.setArg(index++, minInitEWeight);
-	_kernels->_eInitializeKernel.setArg(index++, maxInitEWeight);
-	_kernels->_eInitializeKernel.setArg(index++, minInitIWeight);
-	_kernels->_eInitializeKernel.setArg(index++, maxInitIWeight);
-	_kernels->_eInitializeKernel.setArg(index++, seedE);
+	kernels._initializeMasksKernel.setArg(index++, weights._weightsPrev);
+	kernels._initializeMasksKernel.setArg(index++, weights._masksPrev);
+	kernels._initializeMasksKernel.setArg(index++, inputDims);
+	kernels._initializeMasksKernel.setArg(index++, dimsToInputDims);
+	kernels._initializeMasksKernel.setArg(index++, radius);
+	kernels._initializeMasksKernel.setArg(index++, lateral ? 1 : 0);
+	kernels._initializeMasksKernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
 
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_eInitializeKernel, cl::NullRange, cl::NDRange(_config._eWidth, _config._eHeight));
+	cs.getQueue().enqueueNDRangeKernel(kernels._initializeMasksKernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange, nullptr, cs.profile("initializeMasks"));
 
-	cl::size_t<3> eFeedForwardWeightsDimsCoord;
-	eFeedForwardWeightsDimsCoord[0] = _config._eWidth;
-	eFeedForwardWeightsDimsCoord[1] = _config._eHeight;
-	eFeedForwardWeightsDimsCoord[2] = eFeedForwardSize;
+	if (!_config._inPlaceWeights)
+		cs.getQueue().enqueueCopyBuffer(weights._masksPrev, weights._masks, 0, 0, width * height * getMaskSize(radius) * sizeof(cl_uint));
+}
 
-	cl::size_t<3> eFeedBackWeightsDimsCoord;
-	eFeedBackWeightsDimsCoord[0] = _config._eWidth;
-	eFeedBackWeightsDimsCoord[1] = _config._eHeight;
-	eFeedBackWeightsDimsCoord[2] = eFeedBackSize;
+void EIlayer::packStates(sys::ComputeSystem &cs, const cl::Image2D &states, const cl::Buffer &stateBits, int width, int height) {
+	Kernels &kernels = _parityKernels[_parity];
 
-	cs.getQueue().enqueueCopyImage(_eFeedForwardWeights._weightsPrev, _eFeedForwardWeights._weights, zeroCoord, zeroCoord, eFeedForwardWeightsDimsCoord);
-	cs.getQueue().enqueueCopyImage(_eFeedBackWeights._weightsPrev, _eFeedBackWeights._weights, zeroCoord, zeroCoord, eFeedBackWeightsDimsCoord);
+	cl_int2 dims = { width, height };
 
-	index = 0;
+	int index = 0;
 
-	// Initialize weights
-	_kernels->_iInitializeKernel.setArg(index++, _iFeedForwardWeights._weightsPrev);
-	_kernels->_iInitializeKernel.setArg(index++, _iFeedBackWeights._weightsPrev);
-	_kernels->_iInitializeKernel.setArg(index++, _iLateralWeights._weightsPrev);
-	_kernels->_iInitializeKernel.setArg(index++, iFeedForwardSize);
-	_kernels->_iInitializeKernel.setArg(index++, iLateralSize);
-	_kernels->_iInitializeKernel.setArg(index++, iFeedBackSize);
-	_kernels->_iInitializeKernel.setArg(index++, minInitEWeight);
-	_kernels->_iInitializeKernel.setArg(index++, maxInitEWeight);
-	_kernels->_iInitializeKernel.setArg(index++, minInitIWeight);
-	_kernels->_iInitializeKernel.setArg(index++, maxInitIWeight);
-	_kernels->_iInitializeKernel.setArg(index++, seedI);
-
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_iInitializeKernel, cl::NullRange, cl::NDRange(_config._iWidth, _config._iHeight));
-
-	cl::size_t<3> iFeedForwardWeightsDimsCoord;
-	iFeedForwardWeightsDimsCoord[0] = _config._iWidth;
-	iFeedForwardWeightsDimsCoord[1] = _config._iHeight;
-	iFeedForwardWeightsDimsCoord[2] = iFeedForwardSize;
-
-	cl::size_t<3> iFeedBackWeightsDimsCoord;
-	iFeedBackWeightsDimsCoord[0] = _config._iWidth;
-	iFeedBackWeightsDimsCoord[1] = _config._iHeight;
-	iFeedBackWeightsDimsCoord[2] = iFeedBackSize;
-
-	cl::size_t<3> iLateralWeightsDimsCoord;
-	iLateralWeightsDimsCoord[0] = _config._iWidth;
-	iLateralWeightsDimsCoord[1] = _config._iHeight;
-	iLateralWeightsDimsCoord[2] = iLateralSize;
-
-	cs.getQueue().enqueueCopyImage(_iFeedForwardWeights._weightsPrev, _iFeedForwardWeights._weights, zeroCoord, zeroCoord, iFeedForwardWeightsDimsCoord);
-	cs.getQueue().enqueueCopyImage(_iFeedBackWeights._weightsPrev, _iFeedBackWeights._weights, zeroCoord, zeroCoord, iFeedBackWeightsDimsCoord);
-	cs.getQueue().enqueueCopyImage(_iLateralWeights._weightsPrev, _iLateralWeights._weights, zeroCoord, zeroCoord, iLateralWeightsDimsCoord);
+	kernels._packStatesKernel.setArg(index++, states);
+	kernels._packStatesKernel.setArg(index++, stateBits);
+	kernels._packStatesKernel.setArg(index++, dims);
+
+	cs.getQueue().enqueueNDRangeKernel(kernels._packStatesKernel, cl::NullRange, cl::NDRange(width, (height + 31) / 32), cl::NullRange, nullptr, cs.profile("packStates"));
 }
 
-void EIlayer::eActivate(sys::ComputeSystem &cs, const cl::Image2D &feedForwardInputs, float eta, float shDecay, float saDecay) {
-	cl_int2 eFeedForwardDims = { _config._eFeedForwardWidth, _config._eFeedForwardHeight };
+void EIlayer::buildConnections(sys::ComputeSystem &cs, Weights2D &weights, int radius, int width, int height) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	int index = 0;
+
+	kernels._buildConnectionsKernel.setArg(index++, weights._masksPrev);
+	kernels._buildConnectionsKernel.setArg(index++, weights._connections);
+	kernels._buildConnectionsKernel.setArg(index++, weights._connectionCounts);
+	kernels._buildConnectionsKernel.setArg(index++, radius);
+
+	cs.enqueueKernel(kernels._buildConnectionsKernel, cl::NDRange(width, height), cl::NullRange,
+		{ weights._masksPrev }, { weights._connections, weights._connectionCounts }, "buildConnections");
+}
+
+void EIlayer::bindKernels(Kernels &kernels) {
+	// Per call arguments (inputs and rates) come first in the kernel signatures, bind everything after them
+	// Common
 	cl_int2 eDims = { _config._eWidth, _config._eHeight };
 	cl_int2 iDims = { _config._iWidth, _config._iHeight };
+
+	// Excitatory
+	cl_int2 eFeedForwardDims = { _config._eFeedForwardWidth, _config._eFeedForwardHeight };
 	cl_float2 eDimsToEFeedForwardDims = { static_cast<float>(eFeedForwardDims.x + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(eFeedForwardDims.y + 1) / static_cast<float>(eDims.y + 1) };
 	cl_float2 eDimsToIDims = { static_cast<float>(iDims.x + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(iDims.y + 1) / static_cast<float>(eDims.y + 1) };
 
-	int index = 0;
+	// Inhibitory
+	cl_int2 iFeedBackDims = { _config._iFeedBackWidth, _config._iFeedBackHeight };
+	cl_float2 iDimsToEDims = { static_cast<float>(eDims.x + 1) / static_cast<float>(iDims.x + 1), static_cast<float>(eDims.y + 1) / static_cast<float>(iDims.y + 1) };
+	cl_float2 iDimsToFeedBackDims = { static_cast<float>(iFeedBackDims.x + 1) / static_cast<float>(iDims.x + 1), static_cast<float>(iFeedBackDims.y + 1) / static_cast<float>(iDims.y + 1) };
 
-	_kernels->_eActivationKernel.setArg(index++, feedForwardInputs);
-	_kernels->_eActivationKernel.setArg(index++, _iLayer._statesPrev);
-	_kernels->_eActivationKernel.setArg(index++, _eFeedForwardWeights._weightsPrev);
-	_kernels->_eActivationKernel.setArg(index++, _eFeedBackWeights._weightsPrev);
-	_kernels->_eActivationKernel.setArg(index++, _eLayer._thresholdsPrev);
-	_kernels->_eActivationKernel.setArg(index++, _eLayer._activationsPrev);
-	_kernels->_eActivationKernel.setArg(index++, _eLayer._statesPrev);
-	_kernels->_eActivationKernel.setArg(index++, _eLayer._statesHistoryPrev);
-	_kernels->_eActivationKernel.setArg(index++, _eLayer._stateAveragesPrev);
-	_kernels->_eActivationKernel.setArg(index++, _eLayer._activations);
-	_kernels->_eActivationKernel.setArg(index++, _eLayer._states);
-	_kernels->_eActivationKernel.setArg(index++, _eLayer._statesHistory);
-	_kernels->_eActivationKernel.setArg(index++, _eLayer._stateAverages);
-
-	_kernels->_eActivationKernel.setArg(index++, eFeedForwardDims);
-	_kernels->_eActivationKernel.setArg(index++, eDims);
-	_kernels->_eActivationKernel.setArg(index++, iDims);
-	_kernels->_eActivationKernel.setArg(index++, eDimsToEFeedForwardDims);
-	_kernels->_eActivationKernel.setArg(index++, eDimsToIDims);
-	_kernels->_eActivationKernel.setArg(index++, _config._eFeedForwardRadius);
-	_kernels->_eActivationKernel.setArg(index++, _config._eFeedBackRadius);
-	_kernels->_eActivationKernel.setArg(index++, eta);
-	_kernels->_eActivationKernel.setArg(index++, shDecay);
-	_kernels->_eActivationKernel.setArg(index++, saDecay);
-
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_eActivationKernel, cl::NullRange, cl::NDRange(_config._eWidth, _config._eHeight));
+	// Activation - excitatory, the tiled variant takes the same arguments followed by its tiles.
+	// The packed variants take one previous and one current state image instead of the four pairs
+	for (int ki = 0; ki < 2; ki++) {
+		cl::Kernel &kernel = getEActivationKernel(kernels, ki == 1);
+
+		if (ki == 1 && _tileSize == 0)
+			break;
+
+		int index = 4;
+
+		kernel.setArg(index++, _iLayer._statesPrev);
+		kernel.setArg(index++, _eFeedForwardWeights._weightsPrev);
+		kernel.setArg(index++, _eFeedBackWeights._weightsPrev);
+		kernel.setArg(index++, _eLayer._thresholdsPrev);
+
+		if (_config._packedStates) {
+			kernel.setArg(index++, _eLayer._statesPrev);
+			kernel.setArg(index++, _eLayer._states);
+		}
+		else {
+			kernel.setArg(index++, _eLayer._activationsPrev);
+			kernel.setArg(index++, _eLayer._statesPrev);
+			kernel.setArg(index++, _eLayer._statesHistoryPrev);
+			kernel.setArg(index++, _eLayer._stateAveragesPrev);
+			kernel.setArg(index++, _eLayer._activations);
+			kernel.setArg(index++, _eLayer._states);
+			kernel.setArg(index++, _eLayer._statesHistory);
+			kernel.setArg(index++, _eLayer._stateAverages);
+		}
+
+		kernel.setArg(index++, eFeedForwardDims);
+		kernel.setArg(index++, eDims);
+		kernel.setArg(index++, iDims);
+		kernel.setArg(index++, eDimsToEFeedForwardDims);
+		kernel.setArg(index++, eDimsToIDims);
+		kernel.setArg(index++, _config._eFeedForwardRadius);
+		kernel.setArg(index++, _config._eFeedBackRadius);
+		kernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
+
+		if (ki == 1) {
+			kernel.setArg(index++, cl::Local(_feedForwardTileDims.x * _feedForwardTileDims.y * sizeof(cl_float)));
+			kernel.setArg(index++, cl::Local(_feedBackTileDims.x * _feedBackTileDims.y * sizeof(cl_float)));
+			kernel.setArg(index++, _feedForwardTileDims);
+			kernel.setArg(index++, _feedBackTileDims);
+		}
+	}
+
+	// Activation - inhibitory
+	{
+		cl::Kernel &kernel = _config._packedStates ? kernels._iActivationPackedKernel : kernels._iActivationKernel;
+
+		int index = 4;
+
+		kernel.setArg(index++, _eLayer._statesPrev);
+		kernel.setArg(index++, _iFeedForwardWeights._weightsPrev);
+		kernel.setArg(index++, _iLateralWeights._weightsPrev);
+		kernel.setArg(index++, _iFeedBackWeights._weightsPrev);
+		kernel.setArg(index++, _iLayer._thresholdsPrev);
+
+		if (_config._packedStates) {
+			kernel.setArg(index++, _iLayer._statesPrev);
+			kernel.setArg(index++, _iLayer._states);
+		}
+		else {
+			kernel.setArg(index++, _iLayer._activationsPrev);
+			kernel.setArg(index++, _iLayer._statesPrev);
+			kernel.setArg(index++, _iLayer._statesHistoryPrev);
+			kernel.setArg(index++, _iLayer._stateAveragesPrev);
+			kernel.setArg(index++, _iLayer._activations);
+			kernel.setArg(index++, _iLayer._states);
+			kernel.setArg(index++, _iLayer._statesHistory);
+			kernel.setArg(index++, _iLayer._stateAverages);
+		}
+
+		kernel.setArg(index++, eDims);
+		kernel.setArg(index++, iDims);
+		kernel.setArg(index++, iFeedBackDims);
+		kernel.setArg(index++, iDimsToEDims);
+		kernel.setArg(index++, iDimsToFeedBackDims);
+		kernel.setArg(index++, _config._iFeedForwardRadius);
+		kernel.setArg(index++, _config._iLateralRadius);
+		kernel.setArg(index++, _config._iFeedBackRadius);
+		kernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
+	}
+
+	// Binary activation - excitatory
+	{
+		int index = 4;
+
+		kernels._eActivationBinaryKernel.setArg(index++, _iLayer._stateBitsPrev);
+		kernels._eActivationBinaryKernel.setArg(index++, _eFeedForwardWeights._masksPrev);
+		kernels._eActivationBinaryKernel.setArg(index++, _eFeedBackWeights._masksPrev);
+		kernels._eActivationBinaryKernel.setArg(index++, _eLayer._thresholdsPrev);
+		kernels._eActivationBinaryKernel.setArg(index++, _eLayer._activationsPrev);
+		kernels._eActivationBinaryKernel.setArg(index++, _eLayer._statesHistoryPrev);
+		kernels._eActivationBinaryKernel.setArg(index++, _eLayer._stateAveragesPrev);
+		kernels._eActivationBinaryKernel.setArg(index++, _eLayer._activations);
+		kernels._eActivationBinaryKernel.setArg(index++, _eLayer._states);
+		kernels._eActivationBinaryKernel.setArg(index++, _eLayer._statesHistory);
+		kernels._eActivationBinaryKernel.setArg(index++, _eLayer._stateAverages);
+
+		kernels._eActivationBinaryKernel.setArg(index++, eFeedForwardDims);
+		kernels._eActivationBinaryKernel.setArg(index++, eDims);
+		kernels._eActivationBinaryKernel.setArg(index++, iDims);
+		kernels._eActivationBinaryKernel.setArg(index++, eDimsToEFeedForwardDims);
+		kernels._eActivationBinaryKernel.setArg(index++, eDimsToIDims);
+		kernels._eActivationBinaryKernel.setArg(index++, _config._eFeedForwardRadius);
+		kernels._eActivationBinaryKernel.setArg(index++, _config._eFeedBackRadius);
+	}
+
+	// Binary activation - inhibitory
+	{
+		int index = 4;
+
+		kernels._iActivationBinaryKernel.setArg(index++, _eLayer._stateBitsPrev);
+		kernels._iActivationBinaryKernel.setArg(index++, _iFeedForwardWeights._masksPrev);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLateralWeights._masksPrev);
+		kernels._iActivationBinaryKernel.setArg(index++, _iFeedBackWeights._masksPrev);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLayer._thresholdsPrev);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLayer._activationsPrev);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLayer._stateBitsPrev);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLayer._statesHistoryPrev);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLayer._stateAveragesPrev);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLayer._activations);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLayer._states);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLayer._statesHistory);
+		kernels._iActivationBinaryKernel.setArg(index++, _iLayer._stateAverages);
+
+		kernels._iActivationBinaryKernel.setArg(index++, eDims);
+		kernels._iActivationBinaryKernel.setArg(index++, iDims);
+		kernels._iActivationBinaryKernel.setArg(index++, iFeedBackDims);
+		kernels._iActivationBinaryKernel.setArg(index++, iDimsToEDims);
+		kernels._iActivationBinaryKernel.setArg(index++, iDimsToFeedBackDims);
+		kernels._iActivationBinaryKernel.setArg(index++, _config._iFeedForwardRadius);
+		kernels._iActivationBinaryKernel.setArg(index++, _config._iLateralRadius);
+		kernels._iActivationBinaryKernel.setArg(index++, _config._iFeedBackRadius);
+	}
+
+	// Learn - excitatory, the tiled variant takes the same arguments followed by its tiles, the batch variant by the batch size
+	for (int ki = 0; ki < 3; ki++) {
+		cl::Kernel &kernel = ki == 0 ? kernels._eLearnKernel : (ki == 1 ? kernels._eLearnTiledKernel : kernels._eLearnBatchKernel);
+
+		if (ki == 1 && _tileSize == 0)
+			continue;
+
+		int index = 7;
+
+		kernel.setArg(index++, _eLayer._states);
+		kernel.setArg(index++, _eLayer._statesHistoryPrev);
+		kernel.setArg(index++, _eLayer._statesHistory);
+		kernel.setArg(index++, _iLayer._statesHistoryPrev);
+		kernel.setArg(index++, _iLayer._statesHistory);
+		kernel.setArg(index++, _eLayer._stateAveragesPrev);
+		kernel.setArg(index++, _eFeedForwardWeights._weightsPrev);
+		kernel.setArg(index++, _eFeedBackWeights._weightsPrev);
+		kernel.setArg(index++, _eLayer._thresholdsPrev);
+		kernel.setArg(index++, _eFeedForwardWeights._weights);
+		kernel.setArg(index++, _eFeedBackWeights._weights);
+		kernel.setArg(index++, _eLayer._thresholds);
+		kernel.setArg(index++, _eFeedForwardWeights._masks);
+		kernel.setArg(index++, _eFeedBackWeights._masks);
+
+		kernel.setArg(index++, eFeedForwardDims);
+		kernel.setArg(index++, eDims);
+		kernel.setArg(index++, iDims);
+		kernel.setArg(index++, eDimsToEFeedForwardDims);
+		kernel.setArg(index++, eDimsToIDims);
+		kernel.setArg(index++, _config._eFeedForwardRadius);
+		kernel.setArg(index++, _config._eFeedBackRadius);
+		kernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
+
+		if (ki == 1) {
+			kernel.setArg(index++, cl::Local(_feedForwardTileDims.x * _feedForwardTileDims.y * sizeof(cl_float)));
+			kernel.setArg(index++, cl::Local(_feedBackTileDims.x * _feedBackTileDims.y * sizeof(cl_float)));
+			kernel.setArg(index++, _feedForwardTileDims);
+			kernel.setArg(index++, _feedBackTileDims);
+		}
+
+		if (ki == 2)
+			kernel.setArg(index++, _config._batchSize);
+	}
+
+	// Learn - inhibitory, the batch variant takes the same arguments followed by the batch size
+	for (int ki = 0; ki < 2; ki++) {
+		cl::Kernel &kernel = ki == 0 ? kernels._iLearnKernel : kernels._iLearnBatchKernel;
+
+		int index = 8;
+
+		kernel.setArg(index++, _iLayer._states);
+		kernel.setArg(index++, _eLayer._statesHistoryPrev);
+		kernel.setArg(index++, _eLayer._statesHistory);
+		kernel.setArg(index++, _iLayer._statesHistoryPrev);
+		kernel.setArg(index++, _iLayer._statesHistory);
+		kernel.setArg(index++, _iLayer._stateAveragesPrev);
+		kernel.setArg(index++, _iFeedForwardWeights._weightsPrev);
+		kernel.setArg(index++, _iLateralWeights._weightsPrev);
+		kernel.setArg(index++, _iFeedBackWeights._weightsPrev);
+		kernel.setArg(index++, _iLayer._thresholdsPrev);
+		kernel.setArg(index++, _iFeedForwardWeights._weights);
+		kernel.setArg(index++, _iLateralWeights._weights);
+		kernel.setArg(index++, _iFeedBackWeights._weights);
+		kernel.setArg(index++, _iLayer._thresholds);
+		kernel.setArg(index++, _iFeedForwardWeights._masks);
+		kernel.setArg(index++, _iLateralWeights._masks);
+		kernel.setArg(index++, _iFeedBackWeights._masks);
+
+		kernel.setArg(index++, eDims);
+		kernel.setArg(index++, iDims);
+		kernel.setArg(index++, iFeedBackDims);
+		kernel.setArg(index++, iDimsToEDims);
+		kernel.setArg(index++, iDimsToFeedBackDims);
+		kernel.setArg(index++, _config._iFeedForwardRadius);
+		kernel.setArg(index++, _config._iLateralRadius);
+		kernel.setArg(index++, _config._iFeedBackRadius);
+		kernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
+
+		if (ki == 1)
+			kernel.setArg(index++, _config._batchSize);
+	}
+
+	// Activity gated learning - excitatory, connections from silent inputs are only skipped when there is no second buffer to keep current
+	{
+		int index = 6;
+
+		kernels._eLearnActiveKernel.setArg(index++, _eLayer._learners._spikes);
+		kernels._eLearnActiveKernel.setArg(index++, _eLayer._learners._count);
+		kernels._eLearnActiveKernel.setArg(index++, _eLayer._statesHistory);
+		kernels._eLearnActiveKernel.setArg(index++, _iLayer._statesHistoryPrev);
+		kernels._eLearnActiveKernel.setArg(index++, _eLayer._stateAveragesPrev);
+		kernels._eLearnActiveKernel.setArg(index++, _eFeedForwardWeights._weightsPrev);
+		kernels._eLearnActiveKernel.setArg(index++, _eFeedBackWeights._weightsPrev);
+		kernels._eLearnActiveKernel.setArg(index++, _eFeedForwardWeights._weights);
+		kernels._eLearnActiveKernel.setArg(index++, _eFeedBackWeights._weights);
+		kernels._eLearnActiveKernel.setArg(index++, _eFeedForwardWeights._masks);
+		kernels._eLearnActiveKernel.setArg(index++, _eFeedBackWeights._masks);
+
+		kernels._eLearnActiveKernel.setArg(index++, eFeedForwardDims);
+		kernels._eLearnActiveKernel.setArg(index++, eDims);
+		kernels._eLearnActiveKernel.setArg(index++, iDims);
+		kernels._eLearnActiveKernel.setArg(index++, eDimsToEFeedForwardDims);
+		kernels._eLearnActiveKernel.setArg(index++, eDimsToIDims);
+		kernels._eLearnActiveKernel.setArg(index++, _config._eFeedForwardRadius);
+		kernels._eLearnActiveKernel.setArg(index++, _config._eFeedBackRadius);
+		kernels._eLearnActiveKernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
+		kernels._eLearnActiveKernel.setArg(index++, _config._inPlaceWeights ? 1 : 0);
+	}
+
+	// Activity gated learning - inhibitory
+	{
+		int index = 7;
+
+		kernels._iLearnActiveKernel.setArg(index++, _iLayer._learners._spikes);
+		kernels._iLearnActiveKernel.setArg(index++, _iLayer._learners._count);
+		kernels._iLearnActiveKernel.setArg(index++, _eLayer._statesHistory);
+		kernels._iLearnActiveKernel.setArg(index++, _iLayer._statesHistoryPrev);
+		kernels._iLearnActiveKernel.setArg(index++, _iLayer._statesHistory);
+		kernels._iLearnActiveKernel.setArg(index++, _iLayer._stateAveragesPrev);
+		kernels._iLearnActiveKernel.setArg(index++, _iFeedForwardWeights._weightsPrev);
+		kernels._iLearnActiveKernel.setArg(index++, _iLateralWeights._weightsPrev);
+		kernels._iLearnActiveKernel.setArg(index++, _iFeedBackWeights._weightsPrev);
+		kernels._iLearnActiveKernel.setArg(index++, _iFeedForwardWeights._weights);
+		kernels._iLearnActiveKernel.setArg(index++, _iLateralWeights._weights);
+		kernels._iLearnActiveKernel.setArg(index++, _iFeedBackWeights._weights);
+		kernels._iLearnActiveKernel.setArg(index++, _iFeedForwardWeights._masks);
+		kernels._iLearnActiveKernel.setArg(index++, _iLateralWeights._masks);
+		kernels._iLearnActiveKernel.setArg(index++, _iFeedBackWeights._masks);
+
+		kernels._iLearnActiveKernel.setArg(index++, eDims);
+		kernels._iLearnActiveKernel.setArg(index++, iDims);
+		kernels._iLearnActiveKernel.setArg(index++, iFeedBackDims);
+		kernels._iLearnActiveKernel.setArg(index++, iDimsToEDims);
+		kernels._iLearnActiveKernel.setArg(index++, iDimsToFeedBackDims);
+		kernels._iLearnActiveKernel.setArg(index++, _config._iFeedForwardRadius);
+		kernels._iLearnActiveKernel.setArg(index++, _config._iLateralRadius);
+		kernels._iLearnActiveKernel.setArg(index++, _config._iFeedBackRadius);
+		kernels._iLearnActiveKernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
+		kernels._iLearnActiveKernel.setArg(index++, _config._inPlaceWeights ? 1 : 0);
+	}
 }
 
-void EIlayer::iActivate(sys::ComputeSystem &cs, const cl::Image2D &feedBackInputs, float eta, float shDecay, float saDecay) {
+void EIlayer::bindSparseKernels(Kernels &kernels) {
 	cl_int2 eDims = { _config._eWidth, _config._eHeight };
 	cl_int2 iDims = { _config._iWidth, _config._iHeight };
+
+	cl_int2 eFeedForwardDims = { _config._eFeedForwardWidth, _config._eFeedForwardHeight };
+	cl_float2 eDimsToEFeedForwardDims = { static_cast<float>(eFeedForwardDims.x + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(eFeedForwardDims.y + 1) / static_cast<float>(eDims.y + 1) };
+	cl_float2 eDimsToIDims = { static_cast<float>(iDims.x + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(iDims.y + 1) / static_cast<float>(eDims.y + 1) };
+
 	cl_int2 iFeedBackDims = { _config._iFeedBackWidth, _config._iFeedBackHeight };
 	cl_float2 iDimsToEDims = { static_cast<float>(eDims.x + 1) / static_cast<float>(iDims.x + 1), static_cast<float>(eDims.y + 1) / static_cast<float>(iDims.y + 1) };
 	cl_float2 iDimsToFeedBackDims = { static_cast<float>(iFeedBackDims.x + 1) / static_cast<float>(iDims.x + 1), static_cast<float>(iFeedBackDims.y + 1) / static_cast<float>(iDims.y + 1) };
 
+	// Sparse activation - excitatory
+	{
+		int index = 4;
+
+		kernels._eActivationSparseKernel.setArg(index++, _iLayer._statesPrev);
+		kernels._eActivationSparseKernel.setArg(index++, _eFeedForwardWeights._connections);
+		kernels._eActivationSparseKernel.setArg(index++, _eFeedForwardWeights._connectionCounts);
+		kernels._eActivationSparseKernel.setArg(index++, _eFeedBackWeights._connections);
+		kernels._eActivationSparseKernel.setArg(index++, _eFeedBackWeights._connectionCounts);
+		kernels._eActivationSparseKernel.setArg(index++, _eLayer._thresholdsPrev);
+		kernels._eActivationSparseKernel.setArg(index++, _eLayer._activationsPrev);
+		kernels._eActivationSparseKernel.setArg(index++, _eLayer._statesHistoryPrev);
+		kernels._eActivationSparseKernel.setArg(index++, _eLayer._stateAveragesPrev);
+		kernels._eActivationSparseKernel.setArg(index++, _eLayer._activations);
+		kernels._eActivationSparseKernel.setArg(index++, _eLayer._states);
+		kernels._eActivationSparseKernel.setArg(index++, _eLayer._statesHistory);
+		kernels._eActivationSparseKernel.setArg(index++, _eLayer._stateAverages);
+
+		kernels._eActivationSparseKernel.setArg(index++, eFeedForwardDims);
+		kernels._eActivationSparseKernel.setArg(index++, eDims);
+		kernels._eActivationSparseKernel.setArg(index++, iDims);
+		kernels._eActivationSparseKernel.setArg(index++, eDimsToEFeedForwardDims);
+		kernels._eActivationSparseKernel.setArg(index++, eDimsToIDims);
+	}
+
+	// Sparse activation - inhibitory
+	{
+		int index = 4;
+
+		kernels._iActivationSparseKernel.setArg(index++, _eLayer._statesPrev);
+		kernels._iActivationSparseKernel.setArg(index++, _iFeedForwardWeights._connections);
+		kernels._iActivationSparseKernel.setArg(index++, _iFeedForwardWeights._connectionCounts);
+		kernels._iActivationSparseKernel.setArg(index++, _iLateralWeights._connections);
+		kernels._iActivationSparseKernel.setArg(index++, _iLateralWeights._connectionCounts);
+		kernels._iActivationSparseKernel.setArg(index++, _iFeedBackWeights._connections);
+		kernels._iActivationSparseKernel.setArg(index++, _iFeedBackWeights._connectionCounts);
+		kernels._iActivationSparseKernel.setArg(index++, _iLayer._thresholdsPrev);
+		kernels._iActivationSparseKernel.setArg(index++, _iLayer._activationsPrev);
+		kernels._iActivationSparseKernel.setArg(index++, _iLayer._statesPrev);
+		kernels._iActivationSparseKernel.setArg(index++, _iLayer._statesHistoryPrev);
+		kernels._iActivationSparseKernel.setArg(index++, _iLayer._stateAveragesPrev);
+		kernels._iActivationSparseKernel.setArg(index++, _iLayer._activations);
+		kernels._iActivationSparseKernel.setArg(index++, _iLayer._states);
+		kernels._iActivationSparseKernel.setArg(index++, _iLayer._statesHistory);
+		kernels._iActivationSparseKernel.setArg(index++, _iLayer._stateAverages);
+
+		kernels._iActivationSparseKernel.setArg(index++, eDims);
+		kernels._iActivationSparseKernel.setArg(index++, iDims);
+		kernels._iActivationSparseKernel.setArg(index++, iFeedBackDims);
+		kernels._iActivationSparseKernel.setArg(index++, iDimsToEDims);
+		kernels._iActivationSparseKernel.setArg(index++, iDimsToFeedBackDims);
+	}
+}
+
+void EIlayer::eActivate(sys::ComputeSystem &cs, const cl::Image2D &feedForwardInputs, float eta, float shDecay, float saDecay) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	if (_sparseActivation) {
+		// Everything else is bound once per buffer parity (bindSparseKernels)
+		int index = 0;
+
+		kernels._eActivationSparseKernel.setArg(index++, feedForwardInputs);
+		kernels._eActivationSparseKernel.setArg(index++, eta);
+		kernels._eActivationSparseKernel.setArg(index++, shDecay);
+		kernels._eActivationSparseKernel.setArg(index++, saDecay);
+
+		cs.enqueueKernel(kernels._eActivationSparseKernel, cl::NDRange(_config._eWidth, _config._eHeight, _config._batchSize), cl::NullRange,
+			{ feedForwardInputs, _iLayer._statesPrev, _eFeedForwardWeights._connections, _eFeedForwardWeights._connectionCounts, _eFeedBackWeights._connections, _eFeedBackWeights._connectionCounts,
+			_eLayer._thresholdsPrev, _eLayer._activationsPrev, _eLayer._statesHistoryPrev, _eLayer._stateAveragesPrev },
+			{ _eLayer._activations, _eLayer._states, _eLayer._statesHistory, _eLayer._stateAverages }, "eActivateSparse");
+
+		return;
+	}
+
+	cl::Kernel &kernel = getEActivationKernel(kernels, _tileSize > 0);
+
+	// Everything else is bound once per buffer parity (bindKernels)
 	int index = 0;
 
-	_kernels->_iActivationKernel.setArg(index++, feedBackInputs);
-	_kernels->_iActivationKernel.setArg(index++, _eLayer._statesPrev);
-	_kernels->_iActivationKernel.setArg(index++, _iFeedForwardWeights._weightsPrev);
-	_kernels->_iActivationKernel.setArg(index++, _iLateralWeights._weightsPrev);
-	_kernels->_iActivationKernel.setArg(index++, _iFeedBackWeights._weightsPrev);
-	_kernels->_iActivationKernel.setArg(index++, _iLayer._thresholdsPrev);
-	_kernels->_iActivationKernel.setArg(index++, _iLayer._activationsPrev);
-	_kernels->_iActivationKernel.setArg(index++, _iLayer._statesPrev);
-	_kernels->_iActivationKernel.setArg(index++, _iLayer._statesHistoryPrev);
-	_kernels->_iActivationKernel.setArg(index++, _iLayer._stateAveragesPrev);
-	_kernels->_iActivationKernel.setArg(index++, _iLayer._activations);
-	_kernels->_iActivationKernel.setArg(index++, _iLayer._states);
-	_kernels->_iActivationKernel.setArg(index++, _iLayer._statesHistory);
-	_kernels->_iActivationKernel.setArg(index++, _iLayer._stateAverages);
-
-	_kernels->_iActivationKernel.setArg(index++, eDims);
-	_kernels->_iActivationKernel.setArg(index++, iDims);
-	_kernels->_iActivationKernel.setArg(index++, iFeedBackDims);
-	_kernels->_iActivationKernel.setArg(index++, iDimsToEDims);
-	_kernels->_iActivationKernel.setArg(index++, iDimsToFeedBackDims);
-	_kernels->_iActivationKernel.setArg(index++, _config._iFeedForwardRadius);
-	_kernels->_iActivationKernel.setArg(index++, _config._iLateralRadius);
-	_kernels->_iActivationKernel.setArg(index++, _config._iFeedBackRadius);
-	_kernels->_iActivationKernel.setArg(index++, eta);
-	_kernels->_iActivationKernel.setArg(index++, shDecay);
-	_kernels->_iActivationKernel.setArg(index++, saDecay);
-
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_iActivationKernel, cl::NullRange, cl::NDRange(_config._iWidth, _config._iHeight));
+	kernel.setArg(index++, feedForwardInputs);
+	kernel.setArg(index++, eta);
+	kernel.setArg(index++, shDecay);
+	kernel.setArg(index++, saDecay);
+
+	// What the kernel reads and writes (bindKernels), for ordering on an out-of-order queue
+	std::vector<cl::Memory> reads = { feedForwardInputs, _iLayer._statesPrev, _eFeedForwardWeights._weightsPrev, _eFeedBackWeights._weightsPrev, _eLayer._thresholdsPrev, _eLayer._statesPrev };
+	std::vector<cl::Memory> writes = { _eLayer._states };
+
+	if (!_config._packedStates) {
+		reads.insert(reads.end(), { _eLayer._activationsPrev, _eLayer._statesHistoryPrev, _eLayer._stateAveragesPrev });
+		writes.insert(writes.end(), { _eLayer._activations, _eLayer._statesHistory, _eLayer._stateAverages });
+	}
+
+	if (_tileSize > 0)
+		cs.enqueueKernel(kernel, getTiledRange(_config._eWidth, _config._eHeight), cl::NDRange(_tileSize, _tileSize), reads, writes, "eActivate");
+	else
+		cs.enqueueKernel(kernel, cl::NDRange(_config._eWidth, _config._eHeight, _config._batchSize), cl::NullRange, reads, writes, "eActivate");
+}
+
+void EIlayer::iActivate(sys::ComputeSystem &cs, const cl::Image2D &feedBackInputs, float eta, float shDecay, float saDecay) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	if (_sparseActivation) {
+		// Everything else is bound once per buffer parity (bindSparseKernels)
+		int index = 0;
+
+		kernels._iActivationSparseKernel.setArg(index++, feedBackInputs);
+		kernels._iActivationSparseKernel.setArg(index++, eta);
+		kernels._iActivationSparseKernel.setArg(index++, shDecay);
+		kernels._iActivationSparseKernel.setArg(index++, saDecay);
+
+		cs.enqueueKernel(kernels._iActivationSparseKernel, cl::NDRange(_config._iWidth, _config._iHeight, _config._batchSize), cl::NullRange,
+			{ feedBackInputs, _eLayer._statesPrev, _iFeedForwardWeights._connections, _iFeedForwardWeights._connectionCounts, _iLateralWeights._connections, _iLateralWeights._connectionCounts,
+			_iFeedBackWeights._connections, _iFeedBackWeights._connectionCounts, _iLayer._thresholdsPrev, _iLayer._activationsPrev, _iLayer._statesPrev, _iLayer._statesHistoryPrev, _iLayer._stateAveragesPrev },
+			{ _iLayer._activations, _iLayer._states, _iLayer._statesHistory, _iLayer._stateAverages }, "iActivateSparse");
+
+		return;
+	}
+
+	cl::Kernel &kernel = _config._packedStates ? kernels._iActivationPackedKernel : kernels._iActivationKernel;
+
+	// Everything else is bound once per buffer parity (bindKernels)
+	int index = 0;
+
+	kernel.setArg(index++, feedBackInputs);
+	kernel.setArg(index++, eta);
+	kernel.setArg(index++, shDecay);
+	kernel.setArg(index++, saDecay);
+
+	// What the kernel reads and writes (bindKernels), for ordering on an out-of-order queue
+	std::vector<cl::Memory> reads = { feedBackInputs, _eLayer._statesPrev, _iFeedForwardWeights._weightsPrev, _iLateralWeights._weightsPrev, _iFeedBackWeights._weightsPrev, _iLayer._thresholdsPrev, _iLayer._statesPrev };
+	std::vector<cl::Memory> writes = { _iLayer._states };
+
+	if (!_config._packedStates) {
+		reads.insert(reads.end(), { _iLayer._activationsPrev, _iLayer._statesHistoryPrev, _iLayer._stateAveragesPrev });
+		writes.insert(writes.end(), { _iLayer._activations, _iLayer._statesHistory, _iLayer._stateAverages });
+	}
+
+	cs.enqueueKernel(kernel, cl::NDRange(_config._iWidth, _config._iHeight, _config._batchSize), cl::NullRange, reads, writes, "iActivate");
+}
+
+void EIlayer::eActivateBinary(sys::ComputeSystem &cs, const cl::Buffer &feedForwardInputBits, float eta, float shDecay, float saDecay) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	// Everything else is bound once per buffer parity (bindKernels)
+	int index = 0;
+
+	kernels._eActivationBinaryKernel.setArg(index++, feedForwardInputBits);
+	kernels._eActivationBinaryKernel.setArg(index++, eta);
+	kernels._eActivationBinaryKernel.setArg(index++, shDecay);
+	kernels._eActivationBinaryKernel.setArg(index++, saDecay);
+
+	cs.getQueue().enqueueNDRangeKernel(kernels._eActivationBinaryKernel, cl::NullRange, cl::NDRange(_config._eWidth, _config._eHeight), cl::NullRange, nullptr, cs.profile("eActivateBinary"));
+
+	packStates(cs, _eLayer._states, _eLayer._stateBits, _config._eWidth, _config._eHeight);
+}
+
+void EIlayer::iActivateBinary(sys::ComputeSystem &cs, const cl::Buffer &feedBackInputBits, float eta, float shDecay, float saDecay) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	// Everything else is bound once per buffer parity (bindKernels)
+	int index = 0;
+
+	kernels._iActivationBinaryKernel.setArg(index++, feedBackInputBits);
+	kernels._iActivationBinaryKernel.setArg(index++, eta);
+	kernels._iActivationBinaryKernel.setArg(index++, shDecay);
+	kernels._iActivationBinaryKernel.setArg(index++, saDecay);
+
+	cs.getQueue().enqueueNDRangeKernel(kernels._iActivationBinaryKernel, cl::NullRange, cl::NDRange(_config._iWidth, _config._iHeight), cl::NullRange, nullptr, cs.profile("iActivateBinary"));
+
+	packStates(cs, _iLayer._states, _iLayer._stateBits, _config._iWidth, _config._iHeight);
+}
+
+void EIlayer::packStatesPrev(sys::ComputeSystem &cs) {
+	packStates(cs, _eLayer._statesPrev, _eLayer._stateBitsPrev, _config._eWidth, _config._eHeight);
+	packStates(cs, _iLayer._statesPrev, _iLayer._stateBitsPrev, _config._iWidth, _config._iHeight);
+}
+
+void EIlayer::eActivateEvents(sys::ComputeSystem &cs, const SpikeList &feedForwardSpikes, float eta, float shDecay, float saDecay) {
+	cl_float2 eDimsToEFeedForwardDims = { static_cast<float>(_config._eFeedForwardWidth + 1) / static_cast<float>(_config._eWidth + 1), static_cast<float>(_config._eFeedForwardHeight + 1) / static_cast<float>(_config._eHeight + 1) };
+	cl_float2 eDimsToIDims = { static_cast<float>(_config._iWidth + 1) / static_cast<float>(_config._eWidth + 1), static_cast<float>(_config._iHeight + 1) / static_cast<float>(_config._eHeight + 1) };
+
+	cl_int zeroCount = 0;
+
+	cs.getQueue().enqueueFillBuffer(_eLayer._excitations, zeroCount, 0, _config._eWidth * _config._eHeight * sizeof(cl_int), nullptr, cs.profile("eClearInputs"));
+	cs.getQueue().enqueueFillBuffer(_eLayer._inhibitions, zeroCount, 0, _config._eWidth * _config._eHeight * sizeof(cl_int), nullptr, cs.profile("eClearInputs"));
+
+	// Feed forward (excitatory)
+	scatterSpikes(cs, feedForwardSpikes, _eFeedForwardWeights._masksPrev, _eLayer._excitations,
+		_config._eWidth, _config._eHeight, _config._eFeedForwardWidth, _config._eFeedForwardHeight, eDimsToEFeedForwardDims, _config._eFeedForwardRadius, false);
+
+	// Feed back (inhibitory)
+	scatterSpikes(cs, _iLayer._spikeListPrev, _eFeedBackWeights._masksPrev, _eLayer._inhibitions,
+		_config._eWidth, _config._eHeight, _config._iWidth, _config._iHeight, eDimsToIDims, _config._eFeedBackRadius, false);
+
+	integrate(cs, _eLayer, _config._eWidth, _config._eHeight, eta, shDecay, saDecay);
+
+	eCompactStates(cs);
+}
+
+void EIlayer::iActivateEvents(sys::ComputeSystem &cs, const SpikeList &feedBackSpikes, float eta, float shDecay, float saDecay) {
+	cl_float2 iDimsToEDims = { static_cast<float>(_config._eWidth + 1) / static_cast<float>(_config._iWidth + 1), static_cast<float>(_config._eHeight + 1) / static_cast<float>(_config._iHeight + 1) };
+	cl_float2 iDimsToFeedBackDims = { static_cast<float>(_config._iFeedBackWidth + 1) / static_cast<float>(_config._iWidth + 1), static_cast<float>(_config._iFeedBackHeight + 1) / static_cast<float>(_config._iHeight + 1) };
+	cl_float2 iDimsToIDims = { 1.0f, 1.0f };
+
+	cl_int zeroCount = 0;
+
+	cs.getQueue().enqueueFillBuffer(_iLayer._excitations, zeroCount, 0, _config._iWidth * _config._iHeight * sizeof(cl_int), nullptr, cs.profile("iClearInputs"));
+	cs.getQueue().enqueueFillBuffer(_iLayer._inhibitions, zeroCount, 0, _config._iWidth * _config._iHeight * sizeof(cl_int), nullptr, cs.profile("iClearInputs"));
+
+	// Feed forward (excitatory)
+	scatterSpikes(cs, _eLayer._spikeListPrev, _iFeedForwardWeights._masksPrev, _iLayer._excitations,
+		_config._iWidth, _config._iHeight, _config._eWidth, _config._eHeight, iDimsToEDims, _config._iFeedForwardRadius, false);
+
+	// Feed back (inhibitory)
+	scatterSpikes(cs, feedBackSpikes, _iFeedBackWeights._masksPrev, _iLayer._inhibitions,
+		_config._iWidth, _config._iHeight, _config._iFeedBackWidth, _config._iFeedBackHeight, iDimsToFeedBackDims, _config._iFeedBackRadius, false);
+
+	// Lateral (inhibitory)
+	scatterSpikes(cs, _iLayer._spikeListPrev, _iLateralWeights._masksPrev, _iLayer._inhibitions,
+		_config._iWidth, _config._iHeight, _config._iWidth, _config._iHeight, iDimsToIDims, _config._iLateralRadius, true);
+
+	integrate(cs, _iLayer, _config._iWidth, _config._iHeight, eta, shDecay, saDecay);
+
+	iCompactStates(cs);
+}
+
+void EIlayer::eCompactStates(sys::ComputeSystem &cs) {
+	compactStates(cs, _eLayer._states, _eLayer._spikeList, _config._eWidth, _config._eHeight);
+}
+
+void EIlayer::iCompactStates(sys::ComputeSystem &cs) {
+	compactStates(cs, _iLayer._states, _iLayer._spikeList, _config._iWidth, _config._iHeight);
+}
+
+void EIlayer::ePackStates(sys::ComputeSystem &cs) {
+	packStates(cs, _eLayer._states, _eLayer._stateBits, _config._eWidth, _config._eHeight);
+}
+
+void EIlayer::iPackStates(sys::ComputeSystem &cs) {
+	packStates(cs, _iLayer._states, _iLayer._stateBits, _config._iWidth, _config._iHeight);
+}
+
+void EIlayer::copyToPersistent(sys::ComputeSystem &cs, const cl::Buffer &state, int eOffset, int iOffset, const cl::Buffer &weights, int weightsOffset) {
+	copyToPersistent(cs, _eLayer, state, eOffset, _config._eWidth, _config._eHeight);
+	copyToPersistent(cs, _iLayer, state, iOffset, _config._iWidth, _config._iHeight);
+
+	int eSize = _config._eWidth * _config._eHeight;
+	int iSize = _config._iWidth * _config._iHeight;
+
+	int eFeedForwardSize = getWeightsSize(_config._eFeedForwardRadius, _config._eFeedForwardWidth, _config._eFeedForwardHeight, eSize);
+	int eFeedBackSize = getWeightsSize(_config._eFeedBackRadius, _config._iWidth, _config._iHeight, eSize);
+	int iFeedForwardSize = getWeightsSize(_config._iFeedForwardRadius, _config._eWidth, _config._eHeight, iSize);
+	int iLateralSize = getWeightsSize(_config._iLateralRadius, _config._iWidth, _config._iHeight, iSize);
+	int iFeedBackSize = getWeightsSize(_config._iFeedBackRadius, _config._iFeedBackWidth, _config._iFeedBackHeight, iSize);
+
+	copyToPersistent(cs, _eFeedForwardWeights, weights, weightsOffset, eFeedForwardSize);
+	weightsOffset += eFeedForwardSize;
+	copyToPersistent(cs, _eFeedBackWeights, weights, weightsOffset, eFeedBackSize);
+	weightsOffset += eFeedBackSize;
+	copyToPersistent(cs, _iFeedForwardWeights, weights, weightsOffset, iFeedForwardSize);
+	weightsOffset += iFeedForwardSize;
+	copyToPersistent(cs, _iLateralWeights, weights, weightsOffset, iLateralSize);
+	weightsOffset += iLateralSize;
+	copyToPersistent(cs, _iFeedBackWeights, weights, weightsOffset, iFeedBackSize);
+}
+
+void EIlayer::copyFromPersistent(sys::ComputeSystem &cs, const cl::Buffer &state, int eOffset, int iOffset, const cl::Buffer &weights, int weightsOffset) {
+	copyFromPersistent(cs, _eLayer, state, eOffset, _config._eWidth, _config._eHeight);
+	copyFromPersistent(cs, _iLayer, state, iOffset, _config._iWidth, _config._iHeight);
+
+	// The settle learned into one weight buffer only, every neuron brings the other one up to date on the next gated learn
+	_learnedPrevCurrent = false;
+
+	int eSize = _config._eWidth * _config._eHeight;
+	int iSize = _config._iWidth * _config._iHeight;
+
+	int eFeedForwardSize = getWeightsSize(_config._eFeedForwardRadius, _config._eFeedForwardWidth, _config._eFeedForwardHeight, eSize);
+	int eFeedBackSize = getWeightsSize(_config._eFeedBackRadius, _config._iWidth, _config._iHeight, eSize);
+	int iFeedForwardSize = getWeightsSize(_config._iFeedForwardRadius, _config._eWidth, _config._eHeight, iSize);
+	int iLateralSize = getWeightsSize(_config._iLateralRadius, _config._iWidth, _config._iHeight, iSize);
+	int iFeedBackSize = getWeightsSize(_config._iFeedBackRadius, _config._iFeedBackWidth, _config._iFeedBackHeight, iSize);
+
+	copyFromPersistent(cs, _eFeedForwardWeights, weights, weightsOffset, eFeedForwardSize);
+	weightsOffset += eFeedForwardSize;
+	copyFromPersistent(cs, _eFeedBackWeights, weights, weightsOffset, eFeedBackSize);
+	weightsOffset += eFeedBackSize;
+	copyFromPersistent(cs, _iFeedForwardWeights, weights, weightsOffset, iFeedForwardSize);
+	weightsOffset += iFeedForwardSize;
+	copyFromPersistent(cs, _iLateralWeights, weights, weightsOffset, iLateralSize);
+	weightsOffset += iLateralSize;
+	copyFromPersistent(cs, _iFeedBackWeights, weights, weightsOffset, iFeedBackSize);
+}
+
+void EIlayer::copyToPersistent(sys::ComputeSystem &cs, const NeuronLayer &layer, const cl::Buffer &state, int offset, int width, int height) {
+	cl::size_t<3> zeroCoord;
+	zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+	cl::size_t<3> dims;
+	dims[0] = width;
+	dims[1] = height;
+	dims[2] = 1;
+
+	int size = width * height;
+
+	// Previous step into slot 0 of the double buffered arrays
+	cs.getQueue().enqueueCopyImageToBuffer(layer._activationsPrev, state, zeroCoord, dims, (offset + 0 * size) * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+	cs.getQueue().enqueueCopyImageToBuffer(layer._thresholdsPrev, state, zeroCoord, dims, (offset + 1 * size) * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+	cs.getQueue().enqueueCopyImageToBuffer(layer._stateAveragesPrev, state, zeroCoord, dims, (offset + 2 * size) * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+	cs.getQueue().enqueueCopyImageToBuffer(layer._statesPrev, state, zeroCoord, dims, (offset + 3 * size) * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+	cs.getQueue().enqueueCopyImageToBuffer(layer._statesHistoryPrev, state, zeroCoord, dims, (offset + 5 * size) * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+}
+
+void EIlayer::copyFromPersistent(sys::ComputeSystem &cs, NeuronLayer &layer, const cl::Buffer &state, int offset, int width, int height) {
+	cl::size_t<3> zeroCoord;
+	zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+	cl::size_t<3> dims;
+	dims[0] = width;
+	dims[1] = height;
+	dims[2] = 1;
+
+	int size = width * height;
+
+	cs.getQueue().enqueueCopyBufferToImage(state, layer._activations, (offset + 0 * size) * sizeof(cl_float), zeroCoord, dims, nullptr, cs.profile("copyFromPersistent"));
+	cs.getQueue().enqueueCopyBufferToImage(state, layer._thresholds, (offset + 1 * size) * sizeof(cl_float), zeroCoord, dims, nullptr, cs.profile("copyFromPersistent"));
+	cs.getQueue().enqueueCopyBufferToImage(state, layer._stateAverages, (offset + 2 * size) * sizeof(cl_float), zeroCoord, dims, nullptr, cs.profile("copyFromPersistent"));
+	cs.getQueue().enqueueCopyBufferToImage(state, layer._states, (offset + 3 * size) * sizeof(cl_float), zeroCoord, dims, nullptr, cs.profile("copyFromPersistent"));
+	cs.getQueue().enqueueCopyBufferToImage(state, layer._statesHistory, (offset + 5 * size) * sizeof(cl_float), zeroCoord, dims, nullptr, cs.profile("copyFromPersistent"));
+}
+
+void EIlayer::copyToPersistent(sys::ComputeSystem &cs, const Weights2D &weights, const cl::Buffer &buffer, int offset, int size) {
+	cs.getQueue().enqueueCopyBuffer(weights._weightsPrev, buffer, 0, offset * sizeof(cl_float), size * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+}
+
+void EIlayer::copyFromPersistent(sys::ComputeSystem &cs, Weights2D &weights, const cl::Buffer &buffer, int offset, int size) {
+	cs.getQueue().enqueueCopyBuffer(buffer, weights._weights, offset * sizeof(cl_float), 0, size * sizeof(cl_float), nullptr, cs.profile("copyFromPersistent"));
+}
+
+void EIlayer::updateMasksPrev(sys::ComputeSystem &cs) {
+	initializeMasks(cs, _eFeedForwardWeights, _config._eFeedForwardRadius, false, _config._eWidth, _config._eHeight, _config._eFeedForwardWidth, _config._eFeedForwardHeight);
+	initializeMasks(cs, _eFeedBackWeights, _config._eFeedBackRadius, false, _config._eWidth, _config._eHeight, _config._iWidth, _config._iHeight);
+	initializeMasks(cs, _iFeedForwardWeights, _config._iFeedForwardRadius, false, _config._iWidth, _config._iHeight, _config._eWidth, _config._eHeight);
+	initializeMasks(cs, _iLateralWeights, _config._iLateralRadius, true, _config._iWidth, _config._iHeight, _config._iWidth, _config._iHeight);
+	initializeMasks(cs, _iFeedBackWeights, _config._iFeedBackRadius, false, _config._iWidth, _config._iHeight, _config._iFeedBackWidth, _config._iFeedBackHeight);
+}
+
+int EIlayer::getNumWeights() const {
+	int eSize = _config._eWidth * _config._eHeight;
+	int iSize = _config._iWidth * _config._iHeight;
+
+	int eFeedForwardSize = getWeightsSize(_config._eFeedForwardRadius, _config._eFeedForwardWidth, _config._eFeedForwardHeight, eSize);
+	int eFeedBackSize = getWeightsSize(_config._eFeedBackRadius, _config._iWidth, _config._iHeight, eSize);
+	int iFeedForwardSize = getWeightsSize(_config._iFeedForwardRadius, _config._eWidth, _config._eHeight, iSize);
+	int iLateralSize = getWeightsSize(_config._iLateralRadius, _config._iWidth, _config._iHeight, iSize);
+	int iFeedBackSize = getWeightsSize(_config._iFeedBackRadius, _config._iFeedBackWidth, _config._iFeedBackHeight, iSize);
+
+	return eFeedForwardSize + eFeedBackSize + iFeedForwardSize + iLateralSize + iFeedBackSize;
+}
+
+long long EIlayer::getNumConnections(const Configuration &config) {
+	return countConnections(config._eWidth, config._eHeight, config._eFeedForwardWidth, config._eFeedForwardHeight, config._eFeedForwardRadius, false)
+		+ countConnections(config._eWidth, config._eHeight, config._iWidth, config._iHeight, config._eFeedBackRadius, false)
+		+ countConnections(config._iWidth, config._iHeight, config._eWidth, config._eHeight, config._iFeedForwardRadius, false)
+		+ countConnections(config._iWidth, config._iHeight, config._iWidth, config._iHeight, config._iLateralRadius, true)
+		+ countConnections(config._iWidth, config._iHeight, config._iFeedBackWidth, config._iFeedBackHeight, config._iFeedBackRadius, false);
+}
+
+void EIlayer::compactStatesPrev(sys::ComputeSystem &cs) {
+	compactStates(cs, _eLayer._statesPrev, _eLayer._spikeListPrev, _config._eWidth, _config._eHeight);
+	compactStates(cs, _iLayer._statesPrev, _iLayer._spikeListPrev, _config._iWidth, _config._iHeight);
+}
+
+void EIlayer::compactStates(sys::ComputeSystem &cs, const cl::Image2D &states, const SpikeList &spikeList, int width, int height) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	cl_int zeroCount = 0;
+
+	cs.getQueue().enqueueFillBuffer(spikeList._count, zeroCount, 0, sizeof(cl_int), nullptr, cs.profile("compactStates"));
+
+	int index = 0;
+
+	kernels._compactSpikesKernel.setArg(index++, states);
+	kernels._compactSpikesKernel.setArg(index++, spikeList._spikes);
+	kernels._compactSpikesKernel.setArg(index++, spikeList._count);
+
+	cs.getQueue().enqueueNDRangeKernel(kernels._compactSpikesKernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange, nullptr, cs.profile("compactStates"));
+}
+
+void EIlayer::scatterSpikes(sys::ComputeSystem &cs, const SpikeList &spikeList, const cl::Buffer &masksPrev, const cl::Buffer &accumulators,
+	int width, int height, int inputWidth, int inputHeight, cl_float2 dimsToInputDims, int radius, bool lateral)
+{
+	Kernels &kernels = _parityKernels[_parity];
+
+	cl_int2 dims = { width, height };
+
+	// Work items stride over the list, enough of them for 1/8 of the inputs spiking at once
+	int workSize = ((inputWidth * inputHeight / 8 + 63) / 64) * 64;
+
+	int index = 0;
+
+	kernels._scatterSpikesKernel.setArg(index++, spikeList._spikes);
+	kernels._scatterSpikesKernel.setArg(index++, spikeList._count);
+	kernels._scatterSpikesKernel.setArg(index++, masksPrev);
+	kernels._scatterSpikesKernel.setArg(index++, accumulators);
+	kernels._scatterSpikesKernel.setArg(index++, dims);
+	kernels._scatterSpikesKernel.setArg(index++, dimsToInputDims);
+	kernels._scatterSpikesKernel.setArg(index++, radius);
+	kernels._scatterSpikesKernel.setArg(index++, lateral ? 1 : 0);
+
+	cs.getQueue().enqueueNDRangeKernel(kernels._scatterSpikesKernel, cl::NullRange, cl::NDRange(std::max(64, workSize)), cl::NullRange, nullptr, cs.profile("scatterSpikes"));
+}
+
+void EIlayer::integrate(sys::ComputeSystem &cs, NeuronLayer &layer, int width, int height, float eta, float shDecay, float saDecay) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	int index = 0;
+
+	kernels._integrateKernel.setArg(index++, layer._excitations);
+	kernels._integrateKernel.setArg(index++, layer._inhibitions);
+	kernels._integrateKernel.setArg(index++, layer._thresholdsPrev);
+	kernels._integrateKernel.setArg(index++, layer._activationsPrev);
+	kernels._integrateKernel.setArg(index++, layer._statesHistoryPrev);
+	kernels._integrateKernel.setArg(index++, layer._stateAveragesPrev);
+	kernels._integrateKernel.setArg(index++, layer._activations);
+	kernels._integrateKernel.setArg(index++, layer._states);
+	kernels._integrateKernel.setArg(index++, layer._statesHistory);
+	kernels._integrateKernel.setArg(index++, layer._stateAverages);
+	kernels._integrateKernel.setArg(index++, eta);
+	kernels._integrateKernel.setArg(index++, shDecay);
+	kernels._integrateKernel.setArg(index++, saDecay);
+
+	cs.getQueue().enqueueNDRangeKernel(kernels._integrateKernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange, nullptr, cs.profile("integrate"));
 }
 
 void EIlayer::learn(sys::ComputeSystem &cs,
@@ -296,106 +1528,279 @@ void EIlayer::learn(sys::ComputeSystem &cs,
 	float iAlpha, float iBeta, float iGamma, float iDelta,
 	float sparsityE, float sparsityI)
 {
-	// Common
-	cl_int2 eDims = { _config._eWidth, _config._eHeight };
-	cl_int2 iDims = { _config._iWidth, _config._iHeight };
+	if (_activityGatedLearning && _config._batchSize == 1) {
+		learnActive(cs, feedForwardInputsPrev, feedBackInputsPrev, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
+
+		return;
+	}
+
+	_learnedPrevCurrent = false;
+
+	Kernels &kernels = _parityKernels[_parity];
+
+	// Everything else is bound once per buffer parity (bindKernels)
 
 	// Excitatory
-	cl_int2 eFeedForwardDims = { _config._eFeedForwardWidth, _config._eFeedForwardHeight };
-	cl_float2 eDimsToEFeedForwardDims = { static_cast<float>(eFeedForwardDims.x + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(eFeedForwardDims.y + 1) / static_cast<float>(eDims.y + 1) };
-	cl_float2 eDimsToIDims = { static_cast<float>(iDims.x + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(iDims.y + 1) / static_cast<float>(eDims.y + 1) };
+	{
+		cl::Kernel &kernel = _config._batchSize > 1 ? kernels._eLearnBatchKernel : (_tileSize > 0 ? kernels._eLearnTiledKernel : kernels._eLearnKernel);
+
+		int index = 0;
+
+		kernel.setArg(index++, feedForwardInputsPrev);
+		kernel.setArg(index++, feedForwardInputs);
+		kernel.setArg(index++, eAlpha);
+		kernel.setArg(index++, eBeta);
+		kernel.setArg(index++, eDelta);
+		kernel.setArg(index++, sparsityE);
+		kernel.setArg(index++, _roundingSeed);
+
+		std::vector<cl::Memory> reads = { feedForwardInputsPrev, feedForwardInputs, _eLayer._states, _eLayer._statesHistoryPrev, _eLayer._statesHistory,
+			_iLayer._statesHistoryPrev, _iLayer._statesHistory, _eLayer._stateAveragesPrev, _eFeedForwardWeights._weightsPrev, _eFeedBackWeights._weightsPrev, _eLayer._thresholdsPrev };
+		std::vector<cl::Memory> writes = { _eFeedForwardWeights._weights, _eFeedBackWeights._weights, _eLayer._thresholds, _eFeedForwardWeights._masks, _eFeedBackWeights._masks };
+
+		if (_tileSize > 0)
+			cs.enqueueKernel(kernel, getTiledRange(_config._eWidth, _config._eHeight), cl::NDRange(_tileSize, _tileSize), reads, writes, "eLearn");
+		else
+			cs.enqueueKernel(kernel, cl::NDRange(_config._eWidth, _config._eHeight), cl::NullRange, reads, writes, "eLearn");
+	}
 
 	// Inhibitory
-	cl_int2 iFeedBackDims = { _config._iFeedBackWidth, _config._iFeedBackHeight };
-	cl_float2 iDimsToEDims = { static_cast<float>(eDims.x + 1) / static_cast<float>(iDims.x + 1), static_cast<float>(eDims.y + 1) / static_cast<float>(iDims.y + 1) };
-	cl_float2 iDimsToFeedBackDims = { static_cast<float>(iFeedBackDims.x + 1) / static_cast<float>(iDims.x + 1), static_cast<float>(iFeedBackDims.y + 1) / static_cast<float>(iDims.y + 1) };
+	{
+		cl::Kernel &kernel = _config._batchSize > 1 ? kernels._iLearnBatchKernel : kernels._iLearnKernel;
 
-	// Excitatory
+		int index = 0;
+
+		kernel.setArg(index++, feedBackInputsPrev);
+		kernel.setArg(index++, feedBackInputs);
+		kernel.setArg(index++, iAlpha);
+		kernel.setArg(index++, iBeta);
+		kernel.setArg(index++, iGamma);
+		kernel.setArg(index++, iDelta);
+		kernel.setArg(index++, sparsityI);
+		kernel.setArg(index++, _roundingSeed);
+
+		std::vector<cl::Memory> reads = { feedBackInputsPrev, feedBackInputs, _iLayer._states, _eLayer._statesHistoryPrev, _eLayer._statesHistory,
+			_iLayer._statesHistoryPrev, _iLayer._statesHistory, _iLayer._stateAveragesPrev,
+			_iFeedForwardWeights._weightsPrev, _iLateralWeights._weightsPrev, _iFeedBackWeights._weightsPrev, _iLayer._thresholdsPrev };
+		std::vector<cl::Memory> writes = { _iFeedForwardWeights._weights, _iLateralWeights._weights, _iFeedBackWeights._weights, _iLayer._thresholds,
+			_iFeedForwardWeights._masks, _iLateralWeights._masks, _iFeedBackWeights._masks };
+
+		cs.enqueueKernel(kernel, cl::NDRange(_config._iWidth, _config._iHeight), cl::NullRange, reads, writes, "iLearn");
+	}
+
+	// Fresh rounding noise for the next call
+	_roundingSeed.x += 7919;
+	_roundingSeed.y += 104729;
+}
+
+void EIlayer::compactLearners(sys::ComputeSystem &cs, const NeuronLayer &layer, int width, int height, bool readPrev) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	cl_int zeroCount = 0;
+
+	cs.getQueue().enqueueFillBuffer(layer._learners._count, zeroCount, 0, sizeof(cl_int), nullptr, cs.profile("compactLearners"));
+
+	// After dense learning every neuron may have left the other buffer behind
+	if (!_learnedPrevCurrent) {
+		cl_uchar learned = 1;
+
+		cs.getQueue().enqueueFillBuffer(layer._learnedPrev, learned, 0, width * height * sizeof(cl_uchar), nullptr, cs.profile("compactLearners"));
+	}
+
+	int index = 0;
+
+	kernels._compactLearnersKernel.setArg(index++, layer._statesHistory);
+	kernels._compactLearnersKernel.setArg(index++, layer._statesHistoryPrev);
+	kernels._compactLearnersKernel.setArg(index++, static_cast<cl_int>(readPrev));
+	kernels._compactLearnersKernel.setArg(index++, layer._learnedPrev);
+	kernels._compactLearnersKernel.setArg(index++, static_cast<cl_int>(!_config._inPlaceWeights));
+	kernels._compactLearnersKernel.setArg(index++, layer._learners._spikes);
+	kernels._compactLearnersKernel.setArg(index++, layer._learners._count);
+	kernels._compactLearnersKernel.setArg(index++, _minLearnHistory);
+
+	cs.enqueueKernel(kernels._compactLearnersKernel, cl::NDRange(width, height), cl::NullRange,
+		{ layer._statesHistory, layer._statesHistoryPrev, layer._learnedPrev },
+		{ layer._learners._spikes, layer._learners._count, layer._learnedPrev }, "compactLearners");
+}
+
+void EIlayer::learnThresholds(sys::ComputeSystem &cs, const NeuronLayer &layer, int width, int height, float delta, float sparsity) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	int index = 0;
+
+	kernels._learnThresholdsKernel.setArg(index++, layer._stateAveragesPrev);
+	kernels._learnThresholdsKernel.setArg(index++, layer._thresholdsPrev);
+	kernels._learnThresholdsKernel.setArg(index++, layer._thresholds);
+	kernels._learnThresholdsKernel.setArg(index++, delta);
+	kernels._learnThresholdsKernel.setArg(index++, sparsity);
+
+	cs.enqueueKernel(kernels._learnThresholdsKernel, cl::NDRange(width, height), cl::NullRange,
+		{ layer._stateAveragesPrev, layer._thresholdsPrev }, { layer._thresholds }, "learnThresholds");
+}
+
+void EIlayer::learnActive(sys::ComputeSystem &cs,
+	const cl::Image2D &feedForwardInputsPrev, const cl::Image2D &feedBackInputsPrev,
+	float eAlpha, float eBeta, float eDelta,
+	float iAlpha, float iBeta, float iGamma, float iDelta,
+	float sparsityE, float sparsityI)
+{
+	Kernels &kernels = _parityKernels[_parity];
+
+	// The inhibitory feed forward rule reads the previous state history as postsynaptic term
+	compactLearners(cs, _eLayer, _config._eWidth, _config._eHeight, false);
+	compactLearners(cs, _iLayer, _config._iWidth, _config._iHeight, true);
+
+	_learnedPrevCurrent = true;
+
+	// Excitatory, one work item per neuron at most, those beyond the list length return at once
 	{
 		int index = 0;
 
-		_kernels->_eLearnKernel.setArg(index++, feedForwardInputsPrev);
-		_kernels->_eLearnKernel.setArg(index++, feedForwardInputs);
-		_kernels->_eLearnKernel.setArg(index++, _eLayer._states);
-		_kernels->_eLearnKernel.setArg(index++, _eLayer._statesHistoryPrev);
-		_kernels->_eLearnKernel.setArg(index++, _eLayer._statesHistory);
-		_kernels->_eLearnKernel.setArg(index++, _iLayer._statesHistoryPrev);
-		_kernels->_eLearnKernel.setArg(index++, _iLayer._statesHistory);
-		_kernels->_eLearnKernel.setArg(index++, _eLayer._stateAveragesPrev);
-		_kernels->_eLearnKernel.setArg(index++, _eFeedForwardWeights._weightsPrev);
-		_kernels->_eLearnKernel.setArg(index++, _eFeedBackWeights._weightsPrev);
-		_kernels->_eLearnKernel.setArg(index++, _eLayer._thresholdsPrev);
-		_kernels->_eLearnKernel.setArg(index++, _eFeedForwardWeights._weights);
-		_kernels->_eLearnKernel.setArg(index++, _eFeedBackWeights._weights);
-		_kernels->_eLearnKernel.setArg(index++, _eLayer._thresholds);
-
-		_kernels->_eLearnKernel.setArg(index++, eFeedForwardDims);
-		_kernels->_eLearnKernel.setArg(index++, eDims);
-		_kernels->_eLearnKernel.setArg(index++, iDims);
-		_kernels->_eLearnKernel.setArg(index++, eDimsToEFeedForwardDims);
-		_kernels->_eLearnKernel.setArg(index++, eDimsToIDims);
-		_kernels->_eLearnKernel.setArg(index++, _config._eFeedForwardRadius);
-		_kernels->_eLearnKernel.setArg(index++, _config._eFeedBackRadius);
-
-		_kernels->_eLearnKernel.setArg(index++, eAlpha);
-		_kernels->_eLearnKernel.setArg(index++, eBeta);
-		_kernels->_eLearnKernel.setArg(index++, eDelta);
-		_kernels->_eLearnKernel.setArg(index++, sparsityE);
-		
-		cs.getQueue().enqueueNDRangeKernel(_kernels->_eLearnKernel, cl::NullRange, cl::NDRange(_config._eWidth, _config._eHeight));
+		kernels._eLearnActiveKernel.setArg(index++, feedForwardInputsPrev);
+		kernels._eLearnActiveKernel.setArg(index++, eAlpha);
+		kernels._eLearnActiveKernel.setArg(index++, eBeta);
+		kernels._eLearnActiveKernel.setArg(index++, sparsityE);
+		kernels._eLearnActiveKernel.setArg(index++, _minLearnHistory);
+		kernels._eLearnActiveKernel.setArg(index++, _roundingSeed);
+
+		std::vector<cl::Memory> reads = { feedForwardInputsPrev, _eLayer._learners._spikes, _eLayer._learners._count, _eLayer._statesHistory, _iLayer._statesHistoryPrev,
+			_eLayer._stateAveragesPrev, _eFeedForwardWeights._weightsPrev, _eFeedBackWeights._weightsPrev };
+		std::vector<cl::Memory> writes = { _eFeedForwardWeights._weights, _eFeedBackWeights._weights, _eFeedForwardWeights._masks, _eFeedBackWeights._masks };
+
+		cs.enqueueKernel(kernels._eLearnActiveKernel, cl::NDRange(_config._eWidth * _config._eHeight), cl::NullRange, reads, writes, "eLearnActive");
+
+		learnThresholds(cs, _eLayer, _config._eWidth, _config._eHeight, eDelta, sparsityE);
 	}
 
 	// Inhibitory
 	{
 		int index = 0;
 
-		_kernels->_iLearnKernel.setArg(index++, feedBackInputsPrev);
-		_kernels->_iLearnKernel.setArg(index++, feedBackInputs);
-		_kernels->_iLearnKernel.setArg(index++, _iLayer._states);
-		_kernels->_iLearnKernel.setArg(index++, _eLayer._statesHistoryPrev);
-		_kernels->_iLearnKernel.setArg(index++, _eLayer._statesHistory);
-		_kernels->_iLearnKernel.setArg(index++, _iLayer._statesHistoryPrev);
-		_kernels->_iLearnKernel.setArg(index++, _iLayer._statesHistory);
-		_kernels->_iLearnKernel.setArg(index++, _iLayer._stateAveragesPrev);
-		_kernels->_iLearnKernel.setArg(index++, _iFeedForwardWeights._weightsPrev);
-		_kernels->_iLearnKernel.setArg(index++, _iLateralWeights._weightsPrev);
-		_kernels->_iLearnKernel.setArg(index++, _iFeedBackWeights._weightsPrev);
-		_kernels->_iLearnKernel.setArg(index++, _iLayer._thresholdsPrev);
-		_kernels->_iLearnKernel.setArg(index++, _iFeedForwardWeights._weights);
-		_kernels->_iLearnKernel.setArg(index++, _iLateralWeights._weights);
-		_kernels->_iLearnKernel.setArg(index++, _iFeedBackWeights._weights);
-		_kernels->_iLearnKernel.setArg(index++, _iLayer._thresholds);
-
-		_kernels->_iLearnKernel.setArg(index++, eDims);
-		_kernels->_iLearnKernel.setArg(index++, iDims);
-		_kernels->_iLearnKernel.setArg(index++, iFeedBackDims);
-		_kernels->_iLearnKernel.setArg(index++, iDimsToEDims);
-		_kernels->_iLearnKernel.setArg(index++, iDimsToFeedBackDims);
-		_kernels->_iLearnKernel.setArg(index++, _config._iFeedForwardRadius);
-		_kernels->_iLearnKernel.setArg(index++, _config._iLateralRadius);
-		_kernels->_iLearnKernel.setArg(index++, _config._iFeedBackRadius);
-
-		_kernels->_iLearnKernel.setArg(index++, iAlpha);
-		_kernels->_iLearnKernel.setArg(index++, iBeta);
-		_kernels->_iLearnKernel.setArg(index++, iGamma);
-		_kernels->_iLearnKernel.setArg(index++, iDelta);
-		_kernels->_iLearnKernel.setArg(index++, sparsityI);
-		
-		cs.getQueue().enqueueNDRangeKernel(_kernels->_iLearnKernel, cl::NullRange, cl::NDRange(_config._iWidth, _config._iHeight));
+		kernels._iLearnActiveKernel.setArg(index++, feedBackInputsPrev);
+		kernels._iLearnActiveKernel.setArg(index++, iAlpha);
+		kernels._iLearnActiveKernel.setArg(index++, iBeta);
+		kernels._iLearnActiveKernel.setArg(index++, iGamma);
+		kernels._iLearnActiveKernel.setArg(index++, sparsityI);
+		kernels._iLearnActiveKernel.setArg(index++, _minLearnHistory);
+		kernels._iLearnActiveKernel.setArg(index++, _roundingSeed);
+
+		std::vector<cl::Memory> reads = { feedBackInputsPrev, _iLayer._learners._spikes, _iLayer._learners._count, _eLayer._statesHistory, _iLayer._statesHistoryPrev,
+			_iLayer._statesHistory, _iLayer._stateAveragesPrev, _iFeedForwardWeights._weightsPrev, _iLateralWeights._weightsPrev, _iFeedBackWeights._weightsPrev };
+		std::vector<cl::Memory> writes = { _iFeedForwardWeights._weights, _iLateralWeights._weights, _iFeedBackWeights._weights,
+			_iFeedForwardWeights._masks, _iLateralWeights._masks, _iFeedBackWeights._masks };
+
+		cs.enqueueKernel(kernels._iLearnActiveKernel, cl::NDRange(_config._iWidth * _config._iHeight), cl::NullRange, reads, writes, "iLearnActive");
+
+		learnThresholds(cs, _iLayer, _config._iWidth, _config._iHeight, iDelta, sparsityI);
 	}
+
+	// Fresh rounding noise for the next call
+	_roundingSeed.x += 7919;
+	_roundingSeed.y += 104729;
+}
+
+void EIlayer::recordStatistics(sys::ComputeSystem &cs, const cl::Image2D &feedForwardInputs, const cl::Image2D* feedBackInputs, const cl::Buffer &statistics, int record) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	cl_int2 eDims = { _config._eWidth, _config._eHeight };
+	cl_int2 iDims = { _config._iWidth, _config._iHeight };
+	cl_int2 eFeedForwardDims = { _config._eFeedForwardWidth, _config._eFeedForwardHeight };
+	cl_int2 iFeedBackDims = { _config._iFeedBackWidth, _config._iFeedBackHeight };
+
+	cl_float2 eDimsToEFeedForwardDims = { static_cast<float>(eFeedForwardDims.x + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(eFeedForwardDims.y + 1) / static_cast<float>(eDims.y + 1) };
+	cl_float2 eDimsToIDims = { static_cast<float>(iDims.x + 1) / static_cast<float>(eDims.x + 1), static_cast<float>(iDims.y + 1) / static_cast<float>(eDims.y + 1) };
+	cl_float2 iDimsToEDims = { static_cast<float>(eDims.x + 1) / static_cast<float>(iDims.x + 1), static_cast<float>(eDims.y + 1) / static_cast<float>(iDims.y + 1) };
+	cl_float2 iDimsToFeedBackDims = { static_cast<float>(iFeedBackDims.x + 1) / static_cast<float>(iDims.x + 1), static_cast<float>(iFeedBackDims.y + 1) / static_cast<float>(iDims.y + 1) };
+
+	// Excitatory
+	int groupSize = getStatisticsGroupSize(cs, kernels._eStatisticsKernel);
+
+	int index = 0;
+
+	kernels._eStatisticsKernel.setArg(index++, statistics);
+	kernels._eStatisticsKernel.setArg(index++, record);
+	kernels._eStatisticsKernel.setArg(index++, feedForwardInputs);
+	kernels._eStatisticsKernel.setArg(index++, _iLayer._statesPrev);
+	kernels._eStatisticsKernel.setArg(index++, _eFeedForwardWeights._weightsPrev);
+	kernels._eStatisticsKernel.setArg(index++, _eFeedBackWeights._weightsPrev);
+	kernels._eStatisticsKernel.setArg(index++, _eLayer._thresholdsPrev);
+	kernels._eStatisticsKernel.setArg(index++, _eLayer._states);
+	kernels._eStatisticsKernel.setArg(index++, _eLayer._stateAverages);
+	kernels._eStatisticsKernel.setArg(index++, eFeedForwardDims);
+	kernels._eStatisticsKernel.setArg(index++, eDims);
+	kernels._eStatisticsKernel.setArg(index++, iDims);
+	kernels._eStatisticsKernel.setArg(index++, eDimsToEFeedForwardDims);
+	kernels._eStatisticsKernel.setArg(index++, eDimsToIDims);
+	kernels._eStatisticsKernel.setArg(index++, _config._eFeedForwardRadius);
+	kernels._eStatisticsKernel.setArg(index++, _config._eFeedBackRadius);
+	kernels._eStatisticsKernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
+	kernels._eStatisticsKernel.setArg(index++, _config._batchSize);
+	kernels._eStatisticsKernel.setArg(index++, cl::Local(groupSize * sizeof(cl_float)));
+	kernels._eStatisticsKernel.setArg(index++, cl::Local(groupSize * sizeof(cl_uint)));
+
+	cs.enqueueKernel(kernels._eStatisticsKernel, cl::NDRange(groupSize), cl::NDRange(groupSize),
+		{ feedForwardInputs, _iLayer._statesPrev, _eFeedForwardWeights._weightsPrev, _eFeedBackWeights._weightsPrev, _eLayer._thresholdsPrev, _eLayer._states, _eLayer._stateAverages },
+		{ statistics }, "eStatistics");
+
+	// Inhibitory, the top layer has no feed back input and binds its own states in its place
+	groupSize = getStatisticsGroupSize(cs, kernels._iStatisticsKernel);
+
+	const cl::Image2D &feedBackImage = feedBackInputs != nullptr ? *feedBackInputs : _iLayer._statesPrev;
+
+	index = 0;
+
+	kernels._iStatisticsKernel.setArg(index++, statistics);
+	kernels._iStatisticsKernel.setArg(index++, record + 1);
+	kernels._iStatisticsKernel.setArg(index++, feedBackImage);
+	kernels._iStatisticsKernel.setArg(index++, feedBackInputs != nullptr ? 1 : 0);
+	kernels._iStatisticsKernel.setArg(index++, _eLayer._statesPrev);
+	kernels._iStatisticsKernel.setArg(index++, _iFeedForwardWeights._weightsPrev);
+	kernels._iStatisticsKernel.setArg(index++, _iLateralWeights._weightsPrev);
+	kernels._iStatisticsKernel.setArg(index++, _iFeedBackWeights._weightsPrev);
+	kernels._iStatisticsKernel.setArg(index++, _iLayer._thresholdsPrev);
+	kernels._iStatisticsKernel.setArg(index++, _iLayer._statesPrev);
+	kernels._iStatisticsKernel.setArg(index++, _iLayer._states);
+	kernels._iStatisticsKernel.setArg(index++, _iLayer._stateAverages);
+	kernels._iStatisticsKernel.setArg(index++, eDims);
+	kernels._iStatisticsKernel.setArg(index++, iDims);
+	kernels._iStatisticsKernel.setArg(index++, iFeedBackDims);
+	kernels._iStatisticsKernel.setArg(index++, iDimsToEDims);
+	kernels._iStatisticsKernel.setArg(index++, iDimsToFeedBackDims);
+	kernels._iStatisticsKernel.setArg(index++, _config._iFeedForwardRadius);
+	kernels._iStatisticsKernel.setArg(index++, _config._iLateralRadius);
+	kernels._iStatisticsKernel.setArg(index++, _config._iFeedBackRadius);
+	kernels._iStatisticsKernel.setArg(index++, static_cast<cl_int>(_weightPrecision));
+	kernels._iStatisticsKernel.setArg(index++, _config._batchSize);
+	kernels._iStatisticsKernel.setArg(index++, cl::Local(groupSize * sizeof(cl_float)));
+	kernels._iStatisticsKernel.setArg(index++, cl::Local(groupSize * sizeof(cl_uint)));
+
+	cs.enqueueKernel(kernels._iStatisticsKernel, cl::NDRange(groupSize), cl::NDRange(groupSize),
+		{ feedBackImage, _eLayer._statesPrev, _iFeedForwardWeights._weightsPrev, _iLateralWeights._weightsPrev, _iFeedBackWeights._weightsPrev, _iLayer._thresholdsPrev, _iLayer._statesPrev, _iLayer._states, _iLayer._stateAverages },
+		{ statistics }, "iStatistics");
 }
 
 void EIlayer::stepEnd() {
+	swapBuffers();
+
+	// Select the kernels bound to the swapped buffers
+	_parity = 1 - _parity;
+}
+
+void EIlayer::swapBuffers() {
 	// Swap buffers
 	std::swap(_eLayer._activations, _eLayer._activationsPrev);
 	std::swap(_eLayer._states, _eLayer._statesPrev);
 	std::swap(_eLayer._statesHistory, _eLayer._statesHistoryPrev);
 	std::swap(_eLayer._stateAverages, _eLayer._stateAveragesPrev);
+	std::swap(_eLayer._stateBits, _eLayer._stateBitsPrev);
+	std::swap(_eLayer._spikeList, _eLayer._spikeListPrev);
 
 	std::swap(_iLayer._activations, _iLayer._activationsPrev);
 	std::swap(_iLayer._states, _iLayer._statesPrev);
 	std::swap(_iLayer._statesHistory, _iLayer._statesHistoryPrev);
 	std::swap(_iLayer._stateAverages, _iLayer._stateAveragesPrev);
+	std::swap(_iLayer._stateBits, _iLayer._stateBitsPrev);
+	std::swap(_iLayer._spikeList, _iLayer._spikeListPrev);
 
 	std::swap(_eFeedForwardWeights._weights, _eFeedForwardWeights._weightsPrev);
 	std::swap(_eFeedBackWeights._weights, _eFeedBackWeights._weightsPrev);
@@ -405,4 +1810,115 @@ void EIlayer::stepEnd() {
 	std::swap(_iLateralWeights._weights, _iLateralWeights._weightsPrev);
 	std::swap(_iFeedBackWeights._weights, _iFeedBackWeights._weightsPrev);
 	std::swap(_iLayer._thresholds, _iLayer._thresholdsPrev);
+
+	std::swap(_eFeedForwardWeights._masks, _eFeedForwardWeights._masksPrev);
+	std::swap(_eFeedBackWeights._masks, _eFeedBackWeights._masksPrev);
+	std::swap(_iFeedForwardWeights._masks, _iFeedForwardWeights._masksPrev);
+	std::swap(_iLateralWeights._masks, _iLateralWeights._masksPrev);
+	std::swap(_iFeedBackWeights._masks, _iFeedBackWeights._masksPrev);
+}
+
+void EIlayer::readWeights(sys::ComputeSystem &cs, const cl::Buffer &weights, int radius, int width, int height, int inputWidth, int inputHeight, bool lateral, std::vector<float> &fieldWeights, WeightPrecision weightPrecision) {
+	int layerSize = width * height;
+
+	std::vector<float> data(getWeightsSize(radius, inputWidth, inputHeight, layerSize));
+
+	if (weightPrecision == _float)
+		cs.getQueue().enqueueReadBuffer(weights, CL_TRUE, 0, data.size() * sizeof(float), data.data());
+	else {
+		std::vector<unsigned char> bytes(data.size() * getWeightBytes(weightPrecision));
+
+		cs.getQueue().enqueueReadBuffer(weights, CL_TRUE, 0, bytes.size(), bytes.data());
+
+		for (int i = 0; i < static_cast<int>(data.size()); i++)
+			data[i] = weightPrecision == _half ? halfToFloat(bytes[i * 2] | (bytes[i * 2 + 1] << 8)) : bytes[i] / 255.0f;
+	}
+
+	int diam = radius * 2 + 1;
+
+	int windowWidth = std::min(diam, inputWidth);
+	int windowHeight = std::min(diam, inputHeight);
+
+	float widthRatio = static_cast<float>(inputWidth + 1) / static_cast<float>(width + 1);
+	float heightRatio = static_cast<float>(inputHeight + 1) / static_cast<float>(height + 1);
+
+	fieldWeights.assign(layerSize * diam * diam, 0.0f);
+
+	for (int x = 0; x < width; x++)
+		for (int y = 0; y < height; y++) {
+			int centerX = lateral ? x : static_cast<int>((x + 0.5f) * widthRatio + 0.5f);
+			int centerY = lateral ? y : static_cast<int>((y + 0.5f) * heightRatio + 0.5f);
+
+			// Same as getWeightWindowOrigin in the kernels
+			int originX = std::max(0, std::min(centerX - radius, inputWidth - windowWidth));
+			int originY = std::max(0, std::min(centerY - radius, inputHeight - windowHeight));
+
+			int neuronIndex = x + y * width;
+
+			for (int dx = -radius; dx <= radius; dx++)
+				for (int dy = -radius; dy <= radius; dy++) {
+					int inputX = centerX + dx;
+					int inputY = centerY + dy;
+
+					if (inputX >= 0 && inputX < inputWidth && inputY >= 0 && inputY < inputHeight) {
+						int slot = (inputX - originX) * windowHeight + inputY - originY;
+
+						int wi = (dx + radius) * diam + dy + radius;
+
+						fieldWeights[neuronIndex + wi * layerSize] = data[((slot / 4) * layerSize + neuronIndex) * 4 + slot % 4];
+					}
+				}
+		}
+}
+
+cl::Kernel &EIlayer::getEActivationKernel(Kernels &kernels, bool tiled) const {
+	if (_config._packedStates)
+		return tiled ? kernels._eActivationTiledPackedKernel : kernels._eActivationPackedKernel;
+
+	return tiled ? kernels._eActivationTiledKernel : kernels._eActivationKernel;
+}
+
+cl::NDRange EIlayer::getTiledRange(int width, int height) const {
+	return cl::NDRange((width + _tileSize - 1) / _tileSize * _tileSize, (height + _tileSize - 1) / _tileSize * _tileSize);
+}
+
+std::string EIlayer::getVariantOptions() const {
+	std::ostringstream options;
+
+	options << "-DEI_LAYER_VARIANT"
+		<< " -DEI_E_FEED_FORWARD_DIMS=(int2)(" << _config._eFeedForwardWidth << "," << _config._eFeedForwardHeight << ")"
+		<< " -DEI_E_DIMS=(int2)(" << _config._eWidth << "," << _config._eHeight << ")"
+		<< " -DEI_I_DIMS=(int2)(" << _config._iWidth << "," << _config._iHeight << ")"
+		<< " -DEI_I_FEED_BACK_DIMS=(int2)(" << _config._iFeedBackWidth << "," << _config._iFeedBackHeight << ")"
+		<< " -DEI_E_FEED_FORWARD_RADIUS=" << _config._eFeedForwardRadius
+		<< " -DEI_E_FEED_BACK_RADIUS=" << _config._eFeedBackRadius
+		<< " -DEI_I_FEED_FORWARD_RADIUS=" << _config._iFeedForwardRadius
+		<< " -DEI_I_LATERAL_RADIUS=" << _config._iLateralRadius
+		<< " -DEI_I_FEED_BACK_RADIUS=" << _config._iFeedBackRadius
+		<< " -DEI_WEIGHT_PRECISION=" << static_cast<int>(_weightPrecision)
+		<< " -DEI_FEED_BACK_INPUT=" << (_config._feedBackInput ? 1 : 0);
+
+	return options.str();
+}
+
+int EIlayer::chooseTileSize(sys::ComputeSystem &cs, const cl::Kernel &kernel,
+	cl_float2 dimsToInputDims0, int radius0, cl_float2 dimsToInputDims1, int radius1)
+{
+	// Without dedicated local memory a tile is just another copy in global memory
+	if (cs.getDevice().getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() != CL_LOCAL)
+		return 0;
+
+	size_t workGroupSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(cs.getDevice());
+
+	cl_ulong localMemSize = cs.getDevice().getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() - kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(cs.getDevice());
+
+	for (int tileSize = 16; tileSize >= 4; tileSize /= 2) {
+		cl_int2 tileDims0 = getTileDims(tileSize, dimsToInputDims0, radius0);
+		cl_int2 tileDims1 = getTileDims(tileSize, dimsToInputDims1, radius1);
+
+		if (tileSize * tileSize <= workGroupSize && (tileDims0.x * tileDims0.y + tileDims1.x * tileDims1.y) * sizeof(cl_float) <= localMemSize)
+			return tileSize;
+	}
+
+	return 0;
 }
\ No newline at end of file
@@ -23,16 +23,20 @@ misrepresented as being the original software.
 
 #include "../system/ComputeProgram.h"
 
+#include "Checkpoint.h"
+
+#include <algorithm>
 #include <memory>
 #include <random>
+#include <string>
+#include <vector>
 
 namespace ei {
 	class EIlayer {
 	public:
 		// Kernels this system uses
 		struct Kernels {
-			cl::Kernel _eInitializeKernel;
-			cl::Kernel _iInitializeKernel;
+			cl::Kernel _initializeWeightsKernel;
 
 			cl::Kernel _eActivationKernel;
 			cl::Kernel _iActivationKernel;
@@ -40,10 +44,92 @@ namespace ei {
 			cl::Kernel _eLearnKernel;
 			cl::Kernel _iLearnKernel;
 
+			// Binary activation
+			cl::Kernel _initializeMasksKernel;
+			cl::Kernel _packStatesKernel;
+
+			cl::Kernel _eActivationBinaryKernel;
+			cl::Kernel _iActivationBinaryKernel;
+
+			// Sparse activation
+			cl::Kernel _buildConnectionsKernel;
+			cl::Kernel _eActivationSparseKernel;
+			cl::Kernel _iActivationSparseKernel;
+
+			// Event driven activation
+			cl::Kernel _compactSpikesKernel;
+			cl::Kernel _scatterSpikesKernel;
+			cl::Kernel _integrateKernel;
+
+			// Local memory tiled activation and learning (excitatory, whose fields overlap the most)
+			cl::Kernel _eActivationTiledKernel;
+			cl::Kernel _eLearnTiledKernel;
+
+			// Activation on packed states (Configuration::_packedStates)
+			cl::Kernel _eActivationPackedKernel;
+			cl::Kernel _iActivationPackedKernel;
+			cl::Kernel _eActivationTiledPackedKernel;
+
+			// Learning averaged over the items of a batch (Configuration::_batchSize)
+			cl::Kernel _eLearnBatchKernel;
+			cl::Kernel _iLearnBatchKernel;
+
+			// Activity gated learning
+			cl::Kernel _compactLearnersKernel;
+			cl::Kernel _learnThresholdsKernel;
+			cl::Kernel _eLearnActiveKernel;
+			cl::Kernel _iLearnActiveKernel;
+
+			// Activity statistics
+			cl::Kernel _eStatisticsKernel;
+			cl::Kernel _iStatisticsKernel;
+
+			// Program the kernels were created from, each layer creates its own instances from it
+			cl::Program _program;
+
+			// Set when loaded from a ComputeProgram, which must then outlive the layers. Layers create their instances from
+			// a variant of it specialized to their configuration (EI_LAYER_VARIANT in ei.cl) instead of _program
+			sys::ComputeProgram* _variants;
+
+			Kernels()
+				: _variants(nullptr)
+			{}
+
 			// Load kernels from program
 			void loadFromProgram(sys::ComputeProgram &program);
+			void loadFromProgram(const cl::Program &program);
+		};
+
+		// Counters of the weight sets in random initialization (EIlayer_initializeWeights in ei.cl), shared with the native backend
+		enum InitializationStream {
+			_eFeedForwardStream, _eFeedBackStream, _iFeedForwardStream, _iLateralStream, _iFeedBackStream
+		};
+
+		// Storage of the layer weights (all in [0, 1]). Learning rounds stochastically to the smaller formats
+		enum WeightPrecision {
+			_float, _half, _unorm8
 		};
 
+		// Activity of a neuron population in one step, reduced on the device (recordStatistics). State averages include all batch items
+		struct PopulationStatistics {
+			cl_float _stateAverageMean;
+			cl_float _stateAverageVariance;
+			cl_float _thresholdMin;
+			cl_float _thresholdMax;
+
+			// Spiking neurons, and connected inputs (weight > 0.5) that spiked into the population
+			cl_uint _spikes;
+			cl_uint _synapticEvents;
+		};
+
+		// Positions (int2) of spiking neurons and their count
+		struct SpikeList {
+			cl::Buffer _spikes;
+			cl::Buffer _count;
+		};
+
+		// With packed states _states is a CL_RGBA image of (state, history, average, activation) per neuron, and
+		// _activations, _statesHistory and _stateAverages refer to the same image. Spikes stay in the first channel
 		struct NeuronLayer {
 			cl::Image2D _activations;
 			cl::Image2D _activationsPrev;
@@ -59,11 +145,40 @@ namespace ei {
 
 			cl::Image2D _thresholds;
 			cl::Image2D _thresholdsPrev;
+
+			// States packed into bits, only kept up to date by binary activation
+			cl::Buffer _stateBits;
+			cl::Buffer _stateBitsPrev;
+
+			// Spiking neurons, only kept up to date by event driven activation
+			SpikeList _spikeList;
+			SpikeList _spikeListPrev;
+
+			// Scattered input counts of event driven activation
+			cl::Buffer _excitations;
+			cl::Buffer _inhibitions;
+
+			// Neurons whose weights activity gated learning updates this step, and per neuron (cl_uchar) whether it learned the step before
+			SpikeList _learners;
+			cl::Buffer _learnedPrev;
 		};
 
+		// Weights in linear buffers of getWeightsSize elements (WeightPrecision). Each neuron stores the window of input positions its receptive
+		// field reaches, window slots are grouped in float4 chunks interleaved across neurons (getWeightIndex in ei.cl).
+		// Windows have one size per buffer, so near the input border some slots lie outside the field and stay unused.
+		// With Configuration::_inPlaceWeights both members of a pair refer to the same buffer
 		struct Weights2D {
-			cl::Image3D _weights;
-			cl::Image3D _weightsPrev;
+			cl::Buffer _weights;
+			cl::Buffer _weightsPrev;
+
+			// Connectivity (weight > 0.5) bitmasks, written by the learn kernels
+			cl::Buffer _masks;
+			cl::Buffer _masksPrev;
+
+			// Offsets (cl_char2) of the connected inputs of each neuron and their number, built from _masksPrev by buildConnections.
+			// Only allocated once sparse activation is used
+			cl::Buffer _connections;
+			cl::Buffer _connectionCounts;
 		};
 
 		struct Configuration {
@@ -77,6 +192,24 @@ namespace ei {
 			int _iLateralRadius;
 			int _iFeedBackRadius;
 
+			// One image per population and step instead of four (see NeuronLayer). Activation reads and writes a single
+			// texel per neuron, binary, event driven and persistent activation need the separate images
+			bool _packedStates;
+
+			// Independent inputs simulated together against the same weights and thresholds, learning averages their updates.
+			// Neuron images hold the items stacked vertically (width x height * _batchSize), as do the inputs of a layer.
+			// Must be the same for all layers of a HEInet, binary, event driven, tiled and persistent activation run unbatched only
+			int _batchSize;
+
+			// Whether anything feeds back into the inhibitory neurons, HEInet clears it for its top layer. Specialized kernels
+			// then skip the feed back fields, the generic ones still read the (zero) input they are given
+			bool _feedBackInput;
+
+			// Weights and masks in a single buffer each (Weights2D::_weights and _weightsPrev are the same buffer) instead of one per parity.
+			// Learning reads and writes only the slots of its own neuron, and activation of a step runs before its learning, so the
+			// results are the same at half the weight memory. Thresholds are images and stay double buffered
+			bool _inPlaceWeights;
+
 			Configuration()
 				: _eFeedForwardWidth(8), _eFeedForwardHeight(8),
 				_eWidth(16), _eHeight(16),
@@ -86,15 +219,95 @@ namespace ei {
 				_eFeedBackRadius(6),
 				_iFeedForwardRadius(6),
 				_iLateralRadius(6),
-				_iFeedBackRadius(6)
+				_iFeedBackRadius(6),
+				_packedStates(false),
+				_batchSize(1),
+				_feedBackInput(true),
+				_inPlaceWeights(false)
 			{}
 		};
 
 	private:
 		std::shared_ptr<Kernels> _kernels;
 
+		// Kernel instances owned by this layer, one per buffer parity with all image and buffer arguments bound once.
+		// stepEnd swaps the handles and flips _parity instead of re-binding, and layers never share a kernel object
+		Kernels _parityKernels[2];
+		int _parity;
+
 		Configuration _config;
 
+		WeightPrecision _weightPrecision;
+
+		// Seed of the stochastic rounding, advanced every learn call
+		cl_uint2 _roundingSeed;
+
+		// Activate from the connection lists (setSparseActivation)
+		bool _sparseActivation;
+
+		// Only learn the weights of neurons with state history above _minLearnHistory (setActivityGatedLearning)
+		bool _activityGatedLearning;
+		float _minLearnHistory;
+
+		// The _learnedPrev flags belong to the previous learn call (false after dense learning or a persistent settle)
+		bool _learnedPrevCurrent;
+
+		// Work-group edge of the tiled kernels (0 if not used) and their feed forward and feed back tiles
+		int _tileSize;
+		cl_int2 _feedForwardTileDims;
+		cl_int2 _feedBackTileDims;
+
+		// Allocate and clear images and buffers except the weights, then create the weights (wrapping hostPtr if not null)
+		// and finish by building the masks of the previous weights, choosing tiles and binding the kernels
+		void create(const Configuration &config,
+			float initEThreshold, float initIThreshold,
+			float sparsityE, float sparsityI,
+			sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &eilKernels, WeightPrecision weightPrecision);
+		void createWeights(sys::ComputeSystem &cs, Weights2D &weights, int size, void* hostPtr);
+		void createMasks(sys::ComputeSystem &cs, Weights2D &weights, int size);
+		void createConnections(sys::ComputeSystem &cs, Weights2D &weights, int radius, int width, int height, int inputWidth, int inputHeight);
+		void finishCreate(sys::ComputeSystem &cs);
+
+		// Checkpoint sections of a weight set and of the thresholds and state averages of a population
+		bool writeWeights(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &name, const Weights2D &weights, int size) const;
+		bool writeNeurons(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &prefix, const NeuronLayer &layer, int width, int height) const;
+		bool loadWeights(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &name, Weights2D &weights, int size, bool wrapHostMemory);
+		bool loadNeurons(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &prefix, NeuronLayer &layer, int width, int height);
+
+		cl::NDRange getTiledRange(int width, int height) const;
+
+		// Build options of the program variant specialized to the configuration and weight precision
+		std::string getVariantOptions() const;
+
+		// Excitatory activation kernel for the state layout
+		cl::Kernel &getEActivationKernel(Kernels &kernels, bool tiled) const;
+
+		void bindKernels(Kernels &kernels);
+		void bindSparseKernels(Kernels &kernels);
+		void swapBuffers();
+
+		void initializeWeights(sys::ComputeSystem &cs, Weights2D &weights, int radius, bool lateral, int width, int height, int inputWidth, int inputHeight,
+			float minInitWeight, float maxInitWeight, cl_uint2 seed, InitializationStream stream);
+		void initializeMasks(sys::ComputeSystem &cs, Weights2D &weights, int radius, bool lateral, int width, int height, int inputWidth, int inputHeight);
+		void packStates(sys::ComputeSystem &cs, const cl::Image2D &states, const cl::Buffer &stateBits, int width, int height);
+		void buildConnections(sys::ComputeSystem &cs, Weights2D &weights, int radius, int width, int height);
+		void compactStates(sys::ComputeSystem &cs, const cl::Image2D &states, const SpikeList &spikeList, int width, int height);
+		void scatterSpikes(sys::ComputeSystem &cs, const SpikeList &spikeList, const cl::Buffer &masksPrev, const cl::Buffer &accumulators,
+			int width, int height, int inputWidth, int inputHeight, cl_float2 dimsToInputDims, int radius, bool lateral);
+		void integrate(sys::ComputeSystem &cs, NeuronLayer &layer, int width, int height, float eta, float shDecay, float saDecay);
+		void compactLearners(sys::ComputeSystem &cs, const NeuronLayer &layer, int width, int height, bool readPrev);
+		void learnThresholds(sys::ComputeSystem &cs, const NeuronLayer &layer, int width, int height, float delta, float sparsity);
+		void learnActive(sys::ComputeSystem &cs,
+			const cl::Image2D &feedForwardInputsPrev, const cl::Image2D &feedBackInputsPrev,
+			float eAlpha, float eBeta, float eDelta,
+			float iAlpha, float iBeta, float iGamma, float iDelta,
+			float sparsityE, float sparsityI);
+
+		void copyToPersistent(sys::ComputeSystem &cs, const NeuronLayer &layer, const cl::Buffer &state, int offset, int width, int height);
+		void copyFromPersistent(sys::ComputeSystem &cs, NeuronLayer &layer, const cl::Buffer &state, int offset, int width, int height);
+		void copyToPersistent(sys::ComputeSystem &cs, const Weights2D &weights, const cl::Buffer &buffer, int offset, int size);
+		void copyFromPersistent(sys::ComputeSystem &cs, Weights2D &weights, const cl::Buffer &buffer, int offset, int size);
+
 	public:
 		// Image sets
 		NeuronLayer _eLayer;
@@ -106,18 +319,82 @@ namespace ei {
 		Weights2D _iLateralWeights;
 		Weights2D _iFeedBackWeights;
 
+		EIlayer()
+			: _parity(0), _weightPrecision(_float), _sparseActivation(false), _activityGatedLearning(false), _minLearnHistory(0.0f), _learnedPrevCurrent(false), _tileSize(0)
+		{}
+
 		// Create with random weights
 		void createRandom(const Configuration &config,
 			float minInitEWeight, float maxInitEWeight,
 			float minInitIWeight, float maxInitIWeight,
 			float initEThreshold, float initIThreshold,
 			float sparsityE, float sparsityI,
-			sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &eilKernels, std::mt19937 &generator);
+			sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &eilKernels, std::mt19937 &generator,
+			WeightPrecision weightPrecision = _float);
+
+		// Write the configuration, weights, thresholds and state averages of the previous step as checkpoint sections named prefix.*
+		bool writeCheckpoint(sys::ComputeSystem &cs, Checkpoint &checkpoint, const std::string &prefix) const;
+
+		// Create from the sections of writeCheckpoint instead of random weights. Returns false if one is missing or does not match.
+		// wrapHostMemory lets the previous weights use the mapped sections in place (CL_MEM_USE_HOST_PTR), the checkpoint
+		// must then stay open as long as the layer exists. Otherwise they are uploaded straight from the mapping
+		bool createFromCheckpoint(Checkpoint &checkpoint, const std::string &prefix, bool wrapHostMemory,
+			sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &eilKernels);
 
 		// Find sparse codes
 		void eActivate(sys::ComputeSystem &cs, const cl::Image2D &feedForwardInputs, float eta, float shDecay, float saDecay);
 		void iActivate(sys::ComputeSystem &cs, const cl::Image2D &feedBackInputs, float eta, float shDecay, float saDecay);
 
+		// Find sparse codes from bit-packed spike maps (AND + popcount against the connectivity masks). Same result as
+		// eActivate/iActivate since inputs and states are binary, also packs the resulting states into _stateBits
+		void eActivateBinary(sys::ComputeSystem &cs, const cl::Buffer &feedForwardInputBits, float eta, float shDecay, float saDecay);
+		void iActivateBinary(sys::ComputeSystem &cs, const cl::Buffer &feedBackInputBits, float eta, float shDecay, float saDecay);
+
+		// Pack _statesPrev into _stateBitsPrev, needed when switching to binary activation mid run
+		void packStatesPrev(sys::ComputeSystem &cs);
+
+		// Find sparse codes by scattering the spike lists of the previous step to the connected neurons (mask bits), so the cost
+		// scales with the number of spikes instead of the receptive field sizes. Same result as eActivate/iActivate,
+		// also compacts the resulting states into _spikeList
+		void eActivateEvents(sys::ComputeSystem &cs, const SpikeList &feedForwardSpikes, float eta, float shDecay, float saDecay);
+		void iActivateEvents(sys::ComputeSystem &cs, const SpikeList &feedBackSpikes, float eta, float shDecay, float saDecay);
+
+		// Sparse activation: eActivate/iActivate walk per neuron lists of the connected inputs instead of whole receptive fields,
+		// so their cost follows the number of connections. Allocates the lists on first use and builds them. Not available with
+		// packed states or radii above 127
+		void setSparseActivation(sys::ComputeSystem &cs, bool sparseActivation);
+
+		bool getSparseActivation() const {
+			return _sparseActivation;
+		}
+
+		// Rebuild the connection lists from the previous connectivity masks. Activation sees connections that learning
+		// made or broke only after the next rebuild
+		void buildConnections(sys::ComputeSystem &cs);
+
+		// Activity gated learning: learn compacts the neurons whose postsynaptic histories are above minHistory (this step for
+		// excitatory, this or the previous step for inhibitory neurons) and only updates their weights, thresholds are still updated
+		// everywhere. With double buffered weights a neuron is listed one more step to copy its weights into the buffer it skipped.
+		// With minHistory 0 only zero updates are skipped, above it smaller updates are dropped. With in place weights connections
+		// from inputs at or below minHistory are skipped as well. Batched layers keep dense learning
+		void setActivityGatedLearning(bool activityGatedLearning, float minHistory = 0.0f) {
+			_activityGatedLearning = activityGatedLearning;
+			_minLearnHistory = minHistory;
+		}
+
+		bool getActivityGatedLearning() const {
+			return _activityGatedLearning;
+		}
+
+		// Keep spike lists and spike maps current when another activation path ran this step
+		void eCompactStates(sys::ComputeSystem &cs);
+		void iCompactStates(sys::ComputeSystem &cs);
+		void ePackStates(sys::ComputeSystem &cs);
+		void iPackStates(sys::ComputeSystem &cs);
+
+		// Compact _statesPrev into _spikeListPrev, needed when switching to event driven activation mid run
+		void compactStatesPrev(sys::ComputeSystem &cs);
+
 		// Learn sparse codes
 		void learn(sys::ComputeSystem &cs,
 			const cl::Image2D &feedForwardInputs, const cl::Image2D &feedForwardInputsPrev,
@@ -126,9 +403,81 @@ namespace ei {
 			float iAlpha, float iBeta, float iGamma, float iDelta,
 			float sparsityE, float sparsityI);
 
+		// Reduce the activity of this step into records record (E) and record + 1 (I) of a PopulationStatistics buffer, by one work-group
+		// per population. Call after activation and before stepEnd with the inputs activation read, feedBackInputs nullptr for the top layer
+		void recordStatistics(sys::ComputeSystem &cs, const cl::Image2D &feedForwardInputs, const cl::Image2D* feedBackInputs, const cl::Buffer &statistics, int record);
+
 		// End of simulation step
 		void stepEnd();
 
+		// Persistent settle (HEInet::settlePersistent). Copy the previous step into a state buffer (E and I blocks of
+		// getPersistentPopulationArrays() arrays each) and a weight buffer (all five sets back to back, starting at weightsOffset, _float precision only)
+		void copyToPersistent(sys::ComputeSystem &cs, const cl::Buffer &state, int eOffset, int iOffset, const cl::Buffer &weights, int weightsOffset);
+
+		// Copy the settled state back into the current images, call stepEnd and then updateMasksPrev afterwards
+		void copyFromPersistent(sys::ComputeSystem &cs, const cl::Buffer &state, int eOffset, int iOffset, const cl::Buffer &weights, int weightsOffset);
+
+		// Rebuild the previous connectivity masks from the previous weights
+		void updateMasksPrev(sys::ComputeSystem &cs);
+
+		// Number of weights in all five weight buffers
+		int getNumWeights() const;
+
+		// Number of connections of all receptive fields clipped at the input borders, without the padding slots of getNumWeights
+		long long getNumConnections() const {
+			return getNumConnections(_config);
+		}
+
+		static long long getNumConnections(const Configuration &config);
+
+		// Read weights back in receptive field layout (x + y * width + wi * width * height, wi = (dx + r) * (2r + 1) + dy + r),
+		// positions outside the input read as 0
+		static void readWeights(sys::ComputeSystem &cs, const cl::Buffer &weights, int radius, int width, int height,
+			int inputWidth, int inputHeight, bool lateral, std::vector<float> &fieldWeights, WeightPrecision weightPrecision = _float);
+
+		// Arrays per neuron population in the persistent state buffer (activations, thresholds, state averages, 2 states, 2 state histories)
+		static int getPersistentPopulationArrays() {
+			return 7;
+		}
+
+		// Number of weights in a weight buffer, min(2r+1, input size) window slots per axis rounded up to whole float4 chunks.
+		// Only inputs smaller than the field are compacted, border neurons of larger inputs keep padded windows (getNumConnections)
+		static int getWeightsSize(int radius, int inputWidth, int inputHeight, int layerSize) {
+			return (std::min(radius * 2 + 1, inputWidth) * std::min(radius * 2 + 1, inputHeight) + 3) / 4 * layerSize * 4;
+		}
+
+		// Bytes per weight
+		static int getWeightBytes(WeightPrecision weightPrecision) {
+			return weightPrecision == _unorm8 ? 1 : (weightPrecision == _half ? 2 : 4);
+		}
+
+		// Largest square work-group (16, 8 or 4 wide) of a tiled kernel whose two input tiles fit in local memory,
+		// 0 if nothing fits or the device has no dedicated local memory
+		static int chooseTileSize(sys::ComputeSystem &cs, const cl::Kernel &kernel,
+			cl_float2 dimsToInputDims0, int radius0, cl_float2 dimsToInputDims1, int radius1);
+
+		// Input positions the receptive fields of a tileSize x tileSize work-group can reach
+		static cl_int2 getTileDims(int tileSize, cl_float2 dimsToInputDims, int radius) {
+			cl_int2 tileDims = { static_cast<int>((tileSize - 1) * dimsToInputDims.x) + radius * 2 + 3, static_cast<int>((tileSize - 1) * dimsToInputDims.y) + radius * 2 + 3 };
+
+			return tileDims;
+		}
+
+		// Number of words in a spike map packed by column (32 rows per word)
+		static int getSpikeBitsSize(int width, int height) {
+			return width * ((height + 31) / 32);
+		}
+
+		// Number of entries of a connection list buffer, room for every window slot of every neuron
+		static int getConnectionsSize(int radius, int inputWidth, int inputHeight, int layerSize) {
+			return std::min(radius * 2 + 1, inputWidth) * std::min(radius * 2 + 1, inputHeight) * layerSize;
+		}
+
+		// Number of words in the connectivity masks of one neuron, each receptive field column (2r+1 rows) takes whole words
+		static int getMaskSize(int radius) {
+			return (radius * 2 + 1) * ((radius * 2 + 32) / 32);
+		}
+
 		const std::shared_ptr<Kernels> &getKernels() const {
 			return _kernels;
 		}
@@ -136,5 +485,9 @@ namespace ei {
 		const Configuration &getConfig() const {
 			return _config;
 		}
+
+		WeightPrecision getWeightPrecision() const {
+			return _weightPrecision;
+		}
 	};
 }
\ No newline at end of file
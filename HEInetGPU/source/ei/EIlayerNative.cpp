@@ -0,0 +1,399 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "EIlayerNative.h"
+
+#include "NativeKernels.h"
+
+#include <algorithm>
+
+using namespace ei;
+
+namespace {
+	float stdp(float preHist, float postHist, float weight, float a, float b) {
+		if (preHist <= postHist)
+			return a * preHist * postHist * (1.0f - weight);
+
+		return -b * preHist * postHist * weight;
+	}
+
+	float rstdp(float preHist, float postHist, float weight, float a, float b) {
+		if (preHist >= postHist)
+			return a * preHist * postHist * (1.0f - weight);
+
+		return -b * preHist * postHist * weight;
+	}
+
+	// Fill weights of a layer the same way EIlayer_initializeWeights does, one counter (neuron, field slot, stream) per synapse
+	void initializeWeights(EIlayerNative::Image &weights, int width, int height, int size, float minWeight, float maxWeight, cl_uint2 seed, EIlayer::InitializationStream stream) {
+		int layerSize = width * height;
+
+		weights.resize(layerSize * size);
+
+		for (int wi = 0; wi < size; wi++)
+			for (int i = 0; i < layerSize; i++)
+				weights[i + wi * layerSize] = native::philoxFloat(i, wi, stream, seed) * (maxWeight - minWeight) + minWeight;
+	}
+
+	// Rows per thread pool task
+	const int rowGrain = 2;
+}
+
+void EIlayerNative::createRandom(const EIlayer::Configuration &config,
+	float minInitEWeight, float maxInitEWeight,
+	float minInitIWeight, float maxInitIWeight,
+	float initEThreshold, float initIThreshold,
+	float sparsityE, float sparsityI,
+	sys::ComputeSystem &, std::mt19937 &generator)
+{
+	_config = config;
+
+	// Total size (number of weights) in receptive fields
+	int eFeedForwardSize = std::pow(_config._eFeedForwardRadius * 2 + 1, 2);
+	int eFeedBackSize = std::pow(_config._eFeedBackRadius * 2 + 1, 2);
+	int iFeedForwardSize = std::pow(_config._iFeedForwardRadius * 2 + 1, 2);
+	int iLateralSize = std::pow(_config._iLateralRadius * 2 + 1, 2);
+	int iFeedBackSize = std::pow(_config._iFeedBackRadius * 2 + 1, 2);
+
+	int eSize = _config._eWidth * _config._eHeight;
+	int iSize = _config._iWidth * _config._iHeight;
+
+	// Clear to defaults
+	_eLayer._activations.assign(eSize, 0.0f);
+	_eLayer._activationsPrev.assign(eSize, 0.0f);
+	_eLayer._states.assign(eSize, 0.0f);
+	_eLayer._statesPrev.assign(eSize, 0.0f);
+	_eLayer._statesHistory.assign(eSize, 0.0f);
+	_eLayer._statesHistoryPrev.assign(eSize, 0.0f);
+	_eLayer._stateAverages.assign(eSize, sparsityE);
+	_eLayer._stateAveragesPrev.assign(eSize, sparsityE);
+	_eLayer._thresholds.assign(eSize, initEThreshold);
+	_eLayer._thresholdsPrev.assign(eSize, initEThreshold);
+
+	_iLayer._activations.assign(iSize, 0.0f);
+	_iLayer._activationsPrev.assign(iSize, 0.0f);
+	_iLayer._states.assign(iSize, 0.0f);
+	_iLayer._statesPrev.assign(iSize, 0.0f);
+	_iLayer._statesHistory.assign(iSize, 0.0f);
+	_iLayer._statesHistoryPrev.assign(iSize, 0.0f);
+	_iLayer._stateAverages.assign(iSize, sparsityI);
+	_iLayer._stateAveragesPrev.assign(iSize, sparsityI);
+	_iLayer._thresholds.assign(iSize, initIThreshold);
+	_iLayer._thresholdsPrev.assign(iSize, initIThreshold);
+
+	// Weight RNG keys, full 32 bit
+	cl_uint2 seedE = { static_cast<cl_uint>(generator()), static_cast<cl_uint>(generator()) };
+	cl_uint2 seedI = { static_cast<cl_uint>(generator()), static_cast<cl_uint>(generator()) };
+
+	// Rounding seed of EIlayer, unused here
+	std::uniform_int_distribution<int> seedDist(0, 10000);
+
+	seedDist(generator);
+	seedDist(generator);
+
+	// Initialize weights
+	initializeWeights(_eFeedForwardWeights._weightsPrev, _config._eWidth, _config._eHeight, eFeedForwardSize, minInitEWeight, maxInitEWeight, seedE, EIlayer::_eFeedForwardStream);
+	initializeWeights(_eFeedBackWeights._weightsPrev, _config._eWidth, _config._eHeight, eFeedBackSize, minInitIWeight, maxInitIWeight, seedE, EIlayer::_eFeedBackStream);
+	initializeWeights(_iFeedForwardWeights._weightsPrev, _config._iWidth, _config._iHeight, iFeedForwardSize, minInitIWeight, maxInitIWeight, seedI, EIlayer::_iFeedForwardStream);
+	initializeWeights(_iLateralWeights._weightsPrev, _config._iWidth, _config._iHeight, iLateralSize, minInitIWeight, maxInitIWeight, seedI, EIlayer::_iLateralStream);
+	initializeWeights(_iFeedBackWeights._weightsPrev, _config._iWidth, _config._iHeight, iFeedBackSize, minInitIWeight, maxInitIWeight, seedI, EIlayer::_iFeedBackStream);
+
+	_eFeedForwardWeights._weights = _eFeedForwardWeights._weightsPrev;
+	_eFeedBackWeights._weights = _eFeedBackWeights._weightsPrev;
+	_iFeedForwardWeights._weights = _iFeedForwardWeights._weightsPrev;
+	_iLateralWeights._weights = _iLateralWeights._weightsPrev;
+	_iFeedBackWeights._weights = _iFeedBackWeights._weightsPrev;
+}
+
+void EIlayerNative::eActivate(sys::ComputeSystem &cs, const Image &feedForwardInputs, float eta, float shDecay, float saDecay) {
+	float eDimsToEFeedForwardDimsX = static_cast<float>(_config._eFeedForwardWidth + 1) / static_cast<float>(_config._eWidth + 1);
+	float eDimsToEFeedForwardDimsY = static_cast<float>(_config._eFeedForwardHeight + 1) / static_cast<float>(_config._eHeight + 1);
+	float eDimsToIDimsX = static_cast<float>(_config._iWidth + 1) / static_cast<float>(_config._eWidth + 1);
+	float eDimsToIDimsY = static_cast<float>(_config._iHeight + 1) / static_cast<float>(_config._eHeight + 1);
+
+	cs.getThreadPool().parallelFor(_config._eHeight, rowGrain, [&](int yBegin, int yEnd) {
+		std::vector<float> excitation(_config._eWidth);
+		std::vector<float> inhibition(_config._eWidth);
+
+		for (int y = yBegin; y < yEnd; y++) {
+			std::fill(excitation.begin(), excitation.end(), 0.0f);
+			std::fill(inhibition.begin(), inhibition.end(), 0.0f);
+
+			// Feed forward (excitatory)
+			native::sumConnected(feedForwardInputs.data(), _config._eFeedForwardWidth, _config._eFeedForwardHeight,
+				_eFeedForwardWeights._weightsPrev.data(), _config._eWidth, _config._eHeight,
+				eDimsToEFeedForwardDimsX, eDimsToEFeedForwardDimsY, _config._eFeedForwardRadius, false,
+				y, 0, _config._eWidth, excitation.data());
+
+			// Feed back (inhibitory)
+			native::sumConnected(_iLayer._statesPrev.data(), _config._iWidth, _config._iHeight,
+				_eFeedBackWeights._weightsPrev.data(), _config._eWidth, _config._eHeight,
+				eDimsToIDimsX, eDimsToIDimsY, _config._eFeedBackRadius, false,
+				y, 0, _config._eWidth, inhibition.data());
+
+			for (int x = 0; x < _config._eWidth; x++) {
+				int i = x + y * _config._eWidth;
+
+				float activation = (1.0f - eta) * _eLayer._activationsPrev[i] + (excitation[x] - inhibition[x]);
+
+				float state = 0.0f;
+
+				if (activation > _eLayer._thresholdsPrev[i]) { // Includes refractory period
+					state = 1.0f;
+
+					activation = 0.0f;
+				}
+
+				_eLayer._activations[i] = activation;
+				_eLayer._states[i] = state;
+				_eLayer._statesHistory[i] = std::max((1.0f - shDecay) * _eLayer._statesHistoryPrev[i], state);
+				_eLayer._stateAverages[i] = (1.0f - saDecay) * _eLayer._stateAveragesPrev[i] + saDecay * state;
+			}
+		}
+	});
+}
+
+void EIlayerNative::iActivate(sys::ComputeSystem &cs, const Image &feedBackInputs, float eta, float shDecay, float saDecay) {
+	float iDimsToEDimsX = static_cast<float>(_config._eWidth + 1) / static_cast<float>(_config._iWidth + 1);
+	float iDimsToEDimsY = static_cast<float>(_config._eHeight + 1) / static_cast<float>(_config._iHeight + 1);
+	float iDimsToFeedBackDimsX = static_cast<float>(_config._iFeedBackWidth + 1) / static_cast<float>(_config._iWidth + 1);
+	float iDimsToFeedBackDimsY = static_cast<float>(_config._iFeedBackHeight + 1) / static_cast<float>(_config._iHeight + 1);
+
+	cs.getThreadPool().parallelFor(_config._iHeight, rowGrain, [&](int yBegin, int yEnd) {
+		std::vector<float> excitation(_config._iWidth);
+		std::vector<float> inhibition(_config._iWidth);
+
+		for (int y = yBegin; y < yEnd; y++) {
+			std::fill(excitation.begin(), excitation.end(), 0.0f);
+			std::fill(inhibition.begin(), inhibition.end(), 0.0f);
+
+			// Feed forward (excitatory)
+			native::sumConnected(_eLayer._statesPrev.data(), _config._eWidth, _config._eHeight,
+				_iFeedForwardWeights._weightsPrev.data(), _config._iWidth, _config._iHeight,
+				iDimsToEDimsX, iDimsToEDimsY, _config._iFeedForwardRadius, false,
+				y, 0, _config._iWidth, excitation.data());
+
+			// Feed back (inhibitory)
+			native::sumConnected(feedBackInputs.data(), _config._iFeedBackWidth, _config._iFeedBackHeight,
+				_iFeedBackWeights._weightsPrev.data(), _config._iWidth, _config._iHeight,
+				iDimsToFeedBackDimsX, iDimsToFeedBackDimsY, _config._iFeedBackRadius, false,
+				y, 0, _config._iWidth, inhibition.data());
+
+			// Lateral (inhibitory)
+			native::sumConnected(_iLayer._statesPrev.data(), _config._iWidth, _config._iHeight,
+				_iLateralWeights._weightsPrev.data(), _config._iWidth, _config._iHeight,
+				1.0f, 1.0f, _config._iLateralRadius, true,
+				y, 0, _config._iWidth, inhibition.data());
+
+			for (int x = 0; x < _config._iWidth; x++) {
+				int i = x + y * _config._iWidth;
+
+				float activation = (1.0f - eta) * _iLayer._activationsPrev[i] + (excitation[x] - inhibition[x]);
+
+				float state = 0.0f;
+
+				if (activation > _iLayer._thresholdsPrev[i]) { // Includes refractory period
+					state = 1.0f;
+
+					activation = 0.0f;
+				}
+
+				_iLayer._activations[i] = activation;
+				_iLayer._states[i] = state;
+				_iLayer._statesHistory[i] = std::max((1.0f - shDecay) * _iLayer._statesHistoryPrev[i], state);
+				_iLayer._stateAverages[i] = (1.0f - saDecay) * _iLayer._stateAveragesPrev[i] + saDecay * state;
+			}
+		}
+	});
+}
+
+void EIlayerNative::learn(sys::ComputeSystem &cs,
+	const Image &, const Image &feedForwardInputsPrev,
+	const Image &, const Image &feedBackInputsPrev,
+	float eAlpha, float eBeta, float eDelta,
+	float iAlpha, float iBeta, float iGamma, float iDelta,
+	float sparsityE, float sparsityI)
+{
+	float eDimsToEFeedForwardDimsX = static_cast<float>(_config._eFeedForwardWidth + 1) / static_cast<float>(_config._eWidth + 1);
+	float eDimsToEFeedForwardDimsY = static_cast<float>(_config._eFeedForwardHeight + 1) / static_cast<float>(_config._eHeight + 1);
+	float eDimsToIDimsX = static_cast<float>(_config._iWidth + 1) / static_cast<float>(_config._eWidth + 1);
+	float eDimsToIDimsY = static_cast<float>(_config._iHeight + 1) / static_cast<float>(_config._eHeight + 1);
+
+	float iDimsToEDimsX = static_cast<float>(_config._eWidth + 1) / static_cast<float>(_config._iWidth + 1);
+	float iDimsToEDimsY = static_cast<float>(_config._eHeight + 1) / static_cast<float>(_config._iHeight + 1);
+	float iDimsToFeedBackDimsX = static_cast<float>(_config._iFeedBackWidth + 1) / static_cast<float>(_config._iWidth + 1);
+	float iDimsToFeedBackDimsY = static_cast<float>(_config._iFeedBackHeight + 1) / static_cast<float>(_config._iHeight + 1);
+
+	int eLayerSize = _config._eWidth * _config._eHeight;
+	int iLayerSize = _config._iWidth * _config._iHeight;
+
+	// Excitatory
+	cs.getThreadPool().parallelFor(_config._eHeight, rowGrain, [&](int yBegin, int yEnd) {
+		for (int y = yBegin; y < yEnd; y++)
+			for (int x = 0; x < _config._eWidth; x++) {
+				int i = x + y * _config._eWidth;
+
+				int feedForwardCenterX = native::centerPosition(x, eDimsToEFeedForwardDimsX);
+				int feedForwardCenterY = native::centerPosition(y, eDimsToEFeedForwardDimsY);
+				int feedBackCenterX = native::centerPosition(x, eDimsToIDimsX);
+				int feedBackCenterY = native::centerPosition(y, eDimsToIDimsY);
+
+				float eStateHistory = _eLayer._statesHistory[i];
+
+				float kurt = _eLayer._stateAveragesPrev[i] - sparsityE;
+
+				float eLearn = std::max(0.0f, -kurt);
+				float iLearn = std::max(0.0f, kurt);
+
+				int wi = 0;
+
+				// Feed forward (excitatory)
+				for (int dx = -_config._eFeedForwardRadius; dx <= _config._eFeedForwardRadius; dx++)
+					for (int dy = -_config._eFeedForwardRadius; dy <= _config._eFeedForwardRadius; dy++, wi++) {
+						int inputX = feedForwardCenterX + dx;
+						int inputY = feedForwardCenterY + dy;
+
+						if (inputX >= 0 && inputX < _config._eFeedForwardWidth && inputY >= 0 && inputY < _config._eFeedForwardHeight) {
+							float inputPrev = feedForwardInputsPrev[inputX + inputY * _config._eFeedForwardWidth];
+
+							float weightPrev = _eFeedForwardWeights._weightsPrev[i + wi * eLayerSize];
+
+							_eFeedForwardWeights._weights[i + wi * eLayerSize] = std::min(1.0f, std::max(0.0f, weightPrev + eAlpha * stdp(inputPrev, eStateHistory, weightPrev, eLearn, iLearn)));
+						}
+					}
+
+				wi = 0;
+
+				// Feed back (inhibitory)
+				for (int dx = -_config._eFeedBackRadius; dx <= _config._eFeedBackRadius; dx++)
+					for (int dy = -_config._eFeedBackRadius; dy <= _config._eFeedBackRadius; dy++, wi++) {
+						int inputX = feedBackCenterX + dx;
+						int inputY = feedBackCenterY + dy;
+
+						if (inputX >= 0 && inputX < _config._iWidth && inputY >= 0 && inputY < _config._iHeight) {
+							float inputPrev = _iLayer._statesHistoryPrev[inputX + inputY * _config._iWidth];
+
+							float weightPrev = _eFeedBackWeights._weightsPrev[i + wi * eLayerSize];
+
+							_eFeedBackWeights._weights[i + wi * eLayerSize] = std::min(1.0f, std::max(0.0f, weightPrev + eBeta * stdp(inputPrev, eStateHistory, weightPrev, iLearn, eLearn)));
+						}
+					}
+
+				_eLayer._thresholds[i] = _eLayer._thresholdsPrev[i] + eDelta * kurt;
+			}
+	});
+
+	// Inhibitory
+	cs.getThreadPool().parallelFor(_config._iHeight, rowGrain, [&](int yBegin, int yEnd) {
+		for (int y = yBegin; y < yEnd; y++)
+			for (int x = 0; x < _config._iWidth; x++) {
+				int i = x + y * _config._iWidth;
+
+				int feedForwardCenterX = native::centerPosition(x, iDimsToEDimsX);
+				int feedForwardCenterY = native::centerPosition(y, iDimsToEDimsY);
+				int feedBackCenterX = native::centerPosition(x, iDimsToFeedBackDimsX);
+				int feedBackCenterY = native::centerPosition(y, iDimsToFeedBackDimsY);
+
+				float iStateHistory = _iLayer._statesHistory[i];
+				float iStateHistoryPrev = _iLayer._statesHistoryPrev[i];
+
+				float kurt = _iLayer._stateAveragesPrev[i] - sparsityI;
+
+				float eLearn = std::max(0.0f, -kurt);
+				float iLearn = std::max(0.0f, kurt);
+
+				int wi = 0;
+
+				// Feed forward (excitatory)
+				for (int dx = -_config._iFeedForwardRadius; dx <= _config._iFeedForwardRadius; dx++)
+					for (int dy = -_config._iFeedForwardRadius; dy <= _config._iFeedForwardRadius; dy++, wi++) {
+						int inputX = feedForwardCenterX + dx;
+						int inputY = feedForwardCenterY + dy;
+
+						if (inputX >= 0 && inputX < _config._eWidth && inputY >= 0 && inputY < _config._eHeight) {
+							float input = _eLayer._statesHistory[inputX + inputY * _config._eWidth];
+
+							float weightPrev = _iFeedForwardWeights._weightsPrev[i + wi * iLayerSize];
+
+							_iFeedForwardWeights._weights[i + wi * iLayerSize] = std::min(1.0f, std::max(0.0f, weightPrev + iAlpha * rstdp(input, iStateHistoryPrev, weightPrev, eLearn, iLearn)));
+						}
+					}
+
+				wi = 0;
+
+				// Feed back (inhibitory)
+				for (int dx = -_config._iFeedBackRadius; dx <= _config._iFeedBackRadius; dx++)
+					for (int dy = -_config._iFeedBackRadius; dy <= _config._iFeedBackRadius; dy++, wi++) {
+						int inputX = feedBackCenterX + dx;
+						int inputY = feedBackCenterY + dy;
+
+						if (inputX >= 0 && inputX < _config._iFeedBackWidth && inputY >= 0 && inputY < _config._iFeedBackHeight) {
+							float inputPrev = feedBackInputsPrev[inputX + inputY * _config._iFeedBackWidth];
+
+							float weightPrev = _iFeedBackWeights._weightsPrev[i + wi * iLayerSize];
+
+							_iFeedBackWeights._weights[i + wi * iLayerSize] = std::min(1.0f, std::max(0.0f, weightPrev + iBeta * stdp(inputPrev, iStateHistory, weightPrev, iLearn, eLearn)));
+						}
+					}
+
+				wi = 0;
+
+				// Lateral (inhibitory)
+				for (int dx = -_config._iLateralRadius; dx <= _config._iLateralRadius; dx++)
+					for (int dy = -_config._iLateralRadius; dy <= _config._iLateralRadius; dy++, wi++) {
+						int inputX = x + dx;
+						int inputY = y + dy;
+
+						if (inputX >= 0 && inputX < _config._iWidth && inputY >= 0 && inputY < _config._iHeight) {
+							float inputPrev = _iLayer._statesHistoryPrev[inputX + inputY * _config._iWidth];
+
+							float weightPrev = _iLateralWeights._weightsPrev[i + wi * iLayerSize];
+
+							_iLateralWeights._weights[i + wi * iLayerSize] = std::min(1.0f, std::max(0.0f, weightPrev + iGamma * stdp(inputPrev, iStateHistory, weightPrev, iLearn, eLearn)));
+						}
+					}
+
+				_iLayer._thresholds[i] = _iLayer._thresholdsPrev[i] + iDelta * kurt;
+			}
+	});
+}
+
+void EIlayerNative::stepEnd() {
+	// Swap buffers
+	std::swap(_eLayer._activations, _eLayer._activationsPrev);
+	std::swap(_eLayer._states, _eLayer._statesPrev);
+	std::swap(_eLayer._statesHistory, _eLayer._statesHistoryPrev);
+	std::swap(_eLayer._stateAverages, _eLayer._stateAveragesPrev);
+
+	std::swap(_iLayer._activations, _iLayer._activationsPrev);
+	std::swap(_iLayer._states, _iLayer._statesPrev);
+	std::swap(_iLayer._statesHistory, _iLayer._statesHistoryPrev);
+	std::swap(_iLayer._stateAverages, _iLayer._stateAveragesPrev);
+
+	std::swap(_eFeedForwardWeights._weights, _eFeedForwardWeights._weightsPrev);
+	std::swap(_eFeedBackWeights._weights, _eFeedBackWeights._weightsPrev);
+	std::swap(_eLayer._thresholds, _eLayer._thresholdsPrev);
+
+	std::swap(_iFeedForwardWeights._weights, _iFeedForwardWeights._weightsPrev);
+	std::swap(_iLateralWeights._weights, _iLateralWeights._weightsPrev);
+	std::swap(_iFeedBackWeights._weights, _iFeedBackWeights._weightsPrev);
+	std::swap(_iLayer._thresholds, _iLayer._thresholdsPrev);
+}
\ No newline at end of file
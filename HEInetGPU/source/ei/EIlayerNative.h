@@ -0,0 +1,100 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include "EIlayer.h"
+
+#include <vector>
+
+namespace ei {
+	// EIlayer on the native backend (sys::ComputeSystem::_native). Same semantics as EIlayer, images are flat float arrays
+	// (x + y * width). Weights keep the full (2r + 1)^2 field per neuron, x + y * width + wi * width * height with
+	// wi = (dx + r) * (2r + 1) + dy + r, which is the layout of EIlayer::readWeights and not EIlayer's clamped windows
+	// (getWeightIndex in ei.cl). Slots outside the input are stored but never read or learned
+	class EIlayerNative {
+	public:
+		typedef std::vector<float> Image;
+
+		struct NeuronLayer {
+			Image _activations;
+			Image _activationsPrev;
+
+			Image _states;
+			Image _statesPrev;
+
+			Image _statesHistory;
+			Image _statesHistoryPrev;
+
+			Image _stateAverages;
+			Image _stateAveragesPrev;
+
+			Image _thresholds;
+			Image _thresholdsPrev;
+		};
+
+		struct Weights2D {
+			Image _weights;
+			Image _weightsPrev;
+		};
+
+	private:
+		EIlayer::Configuration _config;
+
+	public:
+		// Image sets
+		NeuronLayer _eLayer;
+		NeuronLayer _iLayer;
+
+		Weights2D _eFeedForwardWeights;
+		Weights2D _eFeedBackWeights;
+		Weights2D _iFeedForwardWeights;
+		Weights2D _iLateralWeights;
+		Weights2D _iFeedBackWeights;
+
+		// Create with random weights, consumes the generator the same way as EIlayer::createRandom
+		void createRandom(const EIlayer::Configuration &config,
+			float minInitEWeight, float maxInitEWeight,
+			float minInitIWeight, float maxInitIWeight,
+			float initEThreshold, float initIThreshold,
+			float sparsityE, float sparsityI,
+			sys::ComputeSystem &cs, std::mt19937 &generator);
+
+		// Find sparse codes
+		void eActivate(sys::ComputeSystem &cs, const Image &feedForwardInputs, float eta, float shDecay, float saDecay);
+		void iActivate(sys::ComputeSystem &cs, const Image &feedBackInputs, float eta, float shDecay, float saDecay);
+
+		// Learn sparse codes
+		void learn(sys::ComputeSystem &cs,
+			const Image &feedForwardInputs, const Image &feedForwardInputsPrev,
+			const Image &feedBackInputs, const Image &feedBackInputsPrev,
+			float eAlpha, float eBeta, float eDelta,
+			float iAlpha, float iBeta, float iGamma, float iDelta,
+			float sparsityE, float sparsityI);
+
+		// End of simulation step
+		void stepEnd();
+
+		const EIlayer::Configuration &getConfig() const {
+			return _config;
+		}
+	};
+}
\ No newline at end of file
@@ -1,67 +1,173 @@
 #include "HEInet.h"
 
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
 using namespace ei;
 
+namespace {
+	// Networks live in OpenCL memory, the native backend has its own classes (HEInetNative)
+	bool hasDevice(sys::ComputeSystem &cs) {
+		if (cs.getDeviceType() == sys::ComputeSystem::_native || cs.getDeviceType() == sys::ComputeSystem::_none) {
+#ifdef SYS_DEBUG
+			std::cerr << "HEInet needs an OpenCL device, use HEInetNative on the native backend!" << std::endl;
+#endif
+			return false;
+		}
+
+		return true;
+	}
+}
+
 void HEInet::Kernels::loadFromProgram(sys::ComputeProgram &program) {
+	loadFromProgram(program.getProgram());
+
+	_variants = &program;
+}
+
+void HEInet::Kernels::loadFromProgram(const cl::Program &program) {
+	_program = program;
+	_variants = nullptr;
+
 	// Create kernels
-	_predictionInitializeKernel = cl::Kernel(program.getProgram(), "HEInet_predictionInitialize");
+	_predictionInitializeKernel = cl::Kernel(program, "HEInet_predictionInitialize");
+
+	_predictKernel = cl::Kernel(program, "HEInet_predict");
+
+	_predictionLearnKernel = cl::Kernel(program, "HEInet_predictionLearn");
+	_predictionLearnBatchKernel = cl::Kernel(program, "HEInet_predictionLearnBatch");
+
+	_predictTiledKernel = cl::Kernel(program, "HEInet_predictTiled");
 
-	_predictKernel = cl::Kernel(program.getProgram(), "HEInet_predict");
+	_updateInputSpikesKernel = cl::Kernel(program, "HEInet_updateInputSpikes");
 
-	_predictionLearnKernel = cl::Kernel(program.getProgram(), "HEInet_predictionLearn");
+	_sumSpikesKernel = cl::Kernel(program, "HEInet_sumSpikes");
 
-	_updateInputSpikesKernel = cl::Kernel(program.getProgram(), "HEInet_updateInputSpikes");
+	_packInputSpikesKernel = cl::Kernel(program, "EIlayer_packStates");
 
-	_sumSpikesKernel = cl::Kernel(program.getProgram(), "HEInet_sumSpikes");
+	_compactInputSpikesKernel = cl::Kernel(program, "EIlayer_compactSpikes");
+
+	_settlePersistentKernel = cl::Kernel(program, "HEInet_settlePersistent");
 }
 
-void HEInet::createRandom(const std::vector<EIlayer::Configuration> &eilConfigs,
+bool HEInet::createRandom(const std::vector<EIlayer::Configuration> &eilConfigs,
 	int predictionRadiusFromE, int predictionRadiusFromI,
 	float minInitEWeight, float maxInitEWeight,
 	float minInitIWeight, float maxInitIWeight,
 	float initEThreshold, float initIThreshold,
 	float sparsityE, float sparsityI,
 	sys::ComputeSystem &cs, const std::shared_ptr<EIlayer::Kernels> &eilKernels,
-	const std::shared_ptr<Kernels> &heiKernels, std::mt19937 &generator)
+	const std::shared_ptr<Kernels> &heiKernels, std::mt19937 &generator,
+	EIlayer::WeightPrecision weightPrecision)
 {
-	_kernels = heiKernels;
-	_predictionRadiusFromE = predictionRadiusFromE;
-	_predictionRadiusFromI = predictionRadiusFromI;
+	if (!hasDevice(cs))
+		return false;
 
 	_eiLayers.resize(eilConfigs.size());
 
+	// Nothing feeds back into the top layer
+	std::vector<EIlayer::Configuration> configs = eilConfigs;
+
+	configs.back()._feedBackInput = false;
+
 	// Initialize all layers
-	for (int li = 0; li < _eiLayers.size(); li++) {
-		_eiLayers[li].createRandom(eilConfigs[li],
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		_eiLayers[li].createRandom(configs[li],
 			minInitEWeight, maxInitEWeight, minInitIWeight, maxInitIWeight,
 			initEThreshold, initIThreshold,
 			sparsityE, sparsityI,
-			cs, eilKernels, generator);
+			cs, eilKernels, generator, weightPrecision);
 	}
 
-	int predictionFromESize = std::pow(_predictionRadiusFromE * 2 + 1, 2);
-	int predictionFromISize = std::pow(_predictionRadiusFromI * 2 + 1, 2);
+	create(cs, heiKernels, predictionRadiusFromE, predictionRadiusFromI);
 
-	_prediction = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight);
-	_predictionPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight);
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
 
-	_inputSpikes = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight);
-	_inputSpikesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight);
+	int inputSize = frontConfig._eFeedForwardWidth * frontConfig._eFeedForwardHeight;
 
-	_inputSpikesHistory = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight);
-	_inputSpikesHistoryPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight);
+	int predictionFromESize = EIlayer::getWeightsSize(_predictionRadiusFromE, frontConfig._eWidth, frontConfig._eHeight, inputSize);
+	int predictionFromISize = EIlayer::getWeightsSize(_predictionRadiusFromI, frontConfig._iWidth, frontConfig._iHeight, inputSize);
 
-	_inputSpikeTimers = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight);
-	_inputSpikeTimersPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight);
+	createPredictionWeights(cs, _predictionFromEWeights, predictionFromESize, nullptr);
+	createPredictionWeights(cs, _predictionFromIWeights, predictionFromISize, nullptr);
 
-	_eSpikeSums = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eWidth, eilConfigs.front()._eHeight);
-	_eSpikeSumsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eWidth, eilConfigs.front()._eHeight);
+	cl_float2 eFeedForwardDimsToEDims = { static_cast<float>(frontConfig._eWidth + 1) / static_cast<float>(frontConfig._eFeedForwardWidth + 1), static_cast<float>(frontConfig._eHeight + 1) / static_cast<float>(frontConfig._eFeedForwardHeight + 1) };
+	cl_float2 eFeedForwardDimsToIDims = { static_cast<float>(frontConfig._iWidth + 1) / static_cast<float>(frontConfig._eFeedForwardWidth + 1), static_cast<float>(frontConfig._iHeight + 1) / static_cast<float>(frontConfig._eFeedForwardHeight + 1) };
+
+	cl_int2 eLayerDims = { frontConfig._eWidth, frontConfig._eHeight };
+	cl_int2 iLayerDims = { frontConfig._iWidth, frontConfig._iHeight };
+
+	cl_uint2 seed = { static_cast<cl_uint>(generator()), static_cast<cl_uint>(generator()) };
+
+	initializePrediction(cs, _predictionFromEWeights, eFeedForwardDimsToEDims, eLayerDims, _predictionRadiusFromE, minInitEWeight, maxInitEWeight, seed, 0);
+	initializePrediction(cs, _predictionFromIWeights, eFeedForwardDimsToIDims, iLayerDims, _predictionRadiusFromI, minInitEWeight, maxInitEWeight, seed, 1);
+
+	finishCreate(cs);
+
+	return true;
+}
+
+void HEInet::create(sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &heiKernels, int predictionRadiusFromE, int predictionRadiusFromI) {
+	_kernels = heiKernels;
+
+	_predictionRadiusFromE = predictionRadiusFromE;
+	_predictionRadiusFromI = predictionRadiusFromI;
+
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+	// Kernel instances of this network, one per buffer parity, specialized to the prediction fields like the layers (EIlayer::create)
+	cl::Program program = _kernels->_program;
+
+	if (_kernels->_variants != nullptr) {
+		std::ostringstream options;
+
+		options << "-DEI_NETWORK_VARIANT"
+			<< " -DEI_E_DIMS=(int2)(" << frontConfig._eWidth << "," << frontConfig._eHeight << ")"
+			<< " -DEI_I_DIMS=(int2)(" << frontConfig._iWidth << "," << frontConfig._iHeight << ")"
+			<< " -DEI_PREDICTION_RADIUS_FROM_E=" << _predictionRadiusFromE
+			<< " -DEI_PREDICTION_RADIUS_FROM_I=" << _predictionRadiusFromI;
+
+		_kernels->_variants->getVariant(options.str(), cs, program);
+	}
+
+	_parityKernels[0].loadFromProgram(program);
+	_parityKernels[1].loadFromProgram(program);
+
+	_parity = 0;
+
+	// The statistics ring is sized for the previous layers
+	_statisticsInterval = 0;
+
+	int inputSize = frontConfig._eFeedForwardWidth * frontConfig._eFeedForwardHeight;
+
+	// Inputs, predictions and spike sums are stacked per batch item like the layers (EIlayer::Configuration::_batchSize)
+	int batchSize = frontConfig._batchSize;
+
+	int inputBatchHeight = frontConfig._eFeedForwardHeight * batchSize;
+	int eBatchHeight = frontConfig._eHeight * batchSize;
+	int iBatchHeight = frontConfig._iHeight * batchSize;
+
+	_prediction = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eFeedForwardWidth, inputBatchHeight);
+	_predictionPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eFeedForwardWidth, inputBatchHeight);
+
+	_inputSpikes = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eFeedForwardWidth, inputBatchHeight);
+	_inputSpikesPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eFeedForwardWidth, inputBatchHeight);
+
+	_inputSpikesHistory = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eFeedForwardWidth, inputBatchHeight);
+	_inputSpikesHistoryPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eFeedForwardWidth, inputBatchHeight);
+
+	_inputSpikeTimers = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eFeedForwardWidth, inputBatchHeight);
+	_inputSpikeTimersPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eFeedForwardWidth, inputBatchHeight);
+
+	_eSpikeSums = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eWidth, eBatchHeight);
+	_eSpikeSumsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eWidth, eBatchHeight);
 	
-	_iSpikeSums = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._iWidth, eilConfigs.front()._iHeight);
-	_iSpikeSumsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._iWidth, eilConfigs.front()._iHeight);
+	_iSpikeSums = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._iWidth, iBatchHeight);
+	_iSpikeSumsPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._iWidth, iBatchHeight);
 
-	_eSpikeSumsIterPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eWidth, eilConfigs.front()._eHeight);
-	_iSpikeSumsIterPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._iWidth, eilConfigs.front()._iHeight);
+	_eSpikeSumsIterPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eWidth, eBatchHeight);
+	_iSpikeSumsIterPrev = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._iWidth, iBatchHeight);
 
 	cl_float4 zeroColor = { 0.0f, 0.0f, 0.0f, 0.0f };
 
@@ -69,28 +175,18 @@ void HEInet::createRandom(const std::vector<EIlayer::Configuration> &eilConfigs,
 	zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
 
 	cl::size_t<3> eFeedForwardDimsCoord;
-	eFeedForwardDimsCoord[0] = eilConfigs.front()._eFeedForwardWidth;
-	eFeedForwardDimsCoord[1] = eilConfigs.front()._eFeedForwardHeight;
+	eFeedForwardDimsCoord[0] = frontConfig._eFeedForwardWidth;
+	eFeedForwardDimsCoord[1] = inputBatchHeight;
 	eFeedForwardDimsCoord[2] = 1;
 
-	cl::size_t<3> ePredictionWeightsDims;
-	ePredictionWeightsDims[0] = eilConfigs.front()._eFeedForwardWidth;
-	ePredictionWeightsDims[1] = eilConfigs.front()._eFeedForwardHeight;
-	ePredictionWeightsDims[2] = predictionFromESize;
-
-	cl::size_t<3> iPredictionWeightsDims;
-	iPredictionWeightsDims[0] = eilConfigs.front()._eFeedForwardWidth;
-	iPredictionWeightsDims[1] = eilConfigs.front()._eFeedForwardHeight;
-	iPredictionWeightsDims[2] = predictionFromISize;
-
 	cl::size_t<3> eDims;
-	eDims[0] = eilConfigs.front()._eWidth;
-	eDims[1] = eilConfigs.front()._eHeight;
+	eDims[0] = frontConfig._eWidth;
+	eDims[1] = eBatchHeight;
 	eDims[2] = 1;
 
 	cl::size_t<3> iDims;
-	iDims[0] = eilConfigs.front()._iWidth;
-	iDims[1] = eilConfigs.front()._iHeight;
+	iDims[0] = frontConfig._iWidth;
+	iDims[1] = iBatchHeight;
 	iDims[2] = 1;
 
 	cs.getQueue().enqueueFillImage(_prediction, zeroColor, zeroCoord, eFeedForwardDimsCoord);
@@ -112,30 +208,201 @@ void HEInet::createRandom(const std::vector<EIlayer::Configuration> &eilConfigs,
 	cs.getQueue().enqueueFillImage(_eSpikeSumsIterPrev, zeroColor, zeroCoord, eDims);
 	cs.getQueue().enqueueFillImage(_iSpikeSumsIterPrev, zeroColor, zeroCoord, iDims);
 
-	_predictionFromEWeights._weights = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight, predictionFromESize);
-	_predictionFromEWeights._weightsPrev = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight, predictionFromESize);
-	
-	_predictionFromIWeights._weights = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight, predictionFromISize);
-	_predictionFromIWeights._weightsPrev = cl::Image3D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight, predictionFromISize);
+	int inputSpikeBitsSize = EIlayer::getSpikeBitsSize(frontConfig._eFeedForwardWidth, frontConfig._eFeedForwardHeight);
+	int zeroBitsSize = EIlayer::getSpikeBitsSize(_eiLayers.back().getConfig()._iFeedBackWidth, _eiLayers.back().getConfig()._iFeedBackHeight);
+
+	_inputSpikeBits = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, inputSpikeBitsSize * sizeof(cl_uint));
+	_inputSpikeBitsPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, inputSpikeBitsSize * sizeof(cl_uint));
+	_zeroBits = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, zeroBitsSize * sizeof(cl_uint));
+
+	cl_uint zeroBits = 0;
+
+	cs.getQueue().enqueueFillBuffer(_inputSpikeBits, zeroBits, 0, inputSpikeBitsSize * sizeof(cl_uint));
+	cs.getQueue().enqueueFillBuffer(_inputSpikeBitsPrev, zeroBits, 0, inputSpikeBitsSize * sizeof(cl_uint));
+	cs.getQueue().enqueueFillBuffer(_zeroBits, zeroBits, 0, zeroBitsSize * sizeof(cl_uint));
+
+	_inputSpikeList._spikes = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, inputSize * sizeof(cl_int2));
+	_inputSpikeList._count = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
+	_inputSpikeListPrev._spikes = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, inputSize * sizeof(cl_int2));
+	_inputSpikeListPrev._count = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
+	_zeroSpikeList._spikes = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int2));
+	_zeroSpikeList._count = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, sizeof(cl_int));
+
+	cl_int zeroCount = 0;
+
+	cs.getQueue().enqueueFillBuffer(_inputSpikeList._count, zeroCount, 0, sizeof(cl_int));
+	cs.getQueue().enqueueFillBuffer(_inputSpikeListPrev._count, zeroCount, 0, sizeof(cl_int));
+	cs.getQueue().enqueueFillBuffer(_zeroSpikeList._count, zeroCount, 0, sizeof(cl_int));
+}
+
+void HEInet::createPredictionWeights(sys::ComputeSystem &cs, EIlayer::Weights2D &weights, int size, void* hostPtr) {
+	// Random initialization and checkpoints write every slot, padding and clipped border slots included
+	if (hostPtr != nullptr)
+		weights._weightsPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, size * sizeof(cl_float), hostPtr);
+	else
+		weights._weightsPrev = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, size * sizeof(cl_float));
+
+	weights._weights = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, size * sizeof(cl_float));
+}
+
+void HEInet::initializePrediction(sys::ComputeSystem &cs, EIlayer::Weights2D &weights, cl_float2 eFeedForwardDimsToDims, cl_int2 dims, int predictionRadius,
+	float minInitWeight, float maxInitWeight, cl_uint2 seed, cl_uint stream)
+{
+	Kernels &kernels = _parityKernels[_parity];
 
-	std::uniform_int_distribution<int> seedDist(0, 10000);
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
 
-	cl_uint2 seed = { seedDist(generator), seedDist(generator) };
+	int windowSize = std::min(predictionRadius * 2 + 1, dims.x) * std::min(predictionRadius * 2 + 1, dims.y);
 
 	int index = 0;
 
-	_kernels->_predictionInitializeKernel.setArg(index++, _predictionFromEWeights._weightsPrev);
-	_kernels->_predictionInitializeKernel.setArg(index++, _predictionFromIWeights._weightsPrev);
-	_kernels->_predictionInitializeKernel.setArg(index++, predictionFromESize);
-	_kernels->_predictionInitializeKernel.setArg(index++, predictionFromISize);
-	_kernels->_predictionInitializeKernel.setArg(index++, minInitEWeight);
-	_kernels->_predictionInitializeKernel.setArg(index++, maxInitEWeight);
-	_kernels->_predictionInitializeKernel.setArg(index++, seed);
+	kernels._predictionInitializeKernel.setArg(index++, weights._weightsPrev);
+	kernels._predictionInitializeKernel.setArg(index++, weights._weights);
+	kernels._predictionInitializeKernel.setArg(index++, eFeedForwardDimsToDims);
+	kernels._predictionInitializeKernel.setArg(index++, dims);
+	kernels._predictionInitializeKernel.setArg(index++, predictionRadius);
+	kernels._predictionInitializeKernel.setArg(index++, minInitWeight);
+	kernels._predictionInitializeKernel.setArg(index++, maxInitWeight);
+	kernels._predictionInitializeKernel.setArg(index++, seed);
+	kernels._predictionInitializeKernel.setArg(index++, stream);
+
+	// One work item per weight slot, chunks of 4 included
+	cs.getQueue().enqueueNDRangeKernel(kernels._predictionInitializeKernel, cl::NullRange, cl::NDRange(frontConfig._eFeedForwardWidth * 4, frontConfig._eFeedForwardHeight, (windowSize + 3) / 4), cl::NullRange, nullptr, cs.profile("initializePrediction"));
+}
+
+void HEInet::finishCreate(sys::ComputeSystem &cs) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+	cl_float2 eFeedForwardDimsToEDims = { static_cast<float>(frontConfig._eWidth + 1) / static_cast<float>(frontConfig._eFeedForwardWidth + 1), static_cast<float>(frontConfig._eHeight + 1) / static_cast<float>(frontConfig._eFeedForwardHeight + 1) };
+	cl_float2 eFeedForwardDimsToIDims = { static_cast<float>(frontConfig._iWidth + 1) / static_cast<float>(frontConfig._eFeedForwardWidth + 1), static_cast<float>(frontConfig._iHeight + 1) / static_cast<float>(frontConfig._eFeedForwardHeight + 1) };
+
+	// Tiles hold a single batch item
+	_predictionTileSize = getBatchSize() > 1 ? 0 : EIlayer::chooseTileSize(cs, kernels._predictTiledKernel, eFeedForwardDimsToEDims, _predictionRadiusFromE, eFeedForwardDimsToIDims, _predictionRadiusFromI);
+
+	_predictionFromETileDims = EIlayer::getTileDims(_predictionTileSize, eFeedForwardDimsToEDims, _predictionRadiusFromE);
+	_predictionFromITileDims = EIlayer::getTileDims(_predictionTileSize, eFeedForwardDimsToIDims, _predictionRadiusFromI);
+
+	createPersistent(cs);
+
+	// Bind both buffer parities, stepEnd only selects the instance afterwards
+	bindKernels(_parityKernels[0]);
+	std::swap(_inputSpikeTimers, _inputSpikeTimersPrev);
+	std::swap(_inputSpikes, _inputSpikesPrev);
+	std::swap(_inputSpikesHistory, _inputSpikesHistoryPrev);
+	bindKernels(_parityKernels[1]);
+	std::swap(_inputSpikeTimers, _inputSpikeTimersPrev);
+	std::swap(_inputSpikes, _inputSpikesPrev);
+	std::swap(_inputSpikesHistory, _inputSpikesHistoryPrev);
+}
+
+bool HEInet::saveCheckpoint(sys::ComputeSystem &cs, const std::string &fileName) const {
+	Checkpoint checkpoint;
+
+	if (!checkpoint.create(fileName))
+		return false;
+
+	cl_int ints[3] = { static_cast<cl_int>(_eiLayers.size()), _predictionRadiusFromE, _predictionRadiusFromI };
+
+	bool written = checkpoint.addSection("network", ints, sizeof(ints));
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()) && written; li++)
+		written = _eiLayers[li].writeCheckpoint(cs, checkpoint, "layer" + std::to_string(li));
+
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+	int inputSize = frontConfig._eFeedForwardWidth * frontConfig._eFeedForwardHeight;
+
+	std::vector<float> predictionFromEWeights(EIlayer::getWeightsSize(_predictionRadiusFromE, frontConfig._eWidth, frontConfig._eHeight, inputSize));
+	std::vector<float> predictionFromIWeights(EIlayer::getWeightsSize(_predictionRadiusFromI, frontConfig._iWidth, frontConfig._iHeight, inputSize));
 
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_predictionInitializeKernel, cl::NullRange, cl::NDRange(eilConfigs.front()._eFeedForwardWidth, eilConfigs.front()._eFeedForwardHeight));
+	cs.getQueue().enqueueReadBuffer(_predictionFromEWeights._weightsPrev, CL_TRUE, 0, predictionFromEWeights.size() * sizeof(float), predictionFromEWeights.data());
+	cs.getQueue().enqueueReadBuffer(_predictionFromIWeights._weightsPrev, CL_TRUE, 0, predictionFromIWeights.size() * sizeof(float), predictionFromIWeights.data());
 
-	cs.getQueue().enqueueCopyImage(_predictionFromEWeights._weightsPrev, _predictionFromEWeights._weights, zeroCoord, zeroCoord, ePredictionWeightsDims);
-	cs.getQueue().enqueueCopyImage(_predictionFromIWeights._weightsPrev, _predictionFromIWeights._weights, zeroCoord, zeroCoord, iPredictionWeightsDims);
+	written = written
+		&& checkpoint.addSection("predictionFromEWeights", predictionFromEWeights.data(), predictionFromEWeights.size() * sizeof(float))
+		&& checkpoint.addSection("predictionFromIWeights", predictionFromIWeights.data(), predictionFromIWeights.size() * sizeof(float));
+
+	if (!written || !checkpoint.finish()) {
+#ifdef SYS_DEBUG
+		std::cerr << "Could not write checkpoint " << fileName << "!" << std::endl;
+#endif
+		return false;
+	}
+
+	return true;
+}
+
+bool HEInet::createFromCheckpoint(const std::string &fileName,
+	sys::ComputeSystem &cs, const std::shared_ptr<EIlayer::Kernels> &eilKernels,
+	const std::shared_ptr<Kernels> &heiKernels)
+{
+	if (!hasDevice(cs))
+		return false;
+
+	std::shared_ptr<Checkpoint> checkpoint = std::make_shared<Checkpoint>();
+
+	if (!checkpoint->open(fileName))
+		return false;
+
+	const cl_int* ints = static_cast<const cl_int*>(checkpoint->getSection("network", 3 * sizeof(cl_int)));
+
+	if (ints == nullptr || ints[0] < 1)
+		return false;
+
+	// CPU devices compute on the mapped pages themselves instead of a copy
+	bool wrapHostMemory = (cs.getDevice().getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) != 0;
+
+	_eiLayers.resize(ints[0]);
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+		if (!_eiLayers[li].createFromCheckpoint(*checkpoint, "layer" + std::to_string(li), wrapHostMemory, cs, eilKernels))
+			return false;
+
+	create(cs, heiKernels, ints[1], ints[2]);
+
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+	int inputSize = frontConfig._eFeedForwardWidth * frontConfig._eFeedForwardHeight;
+
+	int predictionFromESize = EIlayer::getWeightsSize(_predictionRadiusFromE, frontConfig._eWidth, frontConfig._eHeight, inputSize);
+	int predictionFromISize = EIlayer::getWeightsSize(_predictionRadiusFromI, frontConfig._iWidth, frontConfig._iHeight, inputSize);
+
+	void* predictionFromEWeights = checkpoint->getSection("predictionFromEWeights", predictionFromESize * sizeof(cl_float));
+	void* predictionFromIWeights = checkpoint->getSection("predictionFromIWeights", predictionFromISize * sizeof(cl_float));
+
+	if (predictionFromEWeights == nullptr || predictionFromIWeights == nullptr)
+		return false;
+
+	createPredictionWeights(cs, _predictionFromEWeights, predictionFromESize, wrapHostMemory ? predictionFromEWeights : nullptr);
+	createPredictionWeights(cs, _predictionFromIWeights, predictionFromISize, wrapHostMemory ? predictionFromIWeights : nullptr);
+
+	if (!wrapHostMemory) {
+		cs.getQueue().enqueueWriteBuffer(_predictionFromEWeights._weightsPrev, CL_TRUE, 0, predictionFromESize * sizeof(cl_float), predictionFromEWeights);
+		cs.getQueue().enqueueWriteBuffer(_predictionFromIWeights._weightsPrev, CL_TRUE, 0, predictionFromISize * sizeof(cl_float), predictionFromIWeights);
+	}
+
+	cs.getQueue().enqueueCopyBuffer(_predictionFromEWeights._weightsPrev, _predictionFromEWeights._weights, 0, 0, predictionFromESize * sizeof(cl_float));
+	cs.getQueue().enqueueCopyBuffer(_predictionFromIWeights._weightsPrev, _predictionFromIWeights._weights, 0, 0, predictionFromISize * sizeof(cl_float));
+
+	finishCreate(cs);
+
+	// Uploads are blocking, the mapping is only needed while buffers use it
+	_checkpoint = wrapHostMemory ? checkpoint : nullptr;
+
+	return true;
+}
+
+void HEInet::bindKernels(Kernels &kernels) {
+	// Per call arguments (input rates and decay) come first, the spike sums rotate through three images (predictionEnd) and stay per call
+	int index = 2;
+
+	kernels._updateInputSpikesKernel.setArg(index++, _inputSpikeTimersPrev);
+	kernels._updateInputSpikesKernel.setArg(index++, _inputSpikesHistoryPrev);
+	kernels._updateInputSpikesKernel.setArg(index++, _inputSpikeTimers);
+	kernels._updateInputSpikesKernel.setArg(index++, _inputSpikes);
+	kernels._updateInputSpikesKernel.setArg(index++, _inputSpikesHistory);
 }
 
 void HEInet::spikeSumBegin(sys::ComputeSystem &cs) {
@@ -146,38 +413,42 @@ void HEInet::spikeSumBegin(sys::ComputeSystem &cs) {
 
 	cl::size_t<3> eDims;
 	eDims[0] = _eiLayers.front().getConfig()._eWidth;
-	eDims[1] = _eiLayers.front().getConfig()._eHeight;
+	eDims[1] = _eiLayers.front().getConfig()._eHeight * getBatchSize();
 	eDims[2] = 1;
 
 	cl::size_t<3> iDims;
 	iDims[0] = _eiLayers.front().getConfig()._iWidth;
-	iDims[1] = _eiLayers.front().getConfig()._iHeight;
+	iDims[1] = _eiLayers.front().getConfig()._iHeight * getBatchSize();
 	iDims[2] = 1;
 
-	cs.getQueue().enqueueFillImage(_eSpikeSums, zeroColor, zeroCoord, eDims);
-	cs.getQueue().enqueueFillImage(_eSpikeSumsPrev, zeroColor, zeroCoord, eDims);
-	cs.getQueue().enqueueFillImage(_iSpikeSums, zeroColor, zeroCoord, iDims);
-	cs.getQueue().enqueueFillImage(_iSpikeSumsPrev, zeroColor, zeroCoord, iDims);
+	cs.getQueue().enqueueFillImage(_eSpikeSums, zeroColor, zeroCoord, eDims, nullptr, cs.profile("spikeSumBegin"));
+	cs.getQueue().enqueueFillImage(_eSpikeSumsPrev, zeroColor, zeroCoord, eDims, nullptr, cs.profile("spikeSumBegin"));
+	cs.getQueue().enqueueFillImage(_iSpikeSums, zeroColor, zeroCoord, iDims, nullptr, cs.profile("spikeSumBegin"));
+	cs.getQueue().enqueueFillImage(_iSpikeSumsPrev, zeroColor, zeroCoord, iDims, nullptr, cs.profile("spikeSumBegin"));
 }
 
 void HEInet::sumSpikes(sys::ComputeSystem &cs, float scalar) {
+	Kernels &kernels = _parityKernels[_parity];
+
 	int index = 0;
 
-	_kernels->_sumSpikesKernel.setArg(index++, _eiLayers.front()._eLayer._states);
-	_kernels->_sumSpikesKernel.setArg(index++, _eSpikeSumsPrev);
-	_kernels->_sumSpikesKernel.setArg(index++, _eSpikeSums);
-	_kernels->_sumSpikesKernel.setArg(index++, scalar);
+	kernels._sumSpikesKernel.setArg(index++, _eiLayers.front()._eLayer._states);
+	kernels._sumSpikesKernel.setArg(index++, _eSpikeSumsPrev);
+	kernels._sumSpikesKernel.setArg(index++, _eSpikeSums);
+	kernels._sumSpikesKernel.setArg(index++, scalar);
 
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_sumSpikesKernel, cl::NullRange, cl::NDRange(_eiLayers.front().getConfig()._eWidth, _eiLayers.front().getConfig()._eHeight));
+	cs.enqueueKernel(kernels._sumSpikesKernel, cl::NDRange(_eiLayers.front().getConfig()._eWidth, _eiLayers.front().getConfig()._eHeight * getBatchSize()), cl::NullRange,
+		{ _eiLayers.front()._eLayer._states, _eSpikeSumsPrev }, { _eSpikeSums }, "eSumSpikes");
 
 	index = 0;
 
-	_kernels->_sumSpikesKernel.setArg(index++, _eiLayers.front()._iLayer._states);
-	_kernels->_sumSpikesKernel.setArg(index++, _iSpikeSumsPrev);
-	_kernels->_sumSpikesKernel.setArg(index++, _iSpikeSums);
-	_kernels->_sumSpikesKernel.setArg(index++, scalar);
+	kernels._sumSpikesKernel.setArg(index++, _eiLayers.front()._iLayer._states);
+	kernels._sumSpikesKernel.setArg(index++, _iSpikeSumsPrev);
+	kernels._sumSpikesKernel.setArg(index++, _iSpikeSums);
+	kernels._sumSpikesKernel.setArg(index++, scalar);
 
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_sumSpikesKernel, cl::NullRange, cl::NDRange(_eiLayers.front().getConfig()._iWidth, _eiLayers.front().getConfig()._iHeight));
+	cs.enqueueKernel(kernels._sumSpikesKernel, cl::NDRange(_eiLayers.front().getConfig()._iWidth, _eiLayers.front().getConfig()._iHeight * getBatchSize()), cl::NullRange,
+		{ _eiLayers.front()._iLayer._states, _iSpikeSumsPrev }, { _iSpikeSums }, "iSumSpikes");
 }
 
 void HEInet::setInputPhase(sys::ComputeSystem &cs, const cl::Image2D &inputPhaseImage) {
@@ -186,10 +457,10 @@ void HEInet::setInputPhase(sys::ComputeSystem &cs, const cl::Image2D &inputPhase
 
 	cl::size_t<3> eFeedForwardDimsCoord;
 	eFeedForwardDimsCoord[0] = _eiLayers.front().getConfig()._eFeedForwardWidth;
-	eFeedForwardDimsCoord[1] = _eiLayers.front().getConfig()._eFeedForwardHeight;
+	eFeedForwardDimsCoord[1] = _eiLayers.front().getConfig()._eFeedForwardHeight * getBatchSize();
 	eFeedForwardDimsCoord[2] = 1;
 
-	cs.getQueue().enqueueCopyImage(inputPhaseImage, _inputSpikeTimersPrev, zeroCoord, zeroCoord, eFeedForwardDimsCoord);
+	cs.getQueue().enqueueCopyImage(inputPhaseImage, _inputSpikeTimersPrev, zeroCoord, zeroCoord, eFeedForwardDimsCoord, nullptr, cs.profile("setInputPhase"));
 }
 
 void HEInet::setInputPhase(sys::ComputeSystem &cs, cl_uint4 color) {
@@ -198,129 +469,522 @@ void HEInet::setInputPhase(sys::ComputeSystem &cs, cl_uint4 color) {
 
 	cl::size_t<3> eFeedForwardDimsCoord;
 	eFeedForwardDimsCoord[0] = _eiLayers.front().getConfig()._eFeedForwardWidth;
-	eFeedForwardDimsCoord[1] = _eiLayers.front().getConfig()._eFeedForwardHeight;
+	eFeedForwardDimsCoord[1] = _eiLayers.front().getConfig()._eFeedForwardHeight * getBatchSize();
 	eFeedForwardDimsCoord[2] = 1;
 
-	cs.getQueue().enqueueFillImage(_inputSpikeTimersPrev, color, zeroCoord, eFeedForwardDimsCoord);
+	cs.getQueue().enqueueFillImage(_inputSpikeTimersPrev, color, zeroCoord, eFeedForwardDimsCoord, nullptr, cs.profile("setInputPhase"));
+}
+
+void HEInet::createInputPipeline(sys::ComputeSystem &cs) {
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+	int inputSize = frontConfig._eFeedForwardWidth * frontConfig._eFeedForwardHeight * getBatchSize();
+
+	for (int si = 0; si < 2; si++) {
+		InputSlot &slot = _inputSlots[si];
+
+		slot._image = cl::Image2D(cs.getContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), frontConfig._eFeedForwardWidth, frontConfig._eFeedForwardHeight * getBatchSize());
+		slot._staging = cl::Buffer(cs.getContext(), CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, inputSize * sizeof(cl_float));
+		slot._stagingData = nullptr;
+		slot._uploaded = cl::Event();
+		slot._consumed = cl::Event();
+	}
+
+	_inputsSubmitted = 0;
+	_inputsBegun = 0;
+}
+
+float* HEInet::getInputStaging(sys::ComputeSystem &cs) {
+	InputSlot &slot = _inputSlots[_inputsSubmitted % 2];
+
+	if (slot._stagingData == nullptr) {
+		const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+		int inputSize = frontConfig._eFeedForwardWidth * frontConfig._eFeedForwardHeight * getBatchSize();
+
+		// In order behind the last upload from this slot
+		slot._stagingData = static_cast<float*>(cs.getTransferQueue().enqueueMapBuffer(slot._staging, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, inputSize * sizeof(cl_float)));
+	}
+
+	return slot._stagingData;
+}
+
+const cl::Event &HEInet::submitInput(sys::ComputeSystem &cs) {
+	InputSlot &slot = _inputSlots[_inputsSubmitted % 2];
+
+	getInputStaging(cs);
+
+	cs.getTransferQueue().enqueueUnmapMemObject(slot._staging, slot._stagingData);
+
+	slot._stagingData = nullptr;
+
+	cl::size_t<3> zeroCoord;
+	zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+	cl::size_t<3> inputDims;
+	inputDims[0] = _eiLayers.front().getConfig()._eFeedForwardWidth;
+	inputDims[1] = _eiLayers.front().getConfig()._eFeedForwardHeight * getBatchSize();
+	inputDims[2] = 1;
+
+	// The image is free once the work of the example before last ended
+	std::vector<cl::Event> waitList;
+
+	if (slot._consumed() != nullptr)
+		waitList.push_back(slot._consumed);
+
+	cl::Event* profiled = cs.profile("uploadInput");
+
+	cs.getTransferQueue().enqueueCopyBufferToImage(slot._staging, slot._image, 0, zeroCoord, inputDims, waitList.empty() ? nullptr : &waitList, &slot._uploaded);
+	cs.getTransferQueue().flush();
+
+	if (profiled != nullptr)
+		*profiled = slot._uploaded;
+
+	_inputsSubmitted++;
+
+	return slot._uploaded;
+}
+
+const cl::Image2D &HEInet::beginInput(sys::ComputeSystem &cs) {
+	InputSlot &slot = _inputSlots[_inputsBegun % 2];
+
+	if (slot._uploaded() != nullptr) {
+		std::vector<cl::Event> waitList(1, slot._uploaded);
+
+		cs.getQueue().enqueueBarrierWithWaitList(&waitList);
+	}
+#ifdef SYS_DEBUG
+	else
+		std::cerr << "beginInput without a submitted input!" << std::endl;
+#endif
+
+	return slot._image;
+}
+
+void HEInet::endInput(sys::ComputeSystem &cs) {
+	InputSlot &slot = _inputSlots[_inputsBegun % 2];
+
+	cs.getQueue().enqueueMarkerWithWaitList(nullptr, &slot._consumed);
+	cs.getQueue().flush();
+
+	_inputsBegun++;
+}
+
+void HEInet::createOutputReadback(sys::ComputeSystem &cs) {
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+	int batchSize = getBatchSize();
+
+	for (int si = 0; si < 2; si++) {
+		OutputSlot &slot = _outputSlots[si];
+
+		unmapOutputs(cs, slot);
+
+		slot._eSpikeSums = cl::Buffer(cs.getContext(), CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, frontConfig._eWidth * frontConfig._eHeight * batchSize * sizeof(cl_float));
+		slot._iSpikeSums = cl::Buffer(cs.getContext(), CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, frontConfig._iWidth * frontConfig._iHeight * batchSize * sizeof(cl_float));
+		slot._prediction = cl::Buffer(cs.getContext(), CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, frontConfig._eFeedForwardWidth * frontConfig._eFeedForwardHeight * batchSize * sizeof(cl_float));
+	}
+
+	_outputsRequested = 0;
+}
+
+void HEInet::unmapOutputs(sys::ComputeSystem &cs, OutputSlot &slot) {
+	if (slot._outputs._ready() == nullptr)
+		return;
+
+	cs.getQueue().enqueueUnmapMemObject(slot._eSpikeSums, const_cast<float*>(slot._outputs._eSpikeSums));
+	cs.getQueue().enqueueUnmapMemObject(slot._iSpikeSums, const_cast<float*>(slot._outputs._iSpikeSums));
+	cs.getQueue().enqueueUnmapMemObject(slot._prediction, const_cast<float*>(slot._outputs._prediction));
+
+	slot._outputs = Outputs();
+}
+
+const HEInet::Outputs &HEInet::requestOutputs(sys::ComputeSystem &cs) {
+	OutputSlot &slot = _outputSlots[_outputsRequested % 2];
+
+	// Release the results of two requests ago before writing over them
+	unmapOutputs(cs, slot);
+
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+	int batchSize = getBatchSize();
+
+	cl::size_t<3> zeroCoord;
+	zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+	cl::size_t<3> eDims;
+	eDims[0] = frontConfig._eWidth;
+	eDims[1] = frontConfig._eHeight * batchSize;
+	eDims[2] = 1;
+
+	cl::size_t<3> iDims;
+	iDims[0] = frontConfig._iWidth;
+	iDims[1] = frontConfig._iHeight * batchSize;
+	iDims[2] = 1;
+
+	cl::size_t<3> inputDims;
+	inputDims[0] = frontConfig._eFeedForwardWidth;
+	inputDims[1] = frontConfig._eFeedForwardHeight * batchSize;
+	inputDims[2] = 1;
+
+	cs.getQueue().enqueueCopyImageToBuffer(_eSpikeSumsIterPrev, slot._eSpikeSums, zeroCoord, eDims, 0, nullptr, cs.profile("readOutputs"));
+	cs.getQueue().enqueueCopyImageToBuffer(_iSpikeSumsIterPrev, slot._iSpikeSums, zeroCoord, iDims, 0, nullptr, cs.profile("readOutputs"));
+	cs.getQueue().enqueueCopyImageToBuffer(_prediction, slot._prediction, zeroCoord, inputDims, 0, nullptr, cs.profile("readOutputs"));
+
+	// The queue is in order, so the last map completes after the others
+	slot._outputs._eSpikeSums = static_cast<const float*>(cs.getQueue().enqueueMapBuffer(slot._eSpikeSums, CL_FALSE, CL_MAP_READ, 0, eDims[0] * eDims[1] * sizeof(cl_float)));
+	slot._outputs._iSpikeSums = static_cast<const float*>(cs.getQueue().enqueueMapBuffer(slot._iSpikeSums, CL_FALSE, CL_MAP_READ, 0, iDims[0] * iDims[1] * sizeof(cl_float)));
+	slot._outputs._prediction = static_cast<const float*>(cs.getQueue().enqueueMapBuffer(slot._prediction, CL_FALSE, CL_MAP_READ, 0, inputDims[0] * inputDims[1] * sizeof(cl_float), nullptr, &slot._outputs._ready));
+
+	cs.getQueue().flush();
+
+	_outputsRequested++;
+
+	return slot._outputs;
 }
 
 void HEInet::update(sys::ComputeSystem &cs, const cl::Image2D &inputFrequencyImage, const cl::Image2D &zeroImage, float eta, float shDecay, float saDecay) {
-	// Update input spikes
+	Kernels &kernels = _parityKernels[_parity];
+
+	sys::Profiler::Scope scope(cs.getProfiler(), "update");
+
+	// Update input spikes, everything else is bound once per buffer parity (bindKernels)
 	int index = 0;
 
-	_kernels->_updateInputSpikesKernel.setArg(index++, inputFrequencyImage);
-	_kernels->_updateInputSpikesKernel.setArg(index++, _inputSpikeTimersPrev);
-	_kernels->_updateInputSpikesKernel.setArg(index++, _inputSpikesHistoryPrev);
-	_kernels->_updateInputSpikesKernel.setArg(index++, _inputSpikeTimers);
-	_kernels->_updateInputSpikesKernel.setArg(index++, _inputSpikes);
-	_kernels->_updateInputSpikesKernel.setArg(index++, _inputSpikesHistory);
-	_kernels->_updateInputSpikesKernel.setArg(index++, shDecay);
+	kernels._updateInputSpikesKernel.setArg(index++, inputFrequencyImage);
+	kernels._updateInputSpikesKernel.setArg(index++, shDecay);
 
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_updateInputSpikesKernel, cl::NullRange, cl::NDRange(_eiLayers.front().getConfig()._eFeedForwardWidth, _eiLayers.front().getConfig()._eFeedForwardHeight));
+	cs.enqueueKernel(kernels._updateInputSpikesKernel, cl::NDRange(_eiLayers.front().getConfig()._eFeedForwardWidth, _eiLayers.front().getConfig()._eFeedForwardHeight * getBatchSize()), cl::NullRange,
+		{ inputFrequencyImage, _inputSpikeTimersPrev, _inputSpikesHistoryPrev }, { _inputSpikeTimers, _inputSpikes, _inputSpikesHistory }, "updateInputSpikes");
 
-	const cl::Image2D* pLayerInput = &_inputSpikesPrev;
+	if (_binaryActivation)
+		packInputSpikes(cs, _inputSpikes, _inputSpikeBits);
 
-	// Feed forward
-	for (int li = 0; li < _eiLayers.size(); li++) {
-		_eiLayers[li].eActivate(cs, *pLayerInput, eta, shDecay, saDecay);
+	if (_eventDriven) {
+		// Use the spike counts of the latest step that has been read back, waiting for them would stall the queue
+		if (_spikeCountsEvent() != nullptr && _spikeCountsEvent.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE) {
+			int numSpikes = 0;
 
-		pLayerInput = &_eiLayers[li]._eLayer._statesPrev;
+			for (int i = 0; i < static_cast<int>(_spikeCounts.size()); i++)
+				numSpikes += _spikeCounts[i];
+
+			_useEvents = numSpikes <= _maxEventActivity * getNumNeurons();
+		}
+
+		compactInputSpikes(cs, _inputSpikes, _inputSpikeList);
 	}
 
-	pLayerInput = &zeroImage;
+	if (_eventDriven && _useEvents) {
+		const EIlayer::SpikeList* pLayerInputSpikes = &_inputSpikeListPrev;
+
+		// Feed forward
+		for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+			cs.setProfileLayer(li);
+
+			_eiLayers[li].eActivateEvents(cs, *pLayerInputSpikes, eta, shDecay, saDecay);
+
+			if (_binaryActivation)
+				_eiLayers[li].ePackStates(cs);
+
+			pLayerInputSpikes = &_eiLayers[li]._eLayer._spikeListPrev;
+		}
+
+		pLayerInputSpikes = &_zeroSpikeList;
+
+		// Feed back
+		for (int li = _eiLayers.size() - 1; li >= 0; li--) {
+			cs.setProfileLayer(li);
 
-	// Feed back
-	for (int li = _eiLayers.size() - 1; li >= 0; li--) {
-		_eiLayers[li].iActivate(cs, *pLayerInput, eta, shDecay, saDecay);
+			_eiLayers[li].iActivateEvents(cs, *pLayerInputSpikes, eta, shDecay, saDecay);
 
-		pLayerInput = &_eiLayers[li]._iLayer._statesPrev;
+			if (_binaryActivation)
+				_eiLayers[li].iPackStates(cs);
+
+			pLayerInputSpikes = &_eiLayers[li]._iLayer._spikeListPrev;
+		}
+	}
+	else if (_binaryActivation) {
+		const cl::Buffer* pLayerInputBits = &_inputSpikeBitsPrev;
+
+		// Feed forward
+		for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+			cs.setProfileLayer(li);
+
+			_eiLayers[li].eActivateBinary(cs, *pLayerInputBits, eta, shDecay, saDecay);
+
+			if (_eventDriven)
+				_eiLayers[li].eCompactStates(cs);
+
+			pLayerInputBits = &_eiLayers[li]._eLayer._stateBitsPrev;
+		}
+
+		pLayerInputBits = &_zeroBits;
+
+		// Feed back
+		for (int li = _eiLayers.size() - 1; li >= 0; li--) {
+			cs.setProfileLayer(li);
+
+			_eiLayers[li].iActivateBinary(cs, *pLayerInputBits, eta, shDecay, saDecay);
+
+			if (_eventDriven)
+				_eiLayers[li].iCompactStates(cs);
+
+			pLayerInputBits = &_eiLayers[li]._iLayer._stateBitsPrev;
+		}
+	}
+	else {
+		const cl::Image2D* pLayerInput = &_inputSpikesPrev;
+
+		// Feed forward
+		for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+			cs.setProfileLayer(li);
+
+			_eiLayers[li].eActivate(cs, *pLayerInput, eta, shDecay, saDecay);
+
+			if (_eventDriven)
+				_eiLayers[li].eCompactStates(cs);
+
+			pLayerInput = &_eiLayers[li]._eLayer._statesPrev;
+		}
+
+		pLayerInput = &zeroImage;
+
+		// Feed back
+		for (int li = _eiLayers.size() - 1; li >= 0; li--) {
+			cs.setProfileLayer(li);
+
+			_eiLayers[li].iActivate(cs, *pLayerInput, eta, shDecay, saDecay);
+
+			if (_eventDriven)
+				_eiLayers[li].iCompactStates(cs);
+
+			pLayerInput = &_eiLayers[li]._iLayer._statesPrev;
+		}
+	}
+
+	cs.setProfileLayer(-1);
+
+	if (_eventDriven) {
+		// Non-blocking, checked at the next update
+		_spikeCounts.resize(1 + _eiLayers.size() * 2);
+
+		// The last read has its own event (polled above), profiled through a copy
+		cl::Event* profiled = cs.profile("readSpikeCounts");
+
+		cs.getQueue().enqueueReadBuffer(_inputSpikeList._count, CL_FALSE, 0, sizeof(cl_int), &_spikeCounts[0], nullptr, cs.profile("readSpikeCounts"));
+
+		for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+			cs.getQueue().enqueueReadBuffer(_eiLayers[li]._eLayer._spikeList._count, CL_FALSE, 0, sizeof(cl_int), &_spikeCounts[1 + li * 2], nullptr, cs.profile("readSpikeCounts"));
+			cs.getQueue().enqueueReadBuffer(_eiLayers[li]._iLayer._spikeList._count, CL_FALSE, 0, sizeof(cl_int), &_spikeCounts[2 + li * 2], nullptr, li == static_cast<int>(_eiLayers.size()) - 1 ? &_spikeCountsEvent : cs.profile("readSpikeCounts"));
+		}
+
+		if (profiled != nullptr)
+			*profiled = _spikeCountsEvent;
 	}
 }
 
 void HEInet::predict(sys::ComputeSystem &cs) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	sys::Profiler::Scope scope(cs.getProfiler(), "predict");
+
 	cl_float2 eFeedForwardDimsToEDims = { static_cast<float>(_eiLayers.front().getConfig()._eWidth + 1) / static_cast<float>(_eiLayers.front().getConfig()._eFeedForwardWidth + 1), static_cast<float>(_eiLayers.front().getConfig()._eHeight + 1) / static_cast<float>(_eiLayers.front().getConfig()._eFeedForwardHeight + 1) };
 	cl_float2 eFeedForwardDimsToIDims = { static_cast<float>(_eiLayers.front().getConfig()._iWidth + 1) / static_cast<float>(_eiLayers.front().getConfig()._eFeedForwardWidth + 1), static_cast<float>(_eiLayers.front().getConfig()._iHeight + 1) / static_cast<float>(_eiLayers.front().getConfig()._eFeedForwardHeight + 1) };
 
 	cl_int2 eDims = { _eiLayers.front().getConfig()._eWidth, _eiLayers.front().getConfig()._eHeight };
 	cl_int2 iDims = { _eiLayers.front().getConfig()._iWidth, _eiLayers.front().getConfig()._iHeight };
 
+	cl::Kernel &kernel = _predictionTileSize > 0 ? kernels._predictTiledKernel : kernels._predictKernel;
+
 	int index = 0;
 
-	_kernels->_predictKernel.setArg(index++, _eSpikeSumsPrev);
-	_kernels->_predictKernel.setArg(index++, _iSpikeSumsPrev);
-	_kernels->_predictKernel.setArg(index++, _predictionFromEWeights._weightsPrev);
-	_kernels->_predictKernel.setArg(index++, _predictionFromIWeights._weightsPrev);
-	_kernels->_predictKernel.setArg(index++, _prediction);
+	kernel.setArg(index++, _eSpikeSumsPrev);
+	kernel.setArg(index++, _iSpikeSumsPrev);
+	kernel.setArg(index++, _predictionFromEWeights._weightsPrev);
+	kernel.setArg(index++, _predictionFromIWeights._weightsPrev);
+	kernel.setArg(index++, _prediction);
 	
-	_kernels->_predictKernel.setArg(index++, eFeedForwardDimsToEDims);
-	_kernels->_predictKernel.setArg(index++, eFeedForwardDimsToIDims);
-	_kernels->_predictKernel.setArg(index++, eDims);
-	_kernels->_predictKernel.setArg(index++, iDims);
-	_kernels->_predictKernel.setArg(index++, _predictionRadiusFromE);
-	_kernels->_predictKernel.setArg(index++, _predictionRadiusFromI);
-
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_predictKernel, cl::NullRange, cl::NDRange(_eiLayers.front().getConfig()._eFeedForwardWidth, _eiLayers.front().getConfig()._eFeedForwardHeight));
+	kernel.setArg(index++, eFeedForwardDimsToEDims);
+	kernel.setArg(index++, eFeedForwardDimsToIDims);
+	kernel.setArg(index++, eDims);
+	kernel.setArg(index++, iDims);
+	kernel.setArg(index++, _predictionRadiusFromE);
+	kernel.setArg(index++, _predictionRadiusFromI);
+
+	int width = _eiLayers.front().getConfig()._eFeedForwardWidth;
+	int height = _eiLayers.front().getConfig()._eFeedForwardHeight;
+
+	std::vector<cl::Memory> reads = { _eSpikeSumsPrev, _iSpikeSumsPrev, _predictionFromEWeights._weightsPrev, _predictionFromIWeights._weightsPrev };
+	std::vector<cl::Memory> writes = { _prediction };
+
+	if (_predictionTileSize > 0) {
+		kernel.setArg(index++, cl::Local(_predictionFromETileDims.x * _predictionFromETileDims.y * sizeof(cl_float)));
+		kernel.setArg(index++, cl::Local(_predictionFromITileDims.x * _predictionFromITileDims.y * sizeof(cl_float)));
+		kernel.setArg(index++, _predictionFromETileDims);
+		kernel.setArg(index++, _predictionFromITileDims);
+
+		// Round up to whole work-groups, the kernel skips positions past the prediction
+		cs.enqueueKernel(kernel,
+			cl::NDRange((width + _predictionTileSize - 1) / _predictionTileSize * _predictionTileSize, (height + _predictionTileSize - 1) / _predictionTileSize * _predictionTileSize),
+			cl::NDRange(_predictionTileSize, _predictionTileSize), reads, writes, "predict");
+	}
+	else
+		cs.enqueueKernel(kernel, cl::NDRange(width, height, getBatchSize()), cl::NullRange, reads, writes, "predict");
 }
 
 void HEInet::learn(sys::ComputeSystem &cs, const cl::Image2D &zeroImage,
 	float eAlpha, float eBeta, float eDelta, float iAlpha, float iBeta, float iGamma, float iDelta,
 	float sparsityE, float sparsityI)
 {
-	for (int li = 0; li < _eiLayers.size(); li++) {
+	sys::Profiler::Scope scope(cs.getProfiler(), "learn");
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		cs.setProfileLayer(li);
+
 		if (li == 0) {
-			if (li == _eiLayers.size() - 1)
+			if (li == static_cast<int>(_eiLayers.size()) - 1)
 				_eiLayers[li].learn(cs, _inputSpikes, _inputSpikesPrev, zeroImage, zeroImage, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
 			else
 				_eiLayers[li].learn(cs, _inputSpikes, _inputSpikesPrev, _eiLayers[li + 1]._iLayer._statesHistory, _eiLayers[li + 1]._iLayer._statesHistoryPrev, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
 		}
 		else {
-			if (li == _eiLayers.size() - 1)
+			if (li == static_cast<int>(_eiLayers.size()) - 1)
 				_eiLayers[li].learn(cs, _eiLayers[li - 1]._eLayer._statesHistory, _eiLayers[li - 1]._eLayer._statesHistoryPrev, zeroImage, zeroImage, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
 			else
 				_eiLayers[li].learn(cs, _eiLayers[li - 1]._eLayer._statesHistory, _eiLayers[li - 1]._eLayer._statesHistoryPrev, _eiLayers[li + 1]._iLayer._statesHistory, _eiLayers[li + 1]._iLayer._statesHistoryPrev, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
 		}
 	}
+
+	cs.setProfileLayer(-1);
 }
 
 void HEInet::learnPrediction(sys::ComputeSystem &cs, const cl::Image2D &inputImage, float alpha) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	sys::Profiler::Scope scope(cs.getProfiler(), "learnPrediction");
+
 	cl_float2 eFeedForwardDimsToEDims = { static_cast<float>(_eiLayers.front().getConfig()._eWidth + 1) / static_cast<float>(_eiLayers.front().getConfig()._eFeedForwardWidth + 1), static_cast<float>(_eiLayers.front().getConfig()._eHeight + 1) / static_cast<float>(_eiLayers.front().getConfig()._eFeedForwardHeight + 1) };
 	cl_float2 eFeedForwardDimsToIDims = { static_cast<float>(_eiLayers.front().getConfig()._iWidth + 1) / static_cast<float>(_eiLayers.front().getConfig()._eFeedForwardWidth + 1), static_cast<float>(_eiLayers.front().getConfig()._iHeight + 1) / static_cast<float>(_eiLayers.front().getConfig()._eFeedForwardHeight + 1) };
 
 	cl_int2 eDims = { _eiLayers.front().getConfig()._eWidth, _eiLayers.front().getConfig()._eHeight };
 	cl_int2 iDims = { _eiLayers.front().getConfig()._iWidth, _eiLayers.front().getConfig()._iHeight };
 
+	cl::Kernel &kernel = getBatchSize() > 1 ? kernels._predictionLearnBatchKernel : kernels._predictionLearnKernel;
+
 	int index = 0;
 
-	_kernels->_predictionLearnKernel.setArg(index++, _eSpikeSumsIterPrev);
-	_kernels->_predictionLearnKernel.setArg(index++, _iSpikeSumsIterPrev);
-	_kernels->_predictionLearnKernel.setArg(index++, inputImage);
-	_kernels->_predictionLearnKernel.setArg(index++, _predictionPrev);
-	_kernels->_predictionLearnKernel.setArg(index++, _predictionFromEWeights._weightsPrev);
-	_kernels->_predictionLearnKernel.setArg(index++, _predictionFromIWeights._weightsPrev);
-	_kernels->_predictionLearnKernel.setArg(index++, _predictionFromEWeights._weights);
-	_kernels->_predictionLearnKernel.setArg(index++, _predictionFromIWeights._weights);
+	kernel.setArg(index++, _eSpikeSumsIterPrev);
+	kernel.setArg(index++, _iSpikeSumsIterPrev);
+	kernel.setArg(index++, inputImage);
+	kernel.setArg(index++, _predictionPrev);
+	kernel.setArg(index++, _predictionFromEWeights._weightsPrev);
+	kernel.setArg(index++, _predictionFromIWeights._weightsPrev);
+	kernel.setArg(index++, _predictionFromEWeights._weights);
+	kernel.setArg(index++, _predictionFromIWeights._weights);
+
+	kernel.setArg(index++, eFeedForwardDimsToEDims);
+	kernel.setArg(index++, eFeedForwardDimsToIDims);
+	kernel.setArg(index++, eDims);
+	kernel.setArg(index++, iDims);
+	kernel.setArg(index++, _predictionRadiusFromE);
+	kernel.setArg(index++, _predictionRadiusFromI);
+	kernel.setArg(index++, alpha);
+
+	if (getBatchSize() > 1)
+		kernel.setArg(index++, getBatchSize());
+
+	cs.enqueueKernel(kernel, cl::NDRange(_eiLayers.front().getConfig()._eFeedForwardWidth, _eiLayers.front().getConfig()._eFeedForwardHeight), cl::NullRange,
+		{ _eSpikeSumsIterPrev, _iSpikeSumsIterPrev, inputImage, _predictionPrev, _predictionFromEWeights._weightsPrev, _predictionFromIWeights._weightsPrev },
+		{ _predictionFromEWeights._weights, _predictionFromIWeights._weights }, "learnPrediction");
+}
 
-	_kernels->_predictionLearnKernel.setArg(index++, eFeedForwardDimsToEDims);
-	_kernels->_predictionLearnKernel.setArg(index++, eFeedForwardDimsToIDims);
-	_kernels->_predictionLearnKernel.setArg(index++, eDims);
-	_kernels->_predictionLearnKernel.setArg(index++, iDims);
-	_kernels->_predictionLearnKernel.setArg(index++, _predictionRadiusFromE);
-	_kernels->_predictionLearnKernel.setArg(index++, _predictionRadiusFromI);
-	_kernels->_predictionLearnKernel.setArg(index++, alpha);
+void HEInet::stepEnd(sys::ComputeSystem &cs) {
+	if (_statisticsInterval > 0 && ++_statisticsSteps % _statisticsInterval == 0)
+		recordStatistics(cs);
 
-	cs.getQueue().enqueueNDRangeKernel(_kernels->_predictionLearnKernel, cl::NullRange, cl::NDRange(_eiLayers.front().getConfig()._eFeedForwardWidth, _eiLayers.front().getConfig()._eFeedForwardHeight));
+	endStep(cs);
 }
 
-void HEInet::stepEnd(sys::ComputeSystem &cs) {
+void HEInet::endStep(sys::ComputeSystem &cs) {
 	std::swap(_inputSpikes, _inputSpikesPrev);
 	std::swap(_inputSpikesHistory, _inputSpikesHistoryPrev);
 	std::swap(_inputSpikeTimers, _inputSpikeTimersPrev);
+	std::swap(_inputSpikeBits, _inputSpikeBitsPrev);
+	std::swap(_inputSpikeList, _inputSpikeListPrev);
 
 	std::swap(_eSpikeSums, _eSpikeSumsPrev);
 	std::swap(_iSpikeSums, _iSpikeSumsPrev);
 
-	for (int li = 0; li < _eiLayers.size(); li++)
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
 		_eiLayers[li].stepEnd();
+
+	if (_sparseActivation && ++_stepsSinceConnectionsBuilt >= _connectionsRebuildInterval) {
+		for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+			_eiLayers[li].buildConnections(cs);
+
+		_stepsSinceConnectionsBuilt = 0;
+	}
+
+	_parity = 1 - _parity;
+}
+
+void HEInet::createStatistics(sys::ComputeSystem &cs, int interval, int capacity) {
+	_statistics = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, capacity * _eiLayers.size() * 2 * sizeof(EIlayer::PopulationStatistics));
+
+	_statisticsInterval = interval;
+	_statisticsCapacity = capacity;
+	_statisticsSteps = 0;
+	_statisticsRecorded = 0;
+	_statisticsRead = 0;
+}
+
+void HEInet::recordStatistics(sys::ComputeSystem &cs) {
+	sys::Profiler::Scope scope(cs.getProfiler(), "recordStatistics");
+
+	int record = (_statisticsRecorded % _statisticsCapacity) * _eiLayers.size() * 2;
+
+	// The inputs activation read this step (update)
+	const cl::Image2D* pLayerInput = &_inputSpikesPrev;
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		cs.setProfileLayer(li);
+
+		const cl::Image2D* pFeedBackInput = li + 1 < static_cast<int>(_eiLayers.size()) ? &_eiLayers[li + 1]._iLayer._statesPrev : nullptr;
+
+		_eiLayers[li].recordStatistics(cs, *pLayerInput, pFeedBackInput, _statistics, record + li * 2);
+
+		pLayerInput = &_eiLayers[li]._eLayer._statesPrev;
+	}
+
+	cs.setProfileLayer(-1);
+
+	_statisticsRecorded++;
+}
+
+void HEInet::readStatistics(sys::ComputeSystem &cs, std::vector<StatisticsRecord> &records) {
+	records.clear();
+
+	if (_statisticsInterval == 0)
+		return;
+
+	int numPopulations = _eiLayers.size() * 2;
+
+	std::vector<EIlayer::PopulationStatistics> ring(_statisticsCapacity * numPopulations);
+
+	cs.getQueue().enqueueReadBuffer(_statistics, CL_TRUE, 0, ring.size() * sizeof(EIlayer::PopulationStatistics), ring.data());
+
+	for (int ri = std::max(_statisticsRead, _statisticsRecorded - _statisticsCapacity); ri < _statisticsRecorded; ri++) {
+		int slot = ri % _statisticsCapacity;
+
+		StatisticsRecord record;
+
+		record._step = (ri + 1) * _statisticsInterval;
+		record._populations.assign(ring.begin() + slot * numPopulations, ring.begin() + (slot + 1) * numPopulations);
+
+		records.push_back(record);
+	}
+
+	_statisticsRead = _statisticsRecorded;
 }
 
 void HEInet::predictionEnd() {
@@ -328,13 +992,338 @@ void HEInet::predictionEnd() {
 	std::swap(_iSpikeSumsPrev, _iSpikeSumsIterPrev);
 }
 
+void HEInet::setBinaryActivation(sys::ComputeSystem &cs, bool binaryActivation) {
+	if (binaryActivation && (hasPackedStates() || getBatchSize() > 1)) {
+#ifdef SYS_DEBUG
+		std::cout << "Binary activation needs separate unbatched state images, layers with packed states or batches keep the dense path." << std::endl;
+#endif
+		return;
+	}
+
+	// Spike maps are only packed in binary mode, bring the previous step up to date when switching
+	if (binaryActivation && !_binaryActivation) {
+		packInputSpikes(cs, _inputSpikesPrev, _inputSpikeBitsPrev);
+
+		for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+			_eiLayers[li].packStatesPrev(cs);
+	}
+
+	_binaryActivation = binaryActivation;
+}
+
+void HEInet::packInputSpikes(sys::ComputeSystem &cs, const cl::Image2D &inputSpikes, const cl::Buffer &inputSpikeBits) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	cl_int2 eFeedForwardDims = { _eiLayers.front().getConfig()._eFeedForwardWidth, _eiLayers.front().getConfig()._eFeedForwardHeight };
+
+	int index = 0;
+
+	kernels._packInputSpikesKernel.setArg(index++, inputSpikes);
+	kernels._packInputSpikesKernel.setArg(index++, inputSpikeBits);
+	kernels._packInputSpikesKernel.setArg(index++, eFeedForwardDims);
+
+	cs.getQueue().enqueueNDRangeKernel(kernels._packInputSpikesKernel, cl::NullRange, cl::NDRange(eFeedForwardDims.x, (eFeedForwardDims.y + 31) / 32), cl::NullRange, nullptr, cs.profile("packInputSpikes"));
+}
+
+void HEInet::setEventDriven(sys::ComputeSystem &cs, bool eventDriven, float maxEventActivity) {
+	if (eventDriven && (hasPackedStates() || getBatchSize() > 1)) {
+#ifdef SYS_DEBUG
+		std::cout << "Event driven activation needs separate unbatched state images, layers with packed states or batches keep the dense path." << std::endl;
+#endif
+		return;
+	}
+
+	// Spike lists are only compacted in event driven mode, bring the previous step up to date when switching
+	if (eventDriven && !_eventDriven) {
+		compactInputSpikes(cs, _inputSpikesPrev, _inputSpikeListPrev);
+
+		for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+			_eiLayers[li].compactStatesPrev(cs);
+
+		// Start dense until the first spike counts arrive
+		_useEvents = false;
+		_spikeCountsEvent = cl::Event();
+	}
+
+	_eventDriven = eventDriven;
+	_maxEventActivity = maxEventActivity;
+}
+
+void HEInet::setSparseActivation(sys::ComputeSystem &cs, bool sparseActivation, int rebuildInterval) {
+	if (sparseActivation && hasPackedStates()) {
+#ifdef SYS_DEBUG
+		std::cout << "Sparse activation needs separate state images, layers with packed states keep the dense path." << std::endl;
+#endif
+		return;
+	}
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		_eiLayers[li].setSparseActivation(cs, sparseActivation);
+
+		// Radius too large, use the same path everywhere
+		if (sparseActivation && !_eiLayers[li].getSparseActivation()) {
+			for (int lj = 0; lj < li; lj++)
+				_eiLayers[lj].setSparseActivation(cs, false);
+
+			return;
+		}
+	}
+
+	_sparseActivation = sparseActivation;
+	_connectionsRebuildInterval = std::max(1, rebuildInterval);
+	_stepsSinceConnectionsBuilt = 0;
+}
+
+void HEInet::setActivityGatedLearning(bool activityGatedLearning, float minHistory) {
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+		_eiLayers[li].setActivityGatedLearning(activityGatedLearning, minHistory);
+}
+
+bool HEInet::hasPackedStates() const {
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+		if (_eiLayers[li].getConfig()._packedStates)
+			return true;
+
+	return false;
+}
+
+bool HEInet::hasFloatWeights() const {
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+		if (_eiLayers[li].getWeightPrecision() != EIlayer::_float)
+			return false;
+
+	return true;
+}
+
+int HEInet::getNumNeurons() const {
+	int numNeurons = _eiLayers.front().getConfig()._eFeedForwardWidth * _eiLayers.front().getConfig()._eFeedForwardHeight;
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+		numNeurons += _eiLayers[li].getConfig()._eWidth * _eiLayers[li].getConfig()._eHeight + _eiLayers[li].getConfig()._iWidth * _eiLayers[li].getConfig()._iHeight;
+
+	return numNeurons;
+}
+
+void HEInet::compactInputSpikes(sys::ComputeSystem &cs, const cl::Image2D &inputSpikes, const EIlayer::SpikeList &inputSpikeList) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	cl_int zeroCount = 0;
+
+	cs.getQueue().enqueueFillBuffer(inputSpikeList._count, zeroCount, 0, sizeof(cl_int), nullptr, cs.profile("compactInputSpikes"));
+
+	int index = 0;
+
+	kernels._compactInputSpikesKernel.setArg(index++, inputSpikes);
+	kernels._compactInputSpikesKernel.setArg(index++, inputSpikeList._spikes);
+	kernels._compactInputSpikesKernel.setArg(index++, inputSpikeList._count);
+
+	cs.getQueue().enqueueNDRangeKernel(kernels._compactInputSpikesKernel, cl::NullRange, cl::NDRange(_eiLayers.front().getConfig()._eFeedForwardWidth, _eiLayers.front().getConfig()._eFeedForwardHeight), cl::NullRange, nullptr, cs.profile("compactInputSpikes"));
+}
+
+void HEInet::createPersistent(sys::ComputeSystem &cs) {
+	Kernels &kernels = _parityKernels[_parity];
+
+	const int layerInts = 16;
+	const int layerFloats = 8;
+
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+	int inputSize = frontConfig._eFeedForwardWidth * frontConfig._eFeedForwardHeight;
+
+	// Input (timers, history, 2 spikes), spike sums of the front layer, then E and I blocks of each layer
+	int stateSize = 4 * inputSize + frontConfig._eWidth * frontConfig._eHeight + frontConfig._iWidth * frontConfig._iHeight;
+	int weightsSize = 0;
+
+	_persistentLayerInts.resize(_eiLayers.size() * layerInts);
+
+	std::vector<cl_float> persistentLayerFloats(_eiLayers.size() * layerFloats);
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		const EIlayer::Configuration &config = _eiLayers[li].getConfig();
+
+		cl_int* ints = &_persistentLayerInts[li * layerInts];
+		cl_float* floats = &persistentLayerFloats[li * layerFloats];
+
+		ints[0] = config._eFeedForwardWidth;
+		ints[1] = config._eFeedForwardHeight;
+		ints[2] = config._eWidth;
+		ints[3] = config._eHeight;
+		ints[4] = config._iWidth;
+		ints[5] = config._iHeight;
+		ints[6] = config._iFeedBackWidth;
+		ints[7] = config._iFeedBackHeight;
+		ints[8] = config._eFeedForwardRadius;
+		ints[9] = config._eFeedBackRadius;
+		ints[10] = config._iFeedForwardRadius;
+		ints[11] = config._iLateralRadius;
+		ints[12] = config._iFeedBackRadius;
+
+		ints[13] = stateSize;
+		stateSize += EIlayer::getPersistentPopulationArrays() * config._eWidth * config._eHeight;
+		ints[14] = stateSize;
+		stateSize += EIlayer::getPersistentPopulationArrays() * config._iWidth * config._iHeight;
+		ints[15] = weightsSize;
+		weightsSize += _eiLayers[li].getNumWeights();
+
+		// Same ratios as EIlayer::eActivate/iActivate
+		floats[0] = static_cast<float>(config._eFeedForwardWidth + 1) / static_cast<float>(config._eWidth + 1);
+		floats[1] = static_cast<float>(config._eFeedForwardHeight + 1) / static_cast<float>(config._eHeight + 1);
+		floats[2] = static_cast<float>(config._iWidth + 1) / static_cast<float>(config._eWidth + 1);
+		floats[3] = static_cast<float>(config._iHeight + 1) / static_cast<float>(config._eHeight + 1);
+		floats[4] = static_cast<float>(config._eWidth + 1) / static_cast<float>(config._iWidth + 1);
+		floats[5] = static_cast<float>(config._eHeight + 1) / static_cast<float>(config._iHeight + 1);
+		floats[6] = static_cast<float>(config._iFeedBackWidth + 1) / static_cast<float>(config._iWidth + 1);
+		floats[7] = static_cast<float>(config._iFeedBackHeight + 1) / static_cast<float>(config._iHeight + 1);
+	}
+
+	// At most 4 neurons per work item, beyond that the regular kernels spread the work better
+	int workGroupSize = std::min<int>(256, kernels._settlePersistentKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(cs.getDevice()));
+
+	cl_ulong localMemSize = cs.getDevice().getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() - kernels._settlePersistentKernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(cs.getDevice());
+
+	_persistentWorkGroupSize = 0;
+
+	// The state buffer holds the separate images of a single batch item, the weight buffer floats
+	if (hasPackedStates() || getBatchSize() > 1 || !hasFloatWeights() || getNumNeurons() > workGroupSize * 4 || stateSize * sizeof(cl_float) > localMemSize)
+		return;
+
+	_persistentWorkGroupSize = workGroupSize;
+	_persistentStateSize = stateSize;
+
+	_persistentLayerIntsBuffer = cl::Buffer(cs.getContext(), CL_MEM_READ_ONLY, _persistentLayerInts.size() * sizeof(cl_int));
+	_persistentLayerFloatsBuffer = cl::Buffer(cs.getContext(), CL_MEM_READ_ONLY, persistentLayerFloats.size() * sizeof(cl_float));
+
+	cs.getQueue().enqueueWriteBuffer(_persistentLayerIntsBuffer, CL_TRUE, 0, _persistentLayerInts.size() * sizeof(cl_int), _persistentLayerInts.data());
+	cs.getQueue().enqueueWriteBuffer(_persistentLayerFloatsBuffer, CL_TRUE, 0, persistentLayerFloats.size() * sizeof(cl_float), persistentLayerFloats.data());
+
+	_persistentState = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, stateSize * sizeof(cl_float));
+	_persistentWeights = cl::Buffer(cs.getContext(), CL_MEM_READ_WRITE, weightsSize * sizeof(cl_float));
+}
+
+bool HEInet::settlePersistent(sys::ComputeSystem &cs, const cl::Image2D &inputFrequencyImage, int iterations, float sumScalar,
+	float eta, float shDecay, float saDecay,
+	float eAlpha, float eBeta, float eDelta, float iAlpha, float iBeta, float iGamma, float iDelta,
+	float sparsityE, float sparsityI)
+{
+	Kernels &kernels = _parityKernels[_parity];
+
+	sys::Profiler::Scope scope(cs.getProfiler(), "settlePersistent");
+
+	if (_persistentWorkGroupSize == 0) {
+#ifdef SYS_DEBUG
+		std::cout << "Network does not fit a single work-group or uses packed states, settle with the per-step calls." << std::endl;
+#endif
+		return false;
+	}
+
+	const int layerInts = 16;
+
+	const EIlayer::Configuration &frontConfig = _eiLayers.front().getConfig();
+
+	int inputSize = frontConfig._eFeedForwardWidth * frontConfig._eFeedForwardHeight;
+	int frontESize = frontConfig._eWidth * frontConfig._eHeight;
+
+	cl::size_t<3> zeroCoord;
+	zeroCoord[0] = zeroCoord[1] = zeroCoord[2] = 0;
+
+	cl::size_t<3> eFeedForwardDims;
+	eFeedForwardDims[0] = frontConfig._eFeedForwardWidth;
+	eFeedForwardDims[1] = frontConfig._eFeedForwardHeight;
+	eFeedForwardDims[2] = 1;
+
+	cl::size_t<3> eDims;
+	eDims[0] = frontConfig._eWidth;
+	eDims[1] = frontConfig._eHeight;
+	eDims[2] = 1;
+
+	cl::size_t<3> iDims;
+	iDims[0] = frontConfig._iWidth;
+	iDims[1] = frontConfig._iHeight;
+	iDims[2] = 1;
+
+	// Previous step into the state buffer
+	cs.getQueue().enqueueCopyImageToBuffer(_inputSpikeTimersPrev, _persistentState, zeroCoord, eFeedForwardDims, 0, nullptr, cs.profile("copyToPersistent"));
+	cs.getQueue().enqueueCopyImageToBuffer(_inputSpikesHistoryPrev, _persistentState, zeroCoord, eFeedForwardDims, inputSize * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+	cs.getQueue().enqueueCopyImageToBuffer(_inputSpikesPrev, _persistentState, zeroCoord, eFeedForwardDims, 2 * inputSize * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+	cs.getQueue().enqueueCopyImageToBuffer(_eSpikeSumsPrev, _persistentState, zeroCoord, eDims, 4 * inputSize * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+	cs.getQueue().enqueueCopyImageToBuffer(_iSpikeSumsPrev, _persistentState, zeroCoord, iDims, (4 * inputSize + frontESize) * sizeof(cl_float), nullptr, cs.profile("copyToPersistent"));
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		const cl_int* ints = &_persistentLayerInts[li * layerInts];
+
+		_eiLayers[li].copyToPersistent(cs, _persistentState, ints[13], ints[14], _persistentWeights, ints[15]);
+	}
+
+	int index = 0;
+
+	kernels._settlePersistentKernel.setArg(index++, inputFrequencyImage);
+	kernels._settlePersistentKernel.setArg(index++, _persistentState);
+	kernels._settlePersistentKernel.setArg(index++, _persistentWeights);
+	kernels._settlePersistentKernel.setArg(index++, cl::Local(_persistentStateSize * sizeof(cl_float)));
+	kernels._settlePersistentKernel.setArg(index++, _persistentLayerIntsBuffer);
+	kernels._settlePersistentKernel.setArg(index++, _persistentLayerFloatsBuffer);
+	kernels._settlePersistentKernel.setArg(index++, static_cast<int>(_eiLayers.size()));
+	kernels._settlePersistentKernel.setArg(index++, _persistentStateSize);
+	kernels._settlePersistentKernel.setArg(index++, iterations);
+	kernels._settlePersistentKernel.setArg(index++, sumScalar);
+	kernels._settlePersistentKernel.setArg(index++, eta);
+	kernels._settlePersistentKernel.setArg(index++, shDecay);
+	kernels._settlePersistentKernel.setArg(index++, saDecay);
+	kernels._settlePersistentKernel.setArg(index++, eAlpha);
+	kernels._settlePersistentKernel.setArg(index++, eBeta);
+	kernels._settlePersistentKernel.setArg(index++, eDelta);
+	kernels._settlePersistentKernel.setArg(index++, iAlpha);
+	kernels._settlePersistentKernel.setArg(index++, iBeta);
+	kernels._settlePersistentKernel.setArg(index++, iGamma);
+	kernels._settlePersistentKernel.setArg(index++, iDelta);
+	kernels._settlePersistentKernel.setArg(index++, sparsityE);
+	kernels._settlePersistentKernel.setArg(index++, sparsityI);
+
+	cs.getQueue().enqueueNDRangeKernel(kernels._settlePersistentKernel, cl::NullRange, cl::NDRange(_persistentWorkGroupSize), cl::NDRange(_persistentWorkGroupSize), nullptr, cs.profile("settlePersistent"));
+
+	// Settled state into the current images, then end the step as the last iteration would have (its inputs are gone, no statistics)
+	cs.getQueue().enqueueCopyBufferToImage(_persistentState, _inputSpikeTimers, 0, zeroCoord, eFeedForwardDims, nullptr, cs.profile("copyFromPersistent"));
+	cs.getQueue().enqueueCopyBufferToImage(_persistentState, _inputSpikesHistory, inputSize * sizeof(cl_float), zeroCoord, eFeedForwardDims, nullptr, cs.profile("copyFromPersistent"));
+	cs.getQueue().enqueueCopyBufferToImage(_persistentState, _inputSpikes, 2 * inputSize * sizeof(cl_float), zeroCoord, eFeedForwardDims, nullptr, cs.profile("copyFromPersistent"));
+	cs.getQueue().enqueueCopyBufferToImage(_persistentState, _eSpikeSums, 4 * inputSize * sizeof(cl_float), zeroCoord, eDims, nullptr, cs.profile("copyFromPersistent"));
+	cs.getQueue().enqueueCopyBufferToImage(_persistentState, _iSpikeSums, (4 * inputSize + frontESize) * sizeof(cl_float), zeroCoord, iDims, nullptr, cs.profile("copyFromPersistent"));
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		const cl_int* ints = &_persistentLayerInts[li * layerInts];
+
+		_eiLayers[li].copyFromPersistent(cs, _persistentState, ints[13], ints[14], _persistentWeights, ints[15]);
+	}
+
+	endStep(cs);
+
+	// Masks, spike maps and spike lists are not maintained by the persistent kernel
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+		_eiLayers[li].updateMasksPrev(cs);
+
+	if (_binaryActivation) {
+		packInputSpikes(cs, _inputSpikesPrev, _inputSpikeBitsPrev);
+
+		for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+			_eiLayers[li].packStatesPrev(cs);
+	}
+
+	if (_eventDriven) {
+		compactInputSpikes(cs, _inputSpikesPrev, _inputSpikeListPrev);
+
+		for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+			_eiLayers[li].compactStatesPrev(cs);
+	}
+
+	return true;
+}
+
 void ei::generateConfigsFromSizes(cl_int2 inputSize, const std::vector<cl_int2> &layerESizes, const std::vector<cl_int2> &layerISizes, std::vector<EIlayer::Configuration> &configs) {
 	assert(layerESizes.size() == layerISizes.size());
 	
 	if (configs.size() != layerESizes.size())
 		configs.resize(layerESizes.size());
 
-	for (int li = 0; li < configs.size(); li++) {
+	for (int li = 0; li < static_cast<int>(configs.size()); li++) {
 		if (li == 0) {
 			configs[li]._eFeedForwardWidth = inputSize.x;
 			configs[li]._eFeedForwardHeight = inputSize.y;
@@ -350,7 +1339,7 @@ void ei::generateConfigsFromSizes(cl_int2 inputSize, const std::vector<cl_int2>
 		configs[li]._iWidth = layerISizes[li].x;
 		configs[li]._iHeight = layerISizes[li].y;
 
-		if (li == configs.size() - 1) {
+		if (li == static_cast<int>(configs.size()) - 1) {
 			configs[li]._iFeedBackWidth = 1;
 			configs[li]._iFeedBackHeight = 1;
 		}
@@ -3,6 +3,11 @@
 #include "EIlayer.h"
 
 namespace ei {
+	// Thread safety: every network and each of its layers create their own kernel instances from the shared Kernels,
+	// so different HEInet instances can be created and stepped concurrently from several host threads, also on the same
+	// ComputeSystem (OpenCL enqueue calls are thread-safe, ComputeSystem locks its dependency tracking). A single instance must only be used by one thread at a time.
+	// Load the shared Kernels before starting the threads. Blocking reads wait for everything queued before them,
+	// so give each thread its own ComputeSystem if the networks should not wait on each other
 	class HEInet {
 	public:
 		// Kernels this system uses
@@ -12,13 +17,67 @@ namespace ei {
 			cl::Kernel _predictKernel;
 			cl::Kernel _predictionLearnKernel;
 
+			// Prediction learning averaged over a batch (EIlayer::Configuration::_batchSize)
+			cl::Kernel _predictionLearnBatchKernel;
+
+			// Prediction reading its receptive fields from local memory tiles
+			cl::Kernel _predictTiledKernel;
+
 			cl::Kernel _updateInputSpikesKernel;
 
 			cl::Kernel _sumSpikesKernel;
 
+			cl::Kernel _packInputSpikesKernel;
+			cl::Kernel _compactInputSpikesKernel;
+
+			cl::Kernel _settlePersistentKernel;
+
+			// Program the kernels were created from, each network creates its own instances from it
+			cl::Program _program;
+
+			// Set when loaded from a ComputeProgram, networks then specialize to their prediction fields (see EIlayer::Kernels)
+			sys::ComputeProgram* _variants;
+
+			Kernels()
+				: _variants(nullptr)
+			{}
+
 			// Load kernels from program
 			void loadFromProgram(sys::ComputeProgram &program);
+			void loadFromProgram(const cl::Program &program);
+		};
+
+		// Outputs of an example read back without blocking (requestOutputs). Host copies of the first layer's _eSpikeSumsIterPrev and
+		// _iSpikeSumsIterPrev and of _prediction, mapped from pinned buffers. Valid once _ready completed (wait, or a callback set on it)
+		// until the second requestOutputs after the one that returned them
+		struct Outputs {
+			const float* _eSpikeSums;
+			const float* _iSpikeSums;
+			const float* _prediction;
+
+			cl::Event _ready;
+
+			Outputs()
+				: _eSpikeSums(nullptr), _iSpikeSums(nullptr), _prediction(nullptr)
+			{}
+
+			bool isReady() const {
+				return _ready() != nullptr && _ready.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+			}
+
+			void wait() const {
+				_ready.wait();
+			}
+		};
+
+		// Activity statistics of one recording (createStatistics), E and I population of each layer in layer order
+		struct StatisticsRecord {
+			// Steps since createStatistics
+			int _step;
+
+			std::vector<EIlayer::PopulationStatistics> _populations;
 		};
+
 	private:
 		std::vector<EIlayer> _eiLayers;
 
@@ -27,6 +86,125 @@ namespace ei {
 
 		std::shared_ptr<Kernels> _kernels;
 
+		// Kernel instances owned by this network, one per buffer parity (see EIlayer)
+		Kernels _parityKernels[2];
+		int _parity;
+
+		// Allocate and clear everything but the prediction weights for the layers in _eiLayers, then create the prediction
+		// weights (wrapping hostPtr if not null) and finish by choosing tiles, setting up persistent settle and binding the kernels
+		void create(sys::ComputeSystem &cs, const std::shared_ptr<Kernels> &heiKernels, int predictionRadiusFromE, int predictionRadiusFromI);
+		void createPredictionWeights(sys::ComputeSystem &cs, EIlayer::Weights2D &weights, int size, void* hostPtr);
+		void initializePrediction(sys::ComputeSystem &cs, EIlayer::Weights2D &weights, cl_float2 eFeedForwardDimsToDims, cl_int2 dims, int predictionRadius,
+			float minInitWeight, float maxInitWeight, cl_uint2 seed, cl_uint stream);
+		void finishCreate(sys::ComputeSystem &cs);
+
+		// Mapped checkpoint whose sections the weight buffers of CPU devices use in place, kept open while they exist
+		std::shared_ptr<Checkpoint> _checkpoint;
+
+		void bindKernels(Kernels &kernels);
+
+		// Activate layers with bitmasks and popcount instead of reading float weights
+		bool _binaryActivation;
+
+		// Binary, event driven and persistent activation write the separate state images (EIlayer::Configuration::_packedStates)
+		bool hasPackedStates() const;
+
+		// Persistent activation reads float weights (EIlayer::WeightPrecision)
+		bool hasFloatWeights() const;
+
+		// Feed back spike map of the top layer in binary activation
+		cl::Buffer _zeroBits;
+
+		void packInputSpikes(sys::ComputeSystem &cs, const cl::Image2D &inputSpikes, const cl::Buffer &inputSpikeBits);
+
+		// Scatter spike lists instead of gathering receptive fields while few neurons spike
+		bool _eventDriven;
+		bool _useEvents;
+		float _maxEventActivity;
+
+		// Feed back spike list of the top layer in event driven activation
+		EIlayer::SpikeList _zeroSpikeList;
+
+		// Activate layers from their connection lists, rebuilt every _connectionsRebuildInterval steps
+		bool _sparseActivation;
+		int _connectionsRebuildInterval;
+		int _stepsSinceConnectionsBuilt;
+
+		// Spike counts of the input and each layer (E, I) read back without blocking
+		std::vector<cl_int> _spikeCounts;
+		cl::Event _spikeCountsEvent;
+
+		void compactInputSpikes(sys::ComputeSystem &cs, const cl::Image2D &inputSpikes, const EIlayer::SpikeList &inputSpikeList);
+
+		// Work-group edge of the tiled prediction (0 if not used) and its tiles of the first layer's E and I states
+		int _predictionTileSize;
+		cl_int2 _predictionFromETileDims;
+		cl_int2 _predictionFromITileDims;
+
+		// Persistent settle, buffers only allocated when the network fits a single work-group and keeps separate unbatched state images (0 work items otherwise)
+		int _persistentWorkGroupSize;
+		int _persistentStateSize;
+
+		// Per layer dims, radii, state block offsets and weight offset (16 ints), receptive field ratios (8 floats)
+		std::vector<cl_int> _persistentLayerInts;
+
+		cl::Buffer _persistentLayerIntsBuffer;
+		cl::Buffer _persistentLayerFloatsBuffer;
+
+		cl::Buffer _persistentState;
+		cl::Buffer _persistentWeights;
+
+		void createPersistent(sys::ComputeSystem &cs);
+
+		// Input pipeline (createInputPipeline), examples alternate between the slots
+		struct InputSlot {
+			cl::Image2D _image;
+
+			// Pinned staging memory the host fills while mapped
+			cl::Buffer _staging;
+			float* _stagingData;
+
+			// Upload of the slot's example on the transfer queue, and the end of the work on _queue reading it
+			cl::Event _uploaded;
+			cl::Event _consumed;
+
+			InputSlot()
+				: _stagingData(nullptr)
+			{}
+		};
+
+		InputSlot _inputSlots[2];
+		int _inputsSubmitted;
+		int _inputsBegun;
+
+		// Output readback (createOutputReadback), requests alternate between the slots. The buffers are host visible
+		// (CL_MEM_ALLOC_HOST_PTR), on devices sharing host memory mapping them copies nothing
+		struct OutputSlot {
+			cl::Buffer _eSpikeSums;
+			cl::Buffer _iSpikeSums;
+			cl::Buffer _prediction;
+
+			Outputs _outputs;
+		};
+
+		OutputSlot _outputSlots[2];
+		int _outputsRequested;
+
+		void unmapOutputs(sys::ComputeSystem &cs, OutputSlot &slot);
+
+		// Ring of _statisticsCapacity records (createStatistics), each 2 * layers EIlayer::PopulationStatistics
+		cl::Buffer _statistics;
+		int _statisticsInterval;
+		int _statisticsCapacity;
+		int _statisticsSteps;
+		int _statisticsRecorded;
+		int _statisticsRead;
+
+		void recordStatistics(sys::ComputeSystem &cs);
+
+		// stepEnd without recording statistics
+		void endStep(sys::ComputeSystem &cs);
+
 	public:
 		cl::Image2D _prediction;
 		cl::Image2D _predictionPrev;
@@ -40,6 +218,12 @@ namespace ei {
 		cl::Image2D _inputSpikeTimers;
 		cl::Image2D _inputSpikeTimersPrev;
 
+		cl::Buffer _inputSpikeBits;
+		cl::Buffer _inputSpikeBitsPrev;
+
+		EIlayer::SpikeList _inputSpikeList;
+		EIlayer::SpikeList _inputSpikeListPrev;
+
 		cl::Image2D _eSpikeSums;
 		cl::Image2D _iSpikeSums;
 		cl::Image2D _eSpikeSumsPrev;
@@ -50,15 +234,33 @@ namespace ei {
 		EIlayer::Weights2D _predictionFromEWeights;
 		EIlayer::Weights2D _predictionFromIWeights;
 
-		// Randomly initialized weights
-		void createRandom(const std::vector<EIlayer::Configuration> &eilConfigs,
+		HEInet()
+			: _parity(0), _binaryActivation(false), _eventDriven(false), _useEvents(false), _maxEventActivity(0.05f),
+			_sparseActivation(false), _connectionsRebuildInterval(50), _stepsSinceConnectionsBuilt(0),
+			_predictionTileSize(0), _persistentWorkGroupSize(0), _persistentStateSize(0), _inputsSubmitted(0), _inputsBegun(0), _outputsRequested(0),
+			_statisticsInterval(0), _statisticsCapacity(0), _statisticsSteps(0), _statisticsRecorded(0), _statisticsRead(0)
+		{}
+
+		// Randomly initialized weights. Returns false without an OpenCL device (sys::ComputeSystem::_native or _none), HEInetNative
+		// runs the native backend
+		bool createRandom(const std::vector<EIlayer::Configuration> &eilConfigs,
 			int predictionRadiusFromE, int predictionRadiusFromI,
 			float minInitEWeight, float maxInitEWeight,
 			float minInitIWeight, float maxInitIWeight,
 			float initEThreshold, float initIThreshold,
 			float sparsityE, float sparsityI,
 			sys::ComputeSystem &cs, const std::shared_ptr<EIlayer::Kernels> &eilKernels,
-			const std::shared_ptr<Kernels> &heiKernels, std::mt19937 &generator);
+			const std::shared_ptr<Kernels> &heiKernels, std::mt19937 &generator,
+			EIlayer::WeightPrecision weightPrecision = EIlayer::_float);
+
+		// Save weights, thresholds, state averages and layer configurations of the previous step to a versioned binary file (Checkpoint)
+		bool saveCheckpoint(sys::ComputeSystem &cs, const std::string &fileName) const;
+
+		// Create from a file written by saveCheckpoint instead of createRandom, returns false if it can not be used or there is no OpenCL device.
+		// Sections are mapped and uploaded without intermediate copies, CPU devices use the mapped weights in place
+		bool createFromCheckpoint(const std::string &fileName,
+			sys::ComputeSystem &cs, const std::shared_ptr<EIlayer::Kernels> &eilKernels,
+			const std::shared_ptr<Kernels> &heiKernels);
 
 		// Begin summation of spikes
 		void spikeSumBegin(sys::ComputeSystem &cs);
@@ -68,6 +270,44 @@ namespace ei {
 		void setInputPhase(sys::ComputeSystem &cs, const cl::Image2D &inputPhaseImage);
 		void setInputPhase(sys::ComputeSystem &cs, cl_uint4 color);
 
+		// Double buffered input upload, so the next example is prepared and uploaded (on the transfer queue) while the current one settles.
+		// Fill getInputStaging (input width x height * batch size floats) and submitInput, then per example beginInput, enqueue the
+		// steps with the returned image, endInput, and submit the next one. Nothing blocks apart from the staging map waiting for the
+		// upload from the same slot two examples earlier. Allocates two input images and their staging buffers
+		void createInputPipeline(sys::ComputeSystem &cs);
+
+		// Host memory of the next example, valid until submitInput
+		float* getInputStaging(sys::ComputeSystem &cs);
+
+		// Upload the staged example once the examples before it stopped using its image, returns the event of the upload
+		const cl::Event &submitInput(sys::ComputeSystem &cs);
+
+		// Make the following work wait for the upload of the oldest submitted example, returns its image
+		const cl::Image2D &beginInput(sys::ComputeSystem &cs);
+
+		// Mark the end of the work reading the image of beginInput
+		void endInput(sys::ComputeSystem &cs);
+
+		// Non-blocking readback of the spike sums and predictions, so the host can use the results of an example while the next one runs.
+		// Allocates two sets of pinned output buffers
+		void createOutputReadback(sys::ComputeSystem &cs);
+
+		// Copy the current outputs (after predict) into the next set of buffers and map it, nothing waits for the copy
+		const Outputs &requestOutputs(sys::ComputeSystem &cs);
+
+		// Activity statistics reduced on the device. Every interval steps stepEnd reduces each population (EIlayer::recordStatistics:
+		// state average mean and variance, threshold range, spikes and synaptic events) into the next record of a ring of capacity
+		// records, nothing is read back. Examples run by settlePersistent are not recorded. Allocates the ring and starts counting steps
+		void createStatistics(sys::ComputeSystem &cs, int interval = 100, int capacity = 64);
+
+		// Records made since the previous call, oldest first. The ring keeps the last capacity, older records are dropped.
+		// Reads only the ring (capacity * 2 * layers PopulationStatistics), blocking
+		void readStatistics(sys::ComputeSystem &cs, std::vector<StatisticsRecord> &records);
+
+		bool hasStatistics() const {
+			return _statisticsInterval > 0;
+		}
+
 		// Run through an example step (multiple simulation steps)
 		void update(sys::ComputeSystem &cs, const cl::Image2D &inputFrequencyImage, const cl::Image2D &zeroImage, float eta, float shDecay, float saDecay);
 
@@ -86,6 +326,57 @@ namespace ei {
 
 		void predictionEnd();
 
+		// Run iterations of update, sumSpikes, learn and stepEnd in a single kernel launch, for small networks where launch
+		// overhead dominates. One work-group keeps all neuron state in local memory, the host is only involved per example.
+		// Returns false without doing anything if the network does not fit (see canSettlePersistent), use the per-step calls then
+		bool settlePersistent(sys::ComputeSystem &cs, const cl::Image2D &inputFrequencyImage, int iterations, float sumScalar,
+			float eta, float shDecay, float saDecay,
+			float eAlpha, float eBeta, float eDelta, float iAlpha, float iBeta, float iGamma, float iDelta,
+			float sparsityE, float sparsityI);
+
+		bool canSettlePersistent() const {
+			return _persistentWorkGroupSize > 0;
+		}
+
+		// Binary activation (AND + popcount on bit-packed spikes) gives the same spikes as the default float path
+		// while reading about 32x less connectivity data per settle iteration. Can be switched at any time, unless layers use packed states or batches
+		void setBinaryActivation(sys::ComputeSystem &cs, bool binaryActivation);
+
+		bool getBinaryActivation() const {
+			return _binaryActivation;
+		}
+
+		// Event driven activation scatters the spikes of the previous step to their connected neurons, so a step costs about
+		// spikes * fan out instead of neurons * receptive field. Steps where more than maxEventActivity of all neurons spiked
+		// (known one or more steps late, read back without blocking) fall back to the dense (or binary) path. Same spikes either way.
+		// Not available when layers use packed states or batches
+		void setEventDriven(sys::ComputeSystem &cs, bool eventDriven, float maxEventActivity = 0.05f);
+
+		bool getEventDriven() const {
+			return _eventDriven;
+		}
+
+		// Sparse activation sums each receptive field over a list of the connected inputs (EIlayer::setSparseActivation), so the
+		// dense path costs about neurons * connections instead of neurons * receptive field. Lists are rebuilt from the connectivity
+		// masks every rebuildInterval steps (stepEnd), activation does not see connections learning made or broke in between.
+		// Binary, event driven and persistent activation take precedence. Not available when layers use packed states
+		void setSparseActivation(sys::ComputeSystem &cs, bool sparseActivation, int rebuildInterval = 50);
+
+		bool getSparseActivation() const {
+			return _sparseActivation;
+		}
+
+		// Activity gated learning (EIlayer::setActivityGatedLearning) on every layer, learn only updates the weights of neurons
+		// that spiked recently. Prediction weights and persistent settling keep learning densely
+		void setActivityGatedLearning(bool activityGatedLearning, float minHistory = 0.0f);
+
+		bool getActivityGatedLearning() const {
+			return !_eiLayers.empty() && _eiLayers.front().getActivityGatedLearning();
+		}
+
+		// Total number of input and layer neurons
+		int getNumNeurons() const;
+
 		const std::vector<EIlayer> &getEIlayers() const {
 			return _eiLayers;
 		}
@@ -97,6 +388,11 @@ namespace ei {
 		int getPredictionRadiusFromI() const {
 			return _predictionRadiusFromI;
 		}
+
+		// Inputs simulated together, input, prediction and spike sum images hold the items stacked vertically
+		int getBatchSize() const {
+			return _eiLayers.front().getConfig()._batchSize;
+		}
 	};
 
 	void generateConfigsFromSizes(cl_int2 inputSize, const std::vector<cl_int2> &layerESizes, const std::vector<cl_int2> &layerISizes, std::vector<EIlayer::Configuration> &configs);
@@ -0,0 +1,287 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "HEInetNative.h"
+
+#include "NativeKernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace ei;
+
+void HEInetNative::createRandom(const std::vector<EIlayer::Configuration> &eilConfigs,
+	int predictionRadiusFromE, int predictionRadiusFromI,
+	float minInitEWeight, float maxInitEWeight,
+	float minInitIWeight, float maxInitIWeight,
+	float initEThreshold, float initIThreshold,
+	float sparsityE, float sparsityI,
+	sys::ComputeSystem &cs, std::mt19937 &generator)
+{
+	_predictionRadiusFromE = predictionRadiusFromE;
+	_predictionRadiusFromI = predictionRadiusFromI;
+
+	_eiLayers.resize(eilConfigs.size());
+
+	// Initialize all layers
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		_eiLayers[li].createRandom(eilConfigs[li],
+			minInitEWeight, maxInitEWeight, minInitIWeight, maxInitIWeight,
+			initEThreshold, initIThreshold,
+			sparsityE, sparsityI,
+			cs, generator);
+	}
+
+	int predictionFromESize = std::pow(_predictionRadiusFromE * 2 + 1, 2);
+	int predictionFromISize = std::pow(_predictionRadiusFromI * 2 + 1, 2);
+
+	int inputSize = eilConfigs.front()._eFeedForwardWidth * eilConfigs.front()._eFeedForwardHeight;
+	int eSize = eilConfigs.front()._eWidth * eilConfigs.front()._eHeight;
+	int iSize = eilConfigs.front()._iWidth * eilConfigs.front()._iHeight;
+
+	_prediction.assign(inputSize, 0.0f);
+	_predictionPrev.assign(inputSize, 0.0f);
+
+	_inputSpikes.assign(inputSize, 0.0f);
+	_inputSpikesPrev.assign(inputSize, 0.0f);
+
+	_inputSpikesHistory.assign(inputSize, 0.0f);
+	_inputSpikesHistoryPrev.assign(inputSize, 0.0f);
+
+	_inputSpikeTimers.assign(inputSize, 0.0f);
+	_inputSpikeTimersPrev.assign(inputSize, 0.0f);
+
+	_eSpikeSums.assign(eSize, 0.0f);
+	_eSpikeSumsPrev.assign(eSize, 0.0f);
+	_iSpikeSums.assign(iSize, 0.0f);
+	_iSpikeSumsPrev.assign(iSize, 0.0f);
+	_eSpikeSumsIterPrev.assign(eSize, 0.0f);
+	_iSpikeSumsIterPrev.assign(iSize, 0.0f);
+
+	_zeroImage.assign(eilConfigs.back()._iFeedBackWidth * eilConfigs.back()._iFeedBackHeight, 0.0f);
+
+	cl_uint2 seed = { static_cast<cl_uint>(generator()), static_cast<cl_uint>(generator()) };
+
+	_predictionFromEWeights._weightsPrev.resize(inputSize * predictionFromESize);
+	_predictionFromIWeights._weightsPrev.resize(inputSize * predictionFromISize);
+
+	// Streams 0 and 1 as in HEInet::createRandom
+	for (int wi = 0; wi < predictionFromESize; wi++)
+		for (int i = 0; i < inputSize; i++)
+			_predictionFromEWeights._weightsPrev[i + wi * inputSize] = native::philoxFloat(i, wi, 0, seed) * (maxInitEWeight - minInitEWeight) + minInitEWeight;
+
+	for (int wi = 0; wi < predictionFromISize; wi++)
+		for (int i = 0; i < inputSize; i++)
+			_predictionFromIWeights._weightsPrev[i + wi * inputSize] = native::philoxFloat(i, wi, 1, seed) * (maxInitEWeight - minInitEWeight) + minInitEWeight;
+
+	_predictionFromEWeights._weights = _predictionFromEWeights._weightsPrev;
+	_predictionFromIWeights._weights = _predictionFromIWeights._weightsPrev;
+}
+
+void HEInetNative::spikeSumBegin(sys::ComputeSystem &) {
+	std::fill(_eSpikeSums.begin(), _eSpikeSums.end(), 0.0f);
+	std::fill(_eSpikeSumsPrev.begin(), _eSpikeSumsPrev.end(), 0.0f);
+	std::fill(_iSpikeSums.begin(), _iSpikeSums.end(), 0.0f);
+	std::fill(_iSpikeSumsPrev.begin(), _iSpikeSumsPrev.end(), 0.0f);
+}
+
+void HEInetNative::sumSpikes(sys::ComputeSystem &, float scalar) {
+	const Image &eStates = _eiLayers.front()._eLayer._states;
+	const Image &iStates = _eiLayers.front()._iLayer._states;
+
+	for (int i = 0; i < static_cast<int>(_eSpikeSums.size()); i++)
+		_eSpikeSums[i] = _eSpikeSumsPrev[i] + eStates[i] * scalar;
+
+	for (int i = 0; i < static_cast<int>(_iSpikeSums.size()); i++)
+		_iSpikeSums[i] = _iSpikeSumsPrev[i] + iStates[i] * scalar;
+}
+
+void HEInetNative::setInputPhase(sys::ComputeSystem &, const Image &inputPhaseImage) {
+	_inputSpikeTimersPrev = inputPhaseImage;
+}
+
+void HEInetNative::setInputPhase(sys::ComputeSystem &, float phase) {
+	std::fill(_inputSpikeTimersPrev.begin(), _inputSpikeTimersPrev.end(), phase);
+}
+
+void HEInetNative::update(sys::ComputeSystem &cs, const Image &inputFrequencyImage, float eta, float shDecay, float saDecay) {
+	// Update input spikes
+	for (int i = 0; i < static_cast<int>(_inputSpikes.size()); i++) {
+		float spikeTimer = _inputSpikeTimersPrev[i] + inputFrequencyImage[i];
+
+		float spike = 0.0f;
+
+		if (spikeTimer >= 1.0f) {
+			spikeTimer -= 1.0f;
+
+			spike = 1.0f;
+		}
+
+		_inputSpikeTimers[i] = spikeTimer;
+		_inputSpikes[i] = spike;
+		_inputSpikesHistory[i] = std::max((1.0f - shDecay) * _inputSpikesHistoryPrev[i], spike);
+	}
+
+	const Image* pLayerInput = &_inputSpikesPrev;
+
+	// Feed forward
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		_eiLayers[li].eActivate(cs, *pLayerInput, eta, shDecay, saDecay);
+
+		pLayerInput = &_eiLayers[li]._eLayer._statesPrev;
+	}
+
+	pLayerInput = &_zeroImage;
+
+	// Feed back
+	for (int li = _eiLayers.size() - 1; li >= 0; li--) {
+		_eiLayers[li].iActivate(cs, *pLayerInput, eta, shDecay, saDecay);
+
+		pLayerInput = &_eiLayers[li]._iLayer._statesPrev;
+	}
+}
+
+void HEInetNative::predict(sys::ComputeSystem &cs) {
+	const EIlayer::Configuration &config = _eiLayers.front().getConfig();
+
+	float eFeedForwardDimsToEDimsX = static_cast<float>(config._eWidth + 1) / static_cast<float>(config._eFeedForwardWidth + 1);
+	float eFeedForwardDimsToEDimsY = static_cast<float>(config._eHeight + 1) / static_cast<float>(config._eFeedForwardHeight + 1);
+	float eFeedForwardDimsToIDimsX = static_cast<float>(config._iWidth + 1) / static_cast<float>(config._eFeedForwardWidth + 1);
+	float eFeedForwardDimsToIDimsY = static_cast<float>(config._iHeight + 1) / static_cast<float>(config._eFeedForwardHeight + 1);
+
+	int inputSize = config._eFeedForwardWidth * config._eFeedForwardHeight;
+
+	cs.getThreadPool().parallelFor(config._eFeedForwardHeight, 1, [&](int yBegin, int yEnd) {
+		for (int y = yBegin; y < yEnd; y++)
+			for (int x = 0; x < config._eFeedForwardWidth; x++) {
+				int i = x + y * config._eFeedForwardWidth;
+
+				int eCenterX = native::centerPosition(x, eFeedForwardDimsToEDimsX);
+				int eCenterY = native::centerPosition(y, eFeedForwardDimsToEDimsY);
+				int iCenterX = native::centerPosition(x, eFeedForwardDimsToIDimsX);
+				int iCenterY = native::centerPosition(y, eFeedForwardDimsToIDimsY);
+
+				float sum = 0.0f;
+
+				int wi = 0;
+
+				for (int dx = -_predictionRadiusFromE; dx <= _predictionRadiusFromE; dx++)
+					for (int dy = -_predictionRadiusFromE; dy <= _predictionRadiusFromE; dy++, wi++) {
+						int eX = eCenterX + dx;
+						int eY = eCenterY + dy;
+
+						if (eX >= 0 && eX < config._eWidth && eY >= 0 && eY < config._eHeight)
+							sum += _predictionFromEWeights._weightsPrev[i + wi * inputSize] * _eSpikeSumsPrev[eX + eY * config._eWidth];
+					}
+
+				wi = 0;
+
+				for (int dx = -_predictionRadiusFromI; dx <= _predictionRadiusFromI; dx++)
+					for (int dy = -_predictionRadiusFromI; dy <= _predictionRadiusFromI; dy++, wi++) {
+						int iX = iCenterX + dx;
+						int iY = iCenterY + dy;
+
+						if (iX >= 0 && iX < config._iWidth && iY >= 0 && iY < config._iHeight)
+							sum += _predictionFromIWeights._weightsPrev[i + wi * inputSize] * _iSpikeSumsPrev[iX + iY * config._iWidth];
+					}
+
+				_prediction[i] = sum;
+			}
+	});
+}
+
+void HEInetNative::learn(sys::ComputeSystem &cs,
+	float eAlpha, float eBeta, float eDelta, float iAlpha, float iBeta, float iGamma, float iDelta,
+	float sparsityE, float sparsityI)
+{
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++) {
+		const Image &feedForwardInputs = li == 0 ? _inputSpikes : _eiLayers[li - 1]._eLayer._statesHistory;
+		const Image &feedForwardInputsPrev = li == 0 ? _inputSpikesPrev : _eiLayers[li - 1]._eLayer._statesHistoryPrev;
+		const Image &feedBackInputs = li == static_cast<int>(_eiLayers.size()) - 1 ? _zeroImage : _eiLayers[li + 1]._iLayer._statesHistory;
+		const Image &feedBackInputsPrev = li == static_cast<int>(_eiLayers.size()) - 1 ? _zeroImage : _eiLayers[li + 1]._iLayer._statesHistoryPrev;
+
+		_eiLayers[li].learn(cs, feedForwardInputs, feedForwardInputsPrev, feedBackInputs, feedBackInputsPrev, eAlpha, eBeta, eDelta, iAlpha, iBeta, iGamma, iDelta, sparsityE, sparsityI);
+	}
+}
+
+void HEInetNative::learnPrediction(sys::ComputeSystem &cs, const Image &inputImage, float alpha) {
+	const EIlayer::Configuration &config = _eiLayers.front().getConfig();
+
+	float eFeedForwardDimsToEDimsX = static_cast<float>(config._eWidth + 1) / static_cast<float>(config._eFeedForwardWidth + 1);
+	float eFeedForwardDimsToEDimsY = static_cast<float>(config._eHeight + 1) / static_cast<float>(config._eFeedForwardHeight + 1);
+	float eFeedForwardDimsToIDimsX = static_cast<float>(config._iWidth + 1) / static_cast<float>(config._eFeedForwardWidth + 1);
+	float eFeedForwardDimsToIDimsY = static_cast<float>(config._iHeight + 1) / static_cast<float>(config._eFeedForwardHeight + 1);
+
+	int inputSize = config._eFeedForwardWidth * config._eFeedForwardHeight;
+
+	cs.getThreadPool().parallelFor(config._eFeedForwardHeight, 1, [&](int yBegin, int yEnd) {
+		for (int y = yBegin; y < yEnd; y++)
+			for (int x = 0; x < config._eFeedForwardWidth; x++) {
+				int i = x + y * config._eFeedForwardWidth;
+
+				int eCenterX = native::centerPosition(x, eFeedForwardDimsToEDimsX);
+				int eCenterY = native::centerPosition(y, eFeedForwardDimsToEDimsY);
+				int iCenterX = native::centerPosition(x, eFeedForwardDimsToIDimsX);
+				int iCenterY = native::centerPosition(y, eFeedForwardDimsToIDimsY);
+
+				float alphaError = alpha * (inputImage[i] - _predictionPrev[i]);
+
+				int wi = 0;
+
+				for (int dx = -_predictionRadiusFromE; dx <= _predictionRadiusFromE; dx++)
+					for (int dy = -_predictionRadiusFromE; dy <= _predictionRadiusFromE; dy++, wi++) {
+						int eX = eCenterX + dx;
+						int eY = eCenterY + dy;
+
+						if (eX >= 0 && eX < config._eWidth && eY >= 0 && eY < config._eHeight)
+							_predictionFromEWeights._weights[i + wi * inputSize] = _predictionFromEWeights._weightsPrev[i + wi * inputSize] + alphaError * _eSpikeSumsIterPrev[eX + eY * config._eWidth];
+					}
+
+				wi = 0;
+
+				for (int dx = -_predictionRadiusFromI; dx <= _predictionRadiusFromI; dx++)
+					for (int dy = -_predictionRadiusFromI; dy <= _predictionRadiusFromI; dy++, wi++) {
+						int iX = iCenterX + dx;
+						int iY = iCenterY + dy;
+
+						if (iX >= 0 && iX < config._iWidth && iY >= 0 && iY < config._iHeight)
+							_predictionFromIWeights._weights[i + wi * inputSize] = _predictionFromIWeights._weightsPrev[i + wi * inputSize] + alphaError * _iSpikeSumsIterPrev[iX + iY * config._iWidth];
+					}
+			}
+	});
+}
+
+void HEInetNative::stepEnd(sys::ComputeSystem &) {
+	std::swap(_inputSpikes, _inputSpikesPrev);
+	std::swap(_inputSpikesHistory, _inputSpikesHistoryPrev);
+	std::swap(_inputSpikeTimers, _inputSpikeTimersPrev);
+
+	std::swap(_eSpikeSums, _eSpikeSumsPrev);
+	std::swap(_iSpikeSums, _iSpikeSumsPrev);
+
+	for (int li = 0; li < static_cast<int>(_eiLayers.size()); li++)
+		_eiLayers[li].stepEnd();
+}
+
+void HEInetNative::predictionEnd() {
+	std::swap(_eSpikeSumsPrev, _eSpikeSumsIterPrev);
+	std::swap(_iSpikeSumsPrev, _iSpikeSumsIterPrev);
+}
\ No newline at end of file
@@ -0,0 +1,117 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include "EIlayerNative.h"
+#include "HEInet.h"
+
+namespace ei {
+	// HEInet on the native backend (sys::ComputeSystem::_native), multithreaded with AVX2/AVX-512 activation.
+	// Given the same generator state it produces the same weights as HEInet. Spikes and receptive field sums are exact,
+	// the remaining float math follows the kernels operation by operation without FMA contraction. OpenCL compilers may
+	// contract a * b + c, so activations, traces, thresholds and weights can differ from the device by about 1 ulp per step.
+	// These differences can eventually flip spikes of neurons sitting exactly at threshold, so compare runs statistically
+	// Batches (EIlayer::Configuration::_batchSize) are not supported, layers are always simulated for a single input
+	class HEInetNative {
+	public:
+		typedef EIlayerNative::Image Image;
+
+	private:
+		std::vector<EIlayerNative> _eiLayers;
+
+		int _predictionRadiusFromE;
+		int _predictionRadiusFromI;
+
+		// Feed back input of the top layer
+		Image _zeroImage;
+
+	public:
+		Image _prediction;
+		Image _predictionPrev;
+
+		Image _inputSpikes;
+		Image _inputSpikesPrev;
+
+		Image _inputSpikesHistory;
+		Image _inputSpikesHistoryPrev;
+
+		Image _inputSpikeTimers;
+		Image _inputSpikeTimersPrev;
+
+		Image _eSpikeSums;
+		Image _iSpikeSums;
+		Image _eSpikeSumsPrev;
+		Image _iSpikeSumsPrev;
+		Image _eSpikeSumsIterPrev;
+		Image _iSpikeSumsIterPrev;
+
+		EIlayerNative::Weights2D _predictionFromEWeights;
+		EIlayerNative::Weights2D _predictionFromIWeights;
+
+		// Randomly initialized weights
+		void createRandom(const std::vector<EIlayer::Configuration> &eilConfigs,
+			int predictionRadiusFromE, int predictionRadiusFromI,
+			float minInitEWeight, float maxInitEWeight,
+			float minInitIWeight, float maxInitIWeight,
+			float initEThreshold, float initIThreshold,
+			float sparsityE, float sparsityI,
+			sys::ComputeSystem &cs, std::mt19937 &generator);
+
+		// Begin summation of spikes
+		void spikeSumBegin(sys::ComputeSystem &cs);
+
+		void sumSpikes(sys::ComputeSystem &cs, float scalar);
+
+		void setInputPhase(sys::ComputeSystem &cs, const Image &inputPhaseImage);
+		void setInputPhase(sys::ComputeSystem &cs, float phase);
+
+		// Run through an example step (multiple simulation steps)
+		void update(sys::ComputeSystem &cs, const Image &inputFrequencyImage, float eta, float shDecay, float saDecay);
+
+		// Get prediction
+		void predict(sys::ComputeSystem &cs);
+
+		// Learn
+		void learn(sys::ComputeSystem &cs,
+			float eAlpha, float eBeta, float eDelta, float iAlpha, float iBeta, float iGamma, float iDelta,
+			float sparsityE, float sparsityI);
+
+		// Learn prediction
+		void learnPrediction(sys::ComputeSystem &cs, const Image &inputImage, float alpha);
+
+		void stepEnd(sys::ComputeSystem &cs);
+
+		void predictionEnd();
+
+		const std::vector<EIlayerNative> &getEIlayers() const {
+			return _eiLayers;
+		}
+
+		int getPredictionRadiusFromE() const {
+			return _predictionRadiusFromE;
+		}
+
+		int getPredictionRadiusFromI() const {
+			return _predictionRadiusFromI;
+		}
+	};
+}
\ No newline at end of file
@@ -0,0 +1,288 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "NativeKernels.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define EI_NATIVE_X86 1
+#else
+#define EI_NATIVE_X86 0
+#endif
+
+// SIMD paths are selected at runtime with GCC/Clang, at compile time (/arch) otherwise
+#if EI_NATIVE_X86 && defined(__GNUC__)
+#define EI_NATIVE_TARGET(isa) __attribute__((target(isa)))
+#define EI_NATIVE_HAS_AVX2 1
+#define EI_NATIVE_HAS_AVX512 1
+#else
+#define EI_NATIVE_TARGET(isa)
+#if EI_NATIVE_X86 && defined(__AVX2__)
+#define EI_NATIVE_HAS_AVX2 1
+#else
+#define EI_NATIVE_HAS_AVX2 0
+#endif
+#if EI_NATIVE_X86 && defined(__AVX512F__)
+#define EI_NATIVE_HAS_AVX512 1
+#else
+#define EI_NATIVE_HAS_AVX512 0
+#endif
+#endif
+
+using namespace ei;
+
+float native::philoxFloat(cl_uint c0, cl_uint c1, cl_uint c2, cl_uint2 key) {
+	cl_uint counter[4] = { c0, c1, c2, 0 };
+
+	for (int round = 0; round < 10; round++) {
+		cl_ulong product0 = static_cast<cl_ulong>(0xD2511F53u) * counter[0];
+		cl_ulong product1 = static_cast<cl_ulong>(0xCD9E8D57u) * counter[2];
+
+		cl_uint next[4] = {
+			static_cast<cl_uint>(product1 >> 32) ^ counter[1] ^ key.x,
+			static_cast<cl_uint>(product1),
+			static_cast<cl_uint>(product0 >> 32) ^ counter[3] ^ key.y,
+			static_cast<cl_uint>(product0)
+		};
+
+		std::copy(next, next + 4, counter);
+
+		key.x += 0x9E3779B9u;
+		key.y += 0xBB67AE85u;
+	}
+
+	return static_cast<float>(counter[0] >> 8) * (1.0f / 16777216.0f);
+}
+
+namespace {
+	typedef void (*SumConnectedFunc)(const float*, int, int, const float*, int, int, float, float, int, bool, int, int, int, float*);
+
+	void sumConnectedScalar(const float* inputs, int inputWidth, int inputHeight,
+		const float* weights, int width, int height,
+		float ratioX, float ratioY, int radius, bool lateral,
+		int y, int xBegin, int xEnd, float* sums)
+	{
+		int layerSize = width * height;
+
+		int centerY = lateral ? y : native::centerPosition(y, ratioY);
+
+		for (int x = xBegin; x < xEnd; x++) {
+			int centerX = lateral ? x : native::centerPosition(x, ratioX);
+
+			const float* neuronWeights = weights + x + y * width;
+
+			float sum = 0.0f;
+
+			int wi = 0;
+
+			for (int dx = -radius; dx <= radius; dx++)
+				for (int dy = -radius; dy <= radius; dy++, wi++) {
+					if (lateral && dx == 0 && dy == 0)
+						continue;
+
+					int inputX = centerX + dx;
+					int inputY = centerY + dy;
+
+					if (inputX >= 0 && inputX < inputWidth && inputY >= 0 && inputY < inputHeight) {
+						if (neuronWeights[wi * layerSize] > 0.5f)
+							sum += inputs[inputX + inputY * inputWidth];
+					}
+				}
+
+			sums[x - xBegin] += sum;
+		}
+	}
+
+#if EI_NATIVE_HAS_AVX2
+	// 8 neurons of a row per iteration. Weights of neighbouring neurons are contiguous, inputs are gathered
+	EI_NATIVE_TARGET("avx2")
+	void sumConnectedAVX2(const float* inputs, int inputWidth, int inputHeight,
+		const float* weights, int width, int height,
+		float ratioX, float ratioY, int radius, bool lateral,
+		int y, int xBegin, int xEnd, float* sums)
+	{
+		const __m256 half = _mm256_set1_ps(0.5f);
+		const __m256 ratio = _mm256_set1_ps(ratioX);
+		const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i minusOne = _mm256_set1_epi32(-1);
+		const __m256i inputWidthV = _mm256_set1_epi32(inputWidth);
+
+		int layerSize = width * height;
+
+		int centerY = lateral ? y : native::centerPosition(y, ratioY);
+
+		for (int x = xBegin; x < xEnd; x += 8) {
+			__m256i laneMask = _mm256_cmpgt_epi32(_mm256_set1_epi32(std::min(8, xEnd - x)), lane);
+
+			__m256i xs = _mm256_add_epi32(_mm256_set1_epi32(x), lane);
+
+			// Same operation order as ei.cl, no FMA
+			__m256i centerX = xs;
+
+			if (!lateral)
+				centerX = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(xs), half), ratio), half));
+
+			const float* rowWeights = weights + x + y * width;
+
+			__m256 sum = _mm256_setzero_ps();
+
+			int wi = 0;
+
+			for (int dx = -radius; dx <= radius; dx++) {
+				__m256i inputX = _mm256_add_epi32(centerX, _mm256_set1_epi32(dx));
+
+				__m256i validX = _mm256_and_si256(laneMask, _mm256_and_si256(_mm256_cmpgt_epi32(inputX, minusOne), _mm256_cmpgt_epi32(inputWidthV, inputX)));
+
+				for (int dy = -radius; dy <= radius; dy++, wi++) {
+					if (lateral && dx == 0 && dy == 0)
+						continue;
+
+					int inputY = centerY + dy;
+
+					if (inputY < 0 || inputY >= inputHeight)
+						continue;
+
+					__m256 weight = _mm256_maskload_ps(rowWeights + wi * layerSize, laneMask);
+
+					__m256i valid = _mm256_and_si256(validX, _mm256_castps_si256(_mm256_cmp_ps(weight, half, _CMP_GT_OQ)));
+
+					__m256i index = _mm256_add_epi32(inputX, _mm256_set1_epi32(inputY * inputWidth));
+
+					sum = _mm256_add_ps(sum, _mm256_mask_i32gather_ps(_mm256_setzero_ps(), inputs, index, _mm256_castsi256_ps(valid), 4));
+				}
+			}
+
+			_mm256_maskstore_ps(sums + (x - xBegin), laneMask, _mm256_add_ps(_mm256_maskload_ps(sums + (x - xBegin), laneMask), sum));
+		}
+	}
+#endif
+
+#if EI_NATIVE_HAS_AVX512
+	// 16 neurons of a row per iteration
+	EI_NATIVE_TARGET("avx512f")
+	void sumConnectedAVX512(const float* inputs, int inputWidth, int inputHeight,
+		const float* weights, int width, int height,
+		float ratioX, float ratioY, int radius, bool lateral,
+		int y, int xBegin, int xEnd, float* sums)
+	{
+		const __m512 half = _mm512_set1_ps(0.5f);
+		const __m512 ratio = _mm512_set1_ps(ratioX);
+		const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+		const __m512i minusOne = _mm512_set1_epi32(-1);
+		const __m512i inputWidthV = _mm512_set1_epi32(inputWidth);
+
+		int layerSize = width * height;
+
+		int centerY = lateral ? y : native::centerPosition(y, ratioY);
+
+		for (int x = xBegin; x < xEnd; x += 16) {
+			__mmask16 laneMask = _mm512_cmpgt_epi32_mask(_mm512_set1_epi32(std::min(16, xEnd - x)), lane);
+
+			__m512i xs = _mm512_add_epi32(_mm512_set1_epi32(x), lane);
+
+			__m512i centerX = xs;
+
+			if (!lateral)
+				centerX = _mm512_maskz_cvttps_epi32(0xffff, _mm512_add_ps(_mm512_mul_ps(_mm512_add_ps(_mm512_maskz_cvtepi32_ps(0xffff, xs), half), ratio), half));
+
+			const float* rowWeights = weights + x + y * width;
+
+			__m512 sum = _mm512_setzero_ps();
+
+			int wi = 0;
+
+			for (int dx = -radius; dx <= radius; dx++) {
+				__m512i inputX = _mm512_add_epi32(centerX, _mm512_set1_epi32(dx));
+
+				__mmask16 validX = laneMask & _mm512_cmpgt_epi32_mask(inputX, minusOne) & _mm512_cmpgt_epi32_mask(inputWidthV, inputX);
+
+				for (int dy = -radius; dy <= radius; dy++, wi++) {
+					if (lateral && dx == 0 && dy == 0)
+						continue;
+
+					int inputY = centerY + dy;
+
+					if (inputY < 0 || inputY >= inputHeight)
+						continue;
+
+					__m512 weight = _mm512_maskz_loadu_ps(laneMask, rowWeights + wi * layerSize);
+
+					__mmask16 valid = validX & _mm512_cmp_ps_mask(weight, half, _CMP_GT_OQ);
+
+					__m512i index = _mm512_add_epi32(inputX, _mm512_set1_epi32(inputY * inputWidth));
+
+					sum = _mm512_add_ps(sum, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), valid, index, inputs, 4));
+				}
+			}
+
+			_mm512_mask_storeu_ps(sums + (x - xBegin), laneMask, _mm512_add_ps(_mm512_maskz_loadu_ps(laneMask, sums + (x - xBegin)), sum));
+		}
+	}
+#endif
+
+	struct Dispatch {
+		SumConnectedFunc _sumConnected;
+		const char* _name;
+
+		Dispatch()
+			: _sumConnected(sumConnectedScalar), _name("scalar")
+		{
+#if EI_NATIVE_X86 && defined(__GNUC__)
+			__builtin_cpu_init();
+
+			if (__builtin_cpu_supports("avx512f")) {
+				_sumConnected = sumConnectedAVX512;
+				_name = "avx512";
+			}
+			else if (__builtin_cpu_supports("avx2")) {
+				_sumConnected = sumConnectedAVX2;
+				_name = "avx2";
+			}
+#elif EI_NATIVE_HAS_AVX512
+			_sumConnected = sumConnectedAVX512;
+			_name = "avx512";
+#elif EI_NATIVE_HAS_AVX2
+			_sumConnected = sumConnectedAVX2;
+			_name = "avx2";
+#endif
+		}
+	};
+
+	const Dispatch &getDispatch() {
+		static Dispatch dispatch;
+
+		return dispatch;
+	}
+}
+
+void native::sumConnected(const float* inputs, int inputWidth, int inputHeight,
+	const float* weights, int width, int height,
+	float ratioX, float ratioY, int radius, bool lateral,
+	int y, int xBegin, int xEnd, float* sums)
+{
+	getDispatch()._sumConnected(inputs, inputWidth, inputHeight, weights, width, height, ratioX, ratioY, radius, lateral, y, xBegin, xEnd, sums);
+}
+
+const char* native::getSIMDName() {
+	return getDispatch()._name;
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include <CL/cl.hpp>
+
+// Host side equivalents of the ei.cl kernels for the native backend.
+// Images are flat float arrays indexed x + y * width, weight images x + y * width + wi * width * height
+namespace ei {
+	namespace native {
+		// Same counter based generator as philoxFloat in ei.cl (Philox4x32-10), counter (c0, c1, c2, 0)
+		float philoxFloat(cl_uint c0, cl_uint c1, cl_uint c2, cl_uint2 key);
+
+		// Center of the receptive field of neuron (x, y) in a layer scaled by ratio, same rounding as ei.cl
+		inline int centerPosition(int x, float ratio) {
+			return static_cast<int>((x + 0.5f) * ratio + 0.5f);
+		}
+
+		// For neurons [xBegin, xEnd) of row y, add the sum of inputs connected through weights > 0.5 to sums[x - xBegin].
+		// lateral = true centers the field on the neuron itself and skips the neuron's own synapse
+		void sumConnected(const float* inputs, int inputWidth, int inputHeight,
+			const float* weights, int width, int height,
+			float ratioX, float ratioY, int radius, bool lateral,
+			int y, int xBegin, int xEnd, float* sums);
+
+		// Name of the instruction set sumConnected dispatches to ("avx512", "avx2" or "scalar")
+		const char* getSIMDName();
+	}
+}
\ No newline at end of file
@@ -23,11 +23,30 @@ misrepresented as being the original software.
 
 #include <fstream>
 #include <iostream>
+#include <sstream>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 using namespace sys;
 
-bool ComputeProgram::loadFromFile(const std::string &name, ComputeSystem &cs) {
-	std::ifstream fromFile(name);
+namespace {
+	// 64 bit FNV-1a
+	cl_ulong hashString(const std::string &str, cl_ulong hash = 0xcbf29ce484222325ULL) {
+		for (int i = 0; i < static_cast<int>(str.size()); i++) {
+			hash ^= static_cast<unsigned char>(str[i]);
+			hash *= 0x100000001b3ULL;
+		}
+
+		return hash;
+	}
+}
+
+bool ComputeProgram::loadFromFile(const std::string &name, ComputeSystem &cs, const std::string &options) {
+	std::ifstream fromFile(name, std::ios::binary);
 
 	if (!fromFile.is_open()) {
 #ifdef SYS_DEBUG
@@ -36,24 +55,144 @@ bool ComputeProgram::loadFromFile(const std::string &name, ComputeSystem &cs) {
 		return false;
 	}
 
-	std::string source = "";
+	std::ostringstream source;
+
+	source << fromFile.rdbuf();
+
+	return loadFromSource(source.str(), cs, options);
+}
+
+bool ComputeProgram::loadFromSource(const std::string &source, ComputeSystem &cs, const std::string &options) {
+	_source = source;
+	_options = options;
+
+	{
+		std::lock_guard<std::mutex> lock(_variantsMutex);
+
+		_variants.clear();
+	}
+
+	return build(_options, cs, _program);
+}
+
+bool ComputeProgram::getVariant(const std::string &options, ComputeSystem &cs, cl::Program &variant) {
+	std::lock_guard<std::mutex> lock(_variantsMutex);
+
+	std::unordered_map<std::string, cl::Program>::const_iterator it = _variants.find(options);
+
+	if (it == _variants.end()) {
+		cl::Program program;
+
+		if (!build(_options + " " + options, cs, program))
+			return false;
+
+		it = _variants.insert(std::make_pair(options, program)).first;
+	}
+
+	variant = it->second;
+
+	return true;
+}
+
+bool ComputeProgram::build(const std::string &options, ComputeSystem &cs, cl::Program &program) {
+	std::string cacheFileName;
+
+	if (!_cacheDirectory.empty()) {
+		// Binaries are only valid for the same source, device, driver and options
+		cl_ulong hash = hashString(_source);
+		hash = hashString(cs.getDevice().getInfo<CL_DEVICE_NAME>() + '\0', hash);
+		hash = hashString(cs.getDevice().getInfo<CL_DRIVER_VERSION>() + '\0', hash);
+		hash = hashString(options, hash);
 
-	while (!fromFile.eof() && fromFile.good()) {
-		std::string line; 
+		std::ostringstream name;
 
-		std::getline(fromFile, line);
+		name << _cacheDirectory << "/" << std::hex;
+		name.width(16);
+		name.fill('0');
+		name << hash << ".bin";
 
-		source += line + "\n";
+		cacheFileName = name.str();
+
+		if (loadFromCache(cacheFileName, options, cs, program))
+			return true;
+	}
+
+	program = cl::Program(cs.getContext(), _source);
+
+	if (program.build(std::vector<cl::Device>(1, cs.getDevice()), options.c_str()) != CL_SUCCESS) {
+#ifdef SYS_DEBUG
+		std::cerr << "Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(cs.getDevice()) << std::endl;
+#endif
+		return false;
 	}
 
-	_program = cl::Program(cs.getContext(), source);
+	if (!cacheFileName.empty())
+		saveToCache(cacheFileName, program);
+
+	return true;
+}
+
+bool ComputeProgram::loadFromCache(const std::string &fileName, const std::string &options, ComputeSystem &cs, cl::Program &program) {
+	std::ifstream fromFile(fileName, std::ios::binary);
+
+	if (!fromFile.is_open())
+		return false;
+
+	std::ostringstream binaryStream;
+
+	binaryStream << fromFile.rdbuf();
+
+	std::string binary = binaryStream.str();
+
+	if (binary.empty())
+		return false;
+
+	std::vector<cl::Device> devices(1, cs.getDevice());
+
+	cl::Program::Binaries binaries(1, std::make_pair(static_cast<const void*>(binary.data()), binary.size()));
 
-	if (_program.build(std::vector<cl::Device>(1, cs.getDevice())) != CL_SUCCESS) {
+	std::vector<cl_int> binaryStatus;
+	cl_int error;
+
+	cl::Program cached(cs.getContext(), devices, binaries, &binaryStatus, &error);
+
+	// Stale or damaged binaries are rebuilt from source and overwritten
+	if (error != CL_SUCCESS || binaryStatus.empty() || binaryStatus.front() != CL_SUCCESS || cached.build(devices, options.c_str()) != CL_SUCCESS) {
 #ifdef SYS_DEBUG
-		std::cerr << "Error building: " << _program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(cs.getDevice()) << std::endl;
+		std::cout << "Cached program " << fileName << " is invalid, rebuilding." << std::endl;
 #endif
 		return false;
 	}
 
+	program = cached;
+
 	return true;
+}
+
+void ComputeProgram::saveToCache(const std::string &fileName, const cl::Program &program) {
+	std::vector< ::size_t> binarySizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+
+	if (binarySizes.size() != 1 || binarySizes.front() == 0)
+		return;
+
+	std::vector<char> binary(binarySizes.front());
+	std::vector<char*> binaryPointers(1, binary.data());
+
+	if (program.getInfo(CL_PROGRAM_BINARIES, &binaryPointers) != CL_SUCCESS)
+		return;
+
+#ifdef _WIN32
+	_mkdir(_cacheDirectory.c_str());
+#else
+	mkdir(_cacheDirectory.c_str(), 0755);
+#endif
+
+	std::ofstream toFile(fileName, std::ios::binary | std::ios::trunc);
+
+	toFile.write(binary.data(), binary.size());
+
+#ifdef SYS_DEBUG
+	if (!toFile.good())
+		std::cerr << "Could not write cached program " << fileName << "!" << std::endl;
+#endif
 }
\ No newline at end of file
@@ -24,14 +24,48 @@ misrepresented as being the original software.
 #include <system/ComputeSystem.h>
 
 #include <assert.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 namespace sys {
 	class ComputeProgram {
 	private:
 		cl::Program _program;
 
+		// Source and options of _program, variants are built from them
+		std::string _source;
+		std::string _options;
+
+		// Programs built with additional options, by those options. Layers on several host threads request them,
+		// _variantsMutex is held from lookup to insert so each variant is built once
+		std::unordered_map<std::string, cl::Program> _variants;
+		std::mutex _variantsMutex;
+
+		// Compiled program binaries are kept here, keyed by source, device, driver and options (empty disables the cache)
+		std::string _cacheDirectory;
+
+		bool build(const std::string &options, ComputeSystem &cs, cl::Program &program);
+		bool loadFromCache(const std::string &fileName, const std::string &options, ComputeSystem &cs, cl::Program &program);
+		void saveToCache(const std::string &fileName, const cl::Program &program);
+
 	public:
-		bool loadFromFile(const std::string &name, ComputeSystem &cs);
+		bool loadFromFile(const std::string &name, ComputeSystem &cs, const std::string &options = "");
+
+		// Build from source, or from a cached binary of the same source when the cache is enabled and still valid
+		bool loadFromSource(const std::string &source, ComputeSystem &cs, const std::string &options = "");
+
+		// The loaded source built with additional options (usually -D constants) appended, built on first use and
+		// kept for later requests with the same options. Returns false if it does not build
+		bool getVariant(const std::string &options, ComputeSystem &cs, cl::Program &variant);
+
+		void setCacheDirectory(const std::string &cacheDirectory) {
+			_cacheDirectory = cacheDirectory;
+		}
+
+		const std::string &getCacheDirectory() const {
+			return _cacheDirectory;
+		}
 
 		cl::Program &getProgram() {
 			return _program;
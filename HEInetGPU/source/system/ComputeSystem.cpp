@@ -25,7 +25,18 @@ misrepresented as being the original software.
 
 using namespace sys;
 
-bool ComputeSystem::create(DeviceType type, bool createFromGLContext) {
+bool ComputeSystem::create(DeviceType type, bool createFromGLContext, int numNativeThreads, bool outOfOrder, bool profiling) {
+	_type = type;
+
+	if (type == _native) {
+		_threadPool.create(numNativeThreads);
+
+#ifdef SYS_DEBUG
+		std::cout << "Using native backend with " << _threadPool.getNumThreads() << " threads." << std::endl;
+#endif
+		return true;
+	}
+
 	if (type == _none) {
 #ifdef SYS_DEBUG
 		std::cout << "No OpenCL context created." << std::endl;
@@ -61,6 +72,10 @@ bool ComputeSystem::create(DeviceType type, bool createFromGLContext) {
 	case _all:
 		_platform.getDevices(CL_DEVICE_TYPE_ALL, &allDevices);
 		break;
+	case _native:
+	case _none:
+		// Returned above
+		break;
 	}
 
 	if (allDevices.empty()) {
@@ -106,10 +121,106 @@ bool ComputeSystem::create(DeviceType type, bool createFromGLContext) {
 		_context = cl::Context(_device, props);
 	}
 	else
+#else
+	(void)createFromGLContext;
 #endif
 		_context = _device;
 
-	_queue = cl::CommandQueue(_context, _device);
+	cl_command_queue_properties properties = profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+
+	_queue = cl::CommandQueue(_context, _device, properties);
+	_transferQueue = cl::CommandQueue(_context, _device, properties);
+
+	if (outOfOrder && (_device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0)
+		_outOfOrderQueue = cl::CommandQueue(_context, _device, properties | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+#ifdef SYS_DEBUG
+	else if (outOfOrder)
+		std::cout << "Device does not support out-of-order queues, using in-order execution." << std::endl;
+#endif
 
 	return true;
+}
+
+void ComputeSystem::enqueueKernel(const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+	const std::vector<cl::Memory> &reads, const std::vector<cl::Memory> &writes, const char* phase)
+{
+	cl::Event* profiled = profile(phase);
+
+	if (_outOfOrderQueue() == nullptr) {
+		_queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, nullptr, profiled);
+
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_queueMutex);
+
+	// Start after everything enqueued in order so far
+	if (!_outOfOrderPending) {
+		_queue.enqueueMarkerWithWaitList(nullptr, &_inOrderMarker);
+		_queue.flush();
+
+		_outOfOrderPending = true;
+	}
+
+	std::vector<cl::Event> waitList(1, _inOrderMarker);
+
+	for (int ri = 0; ri < static_cast<int>(reads.size()); ri++) {
+		std::unordered_map<cl_mem, MemoryUse>::const_iterator it = _memoryUses.find(reads[ri]());
+
+		if (it != _memoryUses.end() && it->second._write() != nullptr)
+			waitList.push_back(it->second._write);
+	}
+
+	for (int wi = 0; wi < static_cast<int>(writes.size()); wi++) {
+		std::unordered_map<cl_mem, MemoryUse>::const_iterator it = _memoryUses.find(writes[wi]());
+
+		if (it != _memoryUses.end()) {
+			if (it->second._write() != nullptr)
+				waitList.push_back(it->second._write);
+
+			waitList.insert(waitList.end(), it->second._reads.begin(), it->second._reads.end());
+		}
+	}
+
+	cl::Event event;
+
+	_outOfOrderQueue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, &waitList, &event);
+
+	if (profiled != nullptr)
+		*profiled = event;
+
+	for (int ri = 0; ri < static_cast<int>(reads.size()); ri++)
+		_memoryUses[reads[ri]()]._reads.push_back(event);
+
+	for (int wi = 0; wi < static_cast<int>(writes.size()); wi++) {
+		MemoryUse &use = _memoryUses[writes[wi]()];
+
+		use._write = event;
+		use._reads.clear();
+	}
+}
+
+void ComputeSystem::joinQueues() {
+	std::lock_guard<std::mutex> lock(_queueMutex);
+
+	joinQueuesLocked();
+}
+
+void ComputeSystem::joinQueuesLocked() {
+	if (!_outOfOrderPending)
+		return;
+
+	// A marker without a wait list completes after all commands enqueued before it
+	cl::Event marker;
+
+	_outOfOrderQueue.enqueueMarkerWithWaitList(nullptr, &marker);
+	_outOfOrderQueue.flush();
+
+	std::vector<cl::Event> waitList(1, marker);
+
+	_queue.enqueueBarrierWithWaitList(&waitList);
+
+	_memoryUses.clear();
+
+	_outOfOrderPending = false;
 }
\ No newline at end of file
@@ -22,8 +22,15 @@ misrepresented as being the original software.
 #pragma once
 
 #include <system/Uncopyable.h>
+#include <system/ThreadPool.h>
+#include <system/Profiler.h>
 #include <CL/cl.hpp>
 
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
 #define SYS_DEBUG
 
 #define SYS_ALLOW_CL_GL_CONTEXT 0
@@ -32,17 +39,97 @@ namespace sys {
 	class ComputeSystem : private Uncopyable {
 	public:
 		enum DeviceType {
-			_cpu, _gpu, _all, _none
+			_cpu, _gpu, _all, _native, _none
 		};
 
 	private:
+		DeviceType _type;
+
 		cl::Platform _platform;
 		cl::Device _device;
 		cl::Context _context;
 		cl::CommandQueue _queue;
 
+		// In-order queue for uploads that overlap the work on _queue, synchronized with it through events
+		cl::CommandQueue _transferQueue;
+
+		// Commands enqueued with enqueueKernel when created with outOfOrder. They only wait for the commands touching the same
+		// images and buffers and for everything on _queue before them. getQueue joins the two queues again
+		cl::CommandQueue _outOfOrderQueue;
+
+		// Last out-of-order writer and the readers since then of an image or buffer
+		struct MemoryUse {
+			cl::Event _write;
+			std::vector<cl::Event> _reads;
+		};
+
+		std::unordered_map<cl_mem, MemoryUse> _memoryUses;
+
+		// Marker on _queue the pending out-of-order commands start after
+		cl::Event _inOrderMarker;
+		bool _outOfOrderPending;
+
+		// Guards _memoryUses, _inOrderMarker and _outOfOrderPending, networks on several host threads share them
+		std::mutex _queueMutex;
+
+		void joinQueuesLocked();
+
+		// Records the commands enqueued with an event from profile, nullptr when not profiling. Set while other threads enqueue
+		std::atomic<Profiler*> _profiler;
+
+		// Workers for the native (non-OpenCL) backend
+		ThreadPool _threadPool;
+
 	public:
-		bool create(DeviceType type, bool createFromGLContext = false);
+		ComputeSystem()
+			: _type(_none), _outOfOrderPending(false), _profiler(nullptr)
+		{}
+
+		// _native creates no OpenCL context, only a thread pool of numNativeThreads (0 = hardware concurrency)
+		// outOfOrder additionally creates an out-of-order queue for enqueueKernel if the device supports it,
+		// profiling creates the queues with CL_QUEUE_PROFILING_ENABLE (required by setProfiler)
+		bool create(DeviceType type, bool createFromGLContext = false, int numNativeThreads = 0, bool outOfOrder = false, bool profiling = false);
+
+		bool isOutOfOrder() const {
+			return _outOfOrderQueue() != nullptr;
+		}
+
+		// Enqueue a kernel that reads and writes the given images and buffers. Out of order it waits for the last writers of what
+		// it reads and for the last writer and readers of what it writes (RAW, WAW and WAR), otherwise it goes to the in-order queue
+		// The kernel is profiled as phase
+		void enqueueKernel(const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+			const std::vector<cl::Memory> &reads, const std::vector<cl::Memory> &writes, const char* phase);
+
+		// Make _queue wait for all pending out-of-order commands
+		void joinQueues();
+
+		// Start or stop (nullptr) profiling, the profiler is not owned
+		void setProfiler(Profiler* profiler) {
+			_profiler = profiler;
+		}
+
+		Profiler* getProfiler() const {
+			return _profiler;
+		}
+
+		// Event to enqueue a command of the given phase with, nullptr when not profiling
+		cl::Event* profile(const char* phase) {
+			Profiler* profiler = _profiler;
+
+			return profiler != nullptr ? profiler->addCommand(phase) : nullptr;
+		}
+
+		// Layer of the commands the calling thread profiles from now on, -1 for network level work
+		void setProfileLayer(int layer) {
+			Profiler* profiler = _profiler;
+
+			if (profiler != nullptr)
+				profiler->setLayer(layer);
+		}
+
+		DeviceType getDeviceType() const {
+			return _type;
+		}
 
 		cl::Platform &getPlatform() {
 			return _platform;
@@ -56,8 +143,22 @@ namespace sys {
 			return _context;
 		}
 
+		// In-order queue, everything enqueued on it runs after the pending out-of-order commands
 		cl::CommandQueue &getQueue() {
+			std::lock_guard<std::mutex> lock(_queueMutex);
+
+			joinQueuesLocked();
+
 			return _queue;
 		}
+
+		// Separate queue for transfers, its commands only wait for the events they are given
+		cl::CommandQueue &getTransferQueue() {
+			return _transferQueue;
+		}
+
+		ThreadPool &getThreadPool() {
+			return _threadPool;
+		}
 	};
 }
\ No newline at end of file
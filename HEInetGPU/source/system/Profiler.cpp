@@ -0,0 +1,249 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "Profiler.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+
+using namespace sys;
+
+Profiler::Profiler()
+	: _origin(std::chrono::steady_clock::now()), _deviceToHost(0.0), _hasDeviceToHost(false)
+{}
+
+void Profiler::setLayer(int layer) {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	_layers[std::this_thread::get_id()] = layer;
+}
+
+int Profiler::getLayer() const {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	return getLayerLocked();
+}
+
+int Profiler::getLayerLocked() const {
+	std::unordered_map<std::thread::id, int>::const_iterator it = _layers.find(std::this_thread::get_id());
+
+	return it != _layers.end() ? it->second : -1;
+}
+
+cl::Event* Profiler::addCommand(const char* phase) {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	Command command;
+
+	command._phase = phase;
+	command._layer = getLayerLocked();
+	command._enqueued = now();
+	command._queued = command._submit = command._start = command._end = 0;
+
+	_pending.push_back(command);
+	_pendingEvents.push_back(cl::Event());
+
+	return &_pendingEvents.back();
+}
+
+int Profiler::beginSpan(const char* name) {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	Span span;
+
+	span._name = name;
+	span._layer = getLayerLocked();
+	span._begin = span._end = now();
+
+	_spans.push_back(span);
+
+	return _spans.size() - 1;
+}
+
+void Profiler::endSpan(int index) {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	_spans[index]._end = now();
+}
+
+void Profiler::resolve() {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	int ci = 0;
+
+	for (; ci < static_cast<int>(_pending.size()); ci++) {
+		cl::Event &event = _pendingEvents[ci];
+
+		// Not enqueued yet, this and the later commands stay pending so their events stay in place
+		if (event() == nullptr)
+			break;
+
+		event.wait();
+
+		Command command = _pending[ci];
+
+		command._queued = event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+		command._submit = event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+		command._start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		command._end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+		double deviceToHost = static_cast<double>(command._enqueued) - static_cast<double>(command._queued);
+
+		if (!_hasDeviceToHost || deviceToHost > _deviceToHost) {
+			_deviceToHost = deviceToHost;
+			_hasDeviceToHost = true;
+		}
+
+		_commands.push_back(command);
+	}
+
+	// Erasing at the front keeps the references to the remaining events valid
+	_pending.erase(_pending.begin(), _pending.begin() + ci);
+	_pendingEvents.erase(_pendingEvents.begin(), _pendingEvents.begin() + ci);
+}
+
+void Profiler::clear() {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	_pending.clear();
+	_pendingEvents.clear();
+	_commands.clear();
+	_spans.clear();
+}
+
+void Profiler::getStatistics(std::vector<Statistics> &statistics) const {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	std::map<std::pair<std::string, int>, Statistics> byPhase;
+
+	for (int ci = 0; ci < static_cast<int>(_commands.size()); ci++) {
+		const Command &command = _commands[ci];
+
+		double execution = (command._end - command._start) * 1e-6;
+		double latency = (command._start - command._queued) * 1e-6;
+
+		std::pair<std::string, int> key(command._phase, command._layer);
+
+		std::map<std::pair<std::string, int>, Statistics>::iterator it = byPhase.find(key);
+
+		if (it == byPhase.end()) {
+			Statistics s;
+
+			s._phase = command._phase;
+			s._layer = command._layer;
+			s._count = 0;
+			s._total = 0.0;
+			s._min = execution;
+			s._max = execution;
+			s._averageLatency = 0.0;
+
+			it = byPhase.insert(std::make_pair(key, s)).first;
+		}
+
+		Statistics &s = it->second;
+
+		s._count++;
+		s._total += execution;
+		s._min = std::min(s._min, execution);
+		s._max = std::max(s._max, execution);
+		s._averageLatency += latency;
+	}
+
+	statistics.clear();
+
+	for (std::map<std::pair<std::string, int>, Statistics>::iterator it = byPhase.begin(); it != byPhase.end(); it++) {
+		it->second._averageLatency /= it->second._count;
+
+		statistics.push_back(it->second);
+	}
+
+	std::sort(statistics.begin(), statistics.end(), [](const Statistics &a, const Statistics &b) {
+		return a._total > b._total;
+	});
+}
+
+bool Profiler::writeChromeTrace(const std::string &fileName) {
+	resolve();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	std::ofstream output(fileName);
+
+	if (!output.is_open()) {
+#ifdef SYS_DEBUG
+		std::cerr << "Could not create trace " << fileName << "!" << std::endl;
+#endif
+		return false;
+	}
+
+	// Microseconds
+	output << std::fixed << std::setprecision(3);
+
+	output << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+
+	output << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"Host\"}}," << std::endl;
+	output << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Device\"}}";
+
+	// One device track per layer, thread 0 is the network
+	std::vector<int> layers;
+
+	for (int ci = 0; ci < static_cast<int>(_commands.size()); ci++)
+		if (std::find(layers.begin(), layers.end(), _commands[ci]._layer) == layers.end())
+			layers.push_back(_commands[ci]._layer);
+
+	for (int li = 0; li < static_cast<int>(layers.size()); li++) {
+		output << "," << std::endl << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << layers[li] + 1 << ",\"args\":{\"name\":\"";
+
+		if (layers[li] < 0)
+			output << "Network";
+		else
+			output << "Layer " << layers[li];
+
+		output << "\"}}";
+	}
+
+	for (int si = 0; si < static_cast<int>(_spans.size()); si++) {
+		const Span &span = _spans[si];
+
+		output << "," << std::endl << "{\"name\":\"" << span._name << "\",\"cat\":\"host\",\"ph\":\"X\",\"pid\":0,\"tid\":0"
+			<< ",\"ts\":" << span._begin * 1e-3 << ",\"dur\":" << (span._end - span._begin) * 1e-3
+			<< ",\"args\":{\"layer\":" << span._layer << "}}";
+	}
+
+	for (int ci = 0; ci < static_cast<int>(_commands.size()); ci++) {
+		const Command &command = _commands[ci];
+
+		double start = command._start + _deviceToHost;
+
+		output << "," << std::endl << "{\"name\":\"" << command._phase << "\",\"cat\":\"device\",\"ph\":\"X\",\"pid\":1,\"tid\":" << command._layer + 1
+			<< ",\"ts\":" << start * 1e-3 << ",\"dur\":" << (command._end - command._start) * 1e-3
+			<< ",\"args\":{\"layer\":" << command._layer
+			<< ",\"queuedToSubmit\":" << (command._submit - command._queued) * 1e-3
+			<< ",\"submitToStart\":" << (command._start - command._submit) * 1e-3 << "}}";
+	}
+
+	output << std::endl << "]}" << std::endl;
+
+	return output.good();
+}
\ No newline at end of file
@@ -0,0 +1,159 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include <system/Uncopyable.h>
+#include <CL/cl.hpp>
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sys {
+	// Opt-in timeline of device commands and host spans (ComputeSystem::setProfiler). Commands are tagged with a phase name
+	// (string literals only, the pointer is kept) and the current layer, -1 for network level work. Device times are read from
+	// event profiling info, so the queues must be created with profiling (ComputeSystem::create). Networks on several host
+	// threads may record into one profiler, each thread has its own current layer. The events handed out are written by the
+	// enqueue call after addCommand returns, so resolve, clear and writeChromeTrace must not run while other threads step
+	// networks (join or synchronize with them first). resolve leaves commands whose event is not set yet pending
+	class Profiler : private Uncopyable {
+	public:
+		// Device command, times in ns. _enqueued is on the host clock, the others on the device clock
+		struct Command {
+			const char* _phase;
+			int _layer;
+
+			cl_ulong _enqueued;
+			cl_ulong _queued;
+			cl_ulong _submit;
+			cl_ulong _start;
+			cl_ulong _end;
+		};
+
+		// Host span, times in ns on the host clock
+		struct Span {
+			const char* _name;
+			int _layer;
+
+			cl_ulong _begin;
+			cl_ulong _end;
+		};
+
+		// Per phase and layer, times in ms
+		struct Statistics {
+			std::string _phase;
+			int _layer;
+			int _count;
+
+			// Execution (start to end)
+			double _total;
+			double _min;
+			double _max;
+
+			// Average from enqueue to start, launch overhead and waiting for earlier commands
+			double _averageLatency;
+		};
+
+		// Host span for the lifetime of the scope, does nothing without a profiler
+		class Scope : private Uncopyable {
+		private:
+			Profiler* _profiler;
+			int _index;
+
+		public:
+			Scope(Profiler* profiler, const char* name)
+				: _profiler(profiler), _index(profiler != nullptr ? profiler->beginSpan(name) : -1)
+			{}
+
+			~Scope() {
+				if (_profiler != nullptr)
+					_profiler->endSpan(_index);
+			}
+		};
+
+	private:
+		std::chrono::steady_clock::time_point _origin;
+
+		// Guards the members below
+		mutable std::mutex _mutex;
+
+		// Current layer by host thread, -1 if not set
+		std::unordered_map<std::thread::id, int> _layers;
+
+		// Recorded commands whose events have not been read yet, deques so the events handed out stay in place
+		std::deque<Command> _pending;
+		std::deque<cl::Event> _pendingEvents;
+
+		std::vector<Command> _commands;
+		std::vector<Span> _spans;
+
+		// Host minus device clock. Commands are recorded right before they are enqueued, so the largest
+		// difference between the host enqueue time and the device queued time is the closest bound
+		double _deviceToHost;
+		bool _hasDeviceToHost;
+
+		int getLayerLocked() const;
+
+	public:
+		Profiler();
+
+		// Layer of the commands and spans the calling thread records from now on
+		void setLayer(int layer);
+
+		int getLayer() const;
+
+		// Record a command, enqueue it with the returned event
+		cl::Event* addCommand(const char* phase);
+
+		// Returns the index of the span for endSpan
+		int beginSpan(const char* name);
+		void endSpan(int index);
+
+		// Wait for the recorded commands and read their times, releasing the events. Stops at the first command not enqueued yet
+		void resolve();
+
+		void clear();
+
+		// Statistics of the resolved commands, sorted by total execution time
+		void getStatistics(std::vector<Statistics> &statistics) const;
+
+		// Chrome trace event format (chrome://tracing, Perfetto), device commands on one track per layer. Resolves first
+		bool writeChromeTrace(const std::string &fileName);
+
+		// Host time in ns since the profiler was created
+		cl_ulong now() const {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _origin).count();
+		}
+
+		const std::vector<Command> &getCommands() const {
+			return _commands;
+		}
+
+		const std::vector<Span> &getSpans() const {
+			return _spans;
+		}
+	};
+}
\ No newline at end of file
@@ -0,0 +1,131 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+using namespace sys;
+
+ThreadPool::~ThreadPool() {
+	destroy();
+}
+
+void ThreadPool::create(int numThreads) {
+	destroy();
+
+	if (numThreads <= 0)
+		numThreads = std::max<int>(1, std::thread::hardware_concurrency());
+
+	_quit = false;
+
+	for (int t = 1; t < numThreads; t++)
+		_workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+void ThreadPool::destroy() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		_quit = true;
+	}
+
+	_workAvailable.notify_all();
+
+	for (int t = 0; t < static_cast<int>(_workers.size()); t++)
+		_workers[t].join();
+
+	_workers.clear();
+}
+
+void ThreadPool::runChunks(std::unique_lock<std::mutex> &lock) {
+	while (_pJob != nullptr && _jobNext < _jobCount) {
+		int begin = _jobNext;
+		int end = std::min(_jobCount, begin + _jobGrain);
+
+		_jobNext = end;
+		_jobPending++;
+
+		const std::function<void(int, int)>* pJob = _pJob;
+
+		lock.unlock();
+
+		(*pJob)(begin, end);
+
+		lock.lock();
+
+		_jobPending--;
+	}
+
+	if (_jobPending == 0)
+		_workDone.notify_all();
+}
+
+void ThreadPool::workerLoop() {
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	unsigned int lastGeneration = _generation;
+
+	while (true) {
+		_workAvailable.wait(lock, [&] { return _quit || _generation != lastGeneration; });
+
+		if (_quit)
+			return;
+
+		lastGeneration = _generation;
+
+		runChunks(lock);
+	}
+}
+
+void ThreadPool::parallelFor(int count, int grain, const std::function<void(int, int)> &func) {
+	if (count <= 0)
+		return;
+
+	grain = std::max(1, grain);
+
+	// Not worth waking anyone up
+	if (_workers.empty() || count <= grain) {
+		func(0, count);
+
+		return;
+	}
+
+	std::lock_guard<std::mutex> submitLock(_submitMutex);
+
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	_pJob = &func;
+	_jobCount = count;
+	_jobGrain = grain;
+	_jobNext = 0;
+	_jobPending = 0;
+	_generation++;
+
+	_workAvailable.notify_all();
+
+	// Calling thread takes part as well
+	runChunks(lock);
+
+	_workDone.wait(lock, [&] { return _jobNext >= _jobCount && _jobPending == 0; });
+
+	_pJob = nullptr;
+}
\ No newline at end of file
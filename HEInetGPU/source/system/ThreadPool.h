@@ -0,0 +1,78 @@
+/*
+HEInetGPU
+Copyright (C) 2015 Eric Laukien
+
+This software is provided 'as-is', without any express or implied
+warranty.  In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software. If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#pragma once
+
+#include <system/Uncopyable.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sys {
+	// Fixed size pool of worker threads used by the native backend
+	class ThreadPool : private Uncopyable {
+	private:
+		std::vector<std::thread> _workers;
+
+		std::mutex _mutex;
+		std::mutex _submitMutex;
+		std::condition_variable _workAvailable;
+		std::condition_variable _workDone;
+
+		// Current job
+		const std::function<void(int, int)>* _pJob;
+		int _jobCount;
+		int _jobGrain;
+		int _jobNext;
+		int _jobPending;
+		unsigned int _generation;
+
+		bool _quit;
+
+		void workerLoop();
+
+		// Grab chunks of the current job until there are none left. Expects the lock to be held
+		void runChunks(std::unique_lock<std::mutex> &lock);
+
+	public:
+		ThreadPool()
+			: _pJob(nullptr), _jobCount(0), _jobGrain(1), _jobNext(0), _jobPending(0), _generation(0), _quit(false)
+		{}
+
+		~ThreadPool();
+
+		// Start numThreads - 1 workers (the calling thread also works). 0 uses the hardware concurrency
+		void create(int numThreads = 0);
+
+		void destroy();
+
+		// Run func(begin, end) over [0, count) split into chunks of size grain, blocks until done.
+		// Calls from several host threads are serialized
+		void parallelFor(int count, int grain, const std::function<void(int, int)> &func);
+
+		int getNumThreads() const {
+			return _workers.size() + 1;
+		}
+	};
+}
\ No newline at end of file